@@ -0,0 +1,237 @@
+#ifndef INCLUDE_INJA_BYTECODE_HPP_
+#define INCLUDE_INJA_BYTECODE_HPP_
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+#include "function_storage.hpp"
+#include "node.hpp"
+
+namespace inja {
+
+/*!
+ * \brief A single instruction of a compiled template program.
+ */
+struct Instruction {
+  enum class Opcode {
+    Text,           // Write the text of the TextNode
+    Push,           // Push the value of the LiteralNode
+    Load,           // Push the value of the DataNode
+    Call,           // Apply the FunctionNode to the arguments on the stack
+    AtId,           // Access the member given by the DataNode on top of the container
+    And,            // Short-circuit: if the top is false, replace it by false and jump
+    Or,             // Short-circuit: if the top is true, replace it by true and jump
+    Truthy,         // Replace the top by its truthiness
+    Default,        // If the top is found, keep it and jump; else drop it
+    Require,        // Throw if the top could not be found
+    Empty,          // Throw for an empty expression
+    Print,          // Pop and print the result of the ExpressionListNode
+    JumpIfFalse,    // Pop the condition and jump if it is false
+    Jump,           // Jump unconditionally
+    ForArray,       // Pop the array and begin a loop, or jump if it is empty
+    ForObject,      // Pop the object and begin a loop, or jump if it is empty
+    LoopNext,       // Advance the current loop and jump back to the body
+    Set,            // Pop the value and assign it to the SetStatementNode's key
+    Include,        // Render the IncludeStatementNode
+    Extends,        // Render the ExtendsStatementNode, which stops the rendering of the enclosing blocks
+    Break,          // Jump to the end of the enclosing block if rendering was stopped by an extends statement
+    Block,          // Render the BlockStatementNode
+    Return,         // Stop execution
+  };
+
+  Opcode opcode;
+  size_t target {0};
+  const AstNode* node {nullptr};
+
+  explicit Instruction(Opcode opcode, const AstNode* node, size_t target = 0): opcode(opcode), target(target), node(node) {}
+};
+
+/*!
+ * \brief A template compiled to a flat instruction stream.
+ */
+struct Program {
+  std::vector<Instruction> instructions;
+  std::vector<size_t> block_entries; // Start of each block by its index, or npos if the block is never reached
+  bool checks_breaks {false};        // Whether blocks check after each node if an extends statement stopped the rendering
+};
+
+/*!
+ * \brief Class for compiling the AST of a Template into a Program.
+ */
+class Compiler : public NodeVisitor {
+  using Op = FunctionStorage::Operation;
+  using Opcode = Instruction::Opcode;
+
+  Program program;
+  std::vector<const BlockStatementNode*> pending_blocks;
+
+  size_t emit(Opcode opcode, const AstNode* node, size_t target = 0) {
+    program.instructions.emplace_back(opcode, node, target);
+    return program.instructions.size() - 1;
+  }
+
+  void patch(size_t instruction) {
+    program.instructions[instruction].target = program.instructions.size();
+  }
+
+  void compile_expression(const ExpressionListNode& node) {
+    if (!node.root) {
+      emit(Opcode::Empty, &node);
+      return;
+    }
+    node.root->accept(*this);
+  }
+
+  void visit(const BlockNode& node) override {
+    // Like the renderer, each node is followed by a check whether an extends statement stopped the rendering, unless
+    // the template can not stop it
+    std::vector<size_t> breaks;
+    for (size_t i = 0; i < node.nodes.size(); ++i) {
+      node.nodes[i]->accept(*this);
+      if (program.checks_breaks && i + 1 < node.nodes.size()) {
+        breaks.emplace_back(emit(Opcode::Break, &node));
+      }
+    }
+    for (const size_t instruction : breaks) {
+      patch(instruction);
+    }
+  }
+
+  void visit(const TextNode& node) override {
+    if (node.length > 0) {
+      emit(Opcode::Text, &node);
+    }
+  }
+
+  void visit(const ExpressionNode&) override {}
+
+  void visit(const LiteralNode& node) override {
+    emit(Opcode::Push, &node);
+  }
+
+  void visit(const DataNode& node) override {
+    emit(Opcode::Load, &node);
+  }
+
+  void visit(const FunctionNode& node) override {
+    switch (node.operation) {
+    case Op::And:
+    case Op::Or: {
+      node.arguments[0]->accept(*this);
+      const size_t jump = emit((node.operation == Op::And) ? Opcode::And : Opcode::Or, &node);
+      node.arguments[1]->accept(*this);
+      emit(Opcode::Truthy, &node);
+      patch(jump);
+    } break;
+    case Op::Default: {
+      node.arguments[0]->accept(*this);
+      const size_t jump = emit(Opcode::Default, &node);
+      node.arguments[1]->accept(*this);
+      emit(Opcode::Require, &node);
+      patch(jump);
+    } break;
+    case Op::AtId: {
+      node.arguments[0]->accept(*this);
+      node.arguments[1]->accept(*this);
+      emit(Opcode::AtId, &node);
+    } break;
+    default: {
+      for (const auto& a : node.arguments) {
+        a->accept(*this);
+      }
+      emit(Opcode::Call, &node);
+    }
+    }
+  }
+
+  void visit(const ExpressionListNode& node) override {
+    compile_expression(node);
+    emit(Opcode::Print, &node);
+  }
+
+  void visit(const StatementNode&) override {}
+  void visit(const ForStatementNode&) override {}
+
+  void visit(const ForArrayStatementNode& node) override {
+    compile_expression(node.condition);
+    const size_t loop = emit(Opcode::ForArray, &node);
+    const size_t body = program.instructions.size();
+    node.body.accept(*this);
+    emit(Opcode::LoopNext, &node, body);
+    patch(loop);
+  }
+
+  void visit(const ForObjectStatementNode& node) override {
+    compile_expression(node.condition);
+    const size_t loop = emit(Opcode::ForObject, &node);
+    const size_t body = program.instructions.size();
+    node.body.accept(*this);
+    emit(Opcode::LoopNext, &node, body);
+    patch(loop);
+  }
+
+  void visit(const IfStatementNode& node) override {
+    compile_expression(node.condition);
+    const size_t jump_false = emit(Opcode::JumpIfFalse, &node.condition);
+    node.true_statement.accept(*this);
+    if (node.has_false_statement) {
+      const size_t jump_end = emit(Opcode::Jump, &node);
+      patch(jump_false);
+      node.false_statement.accept(*this);
+      patch(jump_end);
+    } else {
+      patch(jump_false);
+    }
+  }
+
+  void visit(const IncludeStatementNode& node) override {
+    emit(Opcode::Include, &node);
+  }
+
+  void visit(const ExtendsStatementNode& node) override {
+    emit(Opcode::Extends, &node);
+  }
+
+  void visit(const BlockStatementNode& node) override {
+    emit(Opcode::Block, &node);
+    pending_blocks.emplace_back(&node);
+  }
+
+  void visit(const SetStatementNode& node) override {
+    compile_expression(node.expression);
+    emit(Opcode::Set, &node);
+  }
+
+public:
+  explicit Compiler() {}
+
+  /// Compile the given root and all blocks within into a program. Only a template with extends or block statements,
+  /// where the implementation of a block might extend another template, can stop the rendering
+  Program compile(const BlockNode& root, bool checks_breaks) {
+    program = Program();
+    program.checks_breaks = checks_breaks;
+    pending_blocks.clear();
+
+    root.accept(*this);
+    emit(Opcode::Return, &root);
+
+    // Each block body is compiled as a separate subroutine after the main code
+    while (!pending_blocks.empty()) {
+      const auto block = pending_blocks.back();
+      pending_blocks.pop_back();
+
+      if (block->index >= program.block_entries.size()) {
+        program.block_entries.resize(block->index + 1, std::string::npos);
+      }
+      program.block_entries[block->index] = program.instructions.size();
+      block->block.accept(*this);
+      emit(Opcode::Return, block);
+    }
+    return std::move(program);
+  }
+};
+
+} // namespace inja
+
+#endif // INCLUDE_INJA_BYTECODE_HPP_
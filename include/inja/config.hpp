@@ -1,12 +1,21 @@
 #ifndef INCLUDE_INJA_CONFIG_HPP_
 #define INCLUDE_INJA_CONFIG_HPP_
 
+#include <cstddef>
 #include <filesystem>
 #include <functional>
+#include <memory>
 #include <string>
+#include <utility>
+#include <vector>
 
+#include "include_resolver.hpp"
 #include "template.hpp"
 
+#define INJA_VERSION_MAJOR 3
+#define INJA_VERSION_MINOR 5
+#define INJA_VERSION_PATCH 0
+
 namespace inja {
 
 /*!
@@ -66,8 +75,22 @@ struct LexerConfig {
  */
 struct ParserConfig {
   bool search_included_templates_in_files {true};
+  bool compile_bytecode {false};
+
+  /// 0: none, 1: merge adjacent text, 2: also fold constant expressions and prune static if statements
+  unsigned int optimization_level {0};
+
+  /// Threads on which the included files of one level are read and parsed, where 0 uses one per core. Parsing with the
+  /// default of 1 never starts a thread
+  size_t include_parse_threads {1};
 
   std::function<Template(const std::filesystem::path&, const std::string&)> include_callback;
+
+  /// Called once for all includes of a level that are not found, with the path and name of each include
+  std::function<std::vector<Template>(const std::vector<std::pair<std::filesystem::path, std::string>>&)> batch_include_callback;
+
+  /// Finds and caches the files of included templates, shared by copies of the config
+  std::shared_ptr<IncludeResolver> include_resolver {std::make_shared<IncludeResolver>()};
 };
 
 /*!
@@ -76,6 +99,10 @@ struct ParserConfig {
 struct RenderConfig {
   bool throw_at_missing_includes {true};
   bool html_autoescape {false};
+
+  /// Included templates with up to this number of nodes are rendered inline, if they have no statements of their own
+  /// scope (include, extends, block, set or super()). 0 renders every include with a renderer of its own
+  size_t include_inline_threshold {64};
 };
 
 } // namespace inja
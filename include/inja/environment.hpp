@@ -1,29 +1,102 @@
 #ifndef INCLUDE_INJA_ENVIRONMENT_HPP_
 #define INCLUDE_INJA_ENVIRONMENT_HPP_
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <filesystem>
 #include <fstream>
 #include <iostream>
+#include <map>
+#include <memory>
+#include <set>
 #include <sstream>
 #include <string>
 #include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
 
 #include "json.hpp"
 #include "config.hpp"
 #include "function_storage.hpp"
 #include "parser.hpp"
 #include "renderer.hpp"
+#include "serialization.hpp"
+#include "specializer.hpp"
 #include "template.hpp"
+#include "template_cache.hpp"
 #include "throw.hpp"
 
 namespace inja {
 
+/*!
+ * \brief Result of preloading a template directory, with the parse time or error of each file.
+ */
+struct PreloadReport {
+  struct File {
+    std::string name;
+    std::chrono::steady_clock::duration parse_time {0};
+    std::string error; // Empty if the file was parsed successfully
+  };
+
+  std::vector<File> files;
+
+  size_t count_errors() const {
+    return std::count_if(files.begin(), files.end(), [](const File& file) { return !file.error.empty(); });
+  }
+};
+
 /*!
  * \brief Class for changing the configuration.
+ *
+ * After its configuration and callbacks are set, an environment can be shared between threads: parsing and rendering
+ * may run concurrently, and templates are registered in a storage that is safe for concurrent lookups and insertions.
  */
 class Environment {
   FunctionStorage function_storage;
   TemplateStorage template_storage;
+  TemplateCache template_cache;
+  size_t template_cache_config {0}; // Hash of the configuration that parsing depends on, updated by every setter of it
+  FileTemplateCache file_template_cache;
+
+  /// Returns the parsed template from the cache of string templates, or parses and caches it
+  std::shared_ptr<const Template> parse_cached(std::string_view input) {
+    auto result = template_cache.find(input, template_cache_config);
+    if (!result) {
+      result = std::make_shared<const Template>(parse(input));
+      template_cache.insert(input, template_cache_config, result);
+    }
+    return result;
+  }
+
+  /// Hashes the configuration again after it changed, so that templates parsed before are not found in the cache
+  void update_template_cache_config() {
+    template_cache_config = TemplateCache::hash_config(lexer_config, parser_config, function_storage, input_path);
+  }
+
+  std::shared_ptr<const Template> load_template(const std::filesystem::path& filename) {
+    // Files that are already registered, e.g. by preloading, are not parsed again
+    if (auto registered = template_storage.find(Parser::storage_name(input_path / filename))) {
+      return registered;
+    }
+
+    Parser parser(parser_config, lexer_config, template_storage, function_storage);
+    auto result = Template(Parser::load_file(input_path / filename));
+    parser.parse_into_template(result, (input_path / filename).string());
+    return std::make_shared<const Template>(std::move(result));
+  }
+
+  /// Returns the parsed template of the file from the cache, or parses and caches it
+  std::shared_ptr<const Template> parse_template_cached(const std::filesystem::path& filename) {
+    const auto path = input_path / filename;
+    auto result = file_template_cache.find(path, template_storage);
+    if (!result) {
+      result = load_template(filename);
+      file_template_cache.insert(path, result, template_storage);
+    }
+    return result;
+  }
 
 protected:
   LexerConfig lexer_config;
@@ -35,8 +108,13 @@ protected:
 
 public:
   Environment(): Environment("") {}
-  explicit Environment(const std::filesystem::path& global_path): input_path(global_path), output_path(global_path) {}
-  Environment(const std::filesystem::path& input_path, const std::filesystem::path& output_path): input_path(input_path), output_path(output_path) {}
+  explicit Environment(const std::filesystem::path& global_path): input_path(global_path), output_path(global_path) {
+    update_template_cache_config();
+  }
+
+  Environment(const std::filesystem::path& input_path, const std::filesystem::path& output_path): input_path(input_path), output_path(output_path) {
+    update_template_cache_config();
+  }
 
   /// Sets the opener and closer for template statements
   void set_statement(const std::string& open, const std::string& close) {
@@ -46,12 +124,14 @@ public:
     lexer_config.statement_close = close;
     lexer_config.statement_close_force_rstrip = "-" + close;
     lexer_config.update_open_chars();
+    update_template_cache_config();
   }
 
   /// Sets the opener for template line statements
   void set_line_statement(const std::string& open) {
     lexer_config.line_statement = open;
     lexer_config.update_open_chars();
+    update_template_cache_config();
   }
 
   /// Sets the opener and closer for template expressions
@@ -61,6 +141,7 @@ public:
     lexer_config.expression_close = close;
     lexer_config.expression_close_force_rstrip = "-" + close;
     lexer_config.update_open_chars();
+    update_template_cache_config();
   }
 
   /// Sets the opener and closer for template comments
@@ -70,21 +151,66 @@ public:
     lexer_config.comment_close = close;
     lexer_config.comment_close_force_rstrip = "-" + close;
     lexer_config.update_open_chars();
+    update_template_cache_config();
   }
 
   /// Sets whether to remove the first newline after a block
   void set_trim_blocks(bool trim_blocks) {
     lexer_config.trim_blocks = trim_blocks;
+    update_template_cache_config();
   }
 
   /// Sets whether to strip the spaces and tabs from the start of a line to a block
   void set_lstrip_blocks(bool lstrip_blocks) {
     lexer_config.lstrip_blocks = lstrip_blocks;
+    update_template_cache_config();
   }
 
   /// Sets the element notation syntax
   void set_search_included_templates_in_files(bool search_in_files) {
     parser_config.search_included_templates_in_files = search_in_files;
+    update_template_cache_config();
+  }
+
+  /// Sets the directories in which included templates are searched after the directory of the including template
+  void set_include_search_paths(const std::vector<std::filesystem::path>& search_paths) {
+    const auto& resolver = *parser_config.include_resolver;
+    parser_config.include_resolver = std::make_shared<IncludeResolver>(search_paths, resolver.get_negative_ttl(), resolver.get_positive_ttl());
+    update_template_cache_config();
+  }
+
+  /// Sets for how long an included template that is not found in the file system is not searched again, one second by
+  /// default and 0 disables it
+  void set_include_negative_cache_ttl(std::chrono::steady_clock::duration ttl) {
+    const auto& resolver = *parser_config.include_resolver;
+    parser_config.include_resolver = std::make_shared<IncludeResolver>(resolver.get_search_paths(), ttl, resolver.get_positive_ttl());
+    update_template_cache_config();
+  }
+
+  /// Sets for how long the file found for an included template is used without searching it again, one second by default
+  /// and 0 disables it
+  void set_include_positive_cache_ttl(std::chrono::steady_clock::duration ttl) {
+    const auto& resolver = *parser_config.include_resolver;
+    parser_config.include_resolver = std::make_shared<IncludeResolver>(resolver.get_search_paths(), resolver.get_negative_ttl(), ttl);
+    update_template_cache_config();
+  }
+
+  /// Sets the number of threads on which the included files of one level are parsed, where 0 uses one per core and 1
+  /// (the default) parses them on the calling thread
+  void set_include_parse_threads(size_t thread_count) {
+    parser_config.include_parse_threads = thread_count;
+  }
+
+  /// Sets whether parsed templates are compiled to bytecode for rendering
+  void set_compile_bytecode(bool compile) {
+    parser_config.compile_bytecode = compile;
+    update_template_cache_config();
+  }
+
+  /// Sets how far parsed templates are optimized, from 0 (none) to 2
+  void set_optimization_level(unsigned int level) {
+    parser_config.optimization_level = level;
+    update_template_cache_config();
   }
 
   /// Sets whether a missing include will throw an error
@@ -92,21 +218,65 @@ public:
     render_config.throw_at_missing_includes = will_throw;
   }
 
+  /// Sets the maximal number of nodes of included templates that are rendered inline, 0 disables inlining
+  void set_include_inline_threshold(size_t threshold) {
+    render_config.include_inline_threshold = threshold;
+  }
+
   /// Sets whether we'll automatically perform HTML escape
   void set_html_autoescape(bool will_escape) {
     render_config.html_autoescape = will_escape;
   }
 
+  /// Sets the number of templates that are kept when rendering strings, where 0 (the default) disables the cache
+  void set_template_cache_size(size_t capacity) {
+    template_cache.set_capacity(capacity);
+  }
+
+  /// Sets whether templates parsed from files are cached, and how often their files are checked for changes
+  void set_file_template_cache(bool enable, std::chrono::steady_clock::duration revalidation_interval = std::chrono::seconds(1)) {
+    file_template_cache.configure(enable, revalidation_interval);
+  }
+
+  /// Returns the hit and miss counters of the cache for rendering strings
+  TemplateCache::Statistics get_template_cache_statistics() const {
+    return template_cache.statistics();
+  }
+
+  /// Returns the hit, miss and file lookup counters of the resolution of included files
+  IncludeResolver::Statistics get_include_resolver_statistics() const {
+    return parser_config.include_resolver->statistics();
+  }
+
   Template parse(std::string_view input) {
     Parser parser(parser_config, lexer_config, template_storage, function_storage);
     return parser.parse(input, input_path);
   }
 
+  /// Returns a smaller template in which everything that only depends on the static data is pre-rendered
+  Template specialize(const Template& tmpl, const json& static_data) {
+    Specializer specializer(parser_config, render_config, template_storage, function_storage);
+    return specializer.specialize(tmpl, static_data);
+  }
+
+  /// Returns the parsed template as an immutable handle, which can be rendered and included without copying it
+  std::shared_ptr<const Template> parse_shared(std::string_view input) {
+    if (template_cache.is_enabled()) {
+      return parse_cached(input);
+    }
+    return std::make_shared<const Template>(parse(input));
+  }
+
+  /// Returns the parsed template of the file as an immutable handle, which can be rendered and included without copying it
+  std::shared_ptr<const Template> parse_template_shared(const std::filesystem::path& filename) {
+    if (file_template_cache.is_enabled()) {
+      return parse_template_cached(filename);
+    }
+    return load_template(filename);
+  }
+
   Template parse_template(const std::filesystem::path& filename) {
-    Parser parser(parser_config, lexer_config, template_storage, function_storage);
-    auto result = Template(Parser::load_file(input_path / filename));
-    parser.parse_into_template(result, (input_path / filename).string());
-    return result;
+    return *parse_template_shared(filename);
   }
 
   Template parse_file(const std::filesystem::path& filename) {
@@ -114,6 +284,9 @@ public:
   }
 
   std::string render(std::string_view input, const json& data) {
+    if (template_cache.is_enabled()) {
+      return render(*parse_cached(input), data);
+    }
     return render(parse(input), data);
   }
 
@@ -123,8 +296,15 @@ public:
     return os.str();
   }
 
+  /// Renders with the bookkeeping kept in the context, which is reused by the next render with it
+  std::string render(const Template& tmpl, const json& data, RenderContext& context) {
+    std::stringstream os;
+    render_to(os, tmpl, data, context);
+    return os.str();
+  }
+
   std::string render_file(const std::filesystem::path& filename, const json& data) {
-    return render(parse_template(filename), data);
+    return render(*parse_template_shared(filename), data);
   }
 
   std::string render_file_with_json_file(const std::filesystem::path& filename, const std::string& filename_data) {
@@ -159,10 +339,118 @@ public:
     return os;
   }
 
+  std::ostream& render_to(std::ostream& os, const Template& tmpl, const json& data, RenderContext& context) {
+    Renderer(render_config, template_storage, function_storage, context).render_to(os, tmpl, data);
+    return os;
+  }
+
   std::ostream& render_to(std::ostream& os, const std::string_view input, const json& data) {
+    if (template_cache.is_enabled()) {
+      return render_to(os, *parse_cached(input), data);
+    }
     return render_to(os, parse(input), data);
   }
 
+  /*!
+  @brief Parses all files below the directory whose file name matches the pattern on a pool of threads
+
+  The templates and everything they include are registered in a single step after all files are parsed, under the
+  same names that includes of these files resolve to. Files that fail to parse are reported and not registered. A
+  thread count of 0 uses one thread per core.
+  */
+  PreloadReport preload_directory(const std::filesystem::path& directory, std::string_view pattern = "*", size_t thread_count = 0) {
+    PreloadReport report;
+    for (const auto& entry : std::filesystem::recursive_directory_iterator(input_path / directory)) {
+      if (entry.is_regular_file() && string_view::matches_wildcard(entry.path().filename().string(), pattern)) {
+        report.files.push_back({Parser::storage_name(entry.path()), {}, {}});
+      }
+    }
+    std::sort(report.files.begin(), report.files.end(), [](const auto& a, const auto& b) { return a.name < b.name; });
+
+    // Parsed into a staging copy of the storage, so that includes between the files are shared by the workers
+    const TemplateStorage original_storage = template_storage;
+    TemplateStorage staging_storage = original_storage;
+
+    // The workers already run in parallel, so that their parsers do not start threads of their own
+    ParserConfig worker_config = parser_config;
+    worker_config.include_parse_threads = 1;
+
+    std::atomic<size_t> next {0};
+    const auto work = [&]() {
+      for (size_t i = next++; i < report.files.size(); i = next++) {
+        auto& file = report.files[i];
+        const auto start = std::chrono::steady_clock::now();
+#if !defined(INJA_NOEXCEPTION)
+        try {
+#endif
+          if (!staging_storage.find(file.name)) {
+            Parser parser(worker_config, lexer_config, staging_storage, function_storage);
+            auto tmpl = Template(Parser::load_file(file.name));
+            parser.parse_into_template(tmpl, file.name);
+            staging_storage.emplace(file.name, std::move(tmpl));
+          }
+#if !defined(INJA_NOEXCEPTION)
+        } catch (const std::exception& e) {
+          file.error = e.what();
+        }
+#endif
+        file.parse_time = std::chrono::steady_clock::now() - start;
+      }
+    };
+
+    if (thread_count == 0) {
+      thread_count = std::max(std::thread::hardware_concurrency(), 1u);
+    }
+    std::vector<std::thread> threads;
+    for (size_t t = 1; t < std::min(thread_count, report.files.size()); ++t) {
+      threads.emplace_back(work);
+    }
+    work();
+    for (auto& thread : threads) {
+      thread.join();
+    }
+
+    const auto original_templates = original_storage.snapshot();
+    const std::map<std::string, std::shared_ptr<const Template>> original_map(original_templates.begin(), original_templates.end());
+
+    std::vector<std::pair<std::string, std::shared_ptr<const Template>>> new_templates;
+    for (auto& [name, tmpl] : staging_storage.snapshot()) {
+      const auto original = original_map.find(name);
+      if (original == original_map.end() || original->second != tmpl) {
+        new_templates.emplace_back(name, std::move(tmpl));
+      }
+    }
+    template_storage.insert_or_assign_all(new_templates);
+    return report;
+  }
+
+  /*!
+  @brief Registers the files below the directory whose file name matches the pattern, without reading them
+
+  Each file is read and parsed when it is rendered or included for the first time, exactly once even if several threads
+  need it at the same time. It uses the configuration and callbacks of the environment at the time of registration.
+  */
+  void add_template_root(const std::filesystem::path& directory, std::string_view pattern = "*") {
+    struct LoaderContext {
+      LexerConfig lexer_config;
+      ParserConfig parser_config;
+      FunctionStorage function_storage;
+    };
+    const auto context = std::make_shared<const LoaderContext>(LoaderContext {lexer_config, parser_config, function_storage});
+
+    for (const auto& entry : std::filesystem::recursive_directory_iterator(input_path / directory)) {
+      if (entry.is_regular_file() && string_view::matches_wildcard(entry.path().filename().string(), pattern)) {
+        const std::string name = Parser::storage_name(entry.path());
+        template_storage.emplace_lazy(name, [context, name](TemplateStorage& storage) {
+          Parser parser(context->parser_config, context->lexer_config, storage, context->function_storage);
+          auto result = Template(Parser::load_file(name));
+          parser.parse_into_template(result, name);
+          return result;
+        });
+      }
+    }
+  }
+
   std::string load_file(const std::string& filename) {
     const Parser parser(parser_config, lexer_config, template_storage, function_storage);
     return Parser::load_file(input_path / filename);
@@ -197,6 +485,7 @@ public:
   */
   void add_callback(const std::string& name, int num_args, const CallbackFunction& callback) {
     function_storage.add_callback(name, num_args, callback);
+    update_template_cache_config();
   }
 
   /*!
@@ -207,6 +496,7 @@ public:
       callback(args);
       return json();
     });
+    update_template_cache_config();
   }
 
   /** Includes a template with a given name into the environment.
@@ -214,7 +504,94 @@ public:
    * include "<name>" syntax.
    */
   void include_template(const std::string& name, const Template& tmpl) {
-    template_storage[name] = tmpl;
+    template_storage.insert_or_assign(name, tmpl);
+  }
+
+  /// Includes a template without copying it
+  void include_template(const std::string& name, Template&& tmpl) {
+    template_storage.insert_or_assign(name, std::move(tmpl));
+  }
+
+  /// Includes a shared template without copying it, e.g. one that is also included by other environments
+  void include_template(const std::string& name, std::shared_ptr<const Template> tmpl) {
+    template_storage.insert_or_assign(name, std::move(tmpl));
+  }
+
+  /*!
+  @brief Links the template and everything it includes or extends, directly or indirectly, to their targets up front
+
+  Throws if a target is missing (unless missing includes are allowed), or if templates extend each other in a cycle.
+  Renders then find the targets without looking up their names, until a template of the environment is replaced.
+  */
+  void link(const Template& tmpl) {
+    std::vector<std::shared_ptr<const Template>> linked;
+    std::set<const Template*> visited {&tmpl};
+    std::vector<const Template*> queue {&tmpl};
+    for (size_t i = 0; i < queue.size(); ++i) {
+      for (const auto& name : queue[i]->dependencies) {
+        auto target = template_storage.find(name);
+        if (!target) {
+          if (render_config.throw_at_missing_includes) {
+            INJA_THROW(LinkError("template '" + name + "' not found"));
+          }
+          continue;
+        }
+        if (visited.insert(target.get()).second) {
+          queue.emplace_back(target.get());
+          linked.emplace_back(std::move(target));
+        }
+      }
+    }
+
+    for (const auto current : queue) {
+      std::vector<std::string> chain;
+      for (auto parent = current; parent != nullptr;) {
+        auto statistic_visitor = StatisticsVisitor();
+        parent->root.accept(statistic_visitor);
+        if (statistic_visitor.extended_templates.empty()) {
+          break;
+        }
+
+        const auto& name = statistic_visitor.extended_templates.front();
+        if (std::find(chain.begin(), chain.end(), name) != chain.end()) {
+          std::string cycle;
+          for (const auto& link : chain) {
+            cycle += link + " -> ";
+          }
+          INJA_THROW(LinkError("templates extend each other in a cycle: " + cycle + name));
+        }
+        chain.emplace_back(name);
+        const auto target = template_storage.find_loaded(name);
+        parent = target.get();
+      }
+    }
+
+    // Loading the targets changed the storage, so all links are built afterwards
+    for (const auto current : queue) {
+      current->link(template_storage);
+    }
+  }
+
+  /// Returns the included template of the given name, or nullptr if there is none
+  std::shared_ptr<const Template> find_template(std::string_view name) const {
+    return template_storage.find(name);
+  }
+
+  /// Writes all included templates into a precompiled bundle
+  void save_bundle(const std::filesystem::path& filename) const {
+    std::ofstream file(output_path / filename, std::ios::binary);
+    if (file.fail()) {
+      INJA_THROW(FileError("failed accessing file at '" + (output_path / filename).string() + "'"));
+    }
+    BundleWriter(lexer_config).write(file, template_storage.snapshot());
+  }
+
+  /// Includes all templates of a precompiled bundle, which must have been written by the same inja version and lexer configuration
+  void load_bundle(const std::filesystem::path& filename) {
+    const MappedFile file(input_path / filename);
+    for (auto& [name, tmpl] : BundleReader(lexer_config, parser_config, function_storage).read(file.data())) {
+      template_storage.insert_or_assign(name, std::move(tmpl));
+    }
   }
 
   /*!
@@ -222,14 +599,25 @@ public:
   */
   void set_include_callback(const std::function<Template(const std::filesystem::path&, const std::string&)>& callback) {
     parser_config.include_callback = callback;
+    template_cache.clear();
+  }
+
+  /*!
+  @brief Sets a function that is called once with all included files of a level that are not found, and returns their templates in the same order
+  */
+  void set_batch_include_callback(
+      const std::function<std::vector<Template>(const std::vector<std::pair<std::filesystem::path, std::string>>&)>& callback) {
+    parser_config.batch_include_callback = callback;
+    template_cache.clear();
   }
 };
 
 /*!
-@brief render with default settings to a string
+@brief Returns the cache of the free render functions, which is disabled by default
 */
-inline std::string render(std::string_view input, const json& data) {
-  return Environment().render(input, data);
+inline TemplateCache& default_template_cache() {
+  static TemplateCache cache;
+  return cache;
 }
 
 /*!
@@ -237,7 +625,32 @@ inline std::string render(std::string_view input, const json& data) {
 */
 inline void render_to(std::ostream& os, std::string_view input, const json& data) {
   Environment env;
-  env.render_to(os, env.parse(input), data);
+  auto& cache = default_template_cache();
+  if (!cache.is_enabled()) {
+    env.render_to(os, env.parse(input), data);
+    return;
+  }
+
+  static const size_t config_hash = TemplateCache::hash_config(LexerConfig(), ParserConfig(), FunctionStorage(), std::filesystem::path());
+  auto tmpl = cache.find(input, config_hash);
+  if (!tmpl) {
+    tmpl = std::make_shared<const Template>(env.parse(input));
+
+    // Included templates are only stored in the temporary environment
+    if (tmpl->count_includes() == 0) {
+      cache.insert(input, config_hash, tmpl);
+    }
+  }
+  env.render_to(os, *tmpl, data);
+}
+
+/*!
+@brief render with default settings to a string
+*/
+inline std::string render(std::string_view input, const json& data) {
+  std::stringstream os;
+  render_to(os, input, data);
+  return os.str();
 }
 
 } // namespace inja
@@ -43,6 +43,10 @@ struct DataError : public InjaError {
   explicit DataError(const std::string& message, SourceLocation location): InjaError("data_error", message, location) {}
 };
 
+struct LinkError : public InjaError {
+  explicit LinkError(const std::string& message): InjaError("link_error", message) {}
+};
+
 } // namespace inja
 
 #endif // INCLUDE_INJA_EXCEPTIONS_HPP_
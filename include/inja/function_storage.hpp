@@ -81,6 +81,7 @@ public:
 
 private:
   const int VARIADIC {-1};
+  size_t version {0}; // Changes with every added function, as parsed templates are bound to their functions
 
   std::map<std::pair<std::string, int>, FunctionData> function_storage = {
       {std::make_pair("at", 2), FunctionData {Operation::At}},
@@ -119,10 +120,17 @@ private:
 public:
   void add_builtin(std::string_view name, int num_args, Operation op) {
     function_storage.emplace(std::make_pair(static_cast<std::string>(name), num_args), FunctionData {op});
+    version += 1;
   }
 
   void add_callback(std::string_view name, int num_args, const CallbackFunction& callback) {
     function_storage.emplace(std::make_pair(static_cast<std::string>(name), num_args), FunctionData {Operation::Callback, callback});
+    version += 1;
+  }
+
+  /// Returns a number that changes whenever a function is added
+  size_t get_version() const {
+    return version;
   }
 
   FunctionData find_function(std::string_view name, int num_args) const {
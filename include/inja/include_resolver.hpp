@@ -0,0 +1,129 @@
+#ifndef INCLUDE_INJA_INCLUDE_RESOLVER_HPP_
+#define INCLUDE_INJA_INCLUDE_RESOLVER_HPP_
+
+#include <chrono>
+#include <cstddef>
+#include <filesystem>
+#include <mutex>
+#include <string>
+#include <system_error>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace inja {
+
+/*!
+ * \brief Finds the files of included templates, safe for concurrent use.
+ *
+ * An include is searched relative to the including template first, and then in each search path. Found files are
+ * cached for a limited time, so that moved or deleted files are found again. Includes that are not found are cached
+ * for a limited time as well, so that templates served by the include callback or the storage do not cause a failing
+ * file lookup on every parse. Both default to one second.
+ */
+class IncludeResolver {
+public:
+  struct Statistics {
+    size_t hits {0};
+    size_t misses {0};
+    size_t syscalls {0}; // Number of file lookups
+  };
+
+private:
+  struct Entry {
+    std::string file; // Empty if the include was not found
+    std::chrono::steady_clock::time_point expires;
+  };
+
+  const std::vector<std::filesystem::path> search_paths;
+  const std::chrono::steady_clock::duration negative_ttl;
+  const std::chrono::steady_clock::duration positive_ttl;
+
+  mutable std::mutex mutex;
+  std::unordered_map<std::string, Entry> entries;
+  Statistics stats;
+
+  std::string lookup(const std::filesystem::path& directory, const std::string& name) {
+    std::vector<std::filesystem::path> candidates {directory / name};
+    for (const auto& search_path : search_paths) {
+      candidates.emplace_back(search_path / name);
+    }
+
+    for (const auto& candidate : candidates) {
+      std::error_code error;
+      const bool exists = std::filesystem::is_regular_file(candidate, error);
+      {
+        std::scoped_lock lock(mutex);
+        stats.syscalls += 1;
+      }
+      if (exists) {
+        return storage_name(candidate);
+      }
+    }
+    return "";
+  }
+
+public:
+  explicit IncludeResolver(std::vector<std::filesystem::path> search_paths = {},
+                           std::chrono::steady_clock::duration negative_ttl = std::chrono::seconds(1),
+                           std::chrono::steady_clock::duration positive_ttl = std::chrono::seconds(1))
+      : search_paths(std::move(search_paths)), negative_ttl(negative_ttl), positive_ttl(positive_ttl) {}
+
+  /// Returns the normalized name under which the template of a file is registered in the storage
+  static std::string storage_name(const std::filesystem::path& filename) {
+    return filename.lexically_normal().string();
+  }
+
+  /// Returns the storage name of the file of the include, or an empty string if it is not found
+  std::string resolve(const std::filesystem::path& directory, const std::string& name) {
+    std::string key = directory.string();
+    key.push_back('\0');
+    key += name;
+
+    const auto now = std::chrono::steady_clock::now();
+    {
+      std::scoped_lock lock(mutex);
+      const auto it = entries.find(key);
+      if (it != entries.end() && it->second.expires > now) {
+        stats.hits += 1;
+        return it->second.file;
+      }
+      stats.misses += 1;
+    }
+
+    auto file = lookup(directory, name);
+    const auto ttl = file.empty() ? negative_ttl : positive_ttl;
+    if (ttl > std::chrono::steady_clock::duration::zero()) {
+      const auto expires = now + ttl;
+      std::scoped_lock lock(mutex);
+      entries.insert_or_assign(std::move(key), Entry {file, expires});
+    }
+    return file;
+  }
+
+  const std::vector<std::filesystem::path>& get_search_paths() const {
+    return search_paths;
+  }
+
+  std::chrono::steady_clock::duration get_negative_ttl() const {
+    return negative_ttl;
+  }
+
+  std::chrono::steady_clock::duration get_positive_ttl() const {
+    return positive_ttl;
+  }
+
+  Statistics statistics() const {
+    std::scoped_lock lock(mutex);
+    return stats;
+  }
+
+  void clear() {
+    std::scoped_lock lock(mutex);
+    entries.clear();
+  }
+};
+
+} // namespace inja
+
+#endif // INCLUDE_INJA_INCLUDE_RESOLVER_HPP_
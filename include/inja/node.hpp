@@ -1,11 +1,15 @@
 #ifndef INCLUDE_INJA_NODE_HPP_
 #define INCLUDE_INJA_NODE_HPP_
 
+#include <algorithm>
 #include <cstddef>
 #include <memory>
+#include <new>
 #include <string>
 #include <string_view>
 #include <tuple>
+#include <type_traits>
+#include <utility>
 #include <vector>
 
 #include "function_storage.hpp"
@@ -69,7 +73,7 @@ public:
 
 class BlockNode : public AstNode {
 public:
-  std::vector<std::shared_ptr<AstNode>> nodes;
+  std::vector<AstNode*> nodes;
 
   explicit BlockNode(): AstNode(0) {}
 
@@ -103,6 +107,7 @@ public:
   const json value;
 
   explicit LiteralNode(std::string_view data_text, size_t pos): ExpressionNode(pos), value(json::parse(data_text)) {}
+  explicit LiteralNode(const json& value, size_t pos): ExpressionNode(pos), value(value) {}
 
   void accept(NodeVisitor& v) const override {
     v.visit(*this);
@@ -111,8 +116,27 @@ public:
 
 class DataNode : public ExpressionNode {
 public:
+  /// How the first segment of the name is looked up, as resolved by the parser
+  enum class Scope {
+    Dynamic, // Loops of other templates, set variables, and the data
+    Loop,    // The variable of an enclosing loop statement
+  };
+
+  /// A segment of the name with its array index pre-parsed, or npos if it is not a valid index
+  struct Segment {
+    std::string key;
+    size_t index;
+  };
+
   const std::string name;
   const json::json_pointer ptr;
+  const std::vector<Segment> path;
+  const std::string& head; // First segment of the name, e.g. a loop variable
+
+  bool is_loop_metadata;                      // Whether the name refers to the special loop object
+  Scope scope {Scope::Dynamic};
+  const std::string* loop_variable {nullptr}; // Name of the loop variable, owned by the loop statement
+  size_t loop_depth {0};                      // Number of loops between the reference and the binding loop
 
   static std::string convert_dot_to_ptr(std::string_view ptr_name) {
     std::string result;
@@ -125,7 +149,49 @@ public:
     return result;
   }
 
-  explicit DataNode(std::string_view ptr_name, size_t pos): ExpressionNode(pos), name(ptr_name), ptr(json::json_pointer(convert_dot_to_ptr(ptr_name))) {}
+  static std::vector<Segment> convert_dot_to_path(std::string_view ptr_name) {
+    std::vector<Segment> result;
+    do {
+      std::string_view part;
+      std::tie(part, ptr_name) = string_view::split(ptr_name, '.');
+
+      // Same rules as for the array indices of a json pointer
+      size_t index = std::string::npos;
+      if (!part.empty() && part.size() < 19 && (part.size() == 1 || part[0] != '0') &&
+          std::all_of(part.begin(), part.end(), [](char c) { return c >= '0' && c <= '9'; })) {
+        index = std::stoull(std::string(part));
+      }
+      result.push_back({std::string(part), index});
+    } while (!ptr_name.empty());
+    return result;
+  }
+
+  explicit DataNode(std::string_view ptr_name, size_t pos)
+      : ExpressionNode(pos), name(ptr_name), ptr(json::json_pointer(convert_dot_to_ptr(ptr_name))), path(convert_dot_to_path(ptr_name)),
+        head(path.front().key), is_loop_metadata(head == "loop") {}
+
+  // The head refers to the path of the node itself, which a copy would still refer to
+  DataNode(const DataNode&) = delete;
+  DataNode& operator=(const DataNode&) = delete;
+
+  /// Follows the path from the given segment on in a single traversal of the data, or returns nullptr if it is not found
+  const json* find_in(const json& data, size_t first = 0) const {
+    const json* result = &data;
+    for (auto segment = path.begin() + first; segment != path.end(); ++segment) {
+      if (result->is_object()) {
+        const auto it = result->find(segment->key);
+        if (it == result->end()) {
+          return nullptr;
+        }
+        result = &*it;
+      } else if (result->is_array() && segment->index < result->size()) {
+        result = &(*result)[segment->index];
+      } else {
+        return nullptr;
+      }
+    }
+    return result;
+  }
 
   void accept(NodeVisitor& v) const override {
     v.visit(*this);
@@ -148,8 +214,9 @@ public:
 
   std::string name;
   int number_args; // Can also be negative -> -1 for unknown number
-  std::vector<std::shared_ptr<ExpressionNode>> arguments;
+  std::vector<ExpressionNode*> arguments;
   CallbackFunction callback;
+  const DataNode* literal_path {nullptr}; // Pre-compiled path of a string literal argument
 
   explicit FunctionNode(std::string_view name, size_t pos)
       : ExpressionNode(pos), precedence(8), associativity(Associativity::Left), operation(Op::Callback), name(name), number_args(0) {}
@@ -254,7 +321,7 @@ public:
 
 class ExpressionListNode : public AstNode {
 public:
-  std::shared_ptr<ExpressionNode> root;
+  ExpressionNode* root {nullptr};
 
   explicit ExpressionListNode(): AstNode(0) {}
   explicit ExpressionListNode(size_t pos): AstNode(pos) {}
@@ -280,6 +347,9 @@ public:
   explicit ForStatementNode(BlockNode* const parent, size_t pos): StatementNode(pos), parent(parent) {}
 
   virtual void accept(NodeVisitor& v) const = 0;
+
+  /// Returns the name of the loop variable that matches, or nullptr if the loop does not bind it
+  virtual const std::string* find_variable(const std::string& name) const = 0;
 };
 
 class ForArrayStatementNode : public ForStatementNode {
@@ -288,6 +358,10 @@ public:
 
   explicit ForArrayStatementNode(const std::string& value, BlockNode* const parent, size_t pos): ForStatementNode(parent, pos), value(value) {}
 
+  const std::string* find_variable(const std::string& name) const override {
+    return (value == name) ? &value : nullptr;
+  }
+
   void accept(NodeVisitor& v) const override {
     v.visit(*this);
   }
@@ -301,6 +375,13 @@ public:
   explicit ForObjectStatementNode(const std::string& key, const std::string& value, BlockNode* const parent, size_t pos)
       : ForStatementNode(parent, pos), key(key), value(value) {}
 
+  const std::string* find_variable(const std::string& name) const override {
+    if (value == name) {
+      return &value;
+    }
+    return (key == name) ? &key : nullptr;
+  }
+
   void accept(NodeVisitor& v) const override {
     v.visit(*this);
   }
@@ -327,6 +408,7 @@ public:
 class IncludeStatementNode : public StatementNode {
 public:
   const std::string file;
+  size_t link_index {std::string::npos}; // Index of the file in the dependencies of the template
 
   explicit IncludeStatementNode(const std::string& file, size_t pos): StatementNode(pos), file(file) {}
 
@@ -338,6 +420,7 @@ public:
 class ExtendsStatementNode : public StatementNode {
 public:
   const std::string file;
+  size_t link_index {std::string::npos}; // Index of the file in the dependencies of the template
 
   explicit ExtendsStatementNode(const std::string& file, size_t pos): StatementNode(pos), file(file) {}
 
@@ -351,6 +434,7 @@ public:
   const std::string name;
   BlockNode block;
   BlockNode* const parent;
+  size_t index {0}; // Of the block in the blocks of its template
 
   explicit BlockStatementNode(BlockNode* const parent, const std::string& name, size_t pos): StatementNode(pos), name(name), parent(parent) {}
 
@@ -362,15 +446,73 @@ public:
 class SetStatementNode : public StatementNode {
 public:
   const std::string key;
+  const json::json_pointer ptr;
+  const std::string head;
   ExpressionListNode expression;
 
-  explicit SetStatementNode(const std::string& key, size_t pos): StatementNode(pos), key(key) {}
+  explicit SetStatementNode(const std::string& key, size_t pos)
+      : StatementNode(pos), key(key), ptr(DataNode::convert_dot_to_ptr(key)), head(string_view::split(key, '.').first) {}
 
   void accept(NodeVisitor& v) const override {
     v.visit(*this);
   }
 };
 
+/*!
+ * \brief Bump allocator that owns all nodes of a Template.
+ *
+ * Nodes are placed contiguously in the order the parser creates them, and are destroyed together with the arena.
+ */
+class NodeArena {
+  static constexpr size_t chunk_size {8192};
+
+  std::vector<std::unique_ptr<unsigned char[]>> chunks;
+  unsigned char* current {nullptr};
+  size_t remaining {0};
+  std::vector<AstNode*> nodes;
+
+  void* allocate(size_t size, size_t alignment) {
+    void* memory = current;
+    if (current == nullptr || std::align(alignment, size, memory, remaining) == nullptr) {
+      const size_t new_size = std::max(chunk_size, size + alignment);
+      chunks.emplace_back(new unsigned char[new_size]);
+      memory = chunks.back().get();
+      remaining = new_size;
+      std::align(alignment, size, memory, remaining);
+    }
+    current = static_cast<unsigned char*>(memory) + size;
+    remaining -= size;
+    return memory;
+  }
+
+public:
+  explicit NodeArena() {}
+  NodeArena(const NodeArena&) = delete;
+  NodeArena& operator=(const NodeArena&) = delete;
+
+  ~NodeArena() {
+    for (auto it = nodes.rbegin(); it != nodes.rend(); ++it) {
+      (*it)->~AstNode();
+    }
+  }
+
+  template <class T, class... Args> T* make(Args&&... args) {
+    static_assert(std::is_base_of<AstNode, T>::value, "arena only holds AST nodes");
+    // The bookkeeping grows first, so that registering a constructed node can not throw and leak it
+    if (nodes.size() == nodes.capacity()) {
+      nodes.reserve(std::max<size_t>(64, 2 * nodes.capacity()));
+    }
+    T* node = new (allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+    nodes.push_back(node);
+    return node;
+  }
+
+  /// Return the number of nodes in the arena
+  size_t size() const {
+    return nodes.size();
+  }
+};
+
 } // namespace inja
 
 #endif // INCLUDE_INJA_NODE_HPP_
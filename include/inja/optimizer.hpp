@@ -0,0 +1,181 @@
+#ifndef INCLUDE_INJA_OPTIMIZER_HPP_
+#define INCLUDE_INJA_OPTIMIZER_HPP_
+
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "config.hpp"
+#include "function_storage.hpp"
+#include "node.hpp"
+#include "renderer.hpp"
+#include "template.hpp"
+#include "throw.hpp"
+
+namespace inja {
+
+/*!
+ * \brief Class for simplifying the AST of a parsed Template.
+ */
+class Optimizer {
+  using Op = FunctionStorage::Operation;
+
+  const ParserConfig& config;
+  const TemplateStorage& template_storage;
+  const FunctionStorage& function_storage;
+  const RenderConfig render_config;
+
+  Template* tmpl {nullptr};
+
+  static bool is_pure(Op operation) {
+    switch (operation) {
+    case Op::AtId:
+    case Op::Exists:
+    case Op::Super:
+    case Op::Callback:
+    case Op::None:
+      return false;
+    default:
+      return true;
+    }
+  }
+
+  bool merge_text() const {
+    return config.optimization_level >= 1;
+  }
+
+  bool fold_constants() const {
+    return config.optimization_level >= 2;
+  }
+
+  /// Replaces builtin function calls on literals by their result
+  void fold(ExpressionNode*& node) {
+    const auto function = dynamic_cast<FunctionNode*>(node);
+    if (!function) {
+      return;
+    }
+
+    bool is_constant = is_pure(function->operation);
+    for (auto& argument : function->arguments) {
+      fold(argument);
+      is_constant &= (dynamic_cast<const LiteralNode*>(argument) != nullptr);
+    }
+
+#if !defined(INJA_NOEXCEPTION)
+    if (is_constant) {
+      ExpressionListNode expression(function->pos);
+      expression.root = function;
+      try {
+        auto renderer = Renderer(render_config, template_storage, function_storage);
+        node = tmpl->arena->make<LiteralNode>(renderer.evaluate_constant(*tmpl, expression), function->pos);
+      } catch (...) {
+        // Keep the call, so that the error is thrown when rendering
+      }
+    }
+#endif
+  }
+
+  void fold(ExpressionListNode& expression) {
+    if (fold_constants() && expression.root) {
+      fold(expression.root);
+    }
+  }
+
+  TextNode* merge(const TextNode& first, const TextNode& second) {
+    if (first.pos + first.length == second.pos) {
+      return tmpl->arena->make<TextNode>(first.pos, first.length + second.length);
+    }
+
+    // Otherwise the merged text is appended to the content of the template
+    auto& content = tmpl->content;
+    size_t pos = first.pos;
+    if (first.pos + first.length != content.size()) {
+      pos = content.size();
+      content += content.substr(first.pos, first.length);
+    }
+    content += content.substr(second.pos, second.length);
+    return tmpl->arena->make<TextNode>(pos, content.size() - pos);
+  }
+
+  void append(std::vector<AstNode*>& nodes, AstNode* node) {
+    const auto text = dynamic_cast<const TextNode*>(node);
+    if (merge_text() && text) {
+      if (text->length == 0) {
+        return;
+      }
+
+      const auto previous = nodes.empty() ? nullptr : dynamic_cast<const TextNode*>(nodes.back());
+      if (previous) {
+        nodes.back() = merge(*previous, *text);
+        return;
+      }
+    }
+    nodes.emplace_back(node);
+  }
+
+  void optimize(BlockNode& block) {
+    std::vector<AstNode*> nodes;
+    nodes.reserve(block.nodes.size());
+
+    for (const auto node : block.nodes) {
+      if (const auto if_statement = dynamic_cast<IfStatementNode*>(node)) {
+        fold(if_statement->condition);
+        optimize(if_statement->true_statement);
+        optimize(if_statement->false_statement);
+
+        // Statically decided conditions are replaced by the taken branch
+        const auto condition = dynamic_cast<const LiteralNode*>(if_statement->condition.root);
+        if (fold_constants() && condition) {
+          const auto& branch = Renderer::is_truthy(condition->value) ? if_statement->true_statement : if_statement->false_statement;
+          for (const auto branch_node : branch.nodes) {
+            append(nodes, branch_node);
+          }
+          continue;
+        }
+
+      } else if (const auto for_statement = dynamic_cast<ForStatementNode*>(node)) {
+        fold(for_statement->condition);
+        optimize(for_statement->body);
+
+      } else if (const auto block_statement = dynamic_cast<BlockStatementNode*>(node)) {
+        optimize(block_statement->block);
+
+      } else if (const auto set_statement = dynamic_cast<SetStatementNode*>(node)) {
+        fold(set_statement->expression);
+
+      } else if (const auto expression = dynamic_cast<ExpressionListNode*>(node)) {
+        fold(*expression);
+      }
+
+      append(nodes, node);
+    }
+
+    block.nodes = std::move(nodes);
+  }
+
+public:
+  explicit Optimizer(const ParserConfig& config, const TemplateStorage& template_storage, const FunctionStorage& function_storage)
+      : config(config), template_storage(template_storage), function_storage(function_storage) {}
+
+  /// Folds the constant parts of a single expression of the template
+  void fold(Template& tmpl, ExpressionListNode& expression) {
+    this->tmpl = &tmpl;
+    fold(expression);
+    this->tmpl = nullptr;
+  }
+
+  /// Optimizes the template in place according to the optimization level of the config
+  void optimize(Template& tmpl) {
+    if (config.optimization_level == 0) {
+      return;
+    }
+
+    this->tmpl = &tmpl;
+    optimize(tmpl.root);
+    this->tmpl = nullptr;
+  }
+};
+
+} // namespace inja
+
+#endif // INCLUDE_INJA_OPTIMIZER_HPP_
@@ -1,14 +1,19 @@
 #ifndef INCLUDE_INJA_PARSER_HPP_
 #define INCLUDE_INJA_PARSER_HPP_
 
+#include <algorithm>
+#include <atomic>
 #include <cstddef>
+#include <exception>
 #include <filesystem>
 #include <fstream>
 #include <iterator>
 #include <memory>
+#include <set>
 #include <stack>
 #include <string>
 #include <string_view>
+#include <thread>
 #include <utility>
 #include <vector>
 
@@ -17,6 +22,7 @@
 #include "function_storage.hpp"
 #include "lexer.hpp"
 #include "node.hpp"
+#include "optimizer.hpp"
 #include "template.hpp"
 #include "throw.hpp"
 #include "token.hpp"
@@ -27,8 +33,8 @@ namespace inja {
  * \brief Class for parsing an inja Template.
  */
 class Parser {
-  using Arguments = std::vector<std::shared_ptr<ExpressionNode>>;
-  using OperatorStack = std::stack<std::shared_ptr<FunctionNode>>;
+  using Arguments = std::vector<ExpressionNode*>;
+  using OperatorStack = std::stack<FunctionNode*>;
 
   const ParserConfig& config;
 
@@ -36,6 +42,23 @@ class Parser {
   TemplateStorage& template_storage;
   const FunctionStorage& function_storage;
 
+  /// An included template that is not in the storage yet
+  struct IncludeRequest {
+    std::filesystem::path path; // Directory of the including template
+    std::string original_name;
+    std::string name; // Name in the template storage
+    bool found_file;
+  };
+
+  struct LoadedInclude {
+    Template tmpl;
+    std::vector<IncludeRequest> include_requests;
+    bool from_callback {false};
+  };
+
+  std::string template_name; // Name of the template parsed by this parser
+  std::vector<IncludeRequest> include_requests;
+
   Token tok, peek_tok;
   bool have_peek_tok {false};
 
@@ -48,6 +71,27 @@ class Parser {
   std::stack<ForStatementNode*> for_statement_stack;
   std::stack<BlockStatementNode*> block_statement_stack;
 
+  // Loop variables that are lexically visible, innermost last. Block bodies may be rendered outside of the
+  // loops around them, so each block starts a new, empty range of visible loops.
+  std::vector<const ForStatementNode*> loop_binding_stack;
+  std::stack<size_t> loop_binding_boundaries;
+
+  /// Binds the variable to the innermost enclosing loop of the same name, so that the renderer finds its frame directly
+  void resolve_scope(DataNode& node) const {
+    const size_t boundary = loop_binding_boundaries.empty() ? 0 : loop_binding_boundaries.top();
+    for (size_t i = loop_binding_stack.size(); i > boundary; --i) {
+      const ForStatementNode* loop = loop_binding_stack[i - 1];
+      const std::string* variable = loop->find_variable(node.head);
+      if (variable) {
+        node.scope = DataNode::Scope::Loop;
+        node.loop_variable = variable;
+        node.loop_depth = loop_binding_stack.size() - i;
+        node.is_loop_metadata = false;
+        return;
+      }
+    }
+  }
+
   void throw_parser_error(const std::string& message) const {
     INJA_THROW(ParserError(message, lexer.current_position()));
   }
@@ -68,9 +112,9 @@ class Parser {
     }
   }
 
-  void add_literal(Arguments &arguments, const char* content_ptr) {
+  void add_literal(Template& tmpl, Arguments& arguments) {
     const std::string_view data_text(literal_start.data(), tok.text.data() - literal_start.data() + tok.text.size());
-    arguments.emplace_back(std::make_shared<LiteralNode>(data_text, data_text.data() - content_ptr));
+    arguments.emplace_back(tmpl.arena->make<LiteralNode>(data_text, data_text.data() - tmpl.content.c_str()));
   }
 
   void add_operator(Arguments &arguments, OperatorStack &operator_stack) {
@@ -88,41 +132,165 @@ class Parser {
     arguments.emplace_back(function);
   }
 
+  /// Resolves the name of an included template, and queues it for loading if it is not in the storage yet
   void add_to_template_storage(const std::filesystem::path& path, std::string& template_name) {
-    if (template_storage.find(template_name) != template_storage.end()) {
+    if (template_storage.contains(template_name)) {
       return;
     }
 
     const std::string original_name = template_name;
 
+    bool found_file {false};
     if (config.search_included_templates_in_files) {
-      // Build the relative path
-      template_name = (path / original_name).string();
-      if (template_name.compare(0, 2, "./") == 0) {
-        template_name.erase(0, 2);
+      // Templates from the include callback are named by the relative path as well
+      const std::string file = config.include_resolver->resolve(path, original_name);
+      found_file = !file.empty();
+      template_name = found_file ? file : storage_name(path / original_name);
+      if (template_storage.contains(template_name)) {
+        return;
+      }
+    } else if (!config.include_callback && !config.batch_include_callback) {
+      return;
+    }
+
+    include_requests.push_back({path, original_name, template_name, found_file});
+  }
+
+  /// Calls the function for all indices on up to the given number of threads, or one per core for 0, and rethrows the
+  /// first error
+  template <class F> static void for_each_concurrently(size_t size, size_t thread_count, const F& function) {
+#if !defined(INJA_NOEXCEPTION)
+    std::vector<std::exception_ptr> errors(size);
+#endif
+    std::atomic<size_t> next {0};
+    const auto work = [&]() {
+      for (size_t i = next++; i < size; i = next++) {
+#if !defined(INJA_NOEXCEPTION)
+        try {
+          function(i);
+        } catch (...) {
+          errors[i] = std::current_exception();
+        }
+#else
+        function(i);
+#endif
+      }
+    };
+
+    if (thread_count == 0) {
+      thread_count = std::max(std::thread::hardware_concurrency(), 1u);
+    }
+    std::vector<std::thread> threads;
+    for (size_t t = 1; t < std::min(thread_count, size); ++t) {
+      threads.emplace_back(work);
+    }
+    work();
+    for (auto& thread : threads) {
+      thread.join();
+    }
+
+#if !defined(INJA_NOEXCEPTION)
+    for (const auto& error : errors) {
+      if (error) {
+        std::rethrow_exception(error);
+      }
+    }
+#endif
+  }
+
+  /// Loads the templates of one level of the include graph, where files are read and parsed concurrently if configured
+  std::vector<LoadedInclude> load_level(const std::vector<IncludeRequest>& requests) const {
+    std::vector<LoadedInclude> result(requests.size());
+    for_each_concurrently(requests.size(), config.include_parse_threads, [&](size_t i) {
+      const auto& request = requests[i];
+      std::ifstream file;
+      if (request.found_file) {
+        file.open(request.name);
+      }
+      if (!file.is_open() || file.fail()) {
+        result[i].from_callback = true;
+        return;
       }
 
-      if (template_storage.find(template_name) == template_storage.end()) {
-        // Load file
-        std::ifstream file;
-        file.open(template_name);
-        if (!file.fail()) {
-          const std::string text((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+      result[i].tmpl = Template(std::string(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>()));
+      auto parser = Parser(config, lexer.get_config(), template_storage, function_storage);
+      parser.template_name = request.name;
+      parser.parse_into(result[i].tmpl, std::filesystem::path(request.name).parent_path());
+      parser.finish(result[i].tmpl);
+      result[i].include_requests = std::move(parser.include_requests);
+    });
+
+    std::vector<size_t> missing;
+    for (size_t i = 0; i < requests.size(); ++i) {
+      if (result[i].from_callback) {
+        missing.emplace_back(i);
+      }
+    }
+    if (missing.empty()) {
+      return result;
+    }
 
-          auto include_template = Template(text);
-          template_storage.emplace(template_name, include_template);
-          parse_into_template(template_storage[template_name], template_name);
-          return;
-        } else if (!config.include_callback) {
-          INJA_THROW(FileError("failed accessing file at '" + template_name + "'"));
+    if (config.batch_include_callback) {
+      std::vector<std::pair<std::filesystem::path, std::string>> batch;
+      for (const auto i : missing) {
+        batch.emplace_back(requests[i].path, requests[i].original_name);
+      }
+      auto templates = config.batch_include_callback(batch);
+      if (templates.size() != missing.size()) {
+        INJA_THROW(FileError("include callback returned " + std::to_string(templates.size()) + " templates for " + std::to_string(missing.size()) +
+                             " includes"));
+      }
+      for (size_t j = 0; j < missing.size(); ++j) {
+        result[missing[j]].tmpl = std::move(templates[j]);
+      }
+    } else if (config.include_callback) {
+      for (const auto i : missing) {
+        result[i].tmpl = config.include_callback(requests[i].path, requests[i].original_name);
+      }
+    } else {
+      INJA_THROW(FileError("failed accessing file at '" + requests[missing.front()].name + "'"));
+    }
+    return result;
+  }
+
+  /// Loads all missing templates included by the parsed template level by level, so that the latency grows with the
+  /// depth of the include graph. They are registered at the end, so that other threads never see a partial template.
+  void load_includes() {
+    std::set<std::string> queued {storage_name(template_name)};
+    std::vector<IncludeRequest> level;
+    const auto enqueue = [&](std::vector<IncludeRequest>& requests) {
+      for (auto& request : requests) {
+        if (queued.insert(request.name).second) {
+          level.emplace_back(std::move(request));
         }
       }
+      requests.clear();
+    };
+    enqueue(include_requests);
+
+    std::vector<std::pair<std::string, Template>> loaded;
+    while (!level.empty()) {
+      const auto requests = std::move(level);
+      level.clear();
+
+      auto results = load_level(requests);
+      for (size_t i = 0; i < requests.size(); ++i) {
+        enqueue(results[i].include_requests);
+        loaded.emplace_back(requests[i].name, std::move(results[i].tmpl));
+      }
     }
 
-    // Try include callback
-    if (config.include_callback) {
-      auto include_template = config.include_callback(path, original_name);
-      template_storage.emplace(template_name, include_template);
+    // The deepest includes first
+    for (auto it = loaded.rbegin(); it != loaded.rend(); ++it) {
+      template_storage.emplace(it->first, std::move(it->second));
+    }
+  }
+
+  /// Pre-compiles a string literal argument such as in exists("user.name") into a path
+  void add_literal_path(Template& tmpl, FunctionNode& func) const {
+    const auto literal = dynamic_cast<const LiteralNode*>(func.arguments[0]);
+    if (literal && literal->value.is_string()) {
+      func.literal_path = tmpl.arena->make<DataNode>(literal->value.get_ref<const json::string_t&>(), literal->pos);
     }
   }
 
@@ -144,7 +312,7 @@ class Parser {
     return tok.kind == closing;
   }
 
-  std::shared_ptr<ExpressionNode> parse_expression(Template& tmpl) {
+  ExpressionNode* parse_expression(Template& tmpl) {
     size_t current_bracket_level {0};
     size_t current_brace_level {0};
     Arguments arguments;
@@ -156,13 +324,13 @@ class Parser {
       case Token::Kind::String: {
         if (current_brace_level == 0 && current_bracket_level == 0) {
           literal_start = tok.text;
-          add_literal(arguments, tmpl.content.c_str());
+          add_literal(tmpl, arguments);
         }
       } break;
       case Token::Kind::Number: {
         if (current_brace_level == 0 && current_bracket_level == 0) {
           literal_start = tok.text;
-          add_literal(arguments, tmpl.content.c_str());
+          add_literal(tmpl, arguments);
         }
       } break;
       case Token::Kind::LeftBracket: {
@@ -184,7 +352,7 @@ class Parser {
 
         current_bracket_level -= 1;
         if (current_brace_level == 0 && current_bracket_level == 0) {
-          add_literal(arguments, tmpl.content.c_str());
+          add_literal(tmpl, arguments);
         }
       } break;
       case Token::Kind::RightBrace: {
@@ -194,7 +362,7 @@ class Parser {
 
         current_brace_level -= 1;
         if (current_brace_level == 0 && current_bracket_level == 0) {
-          add_literal(arguments, tmpl.content.c_str());
+          add_literal(tmpl, arguments);
         }
       } break;
       case Token::Kind::Id: {
@@ -205,7 +373,7 @@ class Parser {
             tok.text == static_cast<decltype(tok.text)>("null")) {
           if (current_brace_level == 0 && current_bracket_level == 0) {
             literal_start = tok.text;
-            add_literal(arguments, tmpl.content.c_str());
+            add_literal(tmpl, arguments);
           }
 
           // Operator
@@ -214,7 +382,7 @@ class Parser {
 
           // Functions
         } else if (peek_tok.kind == Token::Kind::LeftParen) {
-          auto func = std::make_shared<FunctionNode>(tok.text, tok.text.data() - tmpl.content.c_str());
+          auto func = tmpl.arena->make<FunctionNode>(tok.text, tok.text.data() - tmpl.content.c_str());
           get_next_token();
           do {
             get_next_token();
@@ -236,12 +404,16 @@ class Parser {
           func->operation = function_data.operation;
           if (function_data.operation == FunctionStorage::Operation::Callback) {
             func->callback = function_data.callback;
+          } else if (function_data.operation == FunctionStorage::Operation::Exists) {
+            add_literal_path(tmpl, *func);
           }
           arguments.emplace_back(func);
 
           // Variables
         } else {
-          arguments.emplace_back(std::make_shared<DataNode>(static_cast<std::string>(tok.text), tok.text.data() - tmpl.content.c_str()));
+          auto data_node = tmpl.arena->make<DataNode>(static_cast<std::string>(tok.text), tok.text.data() - tmpl.content.c_str());
+          resolve_scope(*data_node);
+          arguments.emplace_back(data_node);
         }
 
         // Operators
@@ -319,7 +491,7 @@ class Parser {
           throw_parser_error("unknown operator in parser.");
         }
         }
-        auto function_node = std::make_shared<FunctionNode>(operation, tok.text.data() - tmpl.content.c_str());
+        auto function_node = tmpl.arena->make<FunctionNode>(operation, tok.text.data() - tmpl.content.c_str());
 
         while (!operator_stack.empty() &&
                ((operator_stack.top()->precedence > function_node->precedence) ||
@@ -358,7 +530,7 @@ class Parser {
         if (tok.kind != Token::Kind::Id) {
           throw_parser_error("expected function name, got '" + tok.describe() + "'");
         }
-        auto func = std::make_shared<FunctionNode>(tok.text, tok.text.data() - tmpl.content.c_str());
+        auto func = tmpl.arena->make<FunctionNode>(tok.text, tok.text.data() - tmpl.content.c_str());
         // add first parameter as last value from arguments
         func->number_args += 1;
         func->arguments.emplace_back(arguments.back());
@@ -403,7 +575,7 @@ class Parser {
       add_operator(arguments, operator_stack);
     }
 
-    std::shared_ptr<ExpressionNode> expr;
+    ExpressionNode* expr {nullptr};
     if (arguments.size() == 1) {
       expr = arguments[0];
       arguments = {};
@@ -421,9 +593,9 @@ class Parser {
     if (tok.text == static_cast<decltype(tok.text)>("if")) {
       get_next_token();
 
-      auto if_statement_node = std::make_shared<IfStatementNode>(current_block, tok.text.data() - tmpl.content.c_str());
+      auto if_statement_node = tmpl.arena->make<IfStatementNode>(current_block, tok.text.data() - tmpl.content.c_str());
       current_block->nodes.emplace_back(if_statement_node);
-      if_statement_stack.emplace(if_statement_node.get());
+      if_statement_stack.emplace(if_statement_node);
       current_block = &if_statement_node->true_statement;
       current_expression_list = &if_statement_node->condition;
 
@@ -444,9 +616,9 @@ class Parser {
       if (tok.kind == Token::Kind::Id && tok.text == static_cast<decltype(tok.text)>("if")) {
         get_next_token();
 
-        auto if_statement_node = std::make_shared<IfStatementNode>(true, current_block, tok.text.data() - tmpl.content.c_str());
+        auto if_statement_node = tmpl.arena->make<IfStatementNode>(true, current_block, tok.text.data() - tmpl.content.c_str());
         current_block->nodes.emplace_back(if_statement_node);
-        if_statement_stack.emplace(if_statement_node.get());
+        if_statement_stack.emplace(if_statement_node);
         current_block = &if_statement_node->true_statement;
         current_expression_list = &if_statement_node->condition;
 
@@ -478,12 +650,12 @@ class Parser {
 
       const std::string block_name = static_cast<std::string>(tok.text);
 
-      auto block_statement_node = std::make_shared<BlockStatementNode>(current_block, block_name, tok.text.data() - tmpl.content.c_str());
+      auto block_statement_node = tmpl.arena->make<BlockStatementNode>(current_block, block_name, tok.text.data() - tmpl.content.c_str());
       current_block->nodes.emplace_back(block_statement_node);
-      block_statement_stack.emplace(block_statement_node.get());
+      block_statement_stack.emplace(block_statement_node);
+      loop_binding_boundaries.emplace(loop_binding_stack.size());
       current_block = &block_statement_node->block;
-      auto success = tmpl.block_storage.emplace(block_name, block_statement_node);
-      if (!success.second) {
+      if (!tmpl.add_block(block_statement_node)) {
         throw_parser_error("block with the name '" + block_name + "' does already exist");
       }
 
@@ -498,6 +670,7 @@ class Parser {
 
       current_block = block_statement_data->parent;
       block_statement_stack.pop();
+      loop_binding_boundaries.pop();
     } else if (tok.text == static_cast<decltype(tok.text)>("for")) {
       get_next_token();
 
@@ -510,7 +683,7 @@ class Parser {
       get_next_token();
 
       // Object type
-      std::shared_ptr<ForStatementNode> for_statement_node;
+      ForStatementNode* for_statement_node;
       if (tok.kind == Token::Kind::Comma) {
         get_next_token();
         if (tok.kind != Token::Kind::Id) {
@@ -521,17 +694,17 @@ class Parser {
         value_token = tok;
         get_next_token();
 
-        for_statement_node = std::make_shared<ForObjectStatementNode>(static_cast<std::string>(key_token.text), static_cast<std::string>(value_token.text),
+        for_statement_node = tmpl.arena->make<ForObjectStatementNode>(static_cast<std::string>(key_token.text), static_cast<std::string>(value_token.text),
                                                                       current_block, tok.text.data() - tmpl.content.c_str());
 
         // Array type
       } else {
         for_statement_node =
-            std::make_shared<ForArrayStatementNode>(static_cast<std::string>(value_token.text), current_block, tok.text.data() - tmpl.content.c_str());
+            tmpl.arena->make<ForArrayStatementNode>(static_cast<std::string>(value_token.text), current_block, tok.text.data() - tmpl.content.c_str());
       }
 
       current_block->nodes.emplace_back(for_statement_node);
-      for_statement_stack.emplace(for_statement_node.get());
+      for_statement_stack.emplace(for_statement_node);
       current_block = &for_statement_node->body;
       current_expression_list = &for_statement_node->condition;
 
@@ -543,6 +716,9 @@ class Parser {
       if (!parse_expression(tmpl, closing)) {
         return false;
       }
+
+      // The loop variables are bound only within the body, not in the condition
+      loop_binding_stack.emplace_back(for_statement_node);
     } else if (tok.text == static_cast<decltype(tok.text)>("endfor")) {
       if (for_statement_stack.empty()) {
         throw_parser_error("endfor without matching for");
@@ -553,13 +729,17 @@ class Parser {
 
       current_block = for_statement_data->parent;
       for_statement_stack.pop();
+      loop_binding_stack.pop_back();
     } else if (tok.text == static_cast<decltype(tok.text)>("include")) {
       get_next_token();
 
       std::string template_name = parse_filename();
       add_to_template_storage(path, template_name);
+      tmpl.dependencies.emplace_back(template_name);
 
-      current_block->nodes.emplace_back(std::make_shared<IncludeStatementNode>(template_name, tok.text.data() - tmpl.content.c_str()));
+      auto node = tmpl.arena->make<IncludeStatementNode>(template_name, tok.text.data() - tmpl.content.c_str());
+      node->link_index = tmpl.dependencies.size() - 1;
+      current_block->nodes.emplace_back(node);
 
       get_next_token();
     } else if (tok.text == static_cast<decltype(tok.text)>("extends")) {
@@ -567,8 +747,11 @@ class Parser {
 
       std::string template_name = parse_filename();
       add_to_template_storage(path, template_name);
+      tmpl.dependencies.emplace_back(template_name);
 
-      current_block->nodes.emplace_back(std::make_shared<ExtendsStatementNode>(template_name, tok.text.data() - tmpl.content.c_str()));
+      auto node = tmpl.arena->make<ExtendsStatementNode>(template_name, tok.text.data() - tmpl.content.c_str());
+      node->link_index = tmpl.dependencies.size() - 1;
+      current_block->nodes.emplace_back(node);
 
       get_next_token();
     } else if (tok.text == static_cast<decltype(tok.text)>("set")) {
@@ -581,7 +764,7 @@ class Parser {
       const std::string key = static_cast<std::string>(tok.text);
       get_next_token();
 
-      auto set_statement_node = std::make_shared<SetStatementNode>(key, tok.text.data() - tmpl.content.c_str());
+      auto set_statement_node = tmpl.arena->make<SetStatementNode>(key, tok.text.data() - tmpl.content.c_str());
       current_block->nodes.emplace_back(set_statement_node);
       current_expression_list = &set_statement_node->expression;
 
@@ -617,7 +800,7 @@ class Parser {
         current_block = nullptr;
         return;
       case Token::Kind::Text: {
-        current_block->nodes.emplace_back(std::make_shared<TextNode>(tok.text.data() - tmpl.content.c_str(), tok.text.size()));
+        current_block->nodes.emplace_back(tmpl.arena->make<TextNode>(tok.text.data() - tmpl.content.c_str(), tok.text.size()));
       } break;
       case Token::Kind::StatementOpen: {
         get_next_token();
@@ -640,9 +823,9 @@ class Parser {
       case Token::Kind::ExpressionOpen: {
         get_next_token();
 
-        auto expression_list_node = std::make_shared<ExpressionListNode>(tok.text.data() - tmpl.content.c_str());
+        auto expression_list_node = tmpl.arena->make<ExpressionListNode>(tok.text.data() - tmpl.content.c_str());
         current_block->nodes.emplace_back(expression_list_node);
-        current_expression_list = expression_list_node.get();
+        current_expression_list = expression_list_node;
 
         if (!parse_expression(tmpl, Token::Kind::ExpressionClose)) {
           throw_parser_error("expected expression close, got '" + tok.describe() + "'");
@@ -661,6 +844,15 @@ class Parser {
     }
   }
 
+  /// Runs the optional passes after parsing
+  void finish(Template& tmpl) const {
+    Optimizer(config, template_storage, function_storage).optimize(tmpl);
+    tmpl.analyze();
+    if (config.compile_bytecode) {
+      tmpl.compile();
+    }
+  }
+
 public:
   explicit Parser(const ParserConfig& parser_config, const LexerConfig& lexer_config, TemplateStorage& template_storage,
                   const FunctionStorage& function_storage)
@@ -669,12 +861,22 @@ public:
   Template parse(std::string_view input, const std::filesystem::path& path) {
     auto result = Template(std::string(input));
     parse_into(result, path);
+    finish(result);
+    load_includes();
     return result;
   }
 
   void parse_into_template(Template& tmpl, const std::filesystem::path& filename) {
     auto sub_parser = Parser(config, lexer.get_config(), template_storage, function_storage);
+    sub_parser.template_name = filename.string();
     sub_parser.parse_into(tmpl, filename.parent_path());
+    finish(tmpl);
+    sub_parser.load_includes();
+  }
+
+  /// Returns the name under which the template of a file is registered in the storage
+  static std::string storage_name(const std::filesystem::path& filename) {
+    return IncludeResolver::storage_name(filename);
   }
 
   static std::string load_file(const std::filesystem::path& filename) {
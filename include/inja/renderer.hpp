@@ -6,8 +6,10 @@
 #include <cctype>
 #include <cmath>
 #include <cstddef>
+#include <cstdint>
 #include <memory>
 #include <numeric>
+#include <optional>
 #include <ostream>
 #include <sstream>
 #include <stack>
@@ -15,6 +17,10 @@
 #include <utility>
 #include <vector>
 
+#if __has_include(<memory_resource>)
+#include <memory_resource>
+#endif
+
 #include "config.hpp"
 #include "exceptions.hpp"
 #include "function_storage.hpp"
@@ -23,6 +29,10 @@
 #include "throw.hpp"
 #include "utils.hpp"
 
+#if defined(__cpp_lib_memory_resource)
+#define INJA_HAS_MEMORY_RESOURCE
+#endif
+
 namespace inja {
 
 /*!
@@ -44,6 +54,187 @@ inline std::string htmlescape(const std::string& data) {
   return buffer;
 }
 
+/*!
+ * \brief Reusable bookkeeping of the renderer, e.g. held per thread, so that renders of warm templates do not allocate it.
+ *
+ * A context must only be used by one render at a time. It keeps the capacity of its containers between renders.
+ */
+class RenderContext {
+  friend class Renderer;
+
+  template <class T> struct Stack : std::stack<T, std::vector<T>> {
+    void clear() {
+      this->c.clear();
+    }
+  };
+
+  struct LoopState {
+    const json* values;
+    json::const_iterator it;
+    size_t index;
+    size_t tmp_size; // Of the temporaries including the values, which are kept until the end of the loop
+  };
+
+  /// Binds the variables of a loop by reference to the current element, and keeps its metadata
+  struct LoopScope {
+    const std::string* key_name;
+    const std::string* value_name;
+    json key;
+    const json* value;
+
+    // Set statements rebind the variables to the additional data until the next iteration
+    const json* assigned_key;
+    bool is_assigned;
+
+    size_t index;
+    size_t size;
+
+    // The loop object is only materialized if a template references it
+    json metadata;
+    size_t metadata_index;
+
+    const json* get_key() const {
+      return assigned_key ? assigned_key : &key;
+    }
+
+    const json* find(const std::string& name) const {
+      if (*value_name == name) {
+        return value;
+      } else if (key_name && *key_name == name) {
+        return get_key();
+      }
+      return nullptr;
+    }
+  };
+
+  std::vector<const Template*> template_stack;
+  std::vector<std::shared_ptr<const Template>> parent_templates;
+  std::vector<size_t> block_slot_stack;
+#ifdef INJA_HAS_MEMORY_RESOURCE
+  /// Counts the memory that the arena takes beyond its buffer
+  class OverflowResource : public std::pmr::memory_resource {
+    void* do_allocate(size_t bytes, size_t alignment) override {
+      size += bytes;
+      return std::pmr::new_delete_resource()->allocate(bytes, alignment);
+    }
+
+    void do_deallocate(void* p, size_t bytes, size_t alignment) override {
+      std::pmr::new_delete_resource()->deallocate(p, bytes, alignment);
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override {
+      return this == &other;
+    }
+
+  public:
+    size_t size {0};
+  };
+
+  // The arena of the temporaries is declared before them, so that it outlives them
+  std::vector<std::byte> arena_buffer;
+  OverflowResource arena_overflow;
+  std::optional<std::pmr::monotonic_buffer_resource> arena_buffer_resource;
+  std::optional<std::pmr::unsynchronized_pool_resource> arena; // Reuses the memory of released temporaries
+#endif
+  size_t arena_capacity {0};
+
+  std::vector<LoopScope> loop_scopes;
+  std::vector<LoopState> loop_states;
+  std::vector<std::shared_ptr<json>> tmp_stack;
+  Stack<const json*> eval_stack;
+  Stack<const DataNode*> not_found_stack;
+  json additional_data;
+
+  // Of the renderers of included templates, which render one after another at each depth
+  std::unique_ptr<RenderContext> include_context;
+
+  RenderContext& get_include_context() {
+    if (!include_context) {
+      include_context = std::make_unique<RenderContext>();
+    }
+    include_context->reset();
+    return *include_context;
+  }
+
+  /// Forgets the state of the last render, also if it threw, which releases its temporaries
+  void clear() {
+    template_stack.clear();
+    parent_templates.clear();
+    block_slot_stack.clear();
+    loop_scopes.clear();
+    loop_states.clear();
+    tmp_stack.clear();
+    eval_stack.clear();
+    not_found_stack.clear();
+    additional_data = nullptr;
+  }
+
+  /// Replaces the arena, which must not hold temporaries anymore
+  void reset_arena() {
+#ifdef INJA_HAS_MEMORY_RESOURCE
+    arena.reset(); // Before the resource it allocates from
+    arena_buffer_resource.reset();
+    if (arena_capacity == 0) {
+      return;
+    }
+
+    // The buffer grows to the memory that the last render needed
+    arena_buffer.resize(std::max(arena_capacity, arena_buffer.size() + arena_overflow.size));
+    arena_overflow.size = 0;
+    arena_buffer_resource.emplace(arena_buffer.data(), arena_buffer.size(), &arena_overflow);
+    arena.emplace(&*arena_buffer_resource);
+#endif
+  }
+
+#ifdef INJA_HAS_MEMORY_RESOURCE
+  /// Returns the arena of the temporaries, or nullptr if they use the global allocator
+  std::pmr::memory_resource* get_arena() {
+    return arena ? &*arena : nullptr;
+  }
+#endif
+
+public:
+  explicit RenderContext() {}
+
+  /// Forgets the state of the last render, which is done in the renderer before each render
+  void reset() {
+    clear();
+    if (arena_capacity > 0) {
+      reset_arena();
+    }
+  }
+
+  /*!
+  @brief Allocates the temporary values of renders from an arena instead of the global allocator
+
+  The arena starts with the given capacity in bytes, and grows to the memory needed by the previous render. It is
+  released as a whole before the next render. A capacity of 0 disables the arena, which is also ignored if the
+  standard library has no polymorphic allocators. The values within temporaries, like strings, still use the global
+  allocator.
+  */
+  void set_arena_capacity(size_t capacity) {
+    clear();
+    arena_capacity = capacity;
+#ifdef INJA_HAS_MEMORY_RESOURCE
+    // The arena keeps its own bookkeeping in the buffer
+    arena.reset();
+    arena_buffer_resource.reset();
+    arena_buffer = std::vector<std::byte>();
+    arena_overflow.size = 0;
+#endif
+    reset_arena();
+  }
+
+  /// Returns the capacity of the arena for the next render
+  size_t get_arena_capacity() const {
+#ifdef INJA_HAS_MEMORY_RESOURCE
+    return std::max(arena_capacity, arena_buffer.size() + arena_overflow.size);
+#else
+    return arena_capacity;
+#endif
+  }
+};
+
 /*!
  * \brief Class for rendering a Template with data.
  */
@@ -54,23 +245,67 @@ class Renderer : public NodeVisitor {
   const TemplateStorage& template_storage;
   const FunctionStorage& function_storage;
 
+  using LoopState = RenderContext::LoopState;
+  using LoopScope = RenderContext::LoopScope;
+
+  RenderContext own_context;
+  RenderContext& context;
+
   const Template* current_template;
-  size_t current_level {0};
-  std::vector<const Template*> template_stack;
-  std::vector<const BlockStatementNode*> block_statement_stack;
+  size_t current_level {0}; // Of the current template in the inheritance chain
+  std::vector<const Template*>& template_stack {context.template_stack};
+  std::vector<std::shared_ptr<const Template>>& parent_templates {context.parent_templates};
+
+  // Links of the template whose include or extends statement was rendered last
+  const Template* linked_template {nullptr};
+  std::shared_ptr<const TemplateLinks> links;
+
+  // Blocks of the inheritance chain, and the slots of the blocks that are rendered
+  std::shared_ptr<const BlockTable> blocks;
+  std::vector<size_t>& block_slot_stack {context.block_slot_stack};
 
   const json* data_input;
+  const json* static_input {nullptr}; // Of a specialized template, whose top-level keys shadow those of the data
   std::ostream* output_stream;
 
-  json additional_data;
-  json* current_loop_data = &additional_data["loop"];
+  json& additional_data {context.additional_data};
+
+  // The set variables that are read, which are those of the including renderer if the template does not assign any
+  const json* additional_data_view {&additional_data};
 
-  std::vector<std::shared_ptr<json>> data_tmp_stack;
-  std::stack<const json*> data_eval_stack;
-  std::stack<const DataNode*> not_found_stack;
+  // The evaluation stacks are shared with the renderers of included templates
+  std::vector<std::shared_ptr<json>>& data_tmp_stack {context.tmp_stack};
+#ifdef INJA_HAS_MEMORY_RESOURCE
+  std::pmr::memory_resource* arena {nullptr}; // Of the temporaries, shared with included templates
+#endif
+  RenderContext::Stack<const json*>& data_eval_stack {context.eval_stack};
+  RenderContext::Stack<const DataNode*>& not_found_stack {context.not_found_stack};
 
   bool break_rendering {false};
 
+  // Set by the bytecode interpreter when the arguments of the next function call are already on the evaluation stack
+  bool arguments_on_stack {false};
+
+  // Whether the current expression has loaded a value from the mutable additional data
+  bool additional_data_loaded {false};
+
+  std::vector<LoopScope>& loop_scopes {context.loop_scopes}; // Shared with included templates that do not assign variables
+  std::vector<LoopState>& loop_states {context.loop_states};
+
+  /// Remembers where a variable was found in the set variables or the data, until the next assignment
+  struct InlineCacheEntry {
+    const DataNode* node {nullptr};
+    size_t generation {0};
+    const json* value {nullptr};
+    bool is_additional_data {false};
+  };
+
+  static constexpr size_t inline_cache_size {64};
+  std::array<InlineCacheEntry, inline_cache_size> inline_cache {};
+
+  // Incremented whenever the set variables change, which invalidates all cached lookups
+  size_t data_generation {1};
+
   static bool truthy(const json* data) {
     if (data->is_boolean()) {
       return data->get<bool>();
@@ -82,30 +317,56 @@ class Renderer : public NodeVisitor {
     return !data->empty();
   }
 
-  void print_data(const std::shared_ptr<json>& value) {
-    if (value->is_string()) {
+  void print_data(const json& value) {
+    if (value.is_string()) {
       if (config.html_autoescape) {
-        *output_stream << htmlescape(value->get_ref<const json::string_t&>());
+        *output_stream << htmlescape(value.get_ref<const json::string_t&>());
       } else {
-        *output_stream << value->get_ref<const json::string_t&>();
+        *output_stream << value.get_ref<const json::string_t&>();
       }
-    } else if (value->is_number_unsigned()) {
-      *output_stream << value->get<const json::number_unsigned_t>();
-    } else if (value->is_number_integer()) {
-      *output_stream << value->get<const json::number_integer_t>();
-    } else if (value->is_null()) {
+    } else if (value.is_number_unsigned()) {
+      *output_stream << value.get<const json::number_unsigned_t>();
+    } else if (value.is_number_integer()) {
+      *output_stream << value.get<const json::number_integer_t>();
+    } else if (value.is_null()) {
     } else {
-      *output_stream << value->dump();
+      *output_stream << value.dump();
     }
   }
 
-  const std::shared_ptr<json> eval_expression_list(const ExpressionListNode& expression_list) {
+  /// Evaluates the expression and returns a pointer into the data, the literal or an owned temporary
+  const json* eval_expression_list(const ExpressionListNode& expression_list) {
     if (!expression_list.root) {
       throw_renderer_error("empty expression", expression_list);
     }
 
     expression_list.root->accept(*this);
+    return pop_expression_result(expression_list);
+  }
 
+  const json* eval_loop_values(const ForStatementNode& node) {
+    if (!node.condition.root) {
+      throw_renderer_error("empty expression", node.condition);
+    }
+
+    node.condition.root->accept(*this);
+    return pop_loop_values(node);
+  }
+
+  /// The loop body might reassign the variable that is iterated over, so values from the additional data are copied
+  const json* pop_loop_values(const ForStatementNode& node) {
+    const bool copy_values = additional_data_loaded;
+    const auto result = pop_expression_result(node.condition);
+    if (copy_values) {
+      make_result(json(*result));
+      const auto copy = data_eval_stack.top();
+      data_eval_stack.pop();
+      return copy;
+    }
+    return result;
+  }
+
+  const json* pop_expression_result(const ExpressionListNode& expression_list) {
     if (data_eval_stack.empty()) {
       throw_renderer_error("empty expression", expression_list);
     } else if (data_eval_stack.size() != 1) {
@@ -114,6 +375,7 @@ class Renderer : public NodeVisitor {
 
     const auto result = data_eval_stack.top();
     data_eval_stack.pop();
+    additional_data_loaded = false;
 
     if (result == nullptr) {
       if (not_found_stack.empty()) {
@@ -125,7 +387,26 @@ class Renderer : public NodeVisitor {
 
       throw_renderer_error("variable '" + static_cast<std::string>(node->name) + "' not found", *node);
     }
-    return std::make_shared<json>(*result);
+    return result;
+  }
+
+  const json* pop_argument(const FunctionNode& node, bool throw_not_found = true) {
+    if (data_eval_stack.empty()) {
+      throw_renderer_error("function needs 1 variables, but has only found 0", node);
+    }
+
+    const auto result = data_eval_stack.top();
+    data_eval_stack.pop();
+
+    if (!result) {
+      const auto data_node = not_found_stack.top();
+      not_found_stack.pop();
+
+      if (throw_not_found) {
+        throw_renderer_error("variable '" + static_cast<std::string>(data_node->name) + "' not found", *data_node);
+      }
+    }
+    return result;
   }
 
   void throw_renderer_error(const std::string& message, const AstNode& node) {
@@ -133,8 +414,8 @@ class Renderer : public NodeVisitor {
     INJA_THROW(RenderError(message, loc));
   }
 
-  void make_result(const json&& result) {
-    auto result_ptr = std::make_shared<json>(result);
+  void make_result(json&& result) {
+    auto result_ptr = make_temporary(std::move(result));
     data_tmp_stack.push_back(result_ptr);
     data_eval_stack.push(result_ptr.get());
   }
@@ -144,8 +425,10 @@ class Renderer : public NodeVisitor {
       throw_renderer_error("function needs " + std::to_string(N_start + N) + " variables, but has only found " + std::to_string(node.arguments.size()), node);
     }
 
-    for (size_t i = N_start; i < N_start + N; i += 1) {
-      node.arguments[i]->accept(*this);
+    if (!std::exchange(arguments_on_stack, false)) {
+      for (size_t i = N_start; i < N_start + N; i += 1) {
+        node.arguments[i]->accept(*this);
+      }
     }
 
     if (data_eval_stack.size() < N) {
@@ -171,8 +454,10 @@ class Renderer : public NodeVisitor {
 
   template <bool throw_not_found = true> Arguments get_argument_vector(const FunctionNode& node) {
     const size_t N = node.arguments.size();
-    for (const auto& a : node.arguments) {
-      a->accept(*this);
+    if (!std::exchange(arguments_on_stack, false)) {
+      for (const auto& a : node.arguments) {
+        a->accept(*this);
+      }
     }
 
     if (data_eval_stack.size() < N) {
@@ -216,17 +501,80 @@ class Renderer : public NodeVisitor {
     data_eval_stack.push(&node.value);
   }
 
+  void push_relative(const json* variable, const DataNode& node) {
+    if (const auto result = node.find_in(*variable, 1)) {
+      data_eval_stack.push(result);
+    } else {
+      data_eval_stack.push(nullptr);
+      not_found_stack.emplace(&node);
+    }
+  }
+
+  /// Returns the bound loop variable, and notes if it was rebound to the mutable additional data
+  const json* find_loop_variable(const DataNode& node) {
+    // The parser has resolved the frame of the enclosing loop
+    if (node.scope == DataNode::Scope::Loop && node.loop_depth < loop_scopes.size()) {
+      const auto& scope = loop_scopes[loop_scopes.size() - 1 - node.loop_depth];
+      if (scope.value_name == node.loop_variable) {
+        additional_data_loaded |= scope.is_assigned;
+        return scope.value;
+      } else if (scope.key_name == node.loop_variable) {
+        additional_data_loaded |= scope.is_assigned;
+        return scope.get_key();
+      }
+    }
+
+    for (auto scope = loop_scopes.rbegin(); scope != loop_scopes.rend(); ++scope) {
+      if (const auto variable = scope->find(node.head)) {
+        additional_data_loaded |= scope->is_assigned;
+        return variable;
+      }
+    }
+    return nullptr;
+  }
+
+  /// Returns the data in which names with the given first segment are looked up, as if the data was updated by the static
+  /// data of a specialized template
+  const json& input_for(const std::string& head) const {
+    if (static_input && static_input->is_object() && static_input->contains(head)) {
+      return *static_input;
+    }
+    return *data_input;
+  }
+
   void visit(const DataNode& node) override {
-    if (additional_data.contains(node.ptr)) {
-      data_eval_stack.push(&(additional_data[node.ptr]));
-    } else if (data_input->contains(node.ptr)) {
-      data_eval_stack.push(&(*data_input)[node.ptr]);
+    if (!loop_scopes.empty()) {
+      if (const auto variable = find_loop_variable(node)) {
+        push_relative(variable, node);
+        return;
+      }
+
+      if (node.is_loop_metadata) {
+        push_relative(&loop_metadata(loop_scopes.size() - 1), node);
+        return;
+      }
+    }
+
+    auto& entry = inline_cache[(reinterpret_cast<std::uintptr_t>(&node) / alignof(DataNode)) % inline_cache_size];
+    if (entry.node != &node || entry.generation != data_generation) {
+      entry.node = &node;
+      entry.generation = data_generation;
+      entry.value = node.find_in(*additional_data_view);
+      entry.is_additional_data = (entry.value != nullptr);
+      if (!entry.value) {
+        entry.value = node.find_in(input_for(node.head));
+      }
+    }
+
+    if (entry.value) {
+      data_eval_stack.push(entry.value);
+      additional_data_loaded |= entry.is_additional_data;
     } else {
       // Try to evaluate as a no-argument callback
       const auto function_data = function_storage.find_function(node.name, 0);
       if (function_data.operation == FunctionStorage::Operation::Callback) {
         Arguments empty_args {};
-        const auto value = std::make_shared<json>(function_data.callback(empty_args));
+        const auto value = make_temporary(function_data.callback(empty_args));
         data_tmp_stack.push_back(value);
         data_eval_stack.push(value.get());
       } else {
@@ -362,7 +710,12 @@ class Renderer : public NodeVisitor {
     } break;
     case Op::Exists: {
       auto&& name = get_arguments<1>(node)[0]->get_ref<const json::string_t&>();
-      make_result(data_input->contains(json::json_pointer(DataNode::convert_dot_to_ptr(name))));
+      if (node.literal_path) {
+        make_result(node.literal_path->find_in(input_for(node.literal_path->head)) != nullptr);
+      } else {
+        const auto ptr = json::json_pointer(DataNode::convert_dot_to_ptr(name));
+        make_result(input_for(std::string(string_view::split(name, '.').first)).contains(ptr));
+      }
     } break;
     case Op::ExistsInObject: {
       const auto args = get_arguments<2>(node);
@@ -431,7 +784,7 @@ class Renderer : public NodeVisitor {
       }
     } break;
     case Op::Sort: {
-      auto result_ptr = std::make_shared<json>(get_arguments<1>(node)[0]->get<std::vector<json>>());
+      auto result_ptr = make_temporary(get_arguments<1>(node)[0]->get<std::vector<json>>());
       std::sort(result_ptr->begin(), result_ptr->end());
       data_tmp_stack.push_back(result_ptr);
       data_eval_stack.push(result_ptr.get());
@@ -468,11 +821,10 @@ class Renderer : public NodeVisitor {
     } break;
     case Op::Super: {
       const auto args = get_argument_vector(node);
-      const size_t old_level = current_level;
       const size_t level_diff = (args.size() == 1) ? args[0]->get<int>() : 1;
       const size_t level = current_level + level_diff;
 
-      if (block_statement_stack.empty()) {
+      if (block_slot_stack.empty()) {
         throw_renderer_error("super() call is not within a block", node);
       }
 
@@ -480,19 +832,12 @@ class Renderer : public NodeVisitor {
         throw_renderer_error("level of super() call does not match parent templates (between 1 and " + std::to_string(template_stack.size() - 1) + ")", node);
       }
 
-      const auto current_block_statement = block_statement_stack.back();
-      const Template* new_template = template_stack.at(level);
-      const Template* old_template = current_template;
-      const auto block_it = new_template->block_storage.find(current_block_statement->name);
-      if (block_it != new_template->block_storage.end()) {
-        current_template = new_template;
-        current_level = level;
-        block_it->second->block.accept(*this);
-        current_level = old_level;
-        current_template = old_template;
-      } else {
-        throw_renderer_error("could not find block with name '" + current_block_statement->name + "'", node);
+      const size_t slot = block_slot_stack.back();
+      if (blocks->implementations[slot][level] == nullptr) {
+        const auto& name = blocks->implementations[slot][current_level]->name;
+        throw_renderer_error("could not find block with name '" + name + "'", node);
       }
+      render_block(slot, level);
       make_result(nullptr);
     } break;
     case Op::Join: {
@@ -516,8 +861,25 @@ class Renderer : public NodeVisitor {
     }
   }
 
+  /// Creates a temporary value, in the arena of the context if there is one
+  template <class... Args> std::shared_ptr<json> make_temporary(Args&&... args) {
+#ifdef INJA_HAS_MEMORY_RESOURCE
+    if (arena) {
+      return std::allocate_shared<json>(std::pmr::polymorphic_allocator<json>(arena), std::forward<Args>(args)...);
+    }
+#endif
+    return std::make_shared<json>(std::forward<Args>(args)...);
+  }
+
+  /// Releases the temporaries created since the stack had the given size, once the expressions that use them are done
+  void release_temporaries(size_t size) {
+    data_tmp_stack.erase(data_tmp_stack.begin() + size, data_tmp_stack.end());
+  }
+
   void visit(const ExpressionListNode& node) override {
-    print_data(eval_expression_list(node));
+    const size_t tmp_size = data_tmp_stack.size();
+    print_data(*eval_expression_list(node));
+    release_temporaries(tmp_size);
   }
 
   void visit(const StatementNode&) override {}
@@ -525,151 +887,479 @@ class Renderer : public NodeVisitor {
   void visit(const ForStatementNode&) override {}
 
   void visit(const ForArrayStatementNode& node) override {
-    const auto result = eval_expression_list(node.condition);
+    const size_t tmp_size = data_tmp_stack.size(); // The values of the loop are kept until its end
+    const auto result = eval_loop_values(node);
     if (!result->is_array()) {
       throw_renderer_error("object must be an array", node);
     }
 
-    if (!current_loop_data->empty()) {
-      auto tmp = *current_loop_data; // Because of clang-3
-      (*current_loop_data)["parent"] = std::move(tmp);
-    }
-
+    begin_loop(*result, nullptr, node.value);
     size_t index = 0;
-    (*current_loop_data)["is_first"] = true;
-    (*current_loop_data)["is_last"] = (result->size() <= 1);
     for (auto it = result->begin(); it != result->end(); ++it) {
-      additional_data[static_cast<std::string>(node.value)] = *it;
-
-      (*current_loop_data)["index"] = index;
-      (*current_loop_data)["index1"] = index + 1;
-      if (index == 1) {
-        (*current_loop_data)["is_first"] = false;
-      }
-      if (index == result->size() - 1) {
-        (*current_loop_data)["is_last"] = true;
-      }
+      bind_loop_variables(it, index);
 
       node.body.accept(*this);
       ++index;
     }
-
-    additional_data[static_cast<std::string>(node.value)].clear();
-    if (!(*current_loop_data)["parent"].empty()) {
-      const auto tmp = (*current_loop_data)["parent"];
-      *current_loop_data = tmp;
-    } else {
-      current_loop_data = &additional_data["loop"];
-    }
+    end_loop();
+    release_temporaries(tmp_size);
   }
 
   void visit(const ForObjectStatementNode& node) override {
-    const auto result = eval_expression_list(node.condition);
+    const size_t tmp_size = data_tmp_stack.size(); // The values of the loop are kept until its end
+    const auto result = eval_loop_values(node);
     if (!result->is_object()) {
       throw_renderer_error("object must be an object", node);
     }
 
-    if (!current_loop_data->empty()) {
-      (*current_loop_data)["parent"] = std::move(*current_loop_data);
-    }
-
+    begin_loop(*result, &node.key, node.value);
     size_t index = 0;
-    (*current_loop_data)["is_first"] = true;
-    (*current_loop_data)["is_last"] = (result->size() <= 1);
     for (auto it = result->begin(); it != result->end(); ++it) {
-      additional_data[static_cast<std::string>(node.key)] = it.key();
-      additional_data[static_cast<std::string>(node.value)] = it.value();
-
-      (*current_loop_data)["index"] = index;
-      (*current_loop_data)["index1"] = index + 1;
-      if (index == 1) {
-        (*current_loop_data)["is_first"] = false;
-      }
-      if (index == result->size() - 1) {
-        (*current_loop_data)["is_last"] = true;
-      }
+      bind_loop_variables(it, index);
 
       node.body.accept(*this);
       ++index;
     }
-
-    additional_data[static_cast<std::string>(node.key)].clear();
-    additional_data[static_cast<std::string>(node.value)].clear();
-    if (!(*current_loop_data)["parent"].empty()) {
-      *current_loop_data = std::move((*current_loop_data)["parent"]);
-    } else {
-      current_loop_data = &additional_data["loop"];
-    }
+    end_loop();
+    release_temporaries(tmp_size);
   }
 
   void visit(const IfStatementNode& node) override {
-    const auto result = eval_expression_list(node.condition);
-    if (truthy(result.get())) {
+    const size_t tmp_size = data_tmp_stack.size();
+    const bool condition = truthy(eval_expression_list(node.condition));
+    release_temporaries(tmp_size);
+    if (condition) {
       node.true_statement.accept(*this);
     } else if (node.has_false_statement) {
       node.false_statement.accept(*this);
     }
   }
 
+  /// Returns the link of an include or extends statement of the current template, or nullptr if its target was not
+  /// loaded at the time of linking
+  const TemplateLinks::Target* find_link(size_t link_index) {
+    if (link_index >= current_template->dependencies.size()) {
+      return nullptr;
+    }
+    if (linked_template != current_template) {
+      links = current_template->link(template_storage);
+      linked_template = current_template;
+    }
+    const auto& target = links->targets[link_index];
+    return target.tmpl.expired() ? nullptr : &target;
+  }
+
+  /// Returns the included or extended template through its link, so that its name is only looked up in the storage if
+  /// it was not loaded at the time of linking
+  std::shared_ptr<const Template> find_linked(const TemplateLinks::Target* link, const std::string& name) {
+    if (link) {
+      if (auto target = link->tmpl.lock()) {
+        return target;
+      }
+    }
+    return template_storage.find(name);
+  }
+
   void visit(const IncludeStatementNode& node) override {
-    auto sub_renderer = Renderer(config, template_storage, function_storage);
-    const auto included_template_it = template_storage.find(node.file);
-    if (included_template_it != template_storage.end()) {
-      sub_renderer.render_to(*output_stream, included_template_it->second, *data_input, &additional_data);
-    } else if (config.throw_at_missing_includes) {
-      throw_renderer_error("include '" + node.file + "' not found", node);
+    const auto link = find_link(node.link_index);
+    const auto included_template = find_linked(link, node.file);
+    if (!included_template) {
+      if (config.throw_at_missing_includes) {
+        throw_renderer_error("include '" + node.file + "' not found", node);
+      }
+      return;
     }
+
+    // Small templates that only read the data are rendered like a part of the current template, which is unaffected by
+    // an extends statement of the current template like a renderer of its own
+    const bool is_linked = link && link->tmpl.lock() == included_template;
+    if (is_linked && config.include_inline_threshold > 0 && link->inline_size <= config.include_inline_threshold) {
+      const Template* old_template = current_template;
+      const bool old_break_rendering = std::exchange(break_rendering, false);
+      current_template = included_template.get();
+      if (current_template->program) {
+        execute(*current_template->program, 0);
+      } else {
+        current_template->root.accept(*this);
+      }
+      current_template = old_template;
+      break_rendering = old_break_rendering;
+      return;
+    }
+
+    auto sub_renderer = Renderer(*this, is_linked && link->is_read_only);
+    sub_renderer.render_to(*output_stream, *included_template, *data_input);
   }
 
   void visit(const ExtendsStatementNode& node) override {
-    const auto included_template_it = template_storage.find(node.file);
-    if (included_template_it != template_storage.end()) {
-      const Template* parent_template = &included_template_it->second;
-      render_to(*output_stream, *parent_template, *data_input, &additional_data);
+    const auto parent_template = find_linked(find_link(node.link_index), node.file);
+    if (parent_template) {
+      // The statements that might still follow, e.g. in a loop, belong to this template and are linked by it
+      const Template* old_template = current_template;
+      const size_t old_level = current_level;
+      parent_templates.emplace_back(parent_template);
+      render_to(*output_stream, *parent_template, *data_input);
+      current_template = old_template;
+      current_level = old_level;
       break_rendering = true;
     } else if (config.throw_at_missing_includes) {
       throw_renderer_error("extends '" + node.file + "' not found", node);
     }
   }
 
+  /// Returns the blocks of the inheritance chain, which only needs to be linked again after following an extends statement
+  const BlockTable& linked_blocks() {
+    if (!blocks || blocks->parents.size() != parent_templates.size()) {
+      blocks = template_stack.front()->link_blocks(parent_templates);
+    }
+    return *blocks;
+  }
+
   void visit(const BlockStatementNode& node) override {
+    // Blocks are rendered as implemented by the rendered template, and blocks it does not implement are left empty
+    const auto& table = linked_blocks();
+    const size_t slot = table.slots[current_level][node.index];
+    if (table.implementations[slot][0] != nullptr) {
+      render_block(slot, 0);
+    }
+  }
+
+  void visit(const SetStatementNode& node) override {
+    const size_t tmp_size = data_tmp_stack.size();
+    assign(node, *eval_expression_list(node.expression));
+    release_temporaries(tmp_size);
+  }
+
+  void assign(const SetStatementNode& node, const json& value) {
+    json copy = value; // The value may alias the additional data that is modified
+
+    // Assigning to a loop variable replaces its binding by a copy in the additional data until the next iteration
+    const auto& head = node.head;
+    bool is_rebound = false;
+    for (auto scope = loop_scopes.rbegin(); scope != loop_scopes.rend(); ++scope) {
+      if (const auto variable = scope->find(head)) {
+        is_rebound = true;
+        json& replacement = additional_data[head];
+        if (&replacement != variable) {
+          replacement = *variable;
+        }
+        if (*scope->value_name == head) {
+          scope->value = &replacement;
+        } else {
+          scope->assigned_key = &replacement;
+        }
+        scope->is_assigned = true;
+        break;
+      }
+    }
+
+    // Assigning to the loop object changes the one of the innermost loop until the next iteration
+    if (!is_rebound && head == "loop" && !loop_scopes.empty()) {
+      loop_metadata(loop_scopes.size() - 1);
+      loop_scopes.back().metadata[json::json_pointer(node.ptr.to_string().substr(head.size() + 1))] = copy;
+    }
+
+    additional_data[node.ptr] = std::move(copy);
+    data_generation += 1;
+  }
+
+  void begin_loop(const json& values, const std::string* key_name, const std::string& value_name) {
+    loop_scopes.push_back({key_name, &value_name, key_name ? json(json::string_t()) : json(), nullptr, nullptr, false, 0, values.size(), json(), std::string::npos});
+  }
+
+  void end_loop() {
+    loop_scopes.pop_back();
+  }
+
+  void bind_loop_variables(json::const_iterator it, size_t index) {
+    auto& scope = loop_scopes.back();
+    if (scope.key_name) {
+      scope.key.get_ref<json::string_t&>() = it.key(); // Reuses the capacity of the key
+    }
+    scope.value = &it.value();
+    scope.assigned_key = nullptr;
+    scope.is_assigned = false;
+    scope.index = index;
+  }
+
+  const json& loop_metadata(size_t level) {
+    auto& scope = loop_scopes[level];
+    if (scope.metadata_index != scope.index) {
+      json metadata;
+      metadata["index"] = scope.index;
+      metadata["index1"] = scope.index + 1;
+      metadata["is_first"] = (scope.index == 0);
+      metadata["is_last"] = (scope.index == scope.size - 1);
+      if (level > 0) {
+        metadata["parent"] = loop_metadata(level - 1);
+      }
+      scope.metadata = std::move(metadata);
+      scope.metadata_index = scope.index;
+    }
+    return scope.metadata;
+  }
+
+  /// Renders the implementation of the block slot in the template of the given level of the inheritance chain
+  void render_block(size_t slot, size_t level) {
+    const BlockStatementNode& node = *blocks->implementations[slot][level];
+    const Template* old_template = current_template;
     const size_t old_level = current_level;
-    current_level = 0;
-    current_template = template_stack.front();
-    const auto block_it = current_template->block_storage.find(node.name);
-    if (block_it != current_template->block_storage.end()) {
-      block_statement_stack.emplace_back(&node);
-      block_it->second->block.accept(*this);
-      block_statement_stack.pop_back();
+    current_template = template_stack[level];
+    current_level = level;
+    block_slot_stack.emplace_back(slot);
+
+    const auto& program = current_template->program;
+    if (program && node.index < program->block_entries.size() && program->block_entries[node.index] != std::string::npos) {
+      execute(*program, program->block_entries[node.index]);
+    } else {
+      node.block.accept(*this);
     }
+
+    block_slot_stack.pop_back();
     current_level = old_level;
-    current_template = template_stack.back();
+    current_template = old_template;
   }
 
-  void visit(const SetStatementNode& node) override {
-    std::string ptr = node.key;
-    replace_substring(ptr, ".", "/");
-    ptr = "/" + ptr;
-    additional_data[json::json_pointer(ptr)] = *eval_expression_list(node.expression);
+  void execute(const Program& program, size_t pc) {
+    using Opcode = Instruction::Opcode;
+
+    // The loops of this program, on top of those of enclosing programs
+    const size_t loop_base = loop_states.size();
+    const Instruction* const code = program.instructions.data();
+
+    // Temporaries are released after each statement, down to those of the innermost loop
+    const size_t tmp_base = data_tmp_stack.size();
+    const auto release_statement_temporaries = [&]() {
+      release_temporaries((loop_states.size() > loop_base) ? loop_states.back().tmp_size : tmp_base);
+    };
+
+    for (;;) {
+      const Instruction& instruction = code[pc];
+      ++pc;
+
+      switch (instruction.opcode) {
+      case Opcode::Text: {
+        const auto& node = static_cast<const TextNode&>(*instruction.node);
+        output_stream->write(current_template->content.c_str() + node.pos, node.length);
+      } break;
+      case Opcode::Push: {
+        data_eval_stack.push(&static_cast<const LiteralNode&>(*instruction.node).value);
+      } break;
+      case Opcode::Load: {
+        visit(static_cast<const DataNode&>(*instruction.node));
+      } break;
+      case Opcode::Call: {
+        arguments_on_stack = true;
+        visit(static_cast<const FunctionNode&>(*instruction.node));
+      } break;
+      case Opcode::AtId: {
+        const auto& node = static_cast<const FunctionNode&>(*instruction.node);
+        const auto id = data_eval_stack.top();
+        data_eval_stack.pop();
+        const DataNode* id_node = nullptr;
+        if (!id) {
+          id_node = not_found_stack.top();
+          not_found_stack.pop();
+        }
+        const auto container = pop_argument(node, false);
+        if (!id_node) {
+          throw_renderer_error("could not find element with given name", node);
+        }
+        data_eval_stack.push(&container->at(id_node->name));
+      } break;
+      case Opcode::And: {
+        if (!truthy(pop_argument(static_cast<const FunctionNode&>(*instruction.node)))) {
+          make_result(false);
+          pc = instruction.target;
+        }
+      } break;
+      case Opcode::Or: {
+        if (truthy(pop_argument(static_cast<const FunctionNode&>(*instruction.node)))) {
+          make_result(true);
+          pc = instruction.target;
+        }
+      } break;
+      case Opcode::Truthy: {
+        make_result(truthy(pop_argument(static_cast<const FunctionNode&>(*instruction.node))));
+      } break;
+      case Opcode::Default: {
+        const auto test_arg = pop_argument(static_cast<const FunctionNode&>(*instruction.node), false);
+        if (test_arg != nullptr) {
+          data_eval_stack.push(test_arg);
+          pc = instruction.target;
+        }
+      } break;
+      case Opcode::Require: {
+        data_eval_stack.push(pop_argument(static_cast<const FunctionNode&>(*instruction.node)));
+      } break;
+      case Opcode::Empty: {
+        throw_renderer_error("empty expression", *instruction.node);
+      } break;
+      case Opcode::Print: {
+        print_data(*pop_expression_result(static_cast<const ExpressionListNode&>(*instruction.node)));
+        release_statement_temporaries();
+      } break;
+      case Opcode::JumpIfFalse: {
+        const bool condition = truthy(pop_expression_result(static_cast<const ExpressionListNode&>(*instruction.node)));
+        release_statement_temporaries();
+        if (!condition) {
+          pc = instruction.target;
+        }
+      } break;
+      case Opcode::Jump: {
+        pc = instruction.target;
+      } break;
+      case Opcode::ForArray:
+      case Opcode::ForObject: {
+        const auto& node = static_cast<const ForStatementNode&>(*instruction.node);
+        const auto result = pop_loop_values(node);
+        if (instruction.opcode == Opcode::ForArray) {
+          if (!result->is_array()) {
+            throw_renderer_error("object must be an array", node);
+          }
+          begin_loop(*result, nullptr, static_cast<const ForArrayStatementNode&>(node).value);
+        } else {
+          if (!result->is_object()) {
+            throw_renderer_error("object must be an object", node);
+          }
+          begin_loop(*result, &static_cast<const ForObjectStatementNode&>(node).key, static_cast<const ForObjectStatementNode&>(node).value);
+        }
+
+        if (result->empty()) {
+          end_loop();
+          release_statement_temporaries();
+          pc = instruction.target;
+          break;
+        }
+
+        loop_states.push_back({result, result->begin(), 0, data_tmp_stack.size()});
+        bind_loop_variables(loop_states.back().it, 0);
+      } break;
+      case Opcode::LoopNext: {
+        auto& state = loop_states.back();
+        ++state.it;
+        ++state.index;
+        if (state.it != state.values->end()) {
+          bind_loop_variables(state.it, state.index);
+          pc = instruction.target;
+        } else {
+          end_loop();
+          loop_states.pop_back();
+          release_statement_temporaries();
+        }
+      } break;
+      case Opcode::Set: {
+        const auto& node = static_cast<const SetStatementNode&>(*instruction.node);
+        assign(node, *pop_expression_result(node.expression));
+        release_statement_temporaries();
+      } break;
+      case Opcode::Include: {
+        visit(static_cast<const IncludeStatementNode&>(*instruction.node));
+      } break;
+      case Opcode::Extends: {
+        visit(static_cast<const ExtendsStatementNode&>(*instruction.node));
+      } break;
+      case Opcode::Break: {
+        if (break_rendering) {
+          pc = instruction.target;
+        }
+      } break;
+      case Opcode::Block: {
+        visit(static_cast<const BlockStatementNode&>(*instruction.node));
+      } break;
+      case Opcode::Return:
+        return;
+      }
+    }
+  }
+
+  /// Renderer of an included template, which reads the set variables and loop frames of the including renderer instead
+  /// of copying them if the template does not assign variables
+  explicit Renderer(Renderer& parent, bool share_scope)
+      : config(parent.config), template_storage(parent.template_storage), function_storage(parent.function_storage),
+        context(parent.context.get_include_context()), data_tmp_stack(parent.data_tmp_stack), data_eval_stack(parent.data_eval_stack),
+        not_found_stack(parent.not_found_stack), loop_scopes(share_scope ? parent.loop_scopes : context.loop_scopes) {
+#ifdef INJA_HAS_MEMORY_RESOURCE
+    arena = parent.arena;
+#endif
+    static_input = parent.static_input;
+    if (share_scope) {
+      additional_data_view = parent.additional_data_view;
+    } else {
+      additional_data = *parent.additional_data_view;
+      context.loop_scopes = parent.loop_scopes;
+    }
   }
 
 public:
   explicit Renderer(const RenderConfig& config, const TemplateStorage& template_storage, const FunctionStorage& function_storage)
-      : config(config), template_storage(template_storage), function_storage(function_storage) {}
+      : config(config), template_storage(template_storage), function_storage(function_storage), context(own_context) {}
+
+  /// Renderer that keeps its bookkeeping in the given context, which is reset
+  explicit Renderer(const RenderConfig& config, const TemplateStorage& template_storage, const FunctionStorage& function_storage,
+                    RenderContext& context)
+      : config(config), template_storage(template_storage), function_storage(function_storage), context(context) {
+    context.reset();
+#ifdef INJA_HAS_MEMORY_RESOURCE
+    arena = context.get_arena();
+#endif
+  }
 
-  void render_to(std::ostream& os, const Template& tmpl, const json& data, json* loop_data = nullptr) {
+  /// Writes the value in the same way as an expression in the template
+  void print_to(std::ostream& os, const json& value) {
+    output_stream = &os;
+    print_data(value);
+  }
+
+  /// Evaluates an expression that does not depend on any data, e.g. for constant folding
+  json evaluate_constant(const Template& tmpl, const ExpressionListNode& expression) {
+    static const json empty_data;
+    current_template = &tmpl;
+    data_input = &empty_data;
+    template_stack.emplace_back(current_template);
+
+    json result = *eval_expression_list(expression);
+    template_stack.pop_back();
+    data_tmp_stack.clear();
+    return result;
+  }
+
+  /// Returns whether the value is true as the condition of an if statement
+  static bool is_truthy(const json& value) {
+    return truthy(&value);
+  }
+
+  void render_to(std::ostream& os, const Template& tmpl, const json& data) {
     output_stream = &os;
     current_template = &tmpl;
     data_input = &data;
-    if (loop_data != nullptr) {
-      additional_data = *loop_data;
-      current_loop_data = &additional_data["loop"];
+    if (tmpl.static_data) {
+      static_input = tmpl.static_data.get();
     }
+    data_generation += 1;
+
+    // Temporaries of an including renderer might still be in use. The others are released even if rendering throws, as
+    // they might be allocated from the arena of the context
+    struct TemporariesGuard {
+      Renderer& renderer;
+      const size_t size;
+
+      ~TemporariesGuard() {
+        renderer.release_temporaries(size);
+      }
+    } temporaries_guard {*this, data_tmp_stack.size()};
 
     template_stack.emplace_back(current_template);
-    current_template->root.accept(*this);
+    current_level = template_stack.size() - 1;
 
-    data_tmp_stack.clear();
+    // An extends statement in a later iteration of a loop renders its parent while the rendering is already stopped,
+    // which needs the checks that templates without extends and block statements are compiled without
+    const auto& program = current_template->program;
+    if (program && (program->checks_breaks || !break_rendering)) {
+      execute(*program, 0);
+    } else {
+      current_template->root.accept(*this);
+    }
   }
 };
 
@@ -0,0 +1,630 @@
+#ifndef INCLUDE_INJA_SERIALIZATION_HPP_
+#define INCLUDE_INJA_SERIALIZATION_HPP_
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define INJA_HAS_MMAP
+#endif
+
+#include "config.hpp"
+#include "exceptions.hpp"
+#include "function_storage.hpp"
+#include "json.hpp"
+#include "node.hpp"
+#include "template.hpp"
+#include "throw.hpp"
+
+namespace inja {
+
+/*!
+ * \brief Layout of a precompiled bundle of templates.
+ *
+ * A bundle starts with a header of the magic bytes, the format and inja versions, and the lexer configuration. It is
+ * followed by the templates, each with its name, content, dependencies, a msgpack pool of its literals, the msgpack of
+ * its static data if it is specialized or null, and its AST in pre-order. All integers are stored in the byte order of
+ * the writing machine, which is detected by the version. Nodes are nested at most max_nesting levels deep.
+ */
+struct TemplateBundle {
+  static constexpr char magic[4] {'I', 'N', 'J', 'B'};
+  static constexpr std::uint32_t format_version {3};
+  static constexpr size_t max_nesting {1000};
+
+  enum class Tag : std::uint8_t {
+    Text,
+    Literal,
+    Data,
+    Function,
+    ExpressionList,
+    ForArray,
+    ForObject,
+    If,
+    Include,
+    Extends,
+    Block,
+    Set,
+  };
+
+  static std::vector<const std::string*> lexer_settings(const LexerConfig& config) {
+    return {&config.statement_open,   &config.statement_open_no_lstrip,     &config.statement_open_force_lstrip,  &config.statement_close,
+            &config.statement_close_force_rstrip, &config.line_statement,  &config.expression_open,  &config.expression_open_force_lstrip,
+            &config.expression_close, &config.expression_close_force_rstrip, &config.comment_open,     &config.comment_open_force_lstrip,
+            &config.comment_close,    &config.comment_close_force_rstrip};
+  }
+};
+
+/*!
+ * \brief Read-only view of a file, which is memory-mapped where the platform supports it.
+ */
+class MappedFile {
+#if defined(INJA_HAS_MMAP)
+  void* address {nullptr};
+  size_t length {0};
+#else
+  std::string buffer;
+#endif
+
+public:
+  explicit MappedFile(const std::filesystem::path& path) {
+#if defined(INJA_HAS_MMAP)
+    const int descriptor = ::open(path.c_str(), O_RDONLY);
+    if (descriptor < 0) {
+      INJA_THROW(FileError("failed accessing file at '" + path.string() + "'"));
+    }
+
+    struct stat status;
+    if (::fstat(descriptor, &status) == 0 && status.st_size > 0) {
+      length = static_cast<size_t>(status.st_size);
+      address = ::mmap(nullptr, length, PROT_READ, MAP_PRIVATE, descriptor, 0);
+    }
+    ::close(descriptor);
+
+    if (address == MAP_FAILED) {
+      address = nullptr;
+      INJA_THROW(FileError("failed mapping file at '" + path.string() + "'"));
+    }
+#else
+    std::ifstream file(path, std::ios::binary);
+    if (file.fail()) {
+      INJA_THROW(FileError("failed accessing file at '" + path.string() + "'"));
+    }
+    buffer.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+#endif
+  }
+
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+
+  ~MappedFile() {
+#if defined(INJA_HAS_MMAP)
+    if (address != nullptr) {
+      ::munmap(address, length);
+    }
+#endif
+  }
+
+  std::string_view data() const {
+#if defined(INJA_HAS_MMAP)
+    return address ? std::string_view(static_cast<const char*>(address), length) : std::string_view();
+#else
+    return buffer;
+#endif
+  }
+};
+
+/*!
+ * \brief Class for writing templates into a precompiled bundle.
+ */
+class BundleWriter : public NodeVisitor {
+  using Tag = TemplateBundle::Tag;
+
+  const LexerConfig& lexer_config;
+
+  std::string nodes;
+  json literals;
+
+  template <class T> static void write_value(std::string& out, T value) {
+    char bytes[sizeof(T)];
+    std::memcpy(bytes, &value, sizeof(T));
+    out.append(bytes, sizeof(T));
+  }
+
+  static void write_size(std::string& out, size_t value) {
+    write_value(out, static_cast<std::uint64_t>(value));
+  }
+
+  static void write_string(std::string& out, std::string_view value) {
+    write_value(out, static_cast<std::uint32_t>(value.size()));
+    out.append(value.data(), value.size());
+  }
+
+  void write_node(Tag tag, const AstNode& node) {
+    write_value(nodes, tag);
+    write_size(nodes, node.pos);
+  }
+
+  void write_expression_list(const ExpressionListNode& node) {
+    write_size(nodes, node.pos);
+    write_value(nodes, static_cast<std::uint8_t>(node.root != nullptr));
+    if (node.root) {
+      node.root->accept(*this);
+    }
+  }
+
+  void visit(const BlockNode& node) override {
+    write_value(nodes, static_cast<std::uint32_t>(node.nodes.size()));
+    for (const auto n : node.nodes) {
+      n->accept(*this);
+    }
+  }
+
+  void visit(const TextNode& node) override {
+    write_node(Tag::Text, node);
+    write_size(nodes, node.length);
+  }
+
+  void visit(const ExpressionNode&) override {}
+
+  void visit(const LiteralNode& node) override {
+    write_node(Tag::Literal, node);
+    write_value(nodes, static_cast<std::uint32_t>(literals.size()));
+    literals.push_back(node.value);
+  }
+
+  void visit(const DataNode& node) override {
+    write_node(Tag::Data, node);
+    write_string(nodes, node.name);
+    write_value(nodes, static_cast<std::uint8_t>(node.scope));
+    write_value(nodes, static_cast<std::uint8_t>(node.is_loop_metadata));
+    write_size(nodes, node.loop_depth);
+  }
+
+  void visit(const FunctionNode& node) override {
+    write_node(Tag::Function, node);
+    write_value(nodes, static_cast<std::uint32_t>(node.operation));
+    write_string(nodes, node.name);
+    write_value(nodes, static_cast<std::int32_t>(node.number_args));
+    write_value(nodes, static_cast<std::uint8_t>(node.literal_path != nullptr));
+    write_value(nodes, static_cast<std::uint32_t>(node.arguments.size()));
+    for (const auto argument : node.arguments) {
+      argument->accept(*this);
+    }
+  }
+
+  void visit(const ExpressionListNode& node) override {
+    write_value(nodes, Tag::ExpressionList);
+    write_expression_list(node);
+  }
+
+  void visit(const StatementNode&) override {}
+  void visit(const ForStatementNode&) override {}
+
+  void visit(const ForArrayStatementNode& node) override {
+    write_node(Tag::ForArray, node);
+    write_string(nodes, node.value);
+    write_expression_list(node.condition);
+    node.body.accept(*this);
+  }
+
+  void visit(const ForObjectStatementNode& node) override {
+    write_node(Tag::ForObject, node);
+    write_string(nodes, node.key);
+    write_string(nodes, node.value);
+    write_expression_list(node.condition);
+    node.body.accept(*this);
+  }
+
+  void visit(const IfStatementNode& node) override {
+    write_node(Tag::If, node);
+    write_value(nodes, static_cast<std::uint8_t>(node.is_nested));
+    write_value(nodes, static_cast<std::uint8_t>(node.has_false_statement));
+    write_expression_list(node.condition);
+    node.true_statement.accept(*this);
+    node.false_statement.accept(*this);
+  }
+
+  void visit(const IncludeStatementNode& node) override {
+    write_node(Tag::Include, node);
+    write_string(nodes, node.file);
+    write_size(nodes, node.link_index);
+  }
+
+  void visit(const ExtendsStatementNode& node) override {
+    write_node(Tag::Extends, node);
+    write_string(nodes, node.file);
+    write_size(nodes, node.link_index);
+  }
+
+  void visit(const BlockStatementNode& node) override {
+    write_node(Tag::Block, node);
+    write_string(nodes, node.name);
+    node.block.accept(*this);
+  }
+
+  void visit(const SetStatementNode& node) override {
+    write_node(Tag::Set, node);
+    write_string(nodes, node.key);
+    write_expression_list(node.expression);
+  }
+
+  void write_template(std::string& out, const std::string& name, const Template& tmpl) {
+    nodes.clear();
+    literals = json::array();
+    tmpl.root.accept(*this);
+
+    std::vector<std::uint8_t> literal_pool;
+    json::to_msgpack(literals, literal_pool);
+    std::vector<std::uint8_t> static_data;
+    json::to_msgpack(tmpl.static_data ? *tmpl.static_data : json(), static_data);
+
+    write_string(out, name);
+    write_string(out, tmpl.content);
+    write_value(out, static_cast<std::uint32_t>(tmpl.dependencies.size()));
+    for (const auto& dependency : tmpl.dependencies) {
+      write_string(out, dependency);
+    }
+    write_string(out, std::string_view(reinterpret_cast<const char*>(literal_pool.data()), literal_pool.size()));
+    write_string(out, std::string_view(reinterpret_cast<const char*>(static_data.data()), static_data.size()));
+    out += nodes;
+  }
+
+public:
+  explicit BundleWriter(const LexerConfig& lexer_config): lexer_config(lexer_config) {}
+
+  /// Writes the named templates into a bundle
+  void write(std::ostream& os, const std::vector<std::pair<std::string, std::shared_ptr<const Template>>>& templates) {
+    std::string out;
+    out.append(TemplateBundle::magic, sizeof(TemplateBundle::magic));
+    write_value(out, TemplateBundle::format_version);
+    write_value(out, static_cast<std::uint32_t>(INJA_VERSION_MAJOR));
+    write_value(out, static_cast<std::uint32_t>(INJA_VERSION_MINOR));
+    write_value(out, static_cast<std::uint32_t>(INJA_VERSION_PATCH));
+    for (const auto setting : TemplateBundle::lexer_settings(lexer_config)) {
+      write_string(out, *setting);
+    }
+    write_value(out, static_cast<std::uint8_t>(lexer_config.trim_blocks));
+    write_value(out, static_cast<std::uint8_t>(lexer_config.lstrip_blocks));
+
+    write_value(out, static_cast<std::uint32_t>(templates.size()));
+    for (const auto& [name, tmpl] : templates) {
+      write_template(out, name, *tmpl);
+    }
+    os.write(out.data(), static_cast<std::streamsize>(out.size()));
+  }
+};
+
+/*!
+ * \brief Class for loading the templates of a precompiled bundle without lexing and parsing them again.
+ */
+class BundleReader {
+  using Op = FunctionStorage::Operation;
+  using Tag = TemplateBundle::Tag;
+
+  const LexerConfig& lexer_config;
+  const ParserConfig& parser_config;
+  const FunctionStorage& function_storage;
+
+  std::string_view data;
+  size_t offset {0};
+
+  Template* tmpl {nullptr};
+  json literals;
+  std::vector<const ForStatementNode*> loop_stack;
+  std::vector<size_t> loop_boundaries;
+  size_t nesting {0};
+
+  /// Counts the nesting of the node that is read, so that a corrupt bundle can not overflow the stack
+  struct NestingGuard {
+    size_t& nesting;
+
+    explicit NestingGuard(size_t& nesting): nesting(nesting) {
+      if (nesting >= TemplateBundle::max_nesting) {
+        throw_invalid("nodes nested too deeply");
+      }
+      nesting += 1;
+    }
+
+    ~NestingGuard() {
+      nesting -= 1;
+    }
+  };
+
+  [[noreturn]] static void throw_invalid(const std::string& message) {
+    INJA_THROW(FileError("invalid template bundle: " + message));
+  }
+
+  template <class T> T read() {
+    if (data.size() - offset < sizeof(T)) {
+      throw_invalid("unexpected end of file");
+    }
+    T result;
+    std::memcpy(&result, data.data() + offset, sizeof(T));
+    offset += sizeof(T);
+    return result;
+  }
+
+  size_t read_size() {
+    return static_cast<size_t>(read<std::uint64_t>());
+  }
+
+  std::string_view read_string() {
+    const size_t length = read<std::uint32_t>();
+    if (data.size() - offset < length) {
+      throw_invalid("unexpected end of file");
+    }
+    const auto result = data.substr(offset, length);
+    offset += length;
+    return result;
+  }
+
+  void read_header() {
+    const auto magic = data.substr(0, sizeof(TemplateBundle::magic));
+    if (magic != std::string_view(TemplateBundle::magic, sizeof(TemplateBundle::magic))) {
+      throw_invalid("not a template bundle");
+    }
+    offset = magic.size();
+
+    if (read<std::uint32_t>() != TemplateBundle::format_version) {
+      throw_invalid("unsupported format version or byte order");
+    }
+
+    const auto major = read<std::uint32_t>();
+    const auto minor = read<std::uint32_t>();
+    const auto patch = read<std::uint32_t>();
+    if (major != INJA_VERSION_MAJOR || minor != INJA_VERSION_MINOR || patch != INJA_VERSION_PATCH) {
+      throw_invalid("written by inja " + std::to_string(major) + "." + std::to_string(minor) + "." + std::to_string(patch));
+    }
+
+    bool same_lexer_config = true;
+    for (const auto setting : TemplateBundle::lexer_settings(lexer_config)) {
+      same_lexer_config &= (read_string() == *setting);
+    }
+    same_lexer_config &= (read<std::uint8_t>() == lexer_config.trim_blocks);
+    same_lexer_config &= (read<std::uint8_t>() == lexer_config.lstrip_blocks);
+    if (!same_lexer_config) {
+      throw_invalid("written with a different lexer configuration");
+    }
+  }
+
+  void read_block(BlockNode& block) {
+    const size_t size = read<std::uint32_t>();
+    block.nodes.reserve(size);
+    for (size_t i = 0; i < size; ++i) {
+      block.nodes.emplace_back(read_node(block));
+    }
+  }
+
+  void read_expression_list(ExpressionListNode& node) {
+    node.pos = read_size();
+    if (read<std::uint8_t>()) {
+      node.root = read_expression(read<Tag>());
+    }
+  }
+
+  /// Binds a loop variable like the parser, as the loops are read in the same nesting
+  void bind_loop_variable(DataNode& node) {
+    const size_t boundary = loop_boundaries.empty() ? 0 : loop_boundaries.back();
+    if (node.loop_depth >= loop_stack.size() - boundary) {
+      throw_invalid("loop variable '" + node.name + "' outside of its loop");
+    }
+    node.loop_variable = loop_stack[loop_stack.size() - 1 - node.loop_depth]->find_variable(node.head);
+    if (!node.loop_variable) {
+      throw_invalid("loop variable '" + node.name + "' outside of its loop");
+    }
+  }
+
+  ExpressionNode* read_expression(Tag tag) {
+    const NestingGuard guard(nesting);
+    const size_t pos = read_size();
+    switch (tag) {
+    case Tag::Literal: {
+      const size_t index = read<std::uint32_t>();
+      if (index >= literals.size()) {
+        throw_invalid("literal out of range");
+      }
+      return tmpl->arena->make<LiteralNode>(literals[index], pos);
+    }
+    case Tag::Data: {
+      auto node = tmpl->arena->make<DataNode>(read_string(), pos);
+      const auto scope = read<std::uint8_t>();
+      if (scope > static_cast<std::uint8_t>(DataNode::Scope::Loop)) {
+        throw_invalid("unknown scope of variable '" + node->name + "'");
+      }
+      node->scope = static_cast<DataNode::Scope>(scope);
+      node->is_loop_metadata = read<std::uint8_t>();
+      node->loop_depth = read_size();
+      if (node->scope == DataNode::Scope::Loop) {
+        bind_loop_variable(*node);
+      }
+      return node;
+    }
+    case Tag::Function: {
+      const auto operation_index = read<std::uint32_t>();
+      if (operation_index > static_cast<std::uint32_t>(Op::None)) {
+        throw_invalid("unknown operation");
+      }
+      const auto operation = static_cast<Op>(operation_index);
+      auto node = tmpl->arena->make<FunctionNode>(read_string(), pos);
+      node->operation = operation;
+      node->number_args = read<std::int32_t>();
+      const bool has_literal_path = read<std::uint8_t>();
+      const size_t size = read<std::uint32_t>();
+      const bool is_binary = (operation == Op::And || operation == Op::Or || operation == Op::Default || operation == Op::AtId);
+      if (is_binary && size != 2) {
+        throw_invalid("wrong number of arguments"); // Which are accessed without checking when rendering
+      }
+      node->arguments.reserve(size);
+      for (size_t i = 0; i < size; ++i) {
+        node->arguments.emplace_back(read_expression(read<Tag>()));
+      }
+
+      if (operation == Op::Callback) {
+        const auto function_data = function_storage.find_function(node->name, node->number_args);
+        if (function_data.operation != Op::Callback) {
+          throw_invalid("unknown function " + node->name);
+        }
+        node->callback = function_data.callback;
+      }
+
+      if (has_literal_path) {
+        const auto literal = node->arguments.empty() ? nullptr : dynamic_cast<const LiteralNode*>(node->arguments[0]);
+        if (!literal || !literal->value.is_string()) {
+          throw_invalid("path without string literal");
+        }
+        node->literal_path = tmpl->arena->make<DataNode>(literal->value.get_ref<const json::string_t&>(), literal->pos);
+      }
+      return node;
+    }
+    default:
+      throw_invalid("expected expression");
+    }
+  }
+
+  AstNode* read_node(BlockNode& parent) {
+    const NestingGuard guard(nesting);
+    const auto tag = read<Tag>();
+    switch (tag) {
+    case Tag::Text: {
+      const size_t pos = read_size();
+      const size_t length = read_size();
+      if (pos > tmpl->content.size() || length > tmpl->content.size() - pos) {
+        throw_invalid("text out of range");
+      }
+      return tmpl->arena->make<TextNode>(pos, length);
+    }
+    case Tag::Literal:
+    case Tag::Data:
+    case Tag::Function: {
+      return read_expression(tag);
+    }
+    case Tag::ExpressionList: {
+      auto node = tmpl->arena->make<ExpressionListNode>();
+      read_expression_list(*node);
+      return node;
+    }
+    case Tag::ForArray:
+    case Tag::ForObject: {
+      const size_t pos = read_size();
+      ForStatementNode* node {nullptr};
+      if (tag == Tag::ForArray) {
+        node = tmpl->arena->make<ForArrayStatementNode>(std::string(read_string()), &parent, pos);
+      } else {
+        const auto key = std::string(read_string());
+        node = tmpl->arena->make<ForObjectStatementNode>(key, std::string(read_string()), &parent, pos);
+      }
+      read_expression_list(node->condition);
+      loop_stack.emplace_back(node);
+      read_block(node->body);
+      loop_stack.pop_back();
+      return node;
+    }
+    case Tag::If: {
+      const size_t pos = read_size();
+      const bool is_nested = read<std::uint8_t>();
+      auto node = tmpl->arena->make<IfStatementNode>(is_nested, &parent, pos);
+      node->has_false_statement = read<std::uint8_t>();
+      read_expression_list(node->condition);
+      read_block(node->true_statement);
+      read_block(node->false_statement);
+      return node;
+    }
+    case Tag::Include: {
+      const size_t pos = read_size();
+      auto node = tmpl->arena->make<IncludeStatementNode>(std::string(read_string()), pos);
+      node->link_index = read_size();
+      return node;
+    }
+    case Tag::Extends: {
+      const size_t pos = read_size();
+      auto node = tmpl->arena->make<ExtendsStatementNode>(std::string(read_string()), pos);
+      node->link_index = read_size();
+      return node;
+    }
+    case Tag::Block: {
+      const size_t pos = read_size();
+      auto node = tmpl->arena->make<BlockStatementNode>(&parent, std::string(read_string()), pos);
+      loop_boundaries.emplace_back(loop_stack.size());
+      read_block(node->block);
+      loop_boundaries.pop_back();
+      tmpl->add_block(node);
+      return node;
+    }
+    case Tag::Set: {
+      const size_t pos = read_size();
+      auto node = tmpl->arena->make<SetStatementNode>(std::string(read_string()), pos);
+      read_expression_list(node->expression);
+      return node;
+    }
+    default:
+      throw_invalid("unknown node");
+    }
+  }
+
+  Template read_template() {
+    Template result;
+    result.content = read_string();
+    const size_t dependencies = read<std::uint32_t>();
+    for (size_t i = 0; i < dependencies; ++i) {
+      result.dependencies.emplace_back(read_string());
+    }
+
+    const auto literal_pool = read_string();
+    literals = json::from_msgpack(literal_pool.begin(), literal_pool.end());
+    const auto static_data = read_string();
+    auto static_json = json::from_msgpack(static_data.begin(), static_data.end());
+    if (!static_json.is_null()) {
+      result.static_data = std::make_shared<const json>(std::move(static_json));
+    }
+
+    tmpl = &result;
+    read_block(result.root);
+    tmpl = nullptr;
+
+    result.analyze();
+    if (parser_config.compile_bytecode) {
+      result.compile();
+    }
+    return result;
+  }
+
+public:
+  explicit BundleReader(const LexerConfig& lexer_config, const ParserConfig& parser_config, const FunctionStorage& function_storage)
+      : lexer_config(lexer_config), parser_config(parser_config), function_storage(function_storage) {}
+
+  /// Returns the named templates of the bundle, or throws if it was written by another version or lexer configuration
+  std::vector<std::pair<std::string, Template>> read(std::string_view bundle) {
+    data = bundle;
+    read_header();
+
+    std::vector<std::pair<std::string, Template>> result;
+    const size_t size = read<std::uint32_t>();
+    result.reserve(size);
+    for (size_t i = 0; i < size; ++i) {
+      auto name = std::string(read_string());
+      result.emplace_back(std::move(name), read_template());
+    }
+    if (offset != data.size()) {
+      throw_invalid("trailing data");
+    }
+    return result;
+  }
+};
+
+} // namespace inja
+
+#endif // INCLUDE_INJA_SERIALIZATION_HPP_
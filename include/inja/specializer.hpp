@@ -0,0 +1,477 @@
+#ifndef INCLUDE_INJA_SPECIALIZER_HPP_
+#define INCLUDE_INJA_SPECIALIZER_HPP_
+
+#include <algorithm>
+#include <set>
+#include <sstream>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "config.hpp"
+#include "function_storage.hpp"
+#include "node.hpp"
+#include "optimizer.hpp"
+#include "renderer.hpp"
+#include "template.hpp"
+
+namespace inja {
+
+/*!
+ * \brief A visitor that collects the properties of a subtree that matter for specialization.
+ */
+class SpecializationAnalysis : public NodeVisitor {
+  size_t loop_level {0};
+
+  void visit(const BlockNode& node) override {
+    for (const auto& n : node.nodes) {
+      n->accept(*this);
+    }
+  }
+
+  void visit(const TextNode&) override {}
+  void visit(const ExpressionNode&) override {}
+  void visit(const LiteralNode&) override {}
+
+  void visit(const DataNode& node) override {
+    if (node.is_loop_metadata) {
+      has_loop_metadata = true;
+      has_nested_loop_metadata |= (loop_level > 0);
+    }
+  }
+
+  void visit(const FunctionNode& node) override {
+    for (const auto& n : node.arguments) {
+      n->accept(*this);
+    }
+  }
+
+  void visit(const ExpressionListNode& node) override {
+    if (node.root) {
+      node.root->accept(*this);
+    }
+  }
+
+  void visit(const StatementNode&) override {}
+  void visit(const ForStatementNode&) override {}
+
+  void visit(const ForArrayStatementNode& node) override {
+    node.condition.accept(*this);
+    loop_level += 1;
+    node.body.accept(*this);
+    loop_level -= 1;
+  }
+
+  void visit(const ForObjectStatementNode& node) override {
+    node.condition.accept(*this);
+    loop_level += 1;
+    node.body.accept(*this);
+    loop_level -= 1;
+  }
+
+  void visit(const IfStatementNode& node) override {
+    node.condition.accept(*this);
+    node.true_statement.accept(*this);
+    node.false_statement.accept(*this);
+  }
+
+  void visit(const IncludeStatementNode&) override {
+    has_scoped_statements = true;
+  }
+
+  void visit(const ExtendsStatementNode&) override {
+    has_scoped_statements = true;
+  }
+
+  void visit(const BlockStatementNode& node) override {
+    has_scoped_statements = true;
+    node.block.accept(*this);
+  }
+
+  void visit(const SetStatementNode& node) override {
+    has_scoped_statements = true;
+    assigned_names.emplace(node.head);
+    node.expression.accept(*this);
+  }
+
+public:
+  bool has_scoped_statements {false};    // Statements that depend on the loop frames at render time
+  bool has_loop_metadata {false};        // References to the loop object
+  bool has_nested_loop_metadata {false}; // References to the loop object within a nested loop
+  std::set<std::string> assigned_names;  // Names of all set statements
+};
+
+/*!
+ * \brief Class for partially evaluating a Template against static data.
+ *
+ * The template is rendered as if the data was updated by the static data, so that each top-level key of the static data
+ * shadows the same key of the data. The template is copied node by node, and each variable found in the static data is
+ * replaced by its value. Loops over static values are unrolled, if their body does not depend on the loop frames at
+ * render time. Afterwards, the optimizer folds the resulting constant expressions and if statements, and constant
+ * expressions are pre-rendered as text. If the template includes or extends others, it keeps the static data for them.
+ */
+class Specializer : public NodeVisitor {
+  using Op = FunctionStorage::Operation;
+
+  struct LoopContext {
+    const ForStatementNode* loop; // Loop of the original template
+    ForStatementNode* copy;       // Loop of the specialized template, or nullptr if it is unrolled
+    const std::string* key_name;
+    const std::string* value_name;
+    json key;
+    const json* value;
+    json metadata;
+  };
+
+  const RenderConfig& render_config;
+  const TemplateStorage& template_storage;
+  const FunctionStorage& function_storage;
+  ParserConfig optimizer_config;
+  Optimizer optimizer;
+
+  const json* static_data {nullptr};
+  std::set<std::string> assigned_names;
+  bool has_dynamic_exists {false}; // Whether an exists() call is left for rendering
+  bool has_static_misses {false};  // Whether a name of a key of the static data is left for rendering, where it is missing
+  std::vector<LoopContext> loops;
+
+  Template* result {nullptr};
+  BlockNode* current_block {nullptr};
+  ExpressionNode* current_expression {nullptr};
+
+  ExpressionNode* copy_expression(const ExpressionNode& node) {
+    node.accept(*this);
+    return current_expression;
+  }
+
+  void copy_expression_list(const ExpressionListNode& from, ExpressionListNode& to) {
+    to.root = from.root ? copy_expression(*from.root) : nullptr;
+  }
+
+  void copy_block(const BlockNode& from, BlockNode& to) {
+    const auto old_block = current_block;
+    current_block = &to;
+    from.accept(*this);
+    current_block = old_block;
+  }
+
+  DataNode* copy_data(const DataNode& node) {
+    const auto copy = result->arena->make<DataNode>(node.name, node.pos);
+    copy->is_loop_metadata = node.is_loop_metadata;
+    return copy;
+  }
+
+  void substitute(const DataNode& node, const json& variable) {
+    if (const auto value = node.find_in(variable, 1)) {
+      current_expression = result->arena->make<LiteralNode>(*value, node.pos);
+    } else {
+      current_expression = copy_data(node); // Throws as before when rendering
+    }
+  }
+
+  bool is_unrollable(const ForStatementNode& node) const {
+    auto analysis = SpecializationAnalysis();
+    node.body.accept(analysis);
+    if (analysis.has_scoped_statements || analysis.has_nested_loop_metadata) {
+      return false;
+    }
+
+    // The parent of the loop object must be unrolled as well
+    const bool inside_kept_loop = std::any_of(loops.begin(), loops.end(), [](const LoopContext& loop) { return loop.copy != nullptr; });
+    return !(analysis.has_loop_metadata && inside_kept_loop);
+  }
+
+  void unroll(const ForStatementNode& node, const json& values, const std::string* key_name, const std::string* value_name) {
+    size_t index = 0;
+    for (auto it = values.begin(); it != values.end(); ++it, ++index) {
+      LoopContext context {&node, nullptr, key_name, value_name, json(), &it.value(), json()};
+      if (key_name) {
+        context.key = it.key();
+      }
+      context.metadata["index"] = index;
+      context.metadata["index1"] = index + 1;
+      context.metadata["is_first"] = (index == 0);
+      context.metadata["is_last"] = (index == values.size() - 1);
+      if (!loops.empty() && !loops.back().copy) {
+        context.metadata["parent"] = loops.back().metadata;
+      }
+
+      loops.emplace_back(std::move(context));
+      node.body.accept(*this);
+      loops.pop_back();
+    }
+  }
+
+  template <class T> void copy_loop(const T& node, const std::string* key_name, const std::string* value_name) {
+    constexpr bool is_object = std::is_same_v<T, ForObjectStatementNode>;
+
+    ExpressionListNode condition;
+    copy_expression_list(node.condition, condition);
+    optimizer.fold(*result, condition);
+
+    const auto values = dynamic_cast<const LiteralNode*>(condition.root);
+    if (values && (is_object ? values->value.is_object() : values->value.is_array()) && is_unrollable(node)) {
+      unroll(node, values->value, key_name, value_name);
+      return;
+    }
+
+    T* copy;
+    if constexpr (is_object) {
+      copy = result->arena->make<T>(node.key, node.value, current_block, node.pos);
+    } else {
+      copy = result->arena->make<T>(node.value, current_block, node.pos);
+    }
+    copy->condition.root = condition.root;
+    current_block->nodes.emplace_back(copy);
+
+    loops.push_back({&node, copy, key_name, value_name, json(), nullptr, json()});
+    copy_block(node.body, copy->body);
+    loops.pop_back();
+  }
+
+  void visit(const BlockNode& node) override {
+    for (const auto& n : node.nodes) {
+      n->accept(*this);
+    }
+  }
+
+  void visit(const TextNode& node) override {
+    current_block->nodes.emplace_back(result->arena->make<TextNode>(node.pos, node.length));
+  }
+
+  void visit(const ExpressionNode&) override {}
+
+  void visit(const LiteralNode& node) override {
+    current_expression = result->arena->make<LiteralNode>(node.value, node.pos);
+  }
+
+  void visit(const DataNode& node) override {
+    // Variables of an enclosing loop, also unbound names that are matched by a loop at render time
+    size_t depth = 0;
+    for (auto loop = loops.rbegin(); loop != loops.rend(); ++loop) {
+      const bool is_bound = (node.scope == DataNode::Scope::Loop) ? (node.loop_variable == loop->value_name || node.loop_variable == loop->key_name)
+                                                                  : (node.head == *loop->value_name || (loop->key_name && node.head == *loop->key_name));
+      if (is_bound) {
+        const bool is_value = (node.head == *loop->value_name);
+        if (!loop->copy) {
+          substitute(node, is_value ? *loop->value : loop->key);
+        } else {
+          const auto copy = copy_data(node);
+          if (node.scope == DataNode::Scope::Loop) {
+            copy->scope = DataNode::Scope::Loop;
+            copy->loop_variable = is_value ? loop->copy->find_variable(node.head) : loop->copy->find_variable(*loop->key_name);
+            copy->loop_depth = depth;
+          }
+          current_expression = copy;
+        }
+        return;
+      }
+      if (loop->copy) {
+        depth += 1;
+      }
+    }
+
+    if (node.is_loop_metadata && !loops.empty()) {
+      if (!loops.back().copy) {
+        substitute(node, loops.back().metadata);
+      } else {
+        current_expression = copy_data(node);
+      }
+      return;
+    }
+
+    const bool is_static = (assigned_names.count(node.head) == 0) && is_static_key(node.head);
+    const auto value = is_static ? node.find_in(*static_data) : nullptr;
+    if (value) {
+      current_expression = result->arena->make<LiteralNode>(*value, node.pos);
+    } else {
+      current_expression = copy_data(node);
+      has_static_misses |= is_static;
+    }
+  }
+
+  void visit(const FunctionNode& node) override {
+    const auto copy = result->arena->make<FunctionNode>(node.operation, node.pos);
+    copy->precedence = node.precedence;
+    copy->associativity = node.associativity;
+    copy->name = node.name;
+    copy->number_args = node.number_args;
+    copy->callback = node.callback;
+    if (node.literal_path) {
+      copy->literal_path = copy_data(*node.literal_path);
+    }
+    for (const auto& argument : node.arguments) {
+      copy->arguments.emplace_back(copy_expression(*argument));
+    }
+    current_expression = copy;
+
+    // Names of keys of the static data exist only if they are found in it, while the others are still looked up in the
+    // data when rendering
+    if (node.operation == Op::Exists) {
+      bool exists = false;
+      if (fold_exists(*copy, exists)) {
+        current_expression = result->arena->make<LiteralNode>(json(exists), node.pos);
+      } else {
+        has_dynamic_exists |= !copy->literal_path;
+      }
+    }
+  }
+
+  /// Returns whether the static data has the top-level key, which then shadows the data as if it was updated by it
+  bool is_static_key(const std::string& head) const {
+    return static_data->is_object() && static_data->contains(head);
+  }
+
+  /// Evaluates exists() if its name is known and starts with a key of the static data
+  bool fold_exists(FunctionNode& node, bool& exists) {
+    if (node.literal_path) {
+      if (!is_static_key(node.literal_path->head)) {
+        return false;
+      }
+      exists = (node.literal_path->find_in(*static_data) != nullptr);
+      return true;
+    }
+    if (node.arguments.size() != 1) {
+      return false;
+    }
+
+    ExpressionListNode argument;
+    argument.root = node.arguments[0];
+    optimizer.fold(*result, argument);
+    node.arguments[0] = argument.root;
+
+    const auto name = dynamic_cast<const LiteralNode*>(argument.root);
+    if (!name || !name->value.is_string()) {
+      return false;
+    }
+    const auto& name_string = name->value.get_ref<const json::string_t&>();
+    if (!is_static_key(std::string(string_view::split(name_string, '.').first))) {
+      return false;
+    }
+    exists = static_data->contains(json::json_pointer(DataNode::convert_dot_to_ptr(name_string)));
+    return true;
+  }
+
+  void visit(const ExpressionListNode& node) override {
+    const auto copy = result->arena->make<ExpressionListNode>(node.pos);
+    copy_expression_list(node, *copy);
+    current_block->nodes.emplace_back(copy);
+  }
+
+  void visit(const StatementNode&) override {}
+  void visit(const ForStatementNode&) override {}
+
+  void visit(const ForArrayStatementNode& node) override {
+    copy_loop(node, nullptr, &node.value);
+  }
+
+  void visit(const ForObjectStatementNode& node) override {
+    copy_loop(node, &node.key, &node.value);
+  }
+
+  void visit(const IfStatementNode& node) override {
+    const auto copy = result->arena->make<IfStatementNode>(node.is_nested, current_block, node.pos);
+    copy->has_false_statement = node.has_false_statement;
+    copy_expression_list(node.condition, copy->condition);
+    current_block->nodes.emplace_back(copy);
+    copy_block(node.true_statement, copy->true_statement);
+    copy_block(node.false_statement, copy->false_statement);
+  }
+
+  void visit(const IncludeStatementNode& node) override {
+    const auto copy = result->arena->make<IncludeStatementNode>(node.file, node.pos);
+    copy->link_index = node.link_index;
+    current_block->nodes.emplace_back(copy);
+  }
+
+  void visit(const ExtendsStatementNode& node) override {
+    const auto copy = result->arena->make<ExtendsStatementNode>(node.file, node.pos);
+    copy->link_index = node.link_index;
+    current_block->nodes.emplace_back(copy);
+  }
+
+  void visit(const BlockStatementNode& node) override {
+    const auto copy = result->arena->make<BlockStatementNode>(current_block, node.name, node.pos);
+    current_block->nodes.emplace_back(copy);
+    result->add_block(copy);
+    copy_block(node.block, copy->block);
+  }
+
+  void visit(const SetStatementNode& node) override {
+    const auto copy = result->arena->make<SetStatementNode>(node.key, node.pos);
+    copy_expression_list(node.expression, copy->expression);
+    current_block->nodes.emplace_back(copy);
+  }
+
+  /// Replaces the printing of constant values by text
+  void prerender(BlockNode& block) {
+    for (auto& node : block.nodes) {
+      if (const auto expression = dynamic_cast<ExpressionListNode*>(node)) {
+        if (const auto literal = dynamic_cast<const LiteralNode*>(expression->root)) {
+          std::ostringstream os;
+          Renderer(render_config, template_storage, function_storage).print_to(os, literal->value);
+
+          const size_t pos = result->content.size();
+          result->content += os.str();
+          node = result->arena->make<TextNode>(pos, result->content.size() - pos);
+        }
+
+      } else if (const auto if_statement = dynamic_cast<IfStatementNode*>(node)) {
+        prerender(if_statement->true_statement);
+        prerender(if_statement->false_statement);
+      } else if (const auto for_statement = dynamic_cast<ForStatementNode*>(node)) {
+        prerender(for_statement->body);
+      } else if (const auto block_statement = dynamic_cast<BlockStatementNode*>(node)) {
+        prerender(block_statement->block);
+      }
+    }
+  }
+
+public:
+  explicit Specializer(const ParserConfig& config, const RenderConfig& render_config, const TemplateStorage& template_storage,
+                       const FunctionStorage& function_storage)
+      : render_config(render_config), template_storage(template_storage), function_storage(function_storage), optimizer_config(config),
+        optimizer(optimizer_config, template_storage, function_storage) {
+    optimizer_config.optimization_level = 2;
+  }
+
+  /// Returns a copy of the template in which everything that only depends on the static data is evaluated
+  Template specialize(const Template& tmpl, const json& data) {
+    Template specialized(tmpl.content);
+    specialized.dependencies = tmpl.dependencies;
+    result = &specialized;
+    static_data = &data;
+    has_dynamic_exists = false;
+    has_static_misses = false;
+
+    auto analysis = SpecializationAnalysis();
+    tmpl.root.accept(analysis);
+    assigned_names = std::move(analysis.assigned_names);
+
+    copy_block(tmpl.root, specialized.root);
+    optimizer.optimize(specialized);
+    prerender(specialized.root);
+    optimizer.optimize(specialized);
+
+    // Included and extended templates read the static data when rendering, as well as names before they are assigned and
+    // names that are missing from it
+    const bool is_read_later = !specialized.dependencies.empty() || has_dynamic_exists || has_static_misses ||
+                               std::any_of(assigned_names.begin(), assigned_names.end(), [&](const std::string& name) { return data.is_object() && data.contains(name); });
+    if (is_read_later) {
+      specialized.static_data = std::make_shared<const json>(data);
+    }
+
+    result = nullptr;
+    static_data = nullptr;
+    specialized.analyze();
+    if (optimizer_config.compile_bytecode) {
+      specialized.compile();
+    }
+    return specialized;
+  }
+};
+
+} // namespace inja
+
+#endif // INCLUDE_INJA_SPECIALIZER_HPP_
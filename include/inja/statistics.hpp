@@ -1,6 +1,9 @@
 #ifndef INCLUDE_INJA_STATISTICS_HPP_
 #define INCLUDE_INJA_STATISTICS_HPP_
 
+#include <string>
+#include <vector>
+
 #include "node.hpp"
 
 namespace inja {
@@ -15,55 +18,92 @@ class StatisticsVisitor : public NodeVisitor {
     }
   }
 
-  void visit(const TextNode&) override {}
+  void visit(const TextNode&) override {
+    node_counter += 1;
+  }
+
   void visit(const ExpressionNode&) override {}
-  void visit(const LiteralNode&) override {}
+
+  void visit(const LiteralNode&) override {
+    node_counter += 1;
+  }
 
   void visit(const DataNode&) override {
+    node_counter += 1;
     variable_counter += 1;
   }
 
   void visit(const FunctionNode& node) override {
+    node_counter += 1;
+    if (node.operation == FunctionStorage::Operation::Super) {
+      scoped_counter += 1;
+    }
     for (const auto& n : node.arguments) {
       n->accept(*this);
     }
   }
 
   void visit(const ExpressionListNode& node) override {
-    node.root->accept(*this);
+    node_counter += 1;
+    if (node.root) {
+      node.root->accept(*this);
+    }
   }
 
   void visit(const StatementNode&) override {}
   void visit(const ForStatementNode&) override {}
 
   void visit(const ForArrayStatementNode& node) override {
+    node_counter += 1;
     node.condition.accept(*this);
     node.body.accept(*this);
   }
 
   void visit(const ForObjectStatementNode& node) override {
+    node_counter += 1;
     node.condition.accept(*this);
     node.body.accept(*this);
   }
 
   void visit(const IfStatementNode& node) override {
+    node_counter += 1;
     node.condition.accept(*this);
     node.true_statement.accept(*this);
     node.false_statement.accept(*this);
   }
 
-  void visit(const IncludeStatementNode&) override {}
+  void visit(const IncludeStatementNode&) override {
+    node_counter += 1;
+    scoped_counter += 1;
+    include_counter += 1;
+  }
 
-  void visit(const ExtendsStatementNode&) override {}
+  void visit(const ExtendsStatementNode& node) override {
+    node_counter += 1;
+    scoped_counter += 1;
+    include_counter += 1;
+    extended_templates.emplace_back(node.file);
+  }
 
   void visit(const BlockStatementNode& node) override {
+    node_counter += 1;
+    scoped_counter += 1;
     node.block.accept(*this);
   }
 
-  void visit(const SetStatementNode&) override {}
+  void visit(const SetStatementNode&) override {
+    node_counter += 1;
+    scoped_counter += 1;
+    set_counter += 1;
+  }
 
 public:
   size_t variable_counter {0};
+  size_t include_counter {0};
+  size_t node_counter {0};
+  size_t set_counter {0};
+  size_t scoped_counter {0}; // Include, extends, block and set statements and super() calls, which need their own renderer
+  std::vector<std::string> extended_templates;
 
   explicit StatisticsVisitor() {}
 };
@@ -1,22 +1,96 @@
 #ifndef INCLUDE_INJA_TEMPLATE_HPP_
 #define INCLUDE_INJA_TEMPLATE_HPP_
 
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <iterator>
 #include <map>
 #include <memory>
+#include <mutex>
+#include <shared_mutex>
 #include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
 
+#include "bytecode.hpp"
 #include "node.hpp"
 #include "statistics.hpp"
 
 namespace inja {
 
+class TemplateStorage;
+struct Template;
+
+/*!
+ * \brief Shared pointer that is read without a lock and replaced atomically.
+ */
+template <class T> class AtomicSharedPtr {
+#if defined(__cpp_lib_atomic_shared_ptr)
+  std::atomic<std::shared_ptr<T>> ptr;
+
+public:
+  std::shared_ptr<T> load() const {
+    return ptr.load(std::memory_order_acquire);
+  }
+
+  void store(std::shared_ptr<T> value) {
+    ptr.store(std::move(value), std::memory_order_release);
+  }
+#else
+  std::shared_ptr<T> ptr;
+
+public:
+  std::shared_ptr<T> load() const {
+    return std::atomic_load_explicit(&ptr, std::memory_order_acquire);
+  }
+
+  void store(std::shared_ptr<T> value) {
+    std::atomic_store_explicit(&ptr, std::move(value), std::memory_order_release);
+  }
+#endif
+};
+
+/*!
+ * \brief Targets of the include and extends statements of a template, by the index of their dependency.
+ */
+struct TemplateLinks {
+  struct Target {
+    std::weak_ptr<const Template> tmpl; // Empty if the target was not loaded when linking
+    size_t inline_size;                 // Number of nodes if the target can be rendered inline, or npos
+    bool is_read_only;                  // Whether the target neither assigns variables nor extends another template
+  };
+
+  const TemplateStorage* storage;
+  size_t generation; // Of the storage when linking
+  std::vector<Target> targets;
+};
+
+/*!
+ * \brief Blocks of an inheritance chain, from the rendered template to its last parent, in slots by their names.
+ */
+struct BlockTable {
+  std::vector<std::weak_ptr<const Template>> parents;
+  std::vector<std::vector<size_t>> slots; // Slot of each block of each level, by the index of the block
+  std::vector<std::vector<const BlockStatementNode*>> implementations; // Of each slot at each level, or nullptr
+};
+
 /*!
  * \brief The main inja Template.
  */
 struct Template {
   BlockNode root;
   std::string content;
-  std::map<std::string, std::shared_ptr<BlockStatementNode>> block_storage;
+  std::map<std::string, BlockStatementNode*> block_storage;
+  std::shared_ptr<NodeArena> arena {std::make_shared<NodeArena>()};
+  std::shared_ptr<const Program> program;
+  std::vector<std::string> dependencies; // Names of the included and extended templates in the storage
+  std::shared_ptr<const json> static_data; // Of a specialized template, which is read by its included and extended templates
+
+  // Computed once after parsing, so that linking an include of this template does not visit its nodes
+  size_t inline_size {std::string::npos}; // Number of nodes if an including template can render it inline, or npos
+  bool is_read_only {false};              // Whether the template neither assigns variables nor extends another template
 
   explicit Template() {}
   explicit Template(std::string content): content(std::move(content)) {}
@@ -27,9 +101,335 @@ struct Template {
     root.accept(statistic_visitor);
     return statistic_visitor.variable_counter;
   }
+
+  /// Return number of include and extends statements in the template
+  size_t count_includes() const {
+    auto statistic_visitor = StatisticsVisitor();
+    root.accept(statistic_visitor);
+    return statistic_visitor.include_counter;
+  }
+
+  /// Computes the properties that the templates including this one are linked with, after the nodes are complete
+  void analyze() {
+    auto statistic_visitor = StatisticsVisitor();
+    root.accept(statistic_visitor);
+    inline_size = (statistic_visitor.scoped_counter == 0) ? statistic_visitor.node_counter : std::string::npos;
+    is_read_only = (statistic_visitor.set_counter == 0 && statistic_visitor.extended_templates.empty());
+  }
+
+  /// Compile the template into a bytecode program, which is then used for rendering
+  void compile() {
+    auto statistic_visitor = StatisticsVisitor();
+    root.accept(statistic_visitor);
+    const bool checks_breaks = !statistic_visitor.extended_templates.empty() || !block_storage.empty();
+    program = std::make_shared<const Program>(Compiler().compile(root, checks_breaks));
+  }
+
+  /// Registers the block under its name, and returns false if the name is taken already
+  bool add_block(BlockStatementNode* block) {
+    if (!block_storage.emplace(block->name, block).second) {
+      return false;
+    }
+    block->index = block_storage.size() - 1;
+    return true;
+  }
+
+  /// Returns the targets of the include and extends statements, whose changed targets are linked again whenever the
+  /// storage has changed
+  std::shared_ptr<const TemplateLinks> link(const TemplateStorage& storage) const;
+
+  /// Returns the blocks of the inheritance chain of this template and the given parents, which is linked once per chain
+  std::shared_ptr<const BlockTable> link_blocks(const std::vector<std::shared_ptr<const Template>>& parents) const;
+
+private:
+  struct LinkState {
+    std::mutex mutex; // Only held for linking again, while the links are read without it
+    AtomicSharedPtr<const TemplateLinks> links;
+    AtomicSharedPtr<const std::vector<std::shared_ptr<const BlockTable>>> block_tables; // One for each chain that was rendered
+  };
+
+  std::shared_ptr<LinkState> link_state {std::make_shared<LinkState>()};
+};
+
+/*!
+ * \brief Registry of named templates, safe for concurrent lookups and insertions.
+ *
+ * Registered templates are immutable. Replacing a template keeps the old one alive for the renders that still use it.
+ * Templates can also be registered lazily by a loader, which is called once by the first lookup of the name.
+ */
+class TemplateStorage {
+public:
+  using Loader = std::function<Template(TemplateStorage&)>;
+
+private:
+  struct PendingTemplate {
+    Loader load;
+    std::once_flag once;
+    std::shared_ptr<const Template> result;
+
+    explicit PendingTemplate(Loader load): load(std::move(load)) {}
+  };
+
+  mutable std::shared_mutex mutex;
+  std::map<std::string, std::shared_ptr<const Template>, std::less<>> templates;
+  std::map<std::string, std::shared_ptr<PendingTemplate>, std::less<>> pending;
+
+  // Changes with every modification, and is unique over all storages so that links never match another storage
+  std::atomic<size_t> generation {next_generation()};
+
+  static size_t next_generation() {
+    static std::atomic<size_t> counter {0};
+    return ++counter;
+  }
+
+  void copy_from(const TemplateStorage& other) {
+    generation = next_generation();
+    templates = other.templates;
+    pending.clear();
+    for (const auto& [name, pending_template] : other.pending) {
+      pending.emplace(name, std::make_shared<PendingTemplate>(pending_template->load));
+    }
+  }
+
+  /// Loads a pending template, where concurrent lookups of the same name wait for the first one
+  std::shared_ptr<const Template> load(std::string_view name, const std::shared_ptr<PendingTemplate>& pending_template) {
+    std::call_once(pending_template->once, [&]() {
+      pending_template->result = std::make_shared<const Template>(pending_template->load(*this));
+    });
+
+    std::unique_lock lock(mutex);
+    const auto it = pending.find(name);
+    if (it != pending.end() && it->second == pending_template) {
+      pending.erase(it);
+      generation = next_generation();
+      return templates.emplace(std::string(name), pending_template->result).first->second;
+    }
+
+    // The name was replaced or removed in the meantime
+    const auto registered = templates.find(name);
+    return (registered != templates.end()) ? registered->second : pending_template->result;
+  }
+
+public:
+  explicit TemplateStorage() {}
+
+  TemplateStorage(const TemplateStorage& other) {
+    std::shared_lock lock(other.mutex);
+    copy_from(other);
+  }
+
+  TemplateStorage& operator=(const TemplateStorage& other) {
+    if (this != &other) {
+      std::unique_lock lock(mutex, std::defer_lock);
+      std::shared_lock other_lock(other.mutex, std::defer_lock);
+      std::lock(lock, other_lock);
+      copy_from(other);
+    }
+    return *this;
+  }
+
+  /// Returns the template with the given name, or nullptr if there is none. A lazily registered template is loaded
+  std::shared_ptr<const Template> find(std::string_view name) const {
+    std::shared_ptr<PendingTemplate> pending_template;
+    {
+      std::shared_lock lock(mutex);
+      const auto it = templates.find(name);
+      if (it != templates.end()) {
+        return it->second;
+      }
+
+      const auto pending_it = pending.find(name);
+      if (pending_it == pending.end()) {
+        return nullptr;
+      }
+      pending_template = pending_it->second;
+    }
+
+    // Loading only extends the storage, so that it is logically const
+    return const_cast<TemplateStorage*>(this)->load(name, pending_template);
+  }
+
+  /// Returns the template with the given name if it is loaded, or nullptr
+  std::shared_ptr<const Template> find_loaded(std::string_view name) const {
+    std::shared_lock lock(mutex);
+    const auto it = templates.find(name);
+    return (it != templates.end()) ? it->second : nullptr;
+  }
+
+  /// Returns a number that changes whenever a template is added, replaced or removed
+  size_t get_generation() const {
+    return generation;
+  }
+
+  /// Whether there is a template with the given name, without loading a lazily registered one
+  bool contains(std::string_view name) const {
+    std::shared_lock lock(mutex);
+    return templates.find(name) != templates.end() || pending.find(name) != pending.end();
+  }
+
+  /// Adds the template if the name is not taken yet, and returns the registered template of that name
+  std::shared_ptr<const Template> emplace(const std::string& name, Template&& tmpl) {
+    auto new_template = std::make_shared<const Template>(std::move(tmpl));
+    std::unique_lock lock(mutex);
+    pending.erase(name);
+    generation = next_generation();
+    return templates.emplace(name, std::move(new_template)).first->second;
+  }
+
+  /// Registers a name whose template is only loaded by the first lookup, unless the name is taken already
+  void emplace_lazy(const std::string& name, Loader loader) {
+    std::unique_lock lock(mutex);
+    if (templates.find(name) == templates.end()) {
+      pending.emplace(name, std::make_shared<PendingTemplate>(std::move(loader)));
+    }
+  }
+
+  /// Adds the template, or replaces the one of the same name
+  void insert_or_assign(const std::string& name, Template tmpl) {
+    insert_or_assign(name, std::make_shared<const Template>(std::move(tmpl)));
+  }
+
+  /// Adds the shared template without copying it, or replaces the one of the same name
+  void insert_or_assign(const std::string& name, std::shared_ptr<const Template> tmpl) {
+    std::unique_lock lock(mutex);
+    pending.erase(name);
+    generation = next_generation();
+    templates.insert_or_assign(name, std::move(tmpl));
+  }
+
+  /// Adds or replaces all given templates in a single step, so that other threads see either none or all of them
+  void insert_or_assign_all(const std::vector<std::pair<std::string, std::shared_ptr<const Template>>>& new_templates) {
+    std::unique_lock lock(mutex);
+    generation = next_generation();
+    for (const auto& [name, tmpl] : new_templates) {
+      pending.erase(name);
+      templates.insert_or_assign(name, tmpl);
+    }
+  }
+
+  /// Removes the template, e.g. so that it is loaded again by the next parse that includes it
+  void erase(std::string_view name) {
+    std::unique_lock lock(mutex);
+    generation = next_generation();
+    const auto it = templates.find(name);
+    if (it != templates.end()) {
+      templates.erase(it);
+    }
+    const auto pending_it = pending.find(name);
+    if (pending_it != pending.end()) {
+      pending.erase(pending_it);
+    }
+  }
+
+  /// Returns the number of templates, including the lazily registered ones that are not loaded yet
+  size_t size() const {
+    std::shared_lock lock(mutex);
+    return templates.size() + pending.size();
+  }
+
+  /// Returns all loaded templates with their names
+  std::vector<std::pair<std::string, std::shared_ptr<const Template>>> snapshot() const {
+    std::shared_lock lock(mutex);
+    return {templates.begin(), templates.end()};
+  }
 };
 
-using TemplateStorage = std::map<std::string, Template>;
+inline std::shared_ptr<const TemplateLinks> Template::link(const TemplateStorage& storage) const {
+  const size_t generation = storage.get_generation();
+  const auto is_current = [&](const std::shared_ptr<const TemplateLinks>& links) {
+    return links && links->storage == &storage && links->generation == generation;
+  };
+
+  auto links = link_state->links.load();
+  if (is_current(links)) {
+    return links;
+  }
+
+  std::scoped_lock lock(link_state->mutex);
+  links = link_state->links.load();
+  if (is_current(links)) {
+    return links; // Linked by another render in the meantime
+  }
+
+  // Targets that are still registered under their names are kept, so that only changed ones are linked again
+  const bool is_relinked = links && links->storage == &storage;
+  auto new_links = std::make_shared<TemplateLinks>(TemplateLinks {&storage, generation, {}});
+  new_links->targets.reserve(dependencies.size());
+  for (size_t i = 0; i < dependencies.size(); ++i) {
+    const auto target = storage.find_loaded(dependencies[i]);
+    if (is_relinked) {
+      const auto& old_link = links->targets[i];
+      if (!old_link.tmpl.owner_before(target) && !target.owner_before(old_link.tmpl)) {
+        new_links->targets.emplace_back(old_link);
+        continue;
+      }
+    }
+
+    TemplateLinks::Target link {target, std::string::npos, false};
+    if (target) {
+      link.inline_size = target->inline_size;
+      link.is_read_only = target->is_read_only;
+    }
+    new_links->targets.emplace_back(std::move(link));
+  }
+  link_state->links.store(new_links);
+  return new_links;
+}
+
+inline std::shared_ptr<const BlockTable> Template::link_blocks(const std::vector<std::shared_ptr<const Template>>& parents) const {
+  // Sharing the owner with a living parent means being the same template
+  const auto is_chain = [&](const BlockTable& table) {
+    return std::equal(table.parents.begin(), table.parents.end(), parents.begin(), parents.end(), [](const auto& linked, const auto& parent) {
+      return !linked.owner_before(parent) && !parent.owner_before(linked);
+    });
+  };
+  const auto find_table = [&](const std::shared_ptr<const std::vector<std::shared_ptr<const BlockTable>>>& tables) -> std::shared_ptr<const BlockTable> {
+    if (tables) {
+      for (const auto& table : *tables) {
+        if (is_chain(*table)) {
+          return table;
+        }
+      }
+    }
+    return nullptr;
+  };
+
+  if (auto table = find_table(link_state->block_tables.load())) {
+    return table;
+  }
+
+  std::scoped_lock lock(link_state->mutex);
+  const auto block_tables = link_state->block_tables.load();
+  if (auto table = find_table(block_tables)) {
+    return table; // Linked by another render in the meantime
+  }
+
+  auto new_block_tables = std::make_shared<std::vector<std::shared_ptr<const BlockTable>>>();
+  if (block_tables) {
+    std::copy_if(block_tables->begin(), block_tables->end(), std::back_inserter(*new_block_tables), [](const auto& table) {
+      return std::none_of(table->parents.begin(), table->parents.end(), [](const auto& parent) { return parent.expired(); });
+    });
+  }
+
+  auto table = std::make_shared<BlockTable>(BlockTable {{parents.begin(), parents.end()}, {}, {}});
+  std::map<std::string_view, size_t> slot_of_name;
+  table->slots.resize(parents.size() + 1);
+  for (size_t level = 0; level <= parents.size(); ++level) {
+    const auto& blocks = (level == 0) ? block_storage : parents[level - 1]->block_storage;
+    table->slots[level].resize(blocks.size());
+    for (const auto& [name, block] : blocks) {
+      const size_t slot = slot_of_name.emplace(name, slot_of_name.size()).first->second;
+      if (slot == table->implementations.size()) {
+        table->implementations.emplace_back(parents.size() + 1, nullptr);
+      }
+      table->implementations[slot][level] = block;
+      table->slots[level][block->index] = slot;
+    }
+  }
+  new_block_tables->emplace_back(table);
+  link_state->block_tables.store(std::move(new_block_tables));
+  return table;
+}
 
 } // namespace inja
 
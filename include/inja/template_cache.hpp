@@ -0,0 +1,336 @@
+#ifndef INCLUDE_INJA_TEMPLATE_CACHE_HPP_
+#define INCLUDE_INJA_TEMPLATE_CACHE_HPP_
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <functional>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "config.hpp"
+#include "function_storage.hpp"
+#include "include_resolver.hpp"
+#include "template.hpp"
+
+namespace inja {
+
+/*!
+ * \brief Bounded least-recently-used cache of templates parsed from strings, safe for concurrent use.
+ */
+class TemplateCache {
+public:
+  struct Statistics {
+    size_t hits {0};
+    size_t misses {0};
+    size_t size {0};
+    size_t capacity {0};
+  };
+
+  /// Returns a hash of all options that change the result of parsing the same input. The include callbacks can not be
+  /// hashed, so that the cache is cleared when they are set
+  static size_t hash_config(const LexerConfig& lexer_config, const ParserConfig& parser_config, const FunctionStorage& function_storage,
+                            const std::filesystem::path& input_path) {
+    size_t result {0};
+    const auto combine = [&result](size_t value) { result ^= value + 0x9e3779b97f4a7c15 + (result << 6) + (result >> 2); };
+    for (const auto& delimiter :
+         {lexer_config.statement_open, lexer_config.statement_open_no_lstrip, lexer_config.statement_open_force_lstrip, lexer_config.statement_close,
+          lexer_config.statement_close_force_rstrip, lexer_config.line_statement, lexer_config.expression_open, lexer_config.expression_open_force_lstrip,
+          lexer_config.expression_close, lexer_config.expression_close_force_rstrip, lexer_config.comment_open, lexer_config.comment_open_force_lstrip,
+          lexer_config.comment_close, lexer_config.comment_close_force_rstrip}) {
+      combine(std::hash<std::string>()(delimiter));
+    }
+    combine(lexer_config.trim_blocks);
+    combine(lexer_config.lstrip_blocks);
+    combine(parser_config.search_included_templates_in_files);
+    combine(parser_config.compile_bytecode);
+    combine(parser_config.optimization_level);
+    for (const auto& search_path : parser_config.include_resolver->get_search_paths()) {
+      combine(std::hash<std::string>()(search_path.string()));
+    }
+    combine(static_cast<size_t>(parser_config.include_resolver->get_negative_ttl().count()));
+    combine(static_cast<size_t>(parser_config.include_resolver->get_positive_ttl().count()));
+    combine(function_storage.get_version());
+    combine(std::hash<std::string>()(input_path.string()));
+    return result;
+  }
+
+private:
+  struct Entry {
+    size_t key;
+    size_t config_hash;
+    std::string input;
+    std::shared_ptr<const Template> tmpl;
+  };
+
+  mutable std::mutex mutex;
+  std::list<Entry> entries; // Most recently used first
+  std::unordered_map<size_t, std::list<Entry>::iterator> index;
+  size_t capacity {0};
+  size_t hits {0};
+  size_t misses {0};
+
+  static size_t make_key(std::string_view input, size_t config_hash) {
+    return std::hash<std::string_view>()(input) ^ (config_hash * 0x9e3779b97f4a7c15);
+  }
+
+  void evict() {
+    while (entries.size() > capacity) {
+      index.erase(entries.back().key);
+      entries.pop_back();
+    }
+  }
+
+public:
+  explicit TemplateCache(size_t capacity = 0): capacity(capacity) {}
+
+  TemplateCache(const TemplateCache& other) {
+    std::scoped_lock lock(other.mutex);
+    capacity = other.capacity;
+  }
+
+  TemplateCache& operator=(const TemplateCache& other) {
+    if (this != &other) {
+      std::scoped_lock lock(mutex, other.mutex);
+      capacity = other.capacity;
+      evict();
+    }
+    return *this;
+  }
+
+  /// Sets the maximal number of templates, where 0 disables the cache
+  void set_capacity(size_t new_capacity) {
+    std::scoped_lock lock(mutex);
+    capacity = new_capacity;
+    evict();
+  }
+
+  bool is_enabled() const {
+    std::scoped_lock lock(mutex);
+    return capacity > 0;
+  }
+
+  /// Returns the cached template for the input, or nullptr on a miss
+  std::shared_ptr<const Template> find(std::string_view input, size_t config_hash) {
+    const size_t key = make_key(input, config_hash);
+    std::scoped_lock lock(mutex);
+    const auto it = index.find(key);
+    if (it == index.end() || it->second->config_hash != config_hash || it->second->input != input) {
+      misses += 1;
+      return nullptr;
+    }
+
+    hits += 1;
+    entries.splice(entries.begin(), entries, it->second);
+    return it->second->tmpl;
+  }
+
+  void insert(std::string_view input, size_t config_hash, std::shared_ptr<const Template> tmpl) {
+    const size_t key = make_key(input, config_hash);
+    std::scoped_lock lock(mutex);
+    if (capacity == 0) {
+      return;
+    }
+
+    // A colliding entry is replaced
+    const auto it = index.find(key);
+    if (it != index.end()) {
+      entries.erase(it->second);
+      index.erase(it);
+    }
+
+    entries.push_front({key, config_hash, std::string(input), std::move(tmpl)});
+    index.emplace(key, entries.begin());
+    evict();
+  }
+
+  void clear() {
+    std::scoped_lock lock(mutex);
+    entries.clear();
+    index.clear();
+  }
+
+  Statistics statistics() const {
+    std::scoped_lock lock(mutex);
+    return Statistics {hits, misses, entries.size(), capacity};
+  }
+};
+
+/*!
+ * \brief Cache of templates parsed from files, which are revalidated by their modification time and size.
+ *
+ * Each entry remembers the files of all templates it includes or extends, directly or indirectly. If one of them
+ * changed, it is removed from the template storage so that it is loaded again, and all entries depending on it are
+ * invalidated.
+ */
+class FileTemplateCache {
+  struct FileStamp {
+    bool exists {false};
+    std::filesystem::file_time_type time;
+    std::uintmax_t size {0};
+
+    static FileStamp of(const std::filesystem::path& path) {
+      FileStamp result;
+      std::error_code error;
+      result.time = std::filesystem::last_write_time(path, error);
+      if (!error) {
+        result.size = std::filesystem::file_size(path, error);
+        result.exists = !error;
+      }
+      return result;
+    }
+
+    bool operator==(const FileStamp& other) const {
+      return exists == other.exists && (!exists || (time == other.time && size == other.size));
+    }
+  };
+
+  struct Entry {
+    std::shared_ptr<const Template> tmpl;
+    std::string path;
+    FileStamp stamp;
+    std::map<std::string, FileStamp> dependencies; // By name in the template storage
+    std::chrono::steady_clock::time_point checked;
+  };
+
+  mutable std::mutex mutex;
+  std::map<std::string, Entry> entries; // By canonical path
+  std::chrono::steady_clock::duration revalidation_interval {std::chrono::seconds(1)};
+  bool enabled {false};
+
+  static std::string canonical_name(const std::filesystem::path& path) {
+    std::error_code error;
+    const auto result = std::filesystem::weakly_canonical(path, error);
+    return error ? path.string() : result.string();
+  }
+
+  static void collect_dependencies(const Template& tmpl, const TemplateStorage& storage, std::map<std::string, FileStamp>& result) {
+    for (const auto& name : tmpl.dependencies) {
+      if (result.count(name) == 0) {
+        result.emplace(name, FileStamp::of(name));
+        if (const auto dependency = storage.find(name)) {
+          collect_dependencies(*dependency, storage, result);
+        }
+      }
+    }
+  }
+
+  void invalidate_dependents(const std::string& name) {
+    for (auto it = entries.begin(); it != entries.end();) {
+      if (it->second.dependencies.count(name) > 0) {
+        it = entries.erase(it);
+      } else {
+        ++it;
+      }
+    }
+  }
+
+public:
+  explicit FileTemplateCache() {}
+
+  FileTemplateCache(const FileTemplateCache& other) {
+    std::scoped_lock lock(other.mutex);
+    revalidation_interval = other.revalidation_interval;
+    enabled = other.enabled;
+  }
+
+  FileTemplateCache& operator=(const FileTemplateCache& other) {
+    if (this != &other) {
+      std::scoped_lock lock(mutex, other.mutex);
+      revalidation_interval = other.revalidation_interval;
+      enabled = other.enabled;
+      entries.clear();
+    }
+    return *this;
+  }
+
+  /// Enables or disables the cache, and sets the minimal time between two checks of the files of a template
+  void configure(bool enable, std::chrono::steady_clock::duration interval) {
+    std::scoped_lock lock(mutex);
+    enabled = enable;
+    revalidation_interval = interval;
+    if (!enabled) {
+      entries.clear();
+    }
+  }
+
+  bool is_enabled() const {
+    std::scoped_lock lock(mutex);
+    return enabled;
+  }
+
+  /// Returns the cached template of the file if it is still valid, or nullptr
+  std::shared_ptr<const Template> find(const std::filesystem::path& path, TemplateStorage& storage) {
+    const auto key = canonical_name(path);
+    const auto now = std::chrono::steady_clock::now();
+
+    std::scoped_lock lock(mutex);
+    auto it = entries.find(key);
+    if (it == entries.end()) {
+      return nullptr;
+    }
+
+    auto& entry = it->second;
+    if (now - entry.checked < revalidation_interval) {
+      return entry.tmpl;
+    }
+
+    std::vector<std::string> changed;
+    for (const auto& [name, stamp] : entry.dependencies) {
+      if (!(FileStamp::of(name) == stamp)) {
+        changed.emplace_back(name);
+      }
+    }
+
+    if (changed.empty() && FileStamp::of(entry.path) == entry.stamp) {
+      entry.checked = now;
+      return entry.tmpl;
+    }
+
+    storage.erase(entry.path);
+    entries.erase(it);
+    for (const auto& name : changed) {
+      storage.erase(name);
+      invalidate_dependents(name);
+    }
+    return nullptr;
+  }
+
+  /// Adds the template parsed from the file, with the current state of its file and all its dependencies
+  void insert(const std::filesystem::path& path, std::shared_ptr<const Template> tmpl, const TemplateStorage& storage) {
+    Entry entry;
+    entry.path = IncludeResolver::storage_name(path); // So that a changed file is also removed from the storage
+    entry.stamp = FileStamp::of(path);
+    collect_dependencies(*tmpl, storage, entry.dependencies);
+    entry.tmpl = std::move(tmpl);
+    entry.checked = std::chrono::steady_clock::now();
+
+    std::scoped_lock lock(mutex);
+    if (enabled) {
+      entries.insert_or_assign(canonical_name(path), std::move(entry));
+    }
+  }
+
+  void clear() {
+    std::scoped_lock lock(mutex);
+    entries.clear();
+  }
+
+  size_t size() const {
+    std::scoped_lock lock(mutex);
+    return entries.size();
+  }
+};
+
+} // namespace inja
+
+#endif // INCLUDE_INJA_TEMPLATE_CACHE_HPP_
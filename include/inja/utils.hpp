@@ -29,6 +29,30 @@ inline std::pair<std::string_view, std::string_view> split(std::string_view view
 inline bool starts_with(std::string_view view, std::string_view prefix) {
   return (view.size() >= prefix.size() && view.compare(0, prefix.size(), prefix) == 0);
 }
+
+/// Matches a pattern in which '*' stands for any sequence of characters and '?' for a single one
+inline bool matches_wildcard(std::string_view view, std::string_view pattern) {
+  size_t v {0}, p {0};
+  size_t star = std::string_view::npos, star_match {0};
+  while (v < view.size()) {
+    if (p < pattern.size() && (pattern[p] == '?' || pattern[p] == view[v])) {
+      ++v;
+      ++p;
+    } else if (p < pattern.size() && pattern[p] == '*') {
+      star = p++;
+      star_match = v;
+    } else if (star != std::string_view::npos) {
+      p = star + 1;
+      v = ++star_match;
+    } else {
+      return false;
+    }
+  }
+  while (p < pattern.size() && pattern[p] == '*') {
+    ++p;
+  }
+  return p == pattern.size();
+}
 } // namespace string_view
 
 inline SourceLocation get_source_location(std::string_view content, size_t pos) {
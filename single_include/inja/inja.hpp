@@ -67,12 +67,21 @@ std::abort();                 \
 #ifndef INCLUDE_INJA_ENVIRONMENT_HPP_
 #define INCLUDE_INJA_ENVIRONMENT_HPP_
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <filesystem>
 #include <fstream>
 #include <iostream>
+#include <map>
+#include <memory>
+#include <set>
 #include <sstream>
 #include <string>
 #include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
 
 // #include "json.hpp"
 
@@ -80,27 +89,168 @@ std::abort();                 \
 #ifndef INCLUDE_INJA_CONFIG_HPP_
 #define INCLUDE_INJA_CONFIG_HPP_
 
+#include <cstddef>
 #include <filesystem>
 #include <functional>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+// #include "include_resolver.hpp"
+#ifndef INCLUDE_INJA_INCLUDE_RESOLVER_HPP_
+#define INCLUDE_INJA_INCLUDE_RESOLVER_HPP_
+
+#include <chrono>
+#include <cstddef>
+#include <filesystem>
+#include <mutex>
 #include <string>
+#include <system_error>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace inja {
+
+/*!
+ * \brief Finds the files of included templates, safe for concurrent use.
+ *
+ * An include is searched relative to the including template first, and then in each search path. Found files are
+ * cached for a limited time, so that moved or deleted files are found again. Includes that are not found are cached
+ * for a limited time as well, so that templates served by the include callback or the storage do not cause a failing
+ * file lookup on every parse. Both default to one second.
+ */
+class IncludeResolver {
+public:
+  struct Statistics {
+    size_t hits {0};
+    size_t misses {0};
+    size_t syscalls {0}; // Number of file lookups
+  };
+
+private:
+  struct Entry {
+    std::string file; // Empty if the include was not found
+    std::chrono::steady_clock::time_point expires;
+  };
+
+  const std::vector<std::filesystem::path> search_paths;
+  const std::chrono::steady_clock::duration negative_ttl;
+  const std::chrono::steady_clock::duration positive_ttl;
+
+  mutable std::mutex mutex;
+  std::unordered_map<std::string, Entry> entries;
+  Statistics stats;
+
+  std::string lookup(const std::filesystem::path& directory, const std::string& name) {
+    std::vector<std::filesystem::path> candidates {directory / name};
+    for (const auto& search_path : search_paths) {
+      candidates.emplace_back(search_path / name);
+    }
+
+    for (const auto& candidate : candidates) {
+      std::error_code error;
+      const bool exists = std::filesystem::is_regular_file(candidate, error);
+      {
+        std::scoped_lock lock(mutex);
+        stats.syscalls += 1;
+      }
+      if (exists) {
+        return storage_name(candidate);
+      }
+    }
+    return "";
+  }
+
+public:
+  explicit IncludeResolver(std::vector<std::filesystem::path> search_paths = {},
+                           std::chrono::steady_clock::duration negative_ttl = std::chrono::seconds(1),
+                           std::chrono::steady_clock::duration positive_ttl = std::chrono::seconds(1))
+      : search_paths(std::move(search_paths)), negative_ttl(negative_ttl), positive_ttl(positive_ttl) {}
+
+  /// Returns the normalized name under which the template of a file is registered in the storage
+  static std::string storage_name(const std::filesystem::path& filename) {
+    return filename.lexically_normal().string();
+  }
+
+  /// Returns the storage name of the file of the include, or an empty string if it is not found
+  std::string resolve(const std::filesystem::path& directory, const std::string& name) {
+    std::string key = directory.string();
+    key.push_back('\0');
+    key += name;
+
+    const auto now = std::chrono::steady_clock::now();
+    {
+      std::scoped_lock lock(mutex);
+      const auto it = entries.find(key);
+      if (it != entries.end() && it->second.expires > now) {
+        stats.hits += 1;
+        return it->second.file;
+      }
+      stats.misses += 1;
+    }
+
+    auto file = lookup(directory, name);
+    const auto ttl = file.empty() ? negative_ttl : positive_ttl;
+    if (ttl > std::chrono::steady_clock::duration::zero()) {
+      const auto expires = now + ttl;
+      std::scoped_lock lock(mutex);
+      entries.insert_or_assign(std::move(key), Entry {file, expires});
+    }
+    return file;
+  }
+
+  const std::vector<std::filesystem::path>& get_search_paths() const {
+    return search_paths;
+  }
+
+  std::chrono::steady_clock::duration get_negative_ttl() const {
+    return negative_ttl;
+  }
+
+  std::chrono::steady_clock::duration get_positive_ttl() const {
+    return positive_ttl;
+  }
+
+  Statistics statistics() const {
+    std::scoped_lock lock(mutex);
+    return stats;
+  }
+
+  void clear() {
+    std::scoped_lock lock(mutex);
+    entries.clear();
+  }
+};
+
+} // namespace inja
+
+#endif // INCLUDE_INJA_INCLUDE_RESOLVER_HPP_
 
 // #include "template.hpp"
 #ifndef INCLUDE_INJA_TEMPLATE_HPP_
 #define INCLUDE_INJA_TEMPLATE_HPP_
 
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <iterator>
 #include <map>
 #include <memory>
+#include <mutex>
+#include <shared_mutex>
 #include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
 
-// #include "node.hpp"
-#ifndef INCLUDE_INJA_NODE_HPP_
-#define INCLUDE_INJA_NODE_HPP_
+// #include "bytecode.hpp"
+#ifndef INCLUDE_INJA_BYTECODE_HPP_
+#define INCLUDE_INJA_BYTECODE_HPP_
 
 #include <cstddef>
-#include <memory>
 #include <string>
-#include <string_view>
-#include <tuple>
 #include <vector>
 
 // #include "function_storage.hpp"
@@ -188,6 +338,7 @@ public:
 
 private:
   const int VARIADIC {-1};
+  size_t version {0}; // Changes with every added function, as parsed templates are bound to their functions
 
   std::map<std::pair<std::string, int>, FunctionData> function_storage = {
       {std::make_pair("at", 2), FunctionData {Operation::At}},
@@ -226,10 +377,17 @@ private:
 public:
   void add_builtin(std::string_view name, int num_args, Operation op) {
     function_storage.emplace(std::make_pair(static_cast<std::string>(name), num_args), FunctionData {op});
+    version += 1;
   }
 
   void add_callback(std::string_view name, int num_args, const CallbackFunction& callback) {
     function_storage.emplace(std::make_pair(static_cast<std::string>(name), num_args), FunctionData {Operation::Callback, callback});
+    version += 1;
+  }
+
+  /// Returns a number that changes whenever a function is added
+  size_t get_version() const {
+    return version;
   }
 
   FunctionData find_function(std::string_view name, int num_args) const {
@@ -253,6 +411,23 @@ public:
 
 #endif // INCLUDE_INJA_FUNCTION_STORAGE_HPP_
 
+// #include "node.hpp"
+#ifndef INCLUDE_INJA_NODE_HPP_
+#define INCLUDE_INJA_NODE_HPP_
+
+#include <algorithm>
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// #include "function_storage.hpp"
+
 // #include "utils.hpp"
 #ifndef INCLUDE_INJA_UTILS_HPP_
 #define INCLUDE_INJA_UTILS_HPP_
@@ -309,6 +484,10 @@ struct DataError : public InjaError {
   explicit DataError(const std::string& message, SourceLocation location): InjaError("data_error", message, location) {}
 };
 
+struct LinkError : public InjaError {
+  explicit LinkError(const std::string& message): InjaError("link_error", message) {}
+};
+
 } // namespace inja
 
 #endif // INCLUDE_INJA_EXCEPTIONS_HPP_
@@ -334,6 +513,30 @@ inline std::pair<std::string_view, std::string_view> split(std::string_view view
 inline bool starts_with(std::string_view view, std::string_view prefix) {
   return (view.size() >= prefix.size() && view.compare(0, prefix.size(), prefix) == 0);
 }
+
+/// Matches a pattern in which '*' stands for any sequence of characters and '?' for a single one
+inline bool matches_wildcard(std::string_view view, std::string_view pattern) {
+  size_t v {0}, p {0};
+  size_t star = std::string_view::npos, star_match {0};
+  while (v < view.size()) {
+    if (p < pattern.size() && (pattern[p] == '?' || pattern[p] == view[v])) {
+      ++v;
+      ++p;
+    } else if (p < pattern.size() && pattern[p] == '*') {
+      star = p++;
+      star_match = v;
+    } else if (star != std::string_view::npos) {
+      p = star + 1;
+      v = ++star_match;
+    } else {
+      return false;
+    }
+  }
+  while (p < pattern.size() && pattern[p] == '*') {
+    ++p;
+  }
+  return p == pattern.size();
+}
 } // namespace string_view
 
 inline SourceLocation get_source_location(std::string_view content, size_t pos) {
@@ -434,7 +637,7 @@ public:
 
 class BlockNode : public AstNode {
 public:
-  std::vector<std::shared_ptr<AstNode>> nodes;
+  std::vector<AstNode*> nodes;
 
   explicit BlockNode(): AstNode(0) {}
 
@@ -468,6 +671,7 @@ public:
   const json value;
 
   explicit LiteralNode(std::string_view data_text, size_t pos): ExpressionNode(pos), value(json::parse(data_text)) {}
+  explicit LiteralNode(const json& value, size_t pos): ExpressionNode(pos), value(value) {}
 
   void accept(NodeVisitor& v) const override {
     v.visit(*this);
@@ -476,8 +680,27 @@ public:
 
 class DataNode : public ExpressionNode {
 public:
+  /// How the first segment of the name is looked up, as resolved by the parser
+  enum class Scope {
+    Dynamic, // Loops of other templates, set variables, and the data
+    Loop,    // The variable of an enclosing loop statement
+  };
+
+  /// A segment of the name with its array index pre-parsed, or npos if it is not a valid index
+  struct Segment {
+    std::string key;
+    size_t index;
+  };
+
   const std::string name;
   const json::json_pointer ptr;
+  const std::vector<Segment> path;
+  const std::string& head; // First segment of the name, e.g. a loop variable
+
+  bool is_loop_metadata;                      // Whether the name refers to the special loop object
+  Scope scope {Scope::Dynamic};
+  const std::string* loop_variable {nullptr}; // Name of the loop variable, owned by the loop statement
+  size_t loop_depth {0};                      // Number of loops between the reference and the binding loop
 
   static std::string convert_dot_to_ptr(std::string_view ptr_name) {
     std::string result;
@@ -490,7 +713,49 @@ public:
     return result;
   }
 
-  explicit DataNode(std::string_view ptr_name, size_t pos): ExpressionNode(pos), name(ptr_name), ptr(json::json_pointer(convert_dot_to_ptr(ptr_name))) {}
+  static std::vector<Segment> convert_dot_to_path(std::string_view ptr_name) {
+    std::vector<Segment> result;
+    do {
+      std::string_view part;
+      std::tie(part, ptr_name) = string_view::split(ptr_name, '.');
+
+      // Same rules as for the array indices of a json pointer
+      size_t index = std::string::npos;
+      if (!part.empty() && part.size() < 19 && (part.size() == 1 || part[0] != '0') &&
+          std::all_of(part.begin(), part.end(), [](char c) { return c >= '0' && c <= '9'; })) {
+        index = std::stoull(std::string(part));
+      }
+      result.push_back({std::string(part), index});
+    } while (!ptr_name.empty());
+    return result;
+  }
+
+  explicit DataNode(std::string_view ptr_name, size_t pos)
+      : ExpressionNode(pos), name(ptr_name), ptr(json::json_pointer(convert_dot_to_ptr(ptr_name))), path(convert_dot_to_path(ptr_name)),
+        head(path.front().key), is_loop_metadata(head == "loop") {}
+
+  // The head refers to the path of the node itself, which a copy would still refer to
+  DataNode(const DataNode&) = delete;
+  DataNode& operator=(const DataNode&) = delete;
+
+  /// Follows the path from the given segment on in a single traversal of the data, or returns nullptr if it is not found
+  const json* find_in(const json& data, size_t first = 0) const {
+    const json* result = &data;
+    for (auto segment = path.begin() + first; segment != path.end(); ++segment) {
+      if (result->is_object()) {
+        const auto it = result->find(segment->key);
+        if (it == result->end()) {
+          return nullptr;
+        }
+        result = &*it;
+      } else if (result->is_array() && segment->index < result->size()) {
+        result = &(*result)[segment->index];
+      } else {
+        return nullptr;
+      }
+    }
+    return result;
+  }
 
   void accept(NodeVisitor& v) const override {
     v.visit(*this);
@@ -513,8 +778,9 @@ public:
 
   std::string name;
   int number_args; // Can also be negative -> -1 for unknown number
-  std::vector<std::shared_ptr<ExpressionNode>> arguments;
+  std::vector<ExpressionNode*> arguments;
   CallbackFunction callback;
+  const DataNode* literal_path {nullptr}; // Pre-compiled path of a string literal argument
 
   explicit FunctionNode(std::string_view name, size_t pos)
       : ExpressionNode(pos), precedence(8), associativity(Associativity::Left), operation(Op::Callback), name(name), number_args(0) {}
@@ -619,7 +885,7 @@ public:
 
 class ExpressionListNode : public AstNode {
 public:
-  std::shared_ptr<ExpressionNode> root;
+  ExpressionNode* root {nullptr};
 
   explicit ExpressionListNode(): AstNode(0) {}
   explicit ExpressionListNode(size_t pos): AstNode(pos) {}
@@ -645,6 +911,9 @@ public:
   explicit ForStatementNode(BlockNode* const parent, size_t pos): StatementNode(pos), parent(parent) {}
 
   virtual void accept(NodeVisitor& v) const = 0;
+
+  /// Returns the name of the loop variable that matches, or nullptr if the loop does not bind it
+  virtual const std::string* find_variable(const std::string& name) const = 0;
 };
 
 class ForArrayStatementNode : public ForStatementNode {
@@ -653,6 +922,10 @@ public:
 
   explicit ForArrayStatementNode(const std::string& value, BlockNode* const parent, size_t pos): ForStatementNode(parent, pos), value(value) {}
 
+  const std::string* find_variable(const std::string& name) const override {
+    return (value == name) ? &value : nullptr;
+  }
+
   void accept(NodeVisitor& v) const override {
     v.visit(*this);
   }
@@ -666,6 +939,13 @@ public:
   explicit ForObjectStatementNode(const std::string& key, const std::string& value, BlockNode* const parent, size_t pos)
       : ForStatementNode(parent, pos), key(key), value(value) {}
 
+  const std::string* find_variable(const std::string& name) const override {
+    if (value == name) {
+      return &value;
+    }
+    return (key == name) ? &key : nullptr;
+  }
+
   void accept(NodeVisitor& v) const override {
     v.visit(*this);
   }
@@ -692,6 +972,7 @@ public:
 class IncludeStatementNode : public StatementNode {
 public:
   const std::string file;
+  size_t link_index {std::string::npos}; // Index of the file in the dependencies of the template
 
   explicit IncludeStatementNode(const std::string& file, size_t pos): StatementNode(pos), file(file) {}
 
@@ -703,6 +984,7 @@ public:
 class ExtendsStatementNode : public StatementNode {
 public:
   const std::string file;
+  size_t link_index {std::string::npos}; // Index of the file in the dependencies of the template
 
   explicit ExtendsStatementNode(const std::string& file, size_t pos): StatementNode(pos), file(file) {}
 
@@ -716,6 +998,7 @@ public:
   const std::string name;
   BlockNode block;
   BlockNode* const parent;
+  size_t index {0}; // Of the block in the blocks of its template
 
   explicit BlockStatementNode(BlockNode* const parent, const std::string& name, size_t pos): StatementNode(pos), name(name), parent(parent) {}
 
@@ -727,133 +1010,856 @@ public:
 class SetStatementNode : public StatementNode {
 public:
   const std::string key;
+  const json::json_pointer ptr;
+  const std::string head;
   ExpressionListNode expression;
 
-  explicit SetStatementNode(const std::string& key, size_t pos): StatementNode(pos), key(key) {}
+  explicit SetStatementNode(const std::string& key, size_t pos)
+      : StatementNode(pos), key(key), ptr(DataNode::convert_dot_to_ptr(key)), head(string_view::split(key, '.').first) {}
 
   void accept(NodeVisitor& v) const override {
     v.visit(*this);
   }
 };
 
+/*!
+ * \brief Bump allocator that owns all nodes of a Template.
+ *
+ * Nodes are placed contiguously in the order the parser creates them, and are destroyed together with the arena.
+ */
+class NodeArena {
+  static constexpr size_t chunk_size {8192};
+
+  std::vector<std::unique_ptr<unsigned char[]>> chunks;
+  unsigned char* current {nullptr};
+  size_t remaining {0};
+  std::vector<AstNode*> nodes;
+
+  void* allocate(size_t size, size_t alignment) {
+    void* memory = current;
+    if (current == nullptr || std::align(alignment, size, memory, remaining) == nullptr) {
+      const size_t new_size = std::max(chunk_size, size + alignment);
+      chunks.emplace_back(new unsigned char[new_size]);
+      memory = chunks.back().get();
+      remaining = new_size;
+      std::align(alignment, size, memory, remaining);
+    }
+    current = static_cast<unsigned char*>(memory) + size;
+    remaining -= size;
+    return memory;
+  }
+
+public:
+  explicit NodeArena() {}
+  NodeArena(const NodeArena&) = delete;
+  NodeArena& operator=(const NodeArena&) = delete;
+
+  ~NodeArena() {
+    for (auto it = nodes.rbegin(); it != nodes.rend(); ++it) {
+      (*it)->~AstNode();
+    }
+  }
+
+  template <class T, class... Args> T* make(Args&&... args) {
+    static_assert(std::is_base_of<AstNode, T>::value, "arena only holds AST nodes");
+    // The bookkeeping grows first, so that registering a constructed node can not throw and leak it
+    if (nodes.size() == nodes.capacity()) {
+      nodes.reserve(std::max<size_t>(64, 2 * nodes.capacity()));
+    }
+    T* node = new (allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+    nodes.push_back(node);
+    return node;
+  }
+
+  /// Return the number of nodes in the arena
+  size_t size() const {
+    return nodes.size();
+  }
+};
+
 } // namespace inja
 
 #endif // INCLUDE_INJA_NODE_HPP_
 
-// #include "statistics.hpp"
-#ifndef INCLUDE_INJA_STATISTICS_HPP_
-#define INCLUDE_INJA_STATISTICS_HPP_
 
-// #include "node.hpp"
+namespace inja {
 
+/*!
+ * \brief A single instruction of a compiled template program.
+ */
+struct Instruction {
+  enum class Opcode {
+    Text,           // Write the text of the TextNode
+    Push,           // Push the value of the LiteralNode
+    Load,           // Push the value of the DataNode
+    Call,           // Apply the FunctionNode to the arguments on the stack
+    AtId,           // Access the member given by the DataNode on top of the container
+    And,            // Short-circuit: if the top is false, replace it by false and jump
+    Or,             // Short-circuit: if the top is true, replace it by true and jump
+    Truthy,         // Replace the top by its truthiness
+    Default,        // If the top is found, keep it and jump; else drop it
+    Require,        // Throw if the top could not be found
+    Empty,          // Throw for an empty expression
+    Print,          // Pop and print the result of the ExpressionListNode
+    JumpIfFalse,    // Pop the condition and jump if it is false
+    Jump,           // Jump unconditionally
+    ForArray,       // Pop the array and begin a loop, or jump if it is empty
+    ForObject,      // Pop the object and begin a loop, or jump if it is empty
+    LoopNext,       // Advance the current loop and jump back to the body
+    Set,            // Pop the value and assign it to the SetStatementNode's key
+    Include,        // Render the IncludeStatementNode
+    Extends,        // Render the ExtendsStatementNode, which stops the rendering of the enclosing blocks
+    Break,          // Jump to the end of the enclosing block if rendering was stopped by an extends statement
+    Block,          // Render the BlockStatementNode
+    Return,         // Stop execution
+  };
 
-namespace inja {
+  Opcode opcode;
+  size_t target {0};
+  const AstNode* node {nullptr};
+
+  explicit Instruction(Opcode opcode, const AstNode* node, size_t target = 0): opcode(opcode), target(target), node(node) {}
+};
 
 /*!
- * \brief A class for counting statistics on a Template.
+ * \brief A template compiled to a flat instruction stream.
  */
-class StatisticsVisitor : public NodeVisitor {
+struct Program {
+  std::vector<Instruction> instructions;
+  std::vector<size_t> block_entries; // Start of each block by its index, or npos if the block is never reached
+  bool checks_breaks {false};        // Whether blocks check after each node if an extends statement stopped the rendering
+};
+
+/*!
+ * \brief Class for compiling the AST of a Template into a Program.
+ */
+class Compiler : public NodeVisitor {
+  using Op = FunctionStorage::Operation;
+  using Opcode = Instruction::Opcode;
+
+  Program program;
+  std::vector<const BlockStatementNode*> pending_blocks;
+
+  size_t emit(Opcode opcode, const AstNode* node, size_t target = 0) {
+    program.instructions.emplace_back(opcode, node, target);
+    return program.instructions.size() - 1;
+  }
+
+  void patch(size_t instruction) {
+    program.instructions[instruction].target = program.instructions.size();
+  }
+
+  void compile_expression(const ExpressionListNode& node) {
+    if (!node.root) {
+      emit(Opcode::Empty, &node);
+      return;
+    }
+    node.root->accept(*this);
+  }
+
   void visit(const BlockNode& node) override {
-    for (const auto& n : node.nodes) {
-      n->accept(*this);
+    // Like the renderer, each node is followed by a check whether an extends statement stopped the rendering, unless
+    // the template can not stop it
+    std::vector<size_t> breaks;
+    for (size_t i = 0; i < node.nodes.size(); ++i) {
+      node.nodes[i]->accept(*this);
+      if (program.checks_breaks && i + 1 < node.nodes.size()) {
+        breaks.emplace_back(emit(Opcode::Break, &node));
+      }
+    }
+    for (const size_t instruction : breaks) {
+      patch(instruction);
+    }
+  }
+
+  void visit(const TextNode& node) override {
+    if (node.length > 0) {
+      emit(Opcode::Text, &node);
     }
   }
 
-  void visit(const TextNode&) override {}
   void visit(const ExpressionNode&) override {}
-  void visit(const LiteralNode&) override {}
 
-  void visit(const DataNode&) override {
-    variable_counter += 1;
+  void visit(const LiteralNode& node) override {
+    emit(Opcode::Push, &node);
+  }
+
+  void visit(const DataNode& node) override {
+    emit(Opcode::Load, &node);
   }
 
   void visit(const FunctionNode& node) override {
-    for (const auto& n : node.arguments) {
-      n->accept(*this);
+    switch (node.operation) {
+    case Op::And:
+    case Op::Or: {
+      node.arguments[0]->accept(*this);
+      const size_t jump = emit((node.operation == Op::And) ? Opcode::And : Opcode::Or, &node);
+      node.arguments[1]->accept(*this);
+      emit(Opcode::Truthy, &node);
+      patch(jump);
+    } break;
+    case Op::Default: {
+      node.arguments[0]->accept(*this);
+      const size_t jump = emit(Opcode::Default, &node);
+      node.arguments[1]->accept(*this);
+      emit(Opcode::Require, &node);
+      patch(jump);
+    } break;
+    case Op::AtId: {
+      node.arguments[0]->accept(*this);
+      node.arguments[1]->accept(*this);
+      emit(Opcode::AtId, &node);
+    } break;
+    default: {
+      for (const auto& a : node.arguments) {
+        a->accept(*this);
+      }
+      emit(Opcode::Call, &node);
+    }
     }
   }
 
   void visit(const ExpressionListNode& node) override {
-    node.root->accept(*this);
+    compile_expression(node);
+    emit(Opcode::Print, &node);
   }
 
   void visit(const StatementNode&) override {}
   void visit(const ForStatementNode&) override {}
 
   void visit(const ForArrayStatementNode& node) override {
-    node.condition.accept(*this);
+    compile_expression(node.condition);
+    const size_t loop = emit(Opcode::ForArray, &node);
+    const size_t body = program.instructions.size();
     node.body.accept(*this);
+    emit(Opcode::LoopNext, &node, body);
+    patch(loop);
   }
 
   void visit(const ForObjectStatementNode& node) override {
-    node.condition.accept(*this);
+    compile_expression(node.condition);
+    const size_t loop = emit(Opcode::ForObject, &node);
+    const size_t body = program.instructions.size();
     node.body.accept(*this);
+    emit(Opcode::LoopNext, &node, body);
+    patch(loop);
   }
 
   void visit(const IfStatementNode& node) override {
-    node.condition.accept(*this);
+    compile_expression(node.condition);
+    const size_t jump_false = emit(Opcode::JumpIfFalse, &node.condition);
     node.true_statement.accept(*this);
-    node.false_statement.accept(*this);
+    if (node.has_false_statement) {
+      const size_t jump_end = emit(Opcode::Jump, &node);
+      patch(jump_false);
+      node.false_statement.accept(*this);
+      patch(jump_end);
+    } else {
+      patch(jump_false);
+    }
   }
 
-  void visit(const IncludeStatementNode&) override {}
+  void visit(const IncludeStatementNode& node) override {
+    emit(Opcode::Include, &node);
+  }
 
-  void visit(const ExtendsStatementNode&) override {}
+  void visit(const ExtendsStatementNode& node) override {
+    emit(Opcode::Extends, &node);
+  }
 
   void visit(const BlockStatementNode& node) override {
-    node.block.accept(*this);
+    emit(Opcode::Block, &node);
+    pending_blocks.emplace_back(&node);
   }
 
-  void visit(const SetStatementNode&) override {}
+  void visit(const SetStatementNode& node) override {
+    compile_expression(node.expression);
+    emit(Opcode::Set, &node);
+  }
 
 public:
-  size_t variable_counter {0};
-
-  explicit StatisticsVisitor() {}
-};
+  explicit Compiler() {}
 
-} // namespace inja
+  /// Compile the given root and all blocks within into a program. Only a template with extends or block statements,
+  /// where the implementation of a block might extend another template, can stop the rendering
+  Program compile(const BlockNode& root, bool checks_breaks) {
+    program = Program();
+    program.checks_breaks = checks_breaks;
+    pending_blocks.clear();
 
-#endif // INCLUDE_INJA_STATISTICS_HPP_
+    root.accept(*this);
+    emit(Opcode::Return, &root);
 
+    // Each block body is compiled as a separate subroutine after the main code
+    while (!pending_blocks.empty()) {
+      const auto block = pending_blocks.back();
+      pending_blocks.pop_back();
 
-namespace inja {
+      if (block->index >= program.block_entries.size()) {
+        program.block_entries.resize(block->index + 1, std::string::npos);
+      }
+      program.block_entries[block->index] = program.instructions.size();
+      block->block.accept(*this);
+      emit(Opcode::Return, block);
+    }
+    return std::move(program);
+  }
+};
 
-/*!
- * \brief The main inja Template.
- */
-struct Template {
-  BlockNode root;
-  std::string content;
-  std::map<std::string, std::shared_ptr<BlockStatementNode>> block_storage;
+} // namespace inja
 
-  explicit Template() {}
-  explicit Template(std::string content): content(std::move(content)) {}
+#endif // INCLUDE_INJA_BYTECODE_HPP_
 
-  /// Return number of variables (total number, not distinct ones) in the template
-  size_t count_variables() const {
-    auto statistic_visitor = StatisticsVisitor();
-    root.accept(statistic_visitor);
-    return statistic_visitor.variable_counter;
-  }
-};
+// #include "node.hpp"
 
-using TemplateStorage = std::map<std::string, Template>;
+// #include "statistics.hpp"
+#ifndef INCLUDE_INJA_STATISTICS_HPP_
+#define INCLUDE_INJA_STATISTICS_HPP_
 
-} // namespace inja
+#include <string>
+#include <vector>
 
-#endif // INCLUDE_INJA_TEMPLATE_HPP_
+// #include "node.hpp"
 
 
 namespace inja {
 
 /*!
- * \brief Class for lexer configuration.
+ * \brief A class for counting statistics on a Template.
  */
-struct LexerConfig {
-  std::string statement_open {"{%"};
-  std::string statement_open_no_lstrip {"{%+"};
-  std::string statement_open_force_lstrip {"{%-"};
+class StatisticsVisitor : public NodeVisitor {
+  void visit(const BlockNode& node) override {
+    for (const auto& n : node.nodes) {
+      n->accept(*this);
+    }
+  }
+
+  void visit(const TextNode&) override {
+    node_counter += 1;
+  }
+
+  void visit(const ExpressionNode&) override {}
+
+  void visit(const LiteralNode&) override {
+    node_counter += 1;
+  }
+
+  void visit(const DataNode&) override {
+    node_counter += 1;
+    variable_counter += 1;
+  }
+
+  void visit(const FunctionNode& node) override {
+    node_counter += 1;
+    if (node.operation == FunctionStorage::Operation::Super) {
+      scoped_counter += 1;
+    }
+    for (const auto& n : node.arguments) {
+      n->accept(*this);
+    }
+  }
+
+  void visit(const ExpressionListNode& node) override {
+    node_counter += 1;
+    if (node.root) {
+      node.root->accept(*this);
+    }
+  }
+
+  void visit(const StatementNode&) override {}
+  void visit(const ForStatementNode&) override {}
+
+  void visit(const ForArrayStatementNode& node) override {
+    node_counter += 1;
+    node.condition.accept(*this);
+    node.body.accept(*this);
+  }
+
+  void visit(const ForObjectStatementNode& node) override {
+    node_counter += 1;
+    node.condition.accept(*this);
+    node.body.accept(*this);
+  }
+
+  void visit(const IfStatementNode& node) override {
+    node_counter += 1;
+    node.condition.accept(*this);
+    node.true_statement.accept(*this);
+    node.false_statement.accept(*this);
+  }
+
+  void visit(const IncludeStatementNode&) override {
+    node_counter += 1;
+    scoped_counter += 1;
+    include_counter += 1;
+  }
+
+  void visit(const ExtendsStatementNode& node) override {
+    node_counter += 1;
+    scoped_counter += 1;
+    include_counter += 1;
+    extended_templates.emplace_back(node.file);
+  }
+
+  void visit(const BlockStatementNode& node) override {
+    node_counter += 1;
+    scoped_counter += 1;
+    node.block.accept(*this);
+  }
+
+  void visit(const SetStatementNode&) override {
+    node_counter += 1;
+    scoped_counter += 1;
+    set_counter += 1;
+  }
+
+public:
+  size_t variable_counter {0};
+  size_t include_counter {0};
+  size_t node_counter {0};
+  size_t set_counter {0};
+  size_t scoped_counter {0}; // Include, extends, block and set statements and super() calls, which need their own renderer
+  std::vector<std::string> extended_templates;
+
+  explicit StatisticsVisitor() {}
+};
+
+} // namespace inja
+
+#endif // INCLUDE_INJA_STATISTICS_HPP_
+
+
+namespace inja {
+
+class TemplateStorage;
+struct Template;
+
+/*!
+ * \brief Shared pointer that is read without a lock and replaced atomically.
+ */
+template <class T> class AtomicSharedPtr {
+#if defined(__cpp_lib_atomic_shared_ptr)
+  std::atomic<std::shared_ptr<T>> ptr;
+
+public:
+  std::shared_ptr<T> load() const {
+    return ptr.load(std::memory_order_acquire);
+  }
+
+  void store(std::shared_ptr<T> value) {
+    ptr.store(std::move(value), std::memory_order_release);
+  }
+#else
+  std::shared_ptr<T> ptr;
+
+public:
+  std::shared_ptr<T> load() const {
+    return std::atomic_load_explicit(&ptr, std::memory_order_acquire);
+  }
+
+  void store(std::shared_ptr<T> value) {
+    std::atomic_store_explicit(&ptr, std::move(value), std::memory_order_release);
+  }
+#endif
+};
+
+/*!
+ * \brief Targets of the include and extends statements of a template, by the index of their dependency.
+ */
+struct TemplateLinks {
+  struct Target {
+    std::weak_ptr<const Template> tmpl; // Empty if the target was not loaded when linking
+    size_t inline_size;                 // Number of nodes if the target can be rendered inline, or npos
+    bool is_read_only;                  // Whether the target neither assigns variables nor extends another template
+  };
+
+  const TemplateStorage* storage;
+  size_t generation; // Of the storage when linking
+  std::vector<Target> targets;
+};
+
+/*!
+ * \brief Blocks of an inheritance chain, from the rendered template to its last parent, in slots by their names.
+ */
+struct BlockTable {
+  std::vector<std::weak_ptr<const Template>> parents;
+  std::vector<std::vector<size_t>> slots; // Slot of each block of each level, by the index of the block
+  std::vector<std::vector<const BlockStatementNode*>> implementations; // Of each slot at each level, or nullptr
+};
+
+/*!
+ * \brief The main inja Template.
+ */
+struct Template {
+  BlockNode root;
+  std::string content;
+  std::map<std::string, BlockStatementNode*> block_storage;
+  std::shared_ptr<NodeArena> arena {std::make_shared<NodeArena>()};
+  std::shared_ptr<const Program> program;
+  std::vector<std::string> dependencies; // Names of the included and extended templates in the storage
+  std::shared_ptr<const json> static_data; // Of a specialized template, which is read by its included and extended templates
+
+  // Computed once after parsing, so that linking an include of this template does not visit its nodes
+  size_t inline_size {std::string::npos}; // Number of nodes if an including template can render it inline, or npos
+  bool is_read_only {false};              // Whether the template neither assigns variables nor extends another template
+
+  explicit Template() {}
+  explicit Template(std::string content): content(std::move(content)) {}
+
+  /// Return number of variables (total number, not distinct ones) in the template
+  size_t count_variables() const {
+    auto statistic_visitor = StatisticsVisitor();
+    root.accept(statistic_visitor);
+    return statistic_visitor.variable_counter;
+  }
+
+  /// Return number of include and extends statements in the template
+  size_t count_includes() const {
+    auto statistic_visitor = StatisticsVisitor();
+    root.accept(statistic_visitor);
+    return statistic_visitor.include_counter;
+  }
+
+  /// Computes the properties that the templates including this one are linked with, after the nodes are complete
+  void analyze() {
+    auto statistic_visitor = StatisticsVisitor();
+    root.accept(statistic_visitor);
+    inline_size = (statistic_visitor.scoped_counter == 0) ? statistic_visitor.node_counter : std::string::npos;
+    is_read_only = (statistic_visitor.set_counter == 0 && statistic_visitor.extended_templates.empty());
+  }
+
+  /// Compile the template into a bytecode program, which is then used for rendering
+  void compile() {
+    auto statistic_visitor = StatisticsVisitor();
+    root.accept(statistic_visitor);
+    const bool checks_breaks = !statistic_visitor.extended_templates.empty() || !block_storage.empty();
+    program = std::make_shared<const Program>(Compiler().compile(root, checks_breaks));
+  }
+
+  /// Registers the block under its name, and returns false if the name is taken already
+  bool add_block(BlockStatementNode* block) {
+    if (!block_storage.emplace(block->name, block).second) {
+      return false;
+    }
+    block->index = block_storage.size() - 1;
+    return true;
+  }
+
+  /// Returns the targets of the include and extends statements, whose changed targets are linked again whenever the
+  /// storage has changed
+  std::shared_ptr<const TemplateLinks> link(const TemplateStorage& storage) const;
+
+  /// Returns the blocks of the inheritance chain of this template and the given parents, which is linked once per chain
+  std::shared_ptr<const BlockTable> link_blocks(const std::vector<std::shared_ptr<const Template>>& parents) const;
+
+private:
+  struct LinkState {
+    std::mutex mutex; // Only held for linking again, while the links are read without it
+    AtomicSharedPtr<const TemplateLinks> links;
+    AtomicSharedPtr<const std::vector<std::shared_ptr<const BlockTable>>> block_tables; // One for each chain that was rendered
+  };
+
+  std::shared_ptr<LinkState> link_state {std::make_shared<LinkState>()};
+};
+
+/*!
+ * \brief Registry of named templates, safe for concurrent lookups and insertions.
+ *
+ * Registered templates are immutable. Replacing a template keeps the old one alive for the renders that still use it.
+ * Templates can also be registered lazily by a loader, which is called once by the first lookup of the name.
+ */
+class TemplateStorage {
+public:
+  using Loader = std::function<Template(TemplateStorage&)>;
+
+private:
+  struct PendingTemplate {
+    Loader load;
+    std::once_flag once;
+    std::shared_ptr<const Template> result;
+
+    explicit PendingTemplate(Loader load): load(std::move(load)) {}
+  };
+
+  mutable std::shared_mutex mutex;
+  std::map<std::string, std::shared_ptr<const Template>, std::less<>> templates;
+  std::map<std::string, std::shared_ptr<PendingTemplate>, std::less<>> pending;
+
+  // Changes with every modification, and is unique over all storages so that links never match another storage
+  std::atomic<size_t> generation {next_generation()};
+
+  static size_t next_generation() {
+    static std::atomic<size_t> counter {0};
+    return ++counter;
+  }
+
+  void copy_from(const TemplateStorage& other) {
+    generation = next_generation();
+    templates = other.templates;
+    pending.clear();
+    for (const auto& [name, pending_template] : other.pending) {
+      pending.emplace(name, std::make_shared<PendingTemplate>(pending_template->load));
+    }
+  }
+
+  /// Loads a pending template, where concurrent lookups of the same name wait for the first one
+  std::shared_ptr<const Template> load(std::string_view name, const std::shared_ptr<PendingTemplate>& pending_template) {
+    std::call_once(pending_template->once, [&]() {
+      pending_template->result = std::make_shared<const Template>(pending_template->load(*this));
+    });
+
+    std::unique_lock lock(mutex);
+    const auto it = pending.find(name);
+    if (it != pending.end() && it->second == pending_template) {
+      pending.erase(it);
+      generation = next_generation();
+      return templates.emplace(std::string(name), pending_template->result).first->second;
+    }
+
+    // The name was replaced or removed in the meantime
+    const auto registered = templates.find(name);
+    return (registered != templates.end()) ? registered->second : pending_template->result;
+  }
+
+public:
+  explicit TemplateStorage() {}
+
+  TemplateStorage(const TemplateStorage& other) {
+    std::shared_lock lock(other.mutex);
+    copy_from(other);
+  }
+
+  TemplateStorage& operator=(const TemplateStorage& other) {
+    if (this != &other) {
+      std::unique_lock lock(mutex, std::defer_lock);
+      std::shared_lock other_lock(other.mutex, std::defer_lock);
+      std::lock(lock, other_lock);
+      copy_from(other);
+    }
+    return *this;
+  }
+
+  /// Returns the template with the given name, or nullptr if there is none. A lazily registered template is loaded
+  std::shared_ptr<const Template> find(std::string_view name) const {
+    std::shared_ptr<PendingTemplate> pending_template;
+    {
+      std::shared_lock lock(mutex);
+      const auto it = templates.find(name);
+      if (it != templates.end()) {
+        return it->second;
+      }
+
+      const auto pending_it = pending.find(name);
+      if (pending_it == pending.end()) {
+        return nullptr;
+      }
+      pending_template = pending_it->second;
+    }
+
+    // Loading only extends the storage, so that it is logically const
+    return const_cast<TemplateStorage*>(this)->load(name, pending_template);
+  }
+
+  /// Returns the template with the given name if it is loaded, or nullptr
+  std::shared_ptr<const Template> find_loaded(std::string_view name) const {
+    std::shared_lock lock(mutex);
+    const auto it = templates.find(name);
+    return (it != templates.end()) ? it->second : nullptr;
+  }
+
+  /// Returns a number that changes whenever a template is added, replaced or removed
+  size_t get_generation() const {
+    return generation;
+  }
+
+  /// Whether there is a template with the given name, without loading a lazily registered one
+  bool contains(std::string_view name) const {
+    std::shared_lock lock(mutex);
+    return templates.find(name) != templates.end() || pending.find(name) != pending.end();
+  }
+
+  /// Adds the template if the name is not taken yet, and returns the registered template of that name
+  std::shared_ptr<const Template> emplace(const std::string& name, Template&& tmpl) {
+    auto new_template = std::make_shared<const Template>(std::move(tmpl));
+    std::unique_lock lock(mutex);
+    pending.erase(name);
+    generation = next_generation();
+    return templates.emplace(name, std::move(new_template)).first->second;
+  }
+
+  /// Registers a name whose template is only loaded by the first lookup, unless the name is taken already
+  void emplace_lazy(const std::string& name, Loader loader) {
+    std::unique_lock lock(mutex);
+    if (templates.find(name) == templates.end()) {
+      pending.emplace(name, std::make_shared<PendingTemplate>(std::move(loader)));
+    }
+  }
+
+  /// Adds the template, or replaces the one of the same name
+  void insert_or_assign(const std::string& name, Template tmpl) {
+    insert_or_assign(name, std::make_shared<const Template>(std::move(tmpl)));
+  }
+
+  /// Adds the shared template without copying it, or replaces the one of the same name
+  void insert_or_assign(const std::string& name, std::shared_ptr<const Template> tmpl) {
+    std::unique_lock lock(mutex);
+    pending.erase(name);
+    generation = next_generation();
+    templates.insert_or_assign(name, std::move(tmpl));
+  }
+
+  /// Adds or replaces all given templates in a single step, so that other threads see either none or all of them
+  void insert_or_assign_all(const std::vector<std::pair<std::string, std::shared_ptr<const Template>>>& new_templates) {
+    std::unique_lock lock(mutex);
+    generation = next_generation();
+    for (const auto& [name, tmpl] : new_templates) {
+      pending.erase(name);
+      templates.insert_or_assign(name, tmpl);
+    }
+  }
+
+  /// Removes the template, e.g. so that it is loaded again by the next parse that includes it
+  void erase(std::string_view name) {
+    std::unique_lock lock(mutex);
+    generation = next_generation();
+    const auto it = templates.find(name);
+    if (it != templates.end()) {
+      templates.erase(it);
+    }
+    const auto pending_it = pending.find(name);
+    if (pending_it != pending.end()) {
+      pending.erase(pending_it);
+    }
+  }
+
+  /// Returns the number of templates, including the lazily registered ones that are not loaded yet
+  size_t size() const {
+    std::shared_lock lock(mutex);
+    return templates.size() + pending.size();
+  }
+
+  /// Returns all loaded templates with their names
+  std::vector<std::pair<std::string, std::shared_ptr<const Template>>> snapshot() const {
+    std::shared_lock lock(mutex);
+    return {templates.begin(), templates.end()};
+  }
+};
+
+inline std::shared_ptr<const TemplateLinks> Template::link(const TemplateStorage& storage) const {
+  const size_t generation = storage.get_generation();
+  const auto is_current = [&](const std::shared_ptr<const TemplateLinks>& links) {
+    return links && links->storage == &storage && links->generation == generation;
+  };
+
+  auto links = link_state->links.load();
+  if (is_current(links)) {
+    return links;
+  }
+
+  std::scoped_lock lock(link_state->mutex);
+  links = link_state->links.load();
+  if (is_current(links)) {
+    return links; // Linked by another render in the meantime
+  }
+
+  // Targets that are still registered under their names are kept, so that only changed ones are linked again
+  const bool is_relinked = links && links->storage == &storage;
+  auto new_links = std::make_shared<TemplateLinks>(TemplateLinks {&storage, generation, {}});
+  new_links->targets.reserve(dependencies.size());
+  for (size_t i = 0; i < dependencies.size(); ++i) {
+    const auto target = storage.find_loaded(dependencies[i]);
+    if (is_relinked) {
+      const auto& old_link = links->targets[i];
+      if (!old_link.tmpl.owner_before(target) && !target.owner_before(old_link.tmpl)) {
+        new_links->targets.emplace_back(old_link);
+        continue;
+      }
+    }
+
+    TemplateLinks::Target link {target, std::string::npos, false};
+    if (target) {
+      link.inline_size = target->inline_size;
+      link.is_read_only = target->is_read_only;
+    }
+    new_links->targets.emplace_back(std::move(link));
+  }
+  link_state->links.store(new_links);
+  return new_links;
+}
+
+inline std::shared_ptr<const BlockTable> Template::link_blocks(const std::vector<std::shared_ptr<const Template>>& parents) const {
+  // Sharing the owner with a living parent means being the same template
+  const auto is_chain = [&](const BlockTable& table) {
+    return std::equal(table.parents.begin(), table.parents.end(), parents.begin(), parents.end(), [](const auto& linked, const auto& parent) {
+      return !linked.owner_before(parent) && !parent.owner_before(linked);
+    });
+  };
+  const auto find_table = [&](const std::shared_ptr<const std::vector<std::shared_ptr<const BlockTable>>>& tables) -> std::shared_ptr<const BlockTable> {
+    if (tables) {
+      for (const auto& table : *tables) {
+        if (is_chain(*table)) {
+          return table;
+        }
+      }
+    }
+    return nullptr;
+  };
+
+  if (auto table = find_table(link_state->block_tables.load())) {
+    return table;
+  }
+
+  std::scoped_lock lock(link_state->mutex);
+  const auto block_tables = link_state->block_tables.load();
+  if (auto table = find_table(block_tables)) {
+    return table; // Linked by another render in the meantime
+  }
+
+  auto new_block_tables = std::make_shared<std::vector<std::shared_ptr<const BlockTable>>>();
+  if (block_tables) {
+    std::copy_if(block_tables->begin(), block_tables->end(), std::back_inserter(*new_block_tables), [](const auto& table) {
+      return std::none_of(table->parents.begin(), table->parents.end(), [](const auto& parent) { return parent.expired(); });
+    });
+  }
+
+  auto table = std::make_shared<BlockTable>(BlockTable {{parents.begin(), parents.end()}, {}, {}});
+  std::map<std::string_view, size_t> slot_of_name;
+  table->slots.resize(parents.size() + 1);
+  for (size_t level = 0; level <= parents.size(); ++level) {
+    const auto& blocks = (level == 0) ? block_storage : parents[level - 1]->block_storage;
+    table->slots[level].resize(blocks.size());
+    for (const auto& [name, block] : blocks) {
+      const size_t slot = slot_of_name.emplace(name, slot_of_name.size()).first->second;
+      if (slot == table->implementations.size()) {
+        table->implementations.emplace_back(parents.size() + 1, nullptr);
+      }
+      table->implementations[slot][level] = block;
+      table->slots[level][block->index] = slot;
+    }
+  }
+  new_block_tables->emplace_back(table);
+  link_state->block_tables.store(std::move(new_block_tables));
+  return table;
+}
+
+} // namespace inja
+
+#endif // INCLUDE_INJA_TEMPLATE_HPP_
+
+
+#define INJA_VERSION_MAJOR 3
+#define INJA_VERSION_MINOR 5
+#define INJA_VERSION_PATCH 0
+
+namespace inja {
+
+/*!
+ * \brief Class for lexer configuration.
+ */
+struct LexerConfig {
+  std::string statement_open {"{%"};
+  std::string statement_open_no_lstrip {"{%+"};
+  std::string statement_open_force_lstrip {"{%-"};
   std::string statement_close {"%}"};
   std::string statement_close_force_rstrip {"-%}"};
   std::string line_statement {"##"};
@@ -904,8 +1910,22 @@ struct LexerConfig {
  */
 struct ParserConfig {
   bool search_included_templates_in_files {true};
+  bool compile_bytecode {false};
+
+  /// 0: none, 1: merge adjacent text, 2: also fold constant expressions and prune static if statements
+  unsigned int optimization_level {0};
+
+  /// Threads on which the included files of one level are read and parsed, where 0 uses one per core. Parsing with the
+  /// default of 1 never starts a thread
+  size_t include_parse_threads {1};
 
   std::function<Template(const std::filesystem::path&, const std::string&)> include_callback;
+
+  /// Called once for all includes of a level that are not found, with the path and name of each include
+  std::function<std::vector<Template>(const std::vector<std::pair<std::filesystem::path, std::string>>&)> batch_include_callback;
+
+  /// Finds and caches the files of included templates, shared by copies of the config
+  std::shared_ptr<IncludeResolver> include_resolver {std::make_shared<IncludeResolver>()};
 };
 
 /*!
@@ -914,6 +1934,10 @@ struct ParserConfig {
 struct RenderConfig {
   bool throw_at_missing_includes {true};
   bool html_autoescape {false};
+
+  /// Included templates with up to this number of nodes are rendered inline, if they have no statements of their own
+  /// scope (include, extends, block, set or super()). 0 renders every include with a renderer of its own
+  size_t include_inline_threshold {64};
 };
 
 } // namespace inja
@@ -926,14 +1950,19 @@ struct RenderConfig {
 #ifndef INCLUDE_INJA_PARSER_HPP_
 #define INCLUDE_INJA_PARSER_HPP_
 
+#include <algorithm>
+#include <atomic>
 #include <cstddef>
+#include <exception>
 #include <filesystem>
 #include <fstream>
 #include <iterator>
 #include <memory>
+#include <set>
 #include <stack>
 #include <string>
 #include <string_view>
+#include <thread>
 #include <utility>
 #include <vector>
 
@@ -1464,1384 +2493,3986 @@ public:
 
 // #include "node.hpp"
 
+// #include "optimizer.hpp"
+#ifndef INCLUDE_INJA_OPTIMIZER_HPP_
+#define INCLUDE_INJA_OPTIMIZER_HPP_
+
+#include <string>
+#include <utility>
+#include <vector>
+
+// #include "config.hpp"
+
+// #include "function_storage.hpp"
+
+// #include "node.hpp"
+
+// #include "renderer.hpp"
+#ifndef INCLUDE_INJA_RENDERER_HPP_
+#define INCLUDE_INJA_RENDERER_HPP_
+
+#include <algorithm>
+#include <array>
+#include <cctype>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <numeric>
+#include <optional>
+#include <ostream>
+#include <sstream>
+#include <stack>
+#include <string>
+#include <utility>
+#include <vector>
+
+#if __has_include(<memory_resource>)
+#include <memory_resource>
+#endif
+
+// #include "config.hpp"
+
+// #include "exceptions.hpp"
+
+// #include "function_storage.hpp"
+
+// #include "node.hpp"
+
 // #include "template.hpp"
 
 // #include "throw.hpp"
 
-// #include "token.hpp"
+// #include "utils.hpp"
+
 
+#if defined(__cpp_lib_memory_resource)
+#define INJA_HAS_MEMORY_RESOURCE
+#endif
 
 namespace inja {
 
 /*!
- * \brief Class for parsing an inja Template.
+@brief Escapes HTML
+*/
+inline std::string htmlescape(const std::string& data) {
+  std::string buffer;
+  buffer.reserve(static_cast<size_t>(1.1 * data.size()));
+  for (size_t pos = 0; pos != data.size(); ++pos) {
+    switch (data[pos]) {
+      case '&':  buffer.append("&amp;");       break;
+      case '\"': buffer.append("&quot;");      break;
+      case '\'': buffer.append("&apos;");      break;
+      case '<':  buffer.append("&lt;");        break;
+      case '>':  buffer.append("&gt;");        break;
+      default:   buffer.append(&data[pos], 1); break;
+    }
+  }
+  return buffer;
+}
+
+/*!
+ * \brief Reusable bookkeeping of the renderer, e.g. held per thread, so that renders of warm templates do not allocate it.
+ *
+ * A context must only be used by one render at a time. It keeps the capacity of its containers between renders.
  */
-class Parser {
-  using Arguments = std::vector<std::shared_ptr<ExpressionNode>>;
-  using OperatorStack = std::stack<std::shared_ptr<FunctionNode>>;
+class RenderContext {
+  friend class Renderer;
 
-  const ParserConfig& config;
+  template <class T> struct Stack : std::stack<T, std::vector<T>> {
+    void clear() {
+      this->c.clear();
+    }
+  };
 
-  Lexer lexer;
-  TemplateStorage& template_storage;
-  const FunctionStorage& function_storage;
+  struct LoopState {
+    const json* values;
+    json::const_iterator it;
+    size_t index;
+    size_t tmp_size; // Of the temporaries including the values, which are kept until the end of the loop
+  };
 
-  Token tok, peek_tok;
-  bool have_peek_tok {false};
+  /// Binds the variables of a loop by reference to the current element, and keeps its metadata
+  struct LoopScope {
+    const std::string* key_name;
+    const std::string* value_name;
+    json key;
+    const json* value;
 
-  std::string_view literal_start;
+    // Set statements rebind the variables to the additional data until the next iteration
+    const json* assigned_key;
+    bool is_assigned;
 
-  BlockNode* current_block {nullptr};
-  ExpressionListNode* current_expression_list {nullptr};
+    size_t index;
+    size_t size;
 
-  std::stack<IfStatementNode*> if_statement_stack;
-  std::stack<ForStatementNode*> for_statement_stack;
-  std::stack<BlockStatementNode*> block_statement_stack;
+    // The loop object is only materialized if a template references it
+    json metadata;
+    size_t metadata_index;
 
-  void throw_parser_error(const std::string& message) const {
-    INJA_THROW(ParserError(message, lexer.current_position()));
+    const json* get_key() const {
+      return assigned_key ? assigned_key : &key;
+    }
+
+    const json* find(const std::string& name) const {
+      if (*value_name == name) {
+        return value;
+      } else if (key_name && *key_name == name) {
+        return get_key();
+      }
+      return nullptr;
+    }
+  };
+
+  std::vector<const Template*> template_stack;
+  std::vector<std::shared_ptr<const Template>> parent_templates;
+  std::vector<size_t> block_slot_stack;
+#ifdef INJA_HAS_MEMORY_RESOURCE
+  /// Counts the memory that the arena takes beyond its buffer
+  class OverflowResource : public std::pmr::memory_resource {
+    void* do_allocate(size_t bytes, size_t alignment) override {
+      size += bytes;
+      return std::pmr::new_delete_resource()->allocate(bytes, alignment);
+    }
+
+    void do_deallocate(void* p, size_t bytes, size_t alignment) override {
+      std::pmr::new_delete_resource()->deallocate(p, bytes, alignment);
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override {
+      return this == &other;
+    }
+
+  public:
+    size_t size {0};
+  };
+
+  // The arena of the temporaries is declared before them, so that it outlives them
+  std::vector<std::byte> arena_buffer;
+  OverflowResource arena_overflow;
+  std::optional<std::pmr::monotonic_buffer_resource> arena_buffer_resource;
+  std::optional<std::pmr::unsynchronized_pool_resource> arena; // Reuses the memory of released temporaries
+#endif
+  size_t arena_capacity {0};
+
+  std::vector<LoopScope> loop_scopes;
+  std::vector<LoopState> loop_states;
+  std::vector<std::shared_ptr<json>> tmp_stack;
+  Stack<const json*> eval_stack;
+  Stack<const DataNode*> not_found_stack;
+  json additional_data;
+
+  // Of the renderers of included templates, which render one after another at each depth
+  std::unique_ptr<RenderContext> include_context;
+
+  RenderContext& get_include_context() {
+    if (!include_context) {
+      include_context = std::make_unique<RenderContext>();
+    }
+    include_context->reset();
+    return *include_context;
   }
 
-  void get_next_token() {
-    if (have_peek_tok) {
-      tok = peek_tok;
-      have_peek_tok = false;
-    } else {
-      tok = lexer.scan();
+  /// Forgets the state of the last render, also if it threw, which releases its temporaries
+  void clear() {
+    template_stack.clear();
+    parent_templates.clear();
+    block_slot_stack.clear();
+    loop_scopes.clear();
+    loop_states.clear();
+    tmp_stack.clear();
+    eval_stack.clear();
+    not_found_stack.clear();
+    additional_data = nullptr;
+  }
+
+  /// Replaces the arena, which must not hold temporaries anymore
+  void reset_arena() {
+#ifdef INJA_HAS_MEMORY_RESOURCE
+    arena.reset(); // Before the resource it allocates from
+    arena_buffer_resource.reset();
+    if (arena_capacity == 0) {
+      return;
     }
+
+    // The buffer grows to the memory that the last render needed
+    arena_buffer.resize(std::max(arena_capacity, arena_buffer.size() + arena_overflow.size));
+    arena_overflow.size = 0;
+    arena_buffer_resource.emplace(arena_buffer.data(), arena_buffer.size(), &arena_overflow);
+    arena.emplace(&*arena_buffer_resource);
+#endif
   }
 
-  void get_peek_token() {
-    if (!have_peek_tok) {
-      peek_tok = lexer.scan();
-      have_peek_tok = true;
+#ifdef INJA_HAS_MEMORY_RESOURCE
+  /// Returns the arena of the temporaries, or nullptr if they use the global allocator
+  std::pmr::memory_resource* get_arena() {
+    return arena ? &*arena : nullptr;
+  }
+#endif
+
+public:
+  explicit RenderContext() {}
+
+  /// Forgets the state of the last render, which is done in the renderer before each render
+  void reset() {
+    clear();
+    if (arena_capacity > 0) {
+      reset_arena();
     }
   }
 
-  void add_literal(Arguments &arguments, const char* content_ptr) {
-    const std::string_view data_text(literal_start.data(), tok.text.data() - literal_start.data() + tok.text.size());
-    arguments.emplace_back(std::make_shared<LiteralNode>(data_text, data_text.data() - content_ptr));
+  /*!
+  @brief Allocates the temporary values of renders from an arena instead of the global allocator
+
+  The arena starts with the given capacity in bytes, and grows to the memory needed by the previous render. It is
+  released as a whole before the next render. A capacity of 0 disables the arena, which is also ignored if the
+  standard library has no polymorphic allocators. The values within temporaries, like strings, still use the global
+  allocator.
+  */
+  void set_arena_capacity(size_t capacity) {
+    clear();
+    arena_capacity = capacity;
+#ifdef INJA_HAS_MEMORY_RESOURCE
+    // The arena keeps its own bookkeeping in the buffer
+    arena.reset();
+    arena_buffer_resource.reset();
+    arena_buffer = std::vector<std::byte>();
+    arena_overflow.size = 0;
+#endif
+    reset_arena();
   }
 
-  void add_operator(Arguments &arguments, OperatorStack &operator_stack) {
-    auto function = operator_stack.top();
-    operator_stack.pop();
+  /// Returns the capacity of the arena for the next render
+  size_t get_arena_capacity() const {
+#ifdef INJA_HAS_MEMORY_RESOURCE
+    return std::max(arena_capacity, arena_buffer.size() + arena_overflow.size);
+#else
+    return arena_capacity;
+#endif
+  }
+};
 
-    if (static_cast<int>(arguments.size()) < function->number_args) {
-      throw_parser_error("too few arguments");
+/*!
+ * \brief Class for rendering a Template with data.
+ */
+class Renderer : public NodeVisitor {
+  using Op = FunctionStorage::Operation;
+
+  const RenderConfig config;
+  const TemplateStorage& template_storage;
+  const FunctionStorage& function_storage;
+
+  using LoopState = RenderContext::LoopState;
+  using LoopScope = RenderContext::LoopScope;
+
+  RenderContext own_context;
+  RenderContext& context;
+
+  const Template* current_template;
+  size_t current_level {0}; // Of the current template in the inheritance chain
+  std::vector<const Template*>& template_stack {context.template_stack};
+  std::vector<std::shared_ptr<const Template>>& parent_templates {context.parent_templates};
+
+  // Links of the template whose include or extends statement was rendered last
+  const Template* linked_template {nullptr};
+  std::shared_ptr<const TemplateLinks> links;
+
+  // Blocks of the inheritance chain, and the slots of the blocks that are rendered
+  std::shared_ptr<const BlockTable> blocks;
+  std::vector<size_t>& block_slot_stack {context.block_slot_stack};
+
+  const json* data_input;
+  const json* static_input {nullptr}; // Of a specialized template, whose top-level keys shadow those of the data
+  std::ostream* output_stream;
+
+  json& additional_data {context.additional_data};
+
+  // The set variables that are read, which are those of the including renderer if the template does not assign any
+  const json* additional_data_view {&additional_data};
+
+  // The evaluation stacks are shared with the renderers of included templates
+  std::vector<std::shared_ptr<json>>& data_tmp_stack {context.tmp_stack};
+#ifdef INJA_HAS_MEMORY_RESOURCE
+  std::pmr::memory_resource* arena {nullptr}; // Of the temporaries, shared with included templates
+#endif
+  RenderContext::Stack<const json*>& data_eval_stack {context.eval_stack};
+  RenderContext::Stack<const DataNode*>& not_found_stack {context.not_found_stack};
+
+  bool break_rendering {false};
+
+  // Set by the bytecode interpreter when the arguments of the next function call are already on the evaluation stack
+  bool arguments_on_stack {false};
+
+  // Whether the current expression has loaded a value from the mutable additional data
+  bool additional_data_loaded {false};
+
+  std::vector<LoopScope>& loop_scopes {context.loop_scopes}; // Shared with included templates that do not assign variables
+  std::vector<LoopState>& loop_states {context.loop_states};
+
+  /// Remembers where a variable was found in the set variables or the data, until the next assignment
+  struct InlineCacheEntry {
+    const DataNode* node {nullptr};
+    size_t generation {0};
+    const json* value {nullptr};
+    bool is_additional_data {false};
+  };
+
+  static constexpr size_t inline_cache_size {64};
+  std::array<InlineCacheEntry, inline_cache_size> inline_cache {};
+
+  // Incremented whenever the set variables change, which invalidates all cached lookups
+  size_t data_generation {1};
+
+  static bool truthy(const json* data) {
+    if (data->is_boolean()) {
+      return data->get<bool>();
+    } else if (data->is_number()) {
+      return (*data != 0);
+    } else if (data->is_null()) {
+      return false;
     }
+    return !data->empty();
+  }
 
-    for (int i = 0; i < function->number_args; ++i) {
-      function->arguments.insert(function->arguments.begin(), arguments.back());
-      arguments.pop_back();
+  void print_data(const json& value) {
+    if (value.is_string()) {
+      if (config.html_autoescape) {
+        *output_stream << htmlescape(value.get_ref<const json::string_t&>());
+      } else {
+        *output_stream << value.get_ref<const json::string_t&>();
+      }
+    } else if (value.is_number_unsigned()) {
+      *output_stream << value.get<const json::number_unsigned_t>();
+    } else if (value.is_number_integer()) {
+      *output_stream << value.get<const json::number_integer_t>();
+    } else if (value.is_null()) {
+    } else {
+      *output_stream << value.dump();
     }
-    arguments.emplace_back(function);
   }
 
-  void add_to_template_storage(const std::filesystem::path& path, std::string& template_name) {
-    if (template_storage.find(template_name) != template_storage.end()) {
-      return;
+  /// Evaluates the expression and returns a pointer into the data, the literal or an owned temporary
+  const json* eval_expression_list(const ExpressionListNode& expression_list) {
+    if (!expression_list.root) {
+      throw_renderer_error("empty expression", expression_list);
     }
 
-    const std::string original_name = template_name;
+    expression_list.root->accept(*this);
+    return pop_expression_result(expression_list);
+  }
 
-    if (config.search_included_templates_in_files) {
-      // Build the relative path
-      template_name = (path / original_name).string();
-      if (template_name.compare(0, 2, "./") == 0) {
-        template_name.erase(0, 2);
-      }
+  const json* eval_loop_values(const ForStatementNode& node) {
+    if (!node.condition.root) {
+      throw_renderer_error("empty expression", node.condition);
+    }
 
-      if (template_storage.find(template_name) == template_storage.end()) {
-        // Load file
-        std::ifstream file;
-        file.open(template_name);
-        if (!file.fail()) {
-          const std::string text((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    node.condition.root->accept(*this);
+    return pop_loop_values(node);
+  }
 
-          auto include_template = Template(text);
-          template_storage.emplace(template_name, include_template);
-          parse_into_template(template_storage[template_name], template_name);
-          return;
-        } else if (!config.include_callback) {
-          INJA_THROW(FileError("failed accessing file at '" + template_name + "'"));
-        }
-      }
+  /// The loop body might reassign the variable that is iterated over, so values from the additional data are copied
+  const json* pop_loop_values(const ForStatementNode& node) {
+    const bool copy_values = additional_data_loaded;
+    const auto result = pop_expression_result(node.condition);
+    if (copy_values) {
+      make_result(json(*result));
+      const auto copy = data_eval_stack.top();
+      data_eval_stack.pop();
+      return copy;
+    }
+    return result;
+  }
+
+  const json* pop_expression_result(const ExpressionListNode& expression_list) {
+    if (data_eval_stack.empty()) {
+      throw_renderer_error("empty expression", expression_list);
+    } else if (data_eval_stack.size() != 1) {
+      throw_renderer_error("malformed expression", expression_list);
     }
 
-    // Try include callback
-    if (config.include_callback) {
-      auto include_template = config.include_callback(path, original_name);
-      template_storage.emplace(template_name, include_template);
+    const auto result = data_eval_stack.top();
+    data_eval_stack.pop();
+    additional_data_loaded = false;
+
+    if (result == nullptr) {
+      if (not_found_stack.empty()) {
+        throw_renderer_error("expression could not be evaluated", expression_list);
+      }
+
+      const auto node = not_found_stack.top();
+      not_found_stack.pop();
+
+      throw_renderer_error("variable '" + static_cast<std::string>(node->name) + "' not found", *node);
     }
+    return result;
   }
 
-  std::string parse_filename() const {
-    if (tok.kind != Token::Kind::String) {
-      throw_parser_error("expected string, got '" + tok.describe() + "'");
+  const json* pop_argument(const FunctionNode& node, bool throw_not_found = true) {
+    if (data_eval_stack.empty()) {
+      throw_renderer_error("function needs 1 variables, but has only found 0", node);
     }
 
-    if (tok.text.length() < 2) {
-      throw_parser_error("expected filename, got '" + static_cast<std::string>(tok.text) + "'");
+    const auto result = data_eval_stack.top();
+    data_eval_stack.pop();
+
+    if (!result) {
+      const auto data_node = not_found_stack.top();
+      not_found_stack.pop();
+
+      if (throw_not_found) {
+        throw_renderer_error("variable '" + static_cast<std::string>(data_node->name) + "' not found", *data_node);
+      }
     }
+    return result;
+  }
 
-    // Remove first and last character ""
-    return std::string {tok.text.substr(1, tok.text.length() - 2)};
+  void throw_renderer_error(const std::string& message, const AstNode& node) {
+    const SourceLocation loc = get_source_location(current_template->content, node.pos);
+    INJA_THROW(RenderError(message, loc));
   }
 
-  bool parse_expression(Template& tmpl, Token::Kind closing) {
-    current_expression_list->root = parse_expression(tmpl);
-    return tok.kind == closing;
+  void make_result(json&& result) {
+    auto result_ptr = make_temporary(std::move(result));
+    data_tmp_stack.push_back(result_ptr);
+    data_eval_stack.push(result_ptr.get());
   }
 
-  std::shared_ptr<ExpressionNode> parse_expression(Template& tmpl) {
-    size_t current_bracket_level {0};
-    size_t current_brace_level {0};
-    Arguments arguments;
-    OperatorStack operator_stack;
+  template <size_t N, size_t N_start = 0, bool throw_not_found = true> std::array<const json*, N> get_arguments(const FunctionNode& node) {
+    if (node.arguments.size() < N_start + N) {
+      throw_renderer_error("function needs " + std::to_string(N_start + N) + " variables, but has only found " + std::to_string(node.arguments.size()), node);
+    }
 
-    while (tok.kind != Token::Kind::Eof) {
-      // Literals
-      switch (tok.kind) {
-      case Token::Kind::String: {
-        if (current_brace_level == 0 && current_bracket_level == 0) {
-          literal_start = tok.text;
-          add_literal(arguments, tmpl.content.c_str());
-        }
-      } break;
-      case Token::Kind::Number: {
-        if (current_brace_level == 0 && current_bracket_level == 0) {
-          literal_start = tok.text;
-          add_literal(arguments, tmpl.content.c_str());
-        }
-      } break;
-      case Token::Kind::LeftBracket: {
-        if (current_brace_level == 0 && current_bracket_level == 0) {
-          literal_start = tok.text;
-        }
-        current_bracket_level += 1;
-      } break;
-      case Token::Kind::LeftBrace: {
-        if (current_brace_level == 0 && current_bracket_level == 0) {
-          literal_start = tok.text;
-        }
-        current_brace_level += 1;
-      } break;
-      case Token::Kind::RightBracket: {
-        if (current_bracket_level == 0) {
-          throw_parser_error("unexpected ']'");
-        }
+    if (!std::exchange(arguments_on_stack, false)) {
+      for (size_t i = N_start; i < N_start + N; i += 1) {
+        node.arguments[i]->accept(*this);
+      }
+    }
 
-        current_bracket_level -= 1;
-        if (current_brace_level == 0 && current_bracket_level == 0) {
-          add_literal(arguments, tmpl.content.c_str());
-        }
-      } break;
-      case Token::Kind::RightBrace: {
-        if (current_brace_level == 0) {
-          throw_parser_error("unexpected '}'");
-        }
+    if (data_eval_stack.size() < N) {
+      throw_renderer_error("function needs " + std::to_string(N) + " variables, but has only found " + std::to_string(data_eval_stack.size()), node);
+    }
 
-        current_brace_level -= 1;
-        if (current_brace_level == 0 && current_bracket_level == 0) {
-          add_literal(arguments, tmpl.content.c_str());
+    std::array<const json*, N> result;
+    for (size_t i = 0; i < N; i += 1) {
+      result[N - i - 1] = data_eval_stack.top();
+      data_eval_stack.pop();
+
+      if (!result[N - i - 1]) {
+        const auto data_node = not_found_stack.top();
+        not_found_stack.pop();
+
+        if (throw_not_found) {
+          throw_renderer_error("variable '" + static_cast<std::string>(data_node->name) + "' not found", *data_node);
         }
-      } break;
-      case Token::Kind::Id: {
-        get_peek_token();
+      }
+    }
+    return result;
+  }
 
-        // Data Literal
-        if (tok.text == static_cast<decltype(tok.text)>("true") || tok.text == static_cast<decltype(tok.text)>("false") ||
-            tok.text == static_cast<decltype(tok.text)>("null")) {
-          if (current_brace_level == 0 && current_bracket_level == 0) {
-            literal_start = tok.text;
-            add_literal(arguments, tmpl.content.c_str());
-          }
+  template <bool throw_not_found = true> Arguments get_argument_vector(const FunctionNode& node) {
+    const size_t N = node.arguments.size();
+    if (!std::exchange(arguments_on_stack, false)) {
+      for (const auto& a : node.arguments) {
+        a->accept(*this);
+      }
+    }
 
-          // Operator
-        } else if (tok.text == "and" || tok.text == "or" || tok.text == "in" || tok.text == "not") {
-          goto parse_operator;
+    if (data_eval_stack.size() < N) {
+      throw_renderer_error("function needs " + std::to_string(N) + " variables, but has only found " + std::to_string(data_eval_stack.size()), node);
+    }
 
-          // Functions
-        } else if (peek_tok.kind == Token::Kind::LeftParen) {
-          auto func = std::make_shared<FunctionNode>(tok.text, tok.text.data() - tmpl.content.c_str());
-          get_next_token();
-          do {
-            get_next_token();
-            auto expr = parse_expression(tmpl);
-            if (!expr) {
-              break;
-            }
-            func->number_args += 1;
-            func->arguments.emplace_back(expr);
-          } while (tok.kind == Token::Kind::Comma);
-          if (tok.kind != Token::Kind::RightParen) {
-            throw_parser_error("expected right parenthesis, got '" + tok.describe() + "'");
-          }
+    Arguments result {N};
+    for (size_t i = 0; i < N; i += 1) {
+      result[N - i - 1] = data_eval_stack.top();
+      data_eval_stack.pop();
 
-          auto function_data = function_storage.find_function(func->name, func->number_args);
-          if (function_data.operation == FunctionStorage::Operation::None) {
-            throw_parser_error("unknown function " + func->name);
-          }
-          func->operation = function_data.operation;
-          if (function_data.operation == FunctionStorage::Operation::Callback) {
-            func->callback = function_data.callback;
-          }
-          arguments.emplace_back(func);
+      if (!result[N - i - 1]) {
+        const auto data_node = not_found_stack.top();
+        not_found_stack.pop();
 
-          // Variables
-        } else {
-          arguments.emplace_back(std::make_shared<DataNode>(static_cast<std::string>(tok.text), tok.text.data() - tmpl.content.c_str()));
+        if (throw_not_found) {
+          throw_renderer_error("variable '" + static_cast<std::string>(data_node->name) + "' not found", *data_node);
         }
+      }
+    }
+    return result;
+  }
 
-        // Operators
-      } break;
-      case Token::Kind::Equal:
-      case Token::Kind::NotEqual:
-      case Token::Kind::GreaterThan:
-      case Token::Kind::GreaterEqual:
-      case Token::Kind::LessThan:
-      case Token::Kind::LessEqual:
-      case Token::Kind::Plus:
-      case Token::Kind::Minus:
-      case Token::Kind::Times:
-      case Token::Kind::Slash:
-      case Token::Kind::Power:
-      case Token::Kind::Percent:
-      case Token::Kind::Dot: {
+  void visit(const BlockNode& node) override {
+    for (const auto& n : node.nodes) {
+      n->accept(*this);
 
-      parse_operator:
-        FunctionStorage::Operation operation;
-        switch (tok.kind) {
-        case Token::Kind::Id: {
-          if (tok.text == "and") {
-            operation = FunctionStorage::Operation::And;
-          } else if (tok.text == "or") {
-            operation = FunctionStorage::Operation::Or;
-          } else if (tok.text == "in") {
-            operation = FunctionStorage::Operation::In;
-          } else if (tok.text == "not") {
-            operation = FunctionStorage::Operation::Not;
-          } else {
-            throw_parser_error("unknown operator in parser.");
-          }
-        } break;
-        case Token::Kind::Equal: {
-          operation = FunctionStorage::Operation::Equal;
-        } break;
-        case Token::Kind::NotEqual: {
-          operation = FunctionStorage::Operation::NotEqual;
-        } break;
-        case Token::Kind::GreaterThan: {
-          operation = FunctionStorage::Operation::Greater;
-        } break;
-        case Token::Kind::GreaterEqual: {
-          operation = FunctionStorage::Operation::GreaterEqual;
-        } break;
-        case Token::Kind::LessThan: {
-          operation = FunctionStorage::Operation::Less;
-        } break;
-        case Token::Kind::LessEqual: {
-          operation = FunctionStorage::Operation::LessEqual;
-        } break;
-        case Token::Kind::Plus: {
-          operation = FunctionStorage::Operation::Add;
-        } break;
-        case Token::Kind::Minus: {
-          operation = FunctionStorage::Operation::Subtract;
-        } break;
-        case Token::Kind::Times: {
-          operation = FunctionStorage::Operation::Multiplication;
-        } break;
-        case Token::Kind::Slash: {
-          operation = FunctionStorage::Operation::Division;
-        } break;
-        case Token::Kind::Power: {
-          operation = FunctionStorage::Operation::Power;
-        } break;
-        case Token::Kind::Percent: {
-          operation = FunctionStorage::Operation::Modulo;
-        } break;
-        case Token::Kind::Dot: {
-          operation = FunctionStorage::Operation::AtId;
-        } break;
-        default: {
-          throw_parser_error("unknown operator in parser.");
-        }
-        }
-        auto function_node = std::make_shared<FunctionNode>(operation, tok.text.data() - tmpl.content.c_str());
+      if (break_rendering) {
+        break;
+      }
+    }
+  }
 
-        while (!operator_stack.empty() &&
-               ((operator_stack.top()->precedence > function_node->precedence) ||
-                (operator_stack.top()->precedence == function_node->precedence && function_node->associativity == FunctionNode::Associativity::Left))) {
-          add_operator(arguments, operator_stack);
-        }
+  void visit(const TextNode& node) override {
+    output_stream->write(current_template->content.c_str() + node.pos, node.length);
+  }
 
-        operator_stack.emplace(function_node);
-      } break;
-      case Token::Kind::Comma: {
-        if (current_brace_level == 0 && current_bracket_level == 0) {
-          goto break_loop;
-        }
-      } break;
-      case Token::Kind::Colon: {
-        if (current_brace_level == 0 && current_bracket_level == 0) {
-          throw_parser_error("unexpected ':'");
-        }
-      } break;
-      case Token::Kind::LeftParen: {
-        get_next_token();
-        auto expr = parse_expression(tmpl);
-        if (tok.kind != Token::Kind::RightParen) {
-            throw_parser_error("expected right parenthesis, got '" + tok.describe() + "'");
-        }
-        if (!expr) {
-          throw_parser_error("empty expression in parentheses");
-        }
-        arguments.emplace_back(expr);
-      } break;
+  void visit(const ExpressionNode&) override {}
 
-      // parse function call pipe syntax
-      case Token::Kind::Pipe: {
-        // get function name
-        get_next_token();
-        if (tok.kind != Token::Kind::Id) {
-          throw_parser_error("expected function name, got '" + tok.describe() + "'");
-        }
-        auto func = std::make_shared<FunctionNode>(tok.text, tok.text.data() - tmpl.content.c_str());
-        // add first parameter as last value from arguments
-        func->number_args += 1;
-        func->arguments.emplace_back(arguments.back());
-        arguments.pop_back();
-        get_peek_token();
-        if (peek_tok.kind == Token::Kind::LeftParen) {
-          get_next_token();
-          // parse additional parameters
-          do {
-            get_next_token();
-            auto expr = parse_expression(tmpl);
-            if (!expr) {
-              break;
-            }
-            func->number_args += 1;
-            func->arguments.emplace_back(expr);
-          } while (tok.kind == Token::Kind::Comma);
-          if (tok.kind != Token::Kind::RightParen) {
-            throw_parser_error("expected right parenthesis, got '" + tok.describe() + "'");
-          }
-        }
-        // search store for defined function with such name and number of args
-        auto function_data = function_storage.find_function(func->name, func->number_args);
-        if (function_data.operation == FunctionStorage::Operation::None) {
-          throw_parser_error("unknown function " + func->name);
-        }
-        func->operation = function_data.operation;
-        if (function_data.operation == FunctionStorage::Operation::Callback) {
-          func->callback = function_data.callback;
-        }
-        arguments.emplace_back(func);
-      } break;
-      default:
-        goto break_loop;
-      }
+  void visit(const LiteralNode& node) override {
+    data_eval_stack.push(&node.value);
+  }
 
-      get_next_token();
+  void push_relative(const json* variable, const DataNode& node) {
+    if (const auto result = node.find_in(*variable, 1)) {
+      data_eval_stack.push(result);
+    } else {
+      data_eval_stack.push(nullptr);
+      not_found_stack.emplace(&node);
     }
+  }
 
-  break_loop:
-    while (!operator_stack.empty()) {
-      add_operator(arguments, operator_stack);
+  /// Returns the bound loop variable, and notes if it was rebound to the mutable additional data
+  const json* find_loop_variable(const DataNode& node) {
+    // The parser has resolved the frame of the enclosing loop
+    if (node.scope == DataNode::Scope::Loop && node.loop_depth < loop_scopes.size()) {
+      const auto& scope = loop_scopes[loop_scopes.size() - 1 - node.loop_depth];
+      if (scope.value_name == node.loop_variable) {
+        additional_data_loaded |= scope.is_assigned;
+        return scope.value;
+      } else if (scope.key_name == node.loop_variable) {
+        additional_data_loaded |= scope.is_assigned;
+        return scope.get_key();
+      }
     }
 
-    std::shared_ptr<ExpressionNode> expr;
-    if (arguments.size() == 1) {
-      expr = arguments[0];
-      arguments = {};
-    } else if (arguments.size() > 1) {
-      throw_parser_error("malformed expression");
+    for (auto scope = loop_scopes.rbegin(); scope != loop_scopes.rend(); ++scope) {
+      if (const auto variable = scope->find(node.head)) {
+        additional_data_loaded |= scope->is_assigned;
+        return variable;
+      }
     }
-    return expr;
+    return nullptr;
   }
 
-  bool parse_statement(Template& tmpl, Token::Kind closing, const std::filesystem::path& path) {
-    if (tok.kind != Token::Kind::Id) {
-      return false;
+  /// Returns the data in which names with the given first segment are looked up, as if the data was updated by the static
+  /// data of a specialized template
+  const json& input_for(const std::string& head) const {
+    if (static_input && static_input->is_object() && static_input->contains(head)) {
+      return *static_input;
     }
+    return *data_input;
+  }
 
-    if (tok.text == static_cast<decltype(tok.text)>("if")) {
-      get_next_token();
-
-      auto if_statement_node = std::make_shared<IfStatementNode>(current_block, tok.text.data() - tmpl.content.c_str());
-      current_block->nodes.emplace_back(if_statement_node);
-      if_statement_stack.emplace(if_statement_node.get());
-      current_block = &if_statement_node->true_statement;
-      current_expression_list = &if_statement_node->condition;
-
-      if (!parse_expression(tmpl, closing)) {
-        return false;
-      }
-    } else if (tok.text == static_cast<decltype(tok.text)>("else")) {
-      if (if_statement_stack.empty()) {
-        throw_parser_error("else without matching if");
-      }
-      auto& if_statement_data = if_statement_stack.top();
-      get_next_token();
-
-      if_statement_data->has_false_statement = true;
-      current_block = &if_statement_data->false_statement;
-
-      // Chained else if
-      if (tok.kind == Token::Kind::Id && tok.text == static_cast<decltype(tok.text)>("if")) {
-        get_next_token();
-
-        auto if_statement_node = std::make_shared<IfStatementNode>(true, current_block, tok.text.data() - tmpl.content.c_str());
-        current_block->nodes.emplace_back(if_statement_node);
-        if_statement_stack.emplace(if_statement_node.get());
-        current_block = &if_statement_node->true_statement;
-        current_expression_list = &if_statement_node->condition;
-
-        if (!parse_expression(tmpl, closing)) {
-          return false;
-        }
-      }
-    } else if (tok.text == static_cast<decltype(tok.text)>("endif")) {
-      if (if_statement_stack.empty()) {
-        throw_parser_error("endif without matching if");
+  void visit(const DataNode& node) override {
+    if (!loop_scopes.empty()) {
+      if (const auto variable = find_loop_variable(node)) {
+        push_relative(variable, node);
+        return;
       }
 
-      // Nested if statements
-      while (if_statement_stack.top()->is_nested) {
-        if_statement_stack.pop();
+      if (node.is_loop_metadata) {
+        push_relative(&loop_metadata(loop_scopes.size() - 1), node);
+        return;
       }
+    }
 
-      auto& if_statement_data = if_statement_stack.top();
-      get_next_token();
-
-      current_block = if_statement_data->parent;
-      if_statement_stack.pop();
-    } else if (tok.text == static_cast<decltype(tok.text)>("block")) {
-      get_next_token();
-
-      if (tok.kind != Token::Kind::Id) {
-        throw_parser_error("expected block name, got '" + tok.describe() + "'");
+    auto& entry = inline_cache[(reinterpret_cast<std::uintptr_t>(&node) / alignof(DataNode)) % inline_cache_size];
+    if (entry.node != &node || entry.generation != data_generation) {
+      entry.node = &node;
+      entry.generation = data_generation;
+      entry.value = node.find_in(*additional_data_view);
+      entry.is_additional_data = (entry.value != nullptr);
+      if (!entry.value) {
+        entry.value = node.find_in(input_for(node.head));
       }
+    }
 
-      const std::string block_name = static_cast<std::string>(tok.text);
-
-      auto block_statement_node = std::make_shared<BlockStatementNode>(current_block, block_name, tok.text.data() - tmpl.content.c_str());
-      current_block->nodes.emplace_back(block_statement_node);
-      block_statement_stack.emplace(block_statement_node.get());
-      current_block = &block_statement_node->block;
-      auto success = tmpl.block_storage.emplace(block_name, block_statement_node);
-      if (!success.second) {
-        throw_parser_error("block with the name '" + block_name + "' does already exist");
+    if (entry.value) {
+      data_eval_stack.push(entry.value);
+      additional_data_loaded |= entry.is_additional_data;
+    } else {
+      // Try to evaluate as a no-argument callback
+      const auto function_data = function_storage.find_function(node.name, 0);
+      if (function_data.operation == FunctionStorage::Operation::Callback) {
+        Arguments empty_args {};
+        const auto value = make_temporary(function_data.callback(empty_args));
+        data_tmp_stack.push_back(value);
+        data_eval_stack.push(value.get());
+      } else {
+        data_eval_stack.push(nullptr);
+        not_found_stack.emplace(&node);
       }
+    }
+  }
 
-      get_next_token();
-    } else if (tok.text == static_cast<decltype(tok.text)>("endblock")) {
-      if (block_statement_stack.empty()) {
-        throw_parser_error("endblock without matching block");
+  void visit(const FunctionNode& node) override {
+    switch (node.operation) {
+    case Op::Not: {
+      const auto args = get_arguments<1>(node);
+      make_result(!truthy(args[0]));
+    } break;
+    case Op::And: {
+      make_result(truthy(get_arguments<1, 0>(node)[0]) && truthy(get_arguments<1, 1>(node)[0]));
+    } break;
+    case Op::Or: {
+      make_result(truthy(get_arguments<1, 0>(node)[0]) || truthy(get_arguments<1, 1>(node)[0]));
+    } break;
+    case Op::In: {
+      const auto args = get_arguments<2>(node);
+      make_result(std::find(args[1]->begin(), args[1]->end(), *args[0]) != args[1]->end());
+    } break;
+    case Op::Equal: {
+      const auto args = get_arguments<2>(node);
+      make_result(*args[0] == *args[1]);
+    } break;
+    case Op::NotEqual: {
+      const auto args = get_arguments<2>(node);
+      make_result(*args[0] != *args[1]);
+    } break;
+    case Op::Greater: {
+      const auto args = get_arguments<2>(node);
+      make_result(*args[0] > *args[1]);
+    } break;
+    case Op::GreaterEqual: {
+      const auto args = get_arguments<2>(node);
+      make_result(*args[0] >= *args[1]);
+    } break;
+    case Op::Less: {
+      const auto args = get_arguments<2>(node);
+      make_result(*args[0] < *args[1]);
+    } break;
+    case Op::LessEqual: {
+      const auto args = get_arguments<2>(node);
+      make_result(*args[0] <= *args[1]);
+    } break;
+    case Op::Add: {
+      const auto args = get_arguments<2>(node);
+      if (args[0]->is_string() && args[1]->is_string()) {
+        make_result(args[0]->get_ref<const json::string_t&>() + args[1]->get_ref<const json::string_t&>());
+      } else if (args[0]->is_number_integer() && args[1]->is_number_integer()) {
+        make_result(args[0]->get<const json::number_integer_t>() + args[1]->get<const json::number_integer_t>());
+      } else {
+        make_result(args[0]->get<const json::number_float_t>() + args[1]->get<const json::number_float_t>());
       }
-
-      auto& block_statement_data = block_statement_stack.top();
-      get_next_token();
-
-      current_block = block_statement_data->parent;
-      block_statement_stack.pop();
-    } else if (tok.text == static_cast<decltype(tok.text)>("for")) {
-      get_next_token();
-
-      // options: for a in arr; for a, b in obj
-      if (tok.kind != Token::Kind::Id) {
-        throw_parser_error("expected id, got '" + tok.describe() + "'");
+    } break;
+    case Op::Subtract: {
+      const auto args = get_arguments<2>(node);
+      if (args[0]->is_number_integer() && args[1]->is_number_integer()) {
+        make_result(args[0]->get<const json::number_integer_t>() - args[1]->get<const json::number_integer_t>());
+      } else {
+        make_result(args[0]->get<const json::number_float_t>() - args[1]->get<const json::number_float_t>());
       }
-
-      Token value_token = tok;
-      get_next_token();
-
-      // Object type
-      std::shared_ptr<ForStatementNode> for_statement_node;
-      if (tok.kind == Token::Kind::Comma) {
-        get_next_token();
-        if (tok.kind != Token::Kind::Id) {
-          throw_parser_error("expected id, got '" + tok.describe() + "'");
-        }
-
-        const Token key_token = value_token;
-        value_token = tok;
-        get_next_token();
-
-        for_statement_node = std::make_shared<ForObjectStatementNode>(static_cast<std::string>(key_token.text), static_cast<std::string>(value_token.text),
-                                                                      current_block, tok.text.data() - tmpl.content.c_str());
-
-        // Array type
+    } break;
+    case Op::Multiplication: {
+      const auto args = get_arguments<2>(node);
+      if (args[0]->is_number_integer() && args[1]->is_number_integer()) {
+        make_result(args[0]->get<const json::number_integer_t>() * args[1]->get<const json::number_integer_t>());
       } else {
-        for_statement_node =
-            std::make_shared<ForArrayStatementNode>(static_cast<std::string>(value_token.text), current_block, tok.text.data() - tmpl.content.c_str());
+        make_result(args[0]->get<const json::number_float_t>() * args[1]->get<const json::number_float_t>());
       }
-
-      current_block->nodes.emplace_back(for_statement_node);
-      for_statement_stack.emplace(for_statement_node.get());
-      current_block = &for_statement_node->body;
-      current_expression_list = &for_statement_node->condition;
-
-      if (tok.kind != Token::Kind::Id || tok.text != static_cast<decltype(tok.text)>("in")) {
-        throw_parser_error("expected 'in', got '" + tok.describe() + "'");
+    } break;
+    case Op::Division: {
+      const auto args = get_arguments<2>(node);
+      if (args[1]->get<const json::number_float_t>() == 0) {
+        throw_renderer_error("division by zero", node);
       }
-      get_next_token();
-
-      if (!parse_expression(tmpl, closing)) {
-        return false;
+      make_result(args[0]->get<const json::number_float_t>() / args[1]->get<const json::number_float_t>());
+    } break;
+    case Op::Power: {
+      const auto args = get_arguments<2>(node);
+      if (args[0]->is_number_integer() && args[1]->get<const json::number_integer_t>() >= 0) {
+        const auto result = static_cast<json::number_integer_t>(std::pow(args[0]->get<const json::number_integer_t>(), args[1]->get<const json::number_integer_t>()));
+        make_result(result);
+      } else {
+        const auto result = std::pow(args[0]->get<const json::number_float_t>(), args[1]->get<const json::number_integer_t>());
+        make_result(result);
       }
-    } else if (tok.text == static_cast<decltype(tok.text)>("endfor")) {
-      if (for_statement_stack.empty()) {
-        throw_parser_error("endfor without matching for");
+    } break;
+    case Op::Modulo: {
+      const auto args = get_arguments<2>(node);
+      make_result(args[0]->get<const json::number_integer_t>() % args[1]->get<const json::number_integer_t>());
+    } break;
+    case Op::AtId: {
+      const auto container = get_arguments<1, 0, false>(node)[0];
+      node.arguments[1]->accept(*this);
+      if (not_found_stack.empty()) {
+        throw_renderer_error("could not find element with given name", node);
       }
-
-      auto& for_statement_data = for_statement_stack.top();
-      get_next_token();
-
-      current_block = for_statement_data->parent;
-      for_statement_stack.pop();
-    } else if (tok.text == static_cast<decltype(tok.text)>("include")) {
-      get_next_token();
-
-      std::string template_name = parse_filename();
-      add_to_template_storage(path, template_name);
-
-      current_block->nodes.emplace_back(std::make_shared<IncludeStatementNode>(template_name, tok.text.data() - tmpl.content.c_str()));
-
-      get_next_token();
-    } else if (tok.text == static_cast<decltype(tok.text)>("extends")) {
-      get_next_token();
-
-      std::string template_name = parse_filename();
-      add_to_template_storage(path, template_name);
-
-      current_block->nodes.emplace_back(std::make_shared<ExtendsStatementNode>(template_name, tok.text.data() - tmpl.content.c_str()));
-
-      get_next_token();
-    } else if (tok.text == static_cast<decltype(tok.text)>("set")) {
-      get_next_token();
-
-      if (tok.kind != Token::Kind::Id) {
-        throw_parser_error("expected variable name, got '" + tok.describe() + "'");
+      const auto id_node = not_found_stack.top();
+      not_found_stack.pop();
+      data_eval_stack.pop();
+      data_eval_stack.push(&container->at(id_node->name));
+    } break;
+    case Op::At: {
+      const auto args = get_arguments<2>(node);
+      if (args[0]->is_object()) {
+        data_eval_stack.push(&args[0]->at(args[1]->get<std::string>()));
+      } else {
+        data_eval_stack.push(&args[0]->at(args[1]->get<int>()));
       }
-
-      const std::string key = static_cast<std::string>(tok.text);
-      get_next_token();
-
-      auto set_statement_node = std::make_shared<SetStatementNode>(key, tok.text.data() - tmpl.content.c_str());
-      current_block->nodes.emplace_back(set_statement_node);
-      current_expression_list = &set_statement_node->expression;
-
-      if (tok.text != static_cast<decltype(tok.text)>("=")) {
-        throw_parser_error("expected '=', got '" + tok.describe() + "'");
+    } break;
+    case Op::Capitalize: {
+      auto result = get_arguments<1>(node)[0]->get<json::string_t>();
+      result[0] = static_cast<char>(::toupper(result[0]));
+      std::transform(result.begin() + 1, result.end(), result.begin() + 1, [](char c) { return static_cast<char>(::tolower(c)); });
+      make_result(std::move(result));
+    } break;
+    case Op::Default: {
+      const auto test_arg = get_arguments<1, 0, false>(node)[0];
+      data_eval_stack.push((test_arg != nullptr) ? test_arg : get_arguments<1, 1>(node)[0]);
+    } break;
+    case Op::DivisibleBy: {
+      const auto args = get_arguments<2>(node);
+      const auto divisor = args[1]->get<const json::number_integer_t>();
+      make_result((divisor != 0) && (args[0]->get<const json::number_integer_t>() % divisor == 0));
+    } break;
+    case Op::Even: {
+      make_result(get_arguments<1>(node)[0]->get<const json::number_integer_t>() % 2 == 0);
+    } break;
+    case Op::Exists: {
+      auto&& name = get_arguments<1>(node)[0]->get_ref<const json::string_t&>();
+      if (node.literal_path) {
+        make_result(node.literal_path->find_in(input_for(node.literal_path->head)) != nullptr);
+      } else {
+        const auto ptr = json::json_pointer(DataNode::convert_dot_to_ptr(name));
+        make_result(input_for(std::string(string_view::split(name, '.').first)).contains(ptr));
       }
-      get_next_token();
-
-      if (!parse_expression(tmpl, closing)) {
-        return false;
+    } break;
+    case Op::ExistsInObject: {
+      const auto args = get_arguments<2>(node);
+      auto&& name = args[1]->get_ref<const json::string_t&>();
+      make_result(args[0]->find(name) != args[0]->end());
+    } break;
+    case Op::First: {
+      const auto result = &get_arguments<1>(node)[0]->front();
+      data_eval_stack.push(result);
+    } break;
+    case Op::Float: {
+      make_result(std::stod(get_arguments<1>(node)[0]->get_ref<const json::string_t&>()));
+    } break;
+    case Op::Int: {
+      make_result(std::stoi(get_arguments<1>(node)[0]->get_ref<const json::string_t&>()));
+    } break;
+    case Op::Last: {
+      const auto result = &get_arguments<1>(node)[0]->back();
+      data_eval_stack.push(result);
+    } break;
+    case Op::Length: {
+      const auto val = get_arguments<1>(node)[0];
+      if (val->is_string()) {
+        make_result(val->get_ref<const json::string_t&>().length());
+      } else {
+        make_result(val->size());
       }
-    } else {
-      return false;
-    }
-    return true;
-  }
-
-  void parse_into(Template& tmpl, const std::filesystem::path& path) {
-    lexer.start(tmpl.content);
-    current_block = &tmpl.root;
+    } break;
+    case Op::Lower: {
+      auto result = get_arguments<1>(node)[0]->get<json::string_t>();
+      std::transform(result.begin(), result.end(), result.begin(), [](char c) { return static_cast<char>(::tolower(c)); });
+      make_result(std::move(result));
+    } break;
+    case Op::Max: {
+      const auto args = get_arguments<1>(node);
+      const auto result = std::max_element(args[0]->begin(), args[0]->end());
+      data_eval_stack.push(&(*result));
+    } break;
+    case Op::Min: {
+      const auto args = get_arguments<1>(node);
+      const auto result = std::min_element(args[0]->begin(), args[0]->end());
+      data_eval_stack.push(&(*result));
+    } break;
+    case Op::Odd: {
+      make_result(get_arguments<1>(node)[0]->get<const json::number_integer_t>() % 2 != 0);
+    } break;
+    case Op::Range: {
+      std::vector<int> result(get_arguments<1>(node)[0]->get<const json::number_integer_t>());
+      std::iota(result.begin(), result.end(), 0);
+      make_result(std::move(result));
+    } break;
+    case Op::Replace: {
+      const auto args = get_arguments<3>(node);
+      auto result = args[0]->get<std::string>();
+      replace_substring(result, args[1]->get<std::string>(), args[2]->get<std::string>());
+      make_result(std::move(result));
+    } break;
+    case Op::Round: {
+      const auto args = get_arguments<2>(node);
+      const auto precision = args[1]->get<const json::number_integer_t>();
+      const double result = std::round(args[0]->get<const json::number_float_t>() * std::pow(10.0, precision)) / std::pow(10.0, precision);
+      if (precision == 0) {
+        make_result(static_cast<int>(result));
+      } else {
+        make_result(result);
+      }
+    } break;
+    case Op::Sort: {
+      auto result_ptr = make_temporary(get_arguments<1>(node)[0]->get<std::vector<json>>());
+      std::sort(result_ptr->begin(), result_ptr->end());
+      data_tmp_stack.push_back(result_ptr);
+      data_eval_stack.push(result_ptr.get());
+    } break;
+    case Op::Upper: {
+      auto result = get_arguments<1>(node)[0]->get<json::string_t>();
+      std::transform(result.begin(), result.end(), result.begin(), [](char c) { return static_cast<char>(::toupper(c)); });
+      make_result(std::move(result));
+    } break;
+    case Op::IsBoolean: {
+      make_result(get_arguments<1>(node)[0]->is_boolean());
+    } break;
+    case Op::IsNumber: {
+      make_result(get_arguments<1>(node)[0]->is_number());
+    } break;
+    case Op::IsInteger: {
+      make_result(get_arguments<1>(node)[0]->is_number_integer());
+    } break;
+    case Op::IsFloat: {
+      make_result(get_arguments<1>(node)[0]->is_number_float());
+    } break;
+    case Op::IsObject: {
+      make_result(get_arguments<1>(node)[0]->is_object());
+    } break;
+    case Op::IsArray: {
+      make_result(get_arguments<1>(node)[0]->is_array());
+    } break;
+    case Op::IsString: {
+      make_result(get_arguments<1>(node)[0]->is_string());
+    } break;
+    case Op::Callback: {
+      auto args = get_argument_vector(node);
+      make_result(node.callback(args));
+    } break;
+    case Op::Super: {
+      const auto args = get_argument_vector(node);
+      const size_t level_diff = (args.size() == 1) ? args[0]->get<int>() : 1;
+      const size_t level = current_level + level_diff;
 
-    for (;;) {
-      get_next_token();
-      switch (tok.kind) {
-      case Token::Kind::Eof: {
-        if (!if_statement_stack.empty()) {
-          throw_parser_error("unmatched if");
-        }
-        if (!for_statement_stack.empty()) {
-          throw_parser_error("unmatched for");
-        }
+      if (block_slot_stack.empty()) {
+        throw_renderer_error("super() call is not within a block", node);
       }
-        current_block = nullptr;
-        return;
-      case Token::Kind::Text: {
-        current_block->nodes.emplace_back(std::make_shared<TextNode>(tok.text.data() - tmpl.content.c_str(), tok.text.size()));
-      } break;
-      case Token::Kind::StatementOpen: {
-        get_next_token();
-        if (!parse_statement(tmpl, Token::Kind::StatementClose, path)) {
-          throw_parser_error("expected statement, got '" + tok.describe() + "'");
-        }
-        if (tok.kind != Token::Kind::StatementClose) {
-          throw_parser_error("expected statement close, got '" + tok.describe() + "'");
-        }
-      } break;
-      case Token::Kind::LineStatementOpen: {
-        get_next_token();
-        if (!parse_statement(tmpl, Token::Kind::LineStatementClose, path)) {
-          throw_parser_error("expected statement, got '" + tok.describe() + "'");
-        }
-        if (tok.kind != Token::Kind::LineStatementClose && tok.kind != Token::Kind::Eof) {
-          throw_parser_error("expected line statement close, got '" + tok.describe() + "'");
-        }
-      } break;
-      case Token::Kind::ExpressionOpen: {
-        get_next_token();
 
-        auto expression_list_node = std::make_shared<ExpressionListNode>(tok.text.data() - tmpl.content.c_str());
-        current_block->nodes.emplace_back(expression_list_node);
-        current_expression_list = expression_list_node.get();
+      if (level < 1 || level > template_stack.size() - 1) {
+        throw_renderer_error("level of super() call does not match parent templates (between 1 and " + std::to_string(template_stack.size() - 1) + ")", node);
+      }
 
-        if (!parse_expression(tmpl, Token::Kind::ExpressionClose)) {
-          throw_parser_error("expected expression close, got '" + tok.describe() + "'");
-        }
-      } break;
-      case Token::Kind::CommentOpen: {
-        get_next_token();
-        if (tok.kind != Token::Kind::CommentClose) {
-          throw_parser_error("expected comment close, got '" + tok.describe() + "'");
+      const size_t slot = block_slot_stack.back();
+      if (blocks->implementations[slot][level] == nullptr) {
+        const auto& name = blocks->implementations[slot][current_level]->name;
+        throw_renderer_error("could not find block with name '" + name + "'", node);
+      }
+      render_block(slot, level);
+      make_result(nullptr);
+    } break;
+    case Op::Join: {
+      const auto args = get_arguments<2>(node);
+      const auto separator = args[1]->get<json::string_t>();
+      std::ostringstream os;
+      std::string sep;
+      for (const auto& value : *args[0]) {
+        os << sep;
+        if (value.is_string()) {
+          os << value.get<std::string>(); // otherwise the value is surrounded with ""
+        } else {
+          os << value.dump();
         }
-      } break;
-      default: {
-        throw_parser_error("unexpected token '" + tok.describe() + "'");
-      } break;
+        sep = separator;
       }
+      make_result(os.str());
+    } break;
+    case Op::None:
+      break;
     }
   }
 
-public:
-  explicit Parser(const ParserConfig& parser_config, const LexerConfig& lexer_config, TemplateStorage& template_storage,
-                  const FunctionStorage& function_storage)
-      : config(parser_config), lexer(lexer_config), template_storage(template_storage), function_storage(function_storage) {}
+  /// Creates a temporary value, in the arena of the context if there is one
+  template <class... Args> std::shared_ptr<json> make_temporary(Args&&... args) {
+#ifdef INJA_HAS_MEMORY_RESOURCE
+    if (arena) {
+      return std::allocate_shared<json>(std::pmr::polymorphic_allocator<json>(arena), std::forward<Args>(args)...);
+    }
+#endif
+    return std::make_shared<json>(std::forward<Args>(args)...);
+  }
 
-  Template parse(std::string_view input, const std::filesystem::path& path) {
-    auto result = Template(std::string(input));
-    parse_into(result, path);
-    return result;
+  /// Releases the temporaries created since the stack had the given size, once the expressions that use them are done
+  void release_temporaries(size_t size) {
+    data_tmp_stack.erase(data_tmp_stack.begin() + size, data_tmp_stack.end());
   }
 
-  void parse_into_template(Template& tmpl, const std::filesystem::path& filename) {
-    auto sub_parser = Parser(config, lexer.get_config(), template_storage, function_storage);
-    sub_parser.parse_into(tmpl, filename.parent_path());
+  void visit(const ExpressionListNode& node) override {
+    const size_t tmp_size = data_tmp_stack.size();
+    print_data(*eval_expression_list(node));
+    release_temporaries(tmp_size);
   }
 
-  static std::string load_file(const std::filesystem::path& filename) {
-    std::ifstream file;
-    file.open(filename);
-    if (file.fail()) {
-      INJA_THROW(FileError("failed accessing file at '" + filename.string() + "'"));
-    }
-    std::string text((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
-    return text;
-  }
-};
-
-} // namespace inja
-
-#endif // INCLUDE_INJA_PARSER_HPP_
-
-// #include "renderer.hpp"
-#ifndef INCLUDE_INJA_RENDERER_HPP_
-#define INCLUDE_INJA_RENDERER_HPP_
-
-#include <algorithm>
-#include <array>
-#include <cctype>
-#include <cmath>
-#include <cstddef>
-#include <memory>
-#include <numeric>
-#include <ostream>
-#include <sstream>
-#include <stack>
-#include <string>
-#include <utility>
-#include <vector>
-
-// #include "config.hpp"
-
-// #include "exceptions.hpp"
-
-// #include "function_storage.hpp"
-
-// #include "node.hpp"
-
-// #include "template.hpp"
-
-// #include "throw.hpp"
+  void visit(const StatementNode&) override {}
 
-// #include "utils.hpp"
+  void visit(const ForStatementNode&) override {}
 
+  void visit(const ForArrayStatementNode& node) override {
+    const size_t tmp_size = data_tmp_stack.size(); // The values of the loop are kept until its end
+    const auto result = eval_loop_values(node);
+    if (!result->is_array()) {
+      throw_renderer_error("object must be an array", node);
+    }
 
-namespace inja {
+    begin_loop(*result, nullptr, node.value);
+    size_t index = 0;
+    for (auto it = result->begin(); it != result->end(); ++it) {
+      bind_loop_variables(it, index);
 
-/*!
-@brief Escapes HTML
-*/
-inline std::string htmlescape(const std::string& data) {
-  std::string buffer;
-  buffer.reserve(static_cast<size_t>(1.1 * data.size()));
-  for (size_t pos = 0; pos != data.size(); ++pos) {
-    switch (data[pos]) {
-      case '&':  buffer.append("&amp;");       break;
-      case '\"': buffer.append("&quot;");      break;
-      case '\'': buffer.append("&apos;");      break;
-      case '<':  buffer.append("&lt;");        break;
-      case '>':  buffer.append("&gt;");        break;
-      default:   buffer.append(&data[pos], 1); break;
+      node.body.accept(*this);
+      ++index;
     }
+    end_loop();
+    release_temporaries(tmp_size);
   }
-  return buffer;
-}
-
-/*!
- * \brief Class for rendering a Template with data.
- */
-class Renderer : public NodeVisitor {
-  using Op = FunctionStorage::Operation;
-
-  const RenderConfig config;
-  const TemplateStorage& template_storage;
-  const FunctionStorage& function_storage;
 
-  const Template* current_template;
-  size_t current_level {0};
-  std::vector<const Template*> template_stack;
-  std::vector<const BlockStatementNode*> block_statement_stack;
+  void visit(const ForObjectStatementNode& node) override {
+    const size_t tmp_size = data_tmp_stack.size(); // The values of the loop are kept until its end
+    const auto result = eval_loop_values(node);
+    if (!result->is_object()) {
+      throw_renderer_error("object must be an object", node);
+    }
 
-  const json* data_input;
-  std::ostream* output_stream;
+    begin_loop(*result, &node.key, node.value);
+    size_t index = 0;
+    for (auto it = result->begin(); it != result->end(); ++it) {
+      bind_loop_variables(it, index);
 
-  json additional_data;
-  json* current_loop_data = &additional_data["loop"];
+      node.body.accept(*this);
+      ++index;
+    }
+    end_loop();
+    release_temporaries(tmp_size);
+  }
 
-  std::vector<std::shared_ptr<json>> data_tmp_stack;
-  std::stack<const json*> data_eval_stack;
-  std::stack<const DataNode*> not_found_stack;
+  void visit(const IfStatementNode& node) override {
+    const size_t tmp_size = data_tmp_stack.size();
+    const bool condition = truthy(eval_expression_list(node.condition));
+    release_temporaries(tmp_size);
+    if (condition) {
+      node.true_statement.accept(*this);
+    } else if (node.has_false_statement) {
+      node.false_statement.accept(*this);
+    }
+  }
 
-  bool break_rendering {false};
+  /// Returns the link of an include or extends statement of the current template, or nullptr if its target was not
+  /// loaded at the time of linking
+  const TemplateLinks::Target* find_link(size_t link_index) {
+    if (link_index >= current_template->dependencies.size()) {
+      return nullptr;
+    }
+    if (linked_template != current_template) {
+      links = current_template->link(template_storage);
+      linked_template = current_template;
+    }
+    const auto& target = links->targets[link_index];
+    return target.tmpl.expired() ? nullptr : &target;
+  }
 
-  static bool truthy(const json* data) {
-    if (data->is_boolean()) {
-      return data->get<bool>();
-    } else if (data->is_number()) {
-      return (*data != 0);
-    } else if (data->is_null()) {
-      return false;
+  /// Returns the included or extended template through its link, so that its name is only looked up in the storage if
+  /// it was not loaded at the time of linking
+  std::shared_ptr<const Template> find_linked(const TemplateLinks::Target* link, const std::string& name) {
+    if (link) {
+      if (auto target = link->tmpl.lock()) {
+        return target;
+      }
     }
-    return !data->empty();
+    return template_storage.find(name);
   }
 
-  void print_data(const std::shared_ptr<json>& value) {
-    if (value->is_string()) {
-      if (config.html_autoescape) {
-        *output_stream << htmlescape(value->get_ref<const json::string_t&>());
+  void visit(const IncludeStatementNode& node) override {
+    const auto link = find_link(node.link_index);
+    const auto included_template = find_linked(link, node.file);
+    if (!included_template) {
+      if (config.throw_at_missing_includes) {
+        throw_renderer_error("include '" + node.file + "' not found", node);
+      }
+      return;
+    }
+
+    // Small templates that only read the data are rendered like a part of the current template, which is unaffected by
+    // an extends statement of the current template like a renderer of its own
+    const bool is_linked = link && link->tmpl.lock() == included_template;
+    if (is_linked && config.include_inline_threshold > 0 && link->inline_size <= config.include_inline_threshold) {
+      const Template* old_template = current_template;
+      const bool old_break_rendering = std::exchange(break_rendering, false);
+      current_template = included_template.get();
+      if (current_template->program) {
+        execute(*current_template->program, 0);
       } else {
-        *output_stream << value->get_ref<const json::string_t&>();
+        current_template->root.accept(*this);
       }
-    } else if (value->is_number_unsigned()) {
-      *output_stream << value->get<const json::number_unsigned_t>();
-    } else if (value->is_number_integer()) {
-      *output_stream << value->get<const json::number_integer_t>();
-    } else if (value->is_null()) {
-    } else {
-      *output_stream << value->dump();
+      current_template = old_template;
+      break_rendering = old_break_rendering;
+      return;
     }
+
+    auto sub_renderer = Renderer(*this, is_linked && link->is_read_only);
+    sub_renderer.render_to(*output_stream, *included_template, *data_input);
   }
 
-  const std::shared_ptr<json> eval_expression_list(const ExpressionListNode& expression_list) {
-    if (!expression_list.root) {
-      throw_renderer_error("empty expression", expression_list);
+  void visit(const ExtendsStatementNode& node) override {
+    const auto parent_template = find_linked(find_link(node.link_index), node.file);
+    if (parent_template) {
+      // The statements that might still follow, e.g. in a loop, belong to this template and are linked by it
+      const Template* old_template = current_template;
+      const size_t old_level = current_level;
+      parent_templates.emplace_back(parent_template);
+      render_to(*output_stream, *parent_template, *data_input);
+      current_template = old_template;
+      current_level = old_level;
+      break_rendering = true;
+    } else if (config.throw_at_missing_includes) {
+      throw_renderer_error("extends '" + node.file + "' not found", node);
     }
+  }
 
-    expression_list.root->accept(*this);
+  /// Returns the blocks of the inheritance chain, which only needs to be linked again after following an extends statement
+  const BlockTable& linked_blocks() {
+    if (!blocks || blocks->parents.size() != parent_templates.size()) {
+      blocks = template_stack.front()->link_blocks(parent_templates);
+    }
+    return *blocks;
+  }
 
-    if (data_eval_stack.empty()) {
-      throw_renderer_error("empty expression", expression_list);
-    } else if (data_eval_stack.size() != 1) {
-      throw_renderer_error("malformed expression", expression_list);
+  void visit(const BlockStatementNode& node) override {
+    // Blocks are rendered as implemented by the rendered template, and blocks it does not implement are left empty
+    const auto& table = linked_blocks();
+    const size_t slot = table.slots[current_level][node.index];
+    if (table.implementations[slot][0] != nullptr) {
+      render_block(slot, 0);
     }
+  }
 
-    const auto result = data_eval_stack.top();
-    data_eval_stack.pop();
+  void visit(const SetStatementNode& node) override {
+    const size_t tmp_size = data_tmp_stack.size();
+    assign(node, *eval_expression_list(node.expression));
+    release_temporaries(tmp_size);
+  }
 
-    if (result == nullptr) {
-      if (not_found_stack.empty()) {
-        throw_renderer_error("expression could not be evaluated", expression_list);
+  void assign(const SetStatementNode& node, const json& value) {
+    json copy = value; // The value may alias the additional data that is modified
+
+    // Assigning to a loop variable replaces its binding by a copy in the additional data until the next iteration
+    const auto& head = node.head;
+    bool is_rebound = false;
+    for (auto scope = loop_scopes.rbegin(); scope != loop_scopes.rend(); ++scope) {
+      if (const auto variable = scope->find(head)) {
+        is_rebound = true;
+        json& replacement = additional_data[head];
+        if (&replacement != variable) {
+          replacement = *variable;
+        }
+        if (*scope->value_name == head) {
+          scope->value = &replacement;
+        } else {
+          scope->assigned_key = &replacement;
+        }
+        scope->is_assigned = true;
+        break;
       }
+    }
 
-      const auto node = not_found_stack.top();
-      not_found_stack.pop();
-
-      throw_renderer_error("variable '" + static_cast<std::string>(node->name) + "' not found", *node);
+    // Assigning to the loop object changes the one of the innermost loop until the next iteration
+    if (!is_rebound && head == "loop" && !loop_scopes.empty()) {
+      loop_metadata(loop_scopes.size() - 1);
+      loop_scopes.back().metadata[json::json_pointer(node.ptr.to_string().substr(head.size() + 1))] = copy;
     }
-    return std::make_shared<json>(*result);
+
+    additional_data[node.ptr] = std::move(copy);
+    data_generation += 1;
   }
 
-  void throw_renderer_error(const std::string& message, const AstNode& node) {
-    const SourceLocation loc = get_source_location(current_template->content, node.pos);
-    INJA_THROW(RenderError(message, loc));
+  void begin_loop(const json& values, const std::string* key_name, const std::string& value_name) {
+    loop_scopes.push_back({key_name, &value_name, key_name ? json(json::string_t()) : json(), nullptr, nullptr, false, 0, values.size(), json(), std::string::npos});
   }
 
-  void make_result(const json&& result) {
-    auto result_ptr = std::make_shared<json>(result);
-    data_tmp_stack.push_back(result_ptr);
-    data_eval_stack.push(result_ptr.get());
+  void end_loop() {
+    loop_scopes.pop_back();
   }
 
-  template <size_t N, size_t N_start = 0, bool throw_not_found = true> std::array<const json*, N> get_arguments(const FunctionNode& node) {
-    if (node.arguments.size() < N_start + N) {
-      throw_renderer_error("function needs " + std::to_string(N_start + N) + " variables, but has only found " + std::to_string(node.arguments.size()), node);
+  void bind_loop_variables(json::const_iterator it, size_t index) {
+    auto& scope = loop_scopes.back();
+    if (scope.key_name) {
+      scope.key.get_ref<json::string_t&>() = it.key(); // Reuses the capacity of the key
     }
+    scope.value = &it.value();
+    scope.assigned_key = nullptr;
+    scope.is_assigned = false;
+    scope.index = index;
+  }
 
-    for (size_t i = N_start; i < N_start + N; i += 1) {
-      node.arguments[i]->accept(*this);
+  const json& loop_metadata(size_t level) {
+    auto& scope = loop_scopes[level];
+    if (scope.metadata_index != scope.index) {
+      json metadata;
+      metadata["index"] = scope.index;
+      metadata["index1"] = scope.index + 1;
+      metadata["is_first"] = (scope.index == 0);
+      metadata["is_last"] = (scope.index == scope.size - 1);
+      if (level > 0) {
+        metadata["parent"] = loop_metadata(level - 1);
+      }
+      scope.metadata = std::move(metadata);
+      scope.metadata_index = scope.index;
     }
+    return scope.metadata;
+  }
 
-    if (data_eval_stack.size() < N) {
-      throw_renderer_error("function needs " + std::to_string(N) + " variables, but has only found " + std::to_string(data_eval_stack.size()), node);
+  /// Renders the implementation of the block slot in the template of the given level of the inheritance chain
+  void render_block(size_t slot, size_t level) {
+    const BlockStatementNode& node = *blocks->implementations[slot][level];
+    const Template* old_template = current_template;
+    const size_t old_level = current_level;
+    current_template = template_stack[level];
+    current_level = level;
+    block_slot_stack.emplace_back(slot);
+
+    const auto& program = current_template->program;
+    if (program && node.index < program->block_entries.size() && program->block_entries[node.index] != std::string::npos) {
+      execute(*program, program->block_entries[node.index]);
+    } else {
+      node.block.accept(*this);
     }
 
-    std::array<const json*, N> result;
-    for (size_t i = 0; i < N; i += 1) {
-      result[N - i - 1] = data_eval_stack.top();
-      data_eval_stack.pop();
+    block_slot_stack.pop_back();
+    current_level = old_level;
+    current_template = old_template;
+  }
 
-      if (!result[N - i - 1]) {
-        const auto data_node = not_found_stack.top();
-        not_found_stack.pop();
+  void execute(const Program& program, size_t pc) {
+    using Opcode = Instruction::Opcode;
 
-        if (throw_not_found) {
-          throw_renderer_error("variable '" + static_cast<std::string>(data_node->name) + "' not found", *data_node);
-        }
-      }
-    }
-    return result;
-  }
+    // The loops of this program, on top of those of enclosing programs
+    const size_t loop_base = loop_states.size();
+    const Instruction* const code = program.instructions.data();
 
-  template <bool throw_not_found = true> Arguments get_argument_vector(const FunctionNode& node) {
-    const size_t N = node.arguments.size();
-    for (const auto& a : node.arguments) {
-      a->accept(*this);
-    }
+    // Temporaries are released after each statement, down to those of the innermost loop
+    const size_t tmp_base = data_tmp_stack.size();
+    const auto release_statement_temporaries = [&]() {
+      release_temporaries((loop_states.size() > loop_base) ? loop_states.back().tmp_size : tmp_base);
+    };
 
-    if (data_eval_stack.size() < N) {
-      throw_renderer_error("function needs " + std::to_string(N) + " variables, but has only found " + std::to_string(data_eval_stack.size()), node);
-    }
+    for (;;) {
+      const Instruction& instruction = code[pc];
+      ++pc;
 
-    Arguments result {N};
-    for (size_t i = 0; i < N; i += 1) {
-      result[N - i - 1] = data_eval_stack.top();
-      data_eval_stack.pop();
+      switch (instruction.opcode) {
+      case Opcode::Text: {
+        const auto& node = static_cast<const TextNode&>(*instruction.node);
+        output_stream->write(current_template->content.c_str() + node.pos, node.length);
+      } break;
+      case Opcode::Push: {
+        data_eval_stack.push(&static_cast<const LiteralNode&>(*instruction.node).value);
+      } break;
+      case Opcode::Load: {
+        visit(static_cast<const DataNode&>(*instruction.node));
+      } break;
+      case Opcode::Call: {
+        arguments_on_stack = true;
+        visit(static_cast<const FunctionNode&>(*instruction.node));
+      } break;
+      case Opcode::AtId: {
+        const auto& node = static_cast<const FunctionNode&>(*instruction.node);
+        const auto id = data_eval_stack.top();
+        data_eval_stack.pop();
+        const DataNode* id_node = nullptr;
+        if (!id) {
+          id_node = not_found_stack.top();
+          not_found_stack.pop();
+        }
+        const auto container = pop_argument(node, false);
+        if (!id_node) {
+          throw_renderer_error("could not find element with given name", node);
+        }
+        data_eval_stack.push(&container->at(id_node->name));
+      } break;
+      case Opcode::And: {
+        if (!truthy(pop_argument(static_cast<const FunctionNode&>(*instruction.node)))) {
+          make_result(false);
+          pc = instruction.target;
+        }
+      } break;
+      case Opcode::Or: {
+        if (truthy(pop_argument(static_cast<const FunctionNode&>(*instruction.node)))) {
+          make_result(true);
+          pc = instruction.target;
+        }
+      } break;
+      case Opcode::Truthy: {
+        make_result(truthy(pop_argument(static_cast<const FunctionNode&>(*instruction.node))));
+      } break;
+      case Opcode::Default: {
+        const auto test_arg = pop_argument(static_cast<const FunctionNode&>(*instruction.node), false);
+        if (test_arg != nullptr) {
+          data_eval_stack.push(test_arg);
+          pc = instruction.target;
+        }
+      } break;
+      case Opcode::Require: {
+        data_eval_stack.push(pop_argument(static_cast<const FunctionNode&>(*instruction.node)));
+      } break;
+      case Opcode::Empty: {
+        throw_renderer_error("empty expression", *instruction.node);
+      } break;
+      case Opcode::Print: {
+        print_data(*pop_expression_result(static_cast<const ExpressionListNode&>(*instruction.node)));
+        release_statement_temporaries();
+      } break;
+      case Opcode::JumpIfFalse: {
+        const bool condition = truthy(pop_expression_result(static_cast<const ExpressionListNode&>(*instruction.node)));
+        release_statement_temporaries();
+        if (!condition) {
+          pc = instruction.target;
+        }
+      } break;
+      case Opcode::Jump: {
+        pc = instruction.target;
+      } break;
+      case Opcode::ForArray:
+      case Opcode::ForObject: {
+        const auto& node = static_cast<const ForStatementNode&>(*instruction.node);
+        const auto result = pop_loop_values(node);
+        if (instruction.opcode == Opcode::ForArray) {
+          if (!result->is_array()) {
+            throw_renderer_error("object must be an array", node);
+          }
+          begin_loop(*result, nullptr, static_cast<const ForArrayStatementNode&>(node).value);
+        } else {
+          if (!result->is_object()) {
+            throw_renderer_error("object must be an object", node);
+          }
+          begin_loop(*result, &static_cast<const ForObjectStatementNode&>(node).key, static_cast<const ForObjectStatementNode&>(node).value);
+        }
 
-      if (!result[N - i - 1]) {
-        const auto data_node = not_found_stack.top();
-        not_found_stack.pop();
+        if (result->empty()) {
+          end_loop();
+          release_statement_temporaries();
+          pc = instruction.target;
+          break;
+        }
 
-        if (throw_not_found) {
-          throw_renderer_error("variable '" + static_cast<std::string>(data_node->name) + "' not found", *data_node);
+        loop_states.push_back({result, result->begin(), 0, data_tmp_stack.size()});
+        bind_loop_variables(loop_states.back().it, 0);
+      } break;
+      case Opcode::LoopNext: {
+        auto& state = loop_states.back();
+        ++state.it;
+        ++state.index;
+        if (state.it != state.values->end()) {
+          bind_loop_variables(state.it, state.index);
+          pc = instruction.target;
+        } else {
+          end_loop();
+          loop_states.pop_back();
+          release_statement_temporaries();
+        }
+      } break;
+      case Opcode::Set: {
+        const auto& node = static_cast<const SetStatementNode&>(*instruction.node);
+        assign(node, *pop_expression_result(node.expression));
+        release_statement_temporaries();
+      } break;
+      case Opcode::Include: {
+        visit(static_cast<const IncludeStatementNode&>(*instruction.node));
+      } break;
+      case Opcode::Extends: {
+        visit(static_cast<const ExtendsStatementNode&>(*instruction.node));
+      } break;
+      case Opcode::Break: {
+        if (break_rendering) {
+          pc = instruction.target;
         }
+      } break;
+      case Opcode::Block: {
+        visit(static_cast<const BlockStatementNode&>(*instruction.node));
+      } break;
+      case Opcode::Return:
+        return;
       }
     }
-    return result;
   }
 
-  void visit(const BlockNode& node) override {
-    for (const auto& n : node.nodes) {
-      n->accept(*this);
-
-      if (break_rendering) {
-        break;
-      }
+  /// Renderer of an included template, which reads the set variables and loop frames of the including renderer instead
+  /// of copying them if the template does not assign variables
+  explicit Renderer(Renderer& parent, bool share_scope)
+      : config(parent.config), template_storage(parent.template_storage), function_storage(parent.function_storage),
+        context(parent.context.get_include_context()), data_tmp_stack(parent.data_tmp_stack), data_eval_stack(parent.data_eval_stack),
+        not_found_stack(parent.not_found_stack), loop_scopes(share_scope ? parent.loop_scopes : context.loop_scopes) {
+#ifdef INJA_HAS_MEMORY_RESOURCE
+    arena = parent.arena;
+#endif
+    static_input = parent.static_input;
+    if (share_scope) {
+      additional_data_view = parent.additional_data_view;
+    } else {
+      additional_data = *parent.additional_data_view;
+      context.loop_scopes = parent.loop_scopes;
     }
   }
 
-  void visit(const TextNode& node) override {
-    output_stream->write(current_template->content.c_str() + node.pos, node.length);
+public:
+  explicit Renderer(const RenderConfig& config, const TemplateStorage& template_storage, const FunctionStorage& function_storage)
+      : config(config), template_storage(template_storage), function_storage(function_storage), context(own_context) {}
+
+  /// Renderer that keeps its bookkeeping in the given context, which is reset
+  explicit Renderer(const RenderConfig& config, const TemplateStorage& template_storage, const FunctionStorage& function_storage,
+                    RenderContext& context)
+      : config(config), template_storage(template_storage), function_storage(function_storage), context(context) {
+    context.reset();
+#ifdef INJA_HAS_MEMORY_RESOURCE
+    arena = context.get_arena();
+#endif
   }
 
-  void visit(const ExpressionNode&) override {}
+  /// Writes the value in the same way as an expression in the template
+  void print_to(std::ostream& os, const json& value) {
+    output_stream = &os;
+    print_data(value);
+  }
 
-  void visit(const LiteralNode& node) override {
-    data_eval_stack.push(&node.value);
+  /// Evaluates an expression that does not depend on any data, e.g. for constant folding
+  json evaluate_constant(const Template& tmpl, const ExpressionListNode& expression) {
+    static const json empty_data;
+    current_template = &tmpl;
+    data_input = &empty_data;
+    template_stack.emplace_back(current_template);
+
+    json result = *eval_expression_list(expression);
+    template_stack.pop_back();
+    data_tmp_stack.clear();
+    return result;
   }
 
-  void visit(const DataNode& node) override {
-    if (additional_data.contains(node.ptr)) {
-      data_eval_stack.push(&(additional_data[node.ptr]));
-    } else if (data_input->contains(node.ptr)) {
-      data_eval_stack.push(&(*data_input)[node.ptr]);
-    } else {
-      // Try to evaluate as a no-argument callback
-      const auto function_data = function_storage.find_function(node.name, 0);
-      if (function_data.operation == FunctionStorage::Operation::Callback) {
-        Arguments empty_args {};
-        const auto value = std::make_shared<json>(function_data.callback(empty_args));
-        data_tmp_stack.push_back(value);
-        data_eval_stack.push(value.get());
-      } else {
-        data_eval_stack.push(nullptr);
-        not_found_stack.emplace(&node);
+  /// Returns whether the value is true as the condition of an if statement
+  static bool is_truthy(const json& value) {
+    return truthy(&value);
+  }
+
+  void render_to(std::ostream& os, const Template& tmpl, const json& data) {
+    output_stream = &os;
+    current_template = &tmpl;
+    data_input = &data;
+    if (tmpl.static_data) {
+      static_input = tmpl.static_data.get();
+    }
+    data_generation += 1;
+
+    // Temporaries of an including renderer might still be in use. The others are released even if rendering throws, as
+    // they might be allocated from the arena of the context
+    struct TemporariesGuard {
+      Renderer& renderer;
+      const size_t size;
+
+      ~TemporariesGuard() {
+        renderer.release_temporaries(size);
       }
+    } temporaries_guard {*this, data_tmp_stack.size()};
+
+    template_stack.emplace_back(current_template);
+    current_level = template_stack.size() - 1;
+
+    // An extends statement in a later iteration of a loop renders its parent while the rendering is already stopped,
+    // which needs the checks that templates without extends and block statements are compiled without
+    const auto& program = current_template->program;
+    if (program && (program->checks_breaks || !break_rendering)) {
+      execute(*program, 0);
+    } else {
+      current_template->root.accept(*this);
     }
   }
+};
 
-  void visit(const FunctionNode& node) override {
-    switch (node.operation) {
-    case Op::Not: {
-      const auto args = get_arguments<1>(node);
-      make_result(!truthy(args[0]));
-    } break;
-    case Op::And: {
-      make_result(truthy(get_arguments<1, 0>(node)[0]) && truthy(get_arguments<1, 1>(node)[0]));
-    } break;
-    case Op::Or: {
-      make_result(truthy(get_arguments<1, 0>(node)[0]) || truthy(get_arguments<1, 1>(node)[0]));
-    } break;
-    case Op::In: {
-      const auto args = get_arguments<2>(node);
-      make_result(std::find(args[1]->begin(), args[1]->end(), *args[0]) != args[1]->end());
-    } break;
-    case Op::Equal: {
-      const auto args = get_arguments<2>(node);
-      make_result(*args[0] == *args[1]);
-    } break;
-    case Op::NotEqual: {
-      const auto args = get_arguments<2>(node);
-      make_result(*args[0] != *args[1]);
-    } break;
-    case Op::Greater: {
-      const auto args = get_arguments<2>(node);
-      make_result(*args[0] > *args[1]);
-    } break;
-    case Op::GreaterEqual: {
-      const auto args = get_arguments<2>(node);
-      make_result(*args[0] >= *args[1]);
-    } break;
-    case Op::Less: {
-      const auto args = get_arguments<2>(node);
-      make_result(*args[0] < *args[1]);
-    } break;
-    case Op::LessEqual: {
-      const auto args = get_arguments<2>(node);
-      make_result(*args[0] <= *args[1]);
-    } break;
-    case Op::Add: {
-      const auto args = get_arguments<2>(node);
-      if (args[0]->is_string() && args[1]->is_string()) {
-        make_result(args[0]->get_ref<const json::string_t&>() + args[1]->get_ref<const json::string_t&>());
-      } else if (args[0]->is_number_integer() && args[1]->is_number_integer()) {
-        make_result(args[0]->get<const json::number_integer_t>() + args[1]->get<const json::number_integer_t>());
-      } else {
-        make_result(args[0]->get<const json::number_float_t>() + args[1]->get<const json::number_float_t>());
-      }
-    } break;
-    case Op::Subtract: {
-      const auto args = get_arguments<2>(node);
-      if (args[0]->is_number_integer() && args[1]->is_number_integer()) {
-        make_result(args[0]->get<const json::number_integer_t>() - args[1]->get<const json::number_integer_t>());
-      } else {
-        make_result(args[0]->get<const json::number_float_t>() - args[1]->get<const json::number_float_t>());
-      }
-    } break;
-    case Op::Multiplication: {
-      const auto args = get_arguments<2>(node);
-      if (args[0]->is_number_integer() && args[1]->is_number_integer()) {
-        make_result(args[0]->get<const json::number_integer_t>() * args[1]->get<const json::number_integer_t>());
-      } else {
-        make_result(args[0]->get<const json::number_float_t>() * args[1]->get<const json::number_float_t>());
+} // namespace inja
+
+#endif // INCLUDE_INJA_RENDERER_HPP_
+
+// #include "template.hpp"
+
+// #include "throw.hpp"
+
+
+namespace inja {
+
+/*!
+ * \brief Class for simplifying the AST of a parsed Template.
+ */
+class Optimizer {
+  using Op = FunctionStorage::Operation;
+
+  const ParserConfig& config;
+  const TemplateStorage& template_storage;
+  const FunctionStorage& function_storage;
+  const RenderConfig render_config;
+
+  Template* tmpl {nullptr};
+
+  static bool is_pure(Op operation) {
+    switch (operation) {
+    case Op::AtId:
+    case Op::Exists:
+    case Op::Super:
+    case Op::Callback:
+    case Op::None:
+      return false;
+    default:
+      return true;
+    }
+  }
+
+  bool merge_text() const {
+    return config.optimization_level >= 1;
+  }
+
+  bool fold_constants() const {
+    return config.optimization_level >= 2;
+  }
+
+  /// Replaces builtin function calls on literals by their result
+  void fold(ExpressionNode*& node) {
+    const auto function = dynamic_cast<FunctionNode*>(node);
+    if (!function) {
+      return;
+    }
+
+    bool is_constant = is_pure(function->operation);
+    for (auto& argument : function->arguments) {
+      fold(argument);
+      is_constant &= (dynamic_cast<const LiteralNode*>(argument) != nullptr);
+    }
+
+#if !defined(INJA_NOEXCEPTION)
+    if (is_constant) {
+      ExpressionListNode expression(function->pos);
+      expression.root = function;
+      try {
+        auto renderer = Renderer(render_config, template_storage, function_storage);
+        node = tmpl->arena->make<LiteralNode>(renderer.evaluate_constant(*tmpl, expression), function->pos);
+      } catch (...) {
+        // Keep the call, so that the error is thrown when rendering
       }
-    } break;
-    case Op::Division: {
-      const auto args = get_arguments<2>(node);
-      if (args[1]->get<const json::number_float_t>() == 0) {
-        throw_renderer_error("division by zero", node);
+    }
+#endif
+  }
+
+  void fold(ExpressionListNode& expression) {
+    if (fold_constants() && expression.root) {
+      fold(expression.root);
+    }
+  }
+
+  TextNode* merge(const TextNode& first, const TextNode& second) {
+    if (first.pos + first.length == second.pos) {
+      return tmpl->arena->make<TextNode>(first.pos, first.length + second.length);
+    }
+
+    // Otherwise the merged text is appended to the content of the template
+    auto& content = tmpl->content;
+    size_t pos = first.pos;
+    if (first.pos + first.length != content.size()) {
+      pos = content.size();
+      content += content.substr(first.pos, first.length);
+    }
+    content += content.substr(second.pos, second.length);
+    return tmpl->arena->make<TextNode>(pos, content.size() - pos);
+  }
+
+  void append(std::vector<AstNode*>& nodes, AstNode* node) {
+    const auto text = dynamic_cast<const TextNode*>(node);
+    if (merge_text() && text) {
+      if (text->length == 0) {
+        return;
       }
-      make_result(args[0]->get<const json::number_float_t>() / args[1]->get<const json::number_float_t>());
-    } break;
-    case Op::Power: {
-      const auto args = get_arguments<2>(node);
-      if (args[0]->is_number_integer() && args[1]->get<const json::number_integer_t>() >= 0) {
-        const auto result = static_cast<json::number_integer_t>(std::pow(args[0]->get<const json::number_integer_t>(), args[1]->get<const json::number_integer_t>()));
-        make_result(result);
-      } else {
-        const auto result = std::pow(args[0]->get<const json::number_float_t>(), args[1]->get<const json::number_integer_t>());
-        make_result(result);
+
+      const auto previous = nodes.empty() ? nullptr : dynamic_cast<const TextNode*>(nodes.back());
+      if (previous) {
+        nodes.back() = merge(*previous, *text);
+        return;
       }
-    } break;
-    case Op::Modulo: {
-      const auto args = get_arguments<2>(node);
-      make_result(args[0]->get<const json::number_integer_t>() % args[1]->get<const json::number_integer_t>());
-    } break;
-    case Op::AtId: {
-      const auto container = get_arguments<1, 0, false>(node)[0];
-      node.arguments[1]->accept(*this);
-      if (not_found_stack.empty()) {
-        throw_renderer_error("could not find element with given name", node);
+    }
+    nodes.emplace_back(node);
+  }
+
+  void optimize(BlockNode& block) {
+    std::vector<AstNode*> nodes;
+    nodes.reserve(block.nodes.size());
+
+    for (const auto node : block.nodes) {
+      if (const auto if_statement = dynamic_cast<IfStatementNode*>(node)) {
+        fold(if_statement->condition);
+        optimize(if_statement->true_statement);
+        optimize(if_statement->false_statement);
+
+        // Statically decided conditions are replaced by the taken branch
+        const auto condition = dynamic_cast<const LiteralNode*>(if_statement->condition.root);
+        if (fold_constants() && condition) {
+          const auto& branch = Renderer::is_truthy(condition->value) ? if_statement->true_statement : if_statement->false_statement;
+          for (const auto branch_node : branch.nodes) {
+            append(nodes, branch_node);
+          }
+          continue;
+        }
+
+      } else if (const auto for_statement = dynamic_cast<ForStatementNode*>(node)) {
+        fold(for_statement->condition);
+        optimize(for_statement->body);
+
+      } else if (const auto block_statement = dynamic_cast<BlockStatementNode*>(node)) {
+        optimize(block_statement->block);
+
+      } else if (const auto set_statement = dynamic_cast<SetStatementNode*>(node)) {
+        fold(set_statement->expression);
+
+      } else if (const auto expression = dynamic_cast<ExpressionListNode*>(node)) {
+        fold(*expression);
       }
-      const auto id_node = not_found_stack.top();
-      not_found_stack.pop();
-      data_eval_stack.pop();
-      data_eval_stack.push(&container->at(id_node->name));
-    } break;
-    case Op::At: {
-      const auto args = get_arguments<2>(node);
-      if (args[0]->is_object()) {
-        data_eval_stack.push(&args[0]->at(args[1]->get<std::string>()));
-      } else {
-        data_eval_stack.push(&args[0]->at(args[1]->get<int>()));
+
+      append(nodes, node);
+    }
+
+    block.nodes = std::move(nodes);
+  }
+
+public:
+  explicit Optimizer(const ParserConfig& config, const TemplateStorage& template_storage, const FunctionStorage& function_storage)
+      : config(config), template_storage(template_storage), function_storage(function_storage) {}
+
+  /// Folds the constant parts of a single expression of the template
+  void fold(Template& tmpl, ExpressionListNode& expression) {
+    this->tmpl = &tmpl;
+    fold(expression);
+    this->tmpl = nullptr;
+  }
+
+  /// Optimizes the template in place according to the optimization level of the config
+  void optimize(Template& tmpl) {
+    if (config.optimization_level == 0) {
+      return;
+    }
+
+    this->tmpl = &tmpl;
+    optimize(tmpl.root);
+    this->tmpl = nullptr;
+  }
+};
+
+} // namespace inja
+
+#endif // INCLUDE_INJA_OPTIMIZER_HPP_
+
+// #include "template.hpp"
+
+// #include "throw.hpp"
+
+// #include "token.hpp"
+
+
+namespace inja {
+
+/*!
+ * \brief Class for parsing an inja Template.
+ */
+class Parser {
+  using Arguments = std::vector<ExpressionNode*>;
+  using OperatorStack = std::stack<FunctionNode*>;
+
+  const ParserConfig& config;
+
+  Lexer lexer;
+  TemplateStorage& template_storage;
+  const FunctionStorage& function_storage;
+
+  /// An included template that is not in the storage yet
+  struct IncludeRequest {
+    std::filesystem::path path; // Directory of the including template
+    std::string original_name;
+    std::string name; // Name in the template storage
+    bool found_file;
+  };
+
+  struct LoadedInclude {
+    Template tmpl;
+    std::vector<IncludeRequest> include_requests;
+    bool from_callback {false};
+  };
+
+  std::string template_name; // Name of the template parsed by this parser
+  std::vector<IncludeRequest> include_requests;
+
+  Token tok, peek_tok;
+  bool have_peek_tok {false};
+
+  std::string_view literal_start;
+
+  BlockNode* current_block {nullptr};
+  ExpressionListNode* current_expression_list {nullptr};
+
+  std::stack<IfStatementNode*> if_statement_stack;
+  std::stack<ForStatementNode*> for_statement_stack;
+  std::stack<BlockStatementNode*> block_statement_stack;
+
+  // Loop variables that are lexically visible, innermost last. Block bodies may be rendered outside of the
+  // loops around them, so each block starts a new, empty range of visible loops.
+  std::vector<const ForStatementNode*> loop_binding_stack;
+  std::stack<size_t> loop_binding_boundaries;
+
+  /// Binds the variable to the innermost enclosing loop of the same name, so that the renderer finds its frame directly
+  void resolve_scope(DataNode& node) const {
+    const size_t boundary = loop_binding_boundaries.empty() ? 0 : loop_binding_boundaries.top();
+    for (size_t i = loop_binding_stack.size(); i > boundary; --i) {
+      const ForStatementNode* loop = loop_binding_stack[i - 1];
+      const std::string* variable = loop->find_variable(node.head);
+      if (variable) {
+        node.scope = DataNode::Scope::Loop;
+        node.loop_variable = variable;
+        node.loop_depth = loop_binding_stack.size() - i;
+        node.is_loop_metadata = false;
+        return;
       }
-    } break;
-    case Op::Capitalize: {
-      auto result = get_arguments<1>(node)[0]->get<json::string_t>();
-      result[0] = static_cast<char>(::toupper(result[0]));
-      std::transform(result.begin() + 1, result.end(), result.begin() + 1, [](char c) { return static_cast<char>(::tolower(c)); });
-      make_result(std::move(result));
-    } break;
-    case Op::Default: {
-      const auto test_arg = get_arguments<1, 0, false>(node)[0];
-      data_eval_stack.push((test_arg != nullptr) ? test_arg : get_arguments<1, 1>(node)[0]);
-    } break;
-    case Op::DivisibleBy: {
-      const auto args = get_arguments<2>(node);
-      const auto divisor = args[1]->get<const json::number_integer_t>();
-      make_result((divisor != 0) && (args[0]->get<const json::number_integer_t>() % divisor == 0));
-    } break;
-    case Op::Even: {
-      make_result(get_arguments<1>(node)[0]->get<const json::number_integer_t>() % 2 == 0);
-    } break;
-    case Op::Exists: {
-      auto&& name = get_arguments<1>(node)[0]->get_ref<const json::string_t&>();
-      make_result(data_input->contains(json::json_pointer(DataNode::convert_dot_to_ptr(name))));
-    } break;
-    case Op::ExistsInObject: {
-      const auto args = get_arguments<2>(node);
-      auto&& name = args[1]->get_ref<const json::string_t&>();
-      make_result(args[0]->find(name) != args[0]->end());
-    } break;
-    case Op::First: {
-      const auto result = &get_arguments<1>(node)[0]->front();
-      data_eval_stack.push(result);
-    } break;
-    case Op::Float: {
-      make_result(std::stod(get_arguments<1>(node)[0]->get_ref<const json::string_t&>()));
-    } break;
-    case Op::Int: {
-      make_result(std::stoi(get_arguments<1>(node)[0]->get_ref<const json::string_t&>()));
-    } break;
-    case Op::Last: {
-      const auto result = &get_arguments<1>(node)[0]->back();
-      data_eval_stack.push(result);
-    } break;
-    case Op::Length: {
-      const auto val = get_arguments<1>(node)[0];
-      if (val->is_string()) {
-        make_result(val->get_ref<const json::string_t&>().length());
+    }
+  }
+
+  void throw_parser_error(const std::string& message) const {
+    INJA_THROW(ParserError(message, lexer.current_position()));
+  }
+
+  void get_next_token() {
+    if (have_peek_tok) {
+      tok = peek_tok;
+      have_peek_tok = false;
+    } else {
+      tok = lexer.scan();
+    }
+  }
+
+  void get_peek_token() {
+    if (!have_peek_tok) {
+      peek_tok = lexer.scan();
+      have_peek_tok = true;
+    }
+  }
+
+  void add_literal(Template& tmpl, Arguments& arguments) {
+    const std::string_view data_text(literal_start.data(), tok.text.data() - literal_start.data() + tok.text.size());
+    arguments.emplace_back(tmpl.arena->make<LiteralNode>(data_text, data_text.data() - tmpl.content.c_str()));
+  }
+
+  void add_operator(Arguments &arguments, OperatorStack &operator_stack) {
+    auto function = operator_stack.top();
+    operator_stack.pop();
+
+    if (static_cast<int>(arguments.size()) < function->number_args) {
+      throw_parser_error("too few arguments");
+    }
+
+    for (int i = 0; i < function->number_args; ++i) {
+      function->arguments.insert(function->arguments.begin(), arguments.back());
+      arguments.pop_back();
+    }
+    arguments.emplace_back(function);
+  }
+
+  /// Resolves the name of an included template, and queues it for loading if it is not in the storage yet
+  void add_to_template_storage(const std::filesystem::path& path, std::string& template_name) {
+    if (template_storage.contains(template_name)) {
+      return;
+    }
+
+    const std::string original_name = template_name;
+
+    bool found_file {false};
+    if (config.search_included_templates_in_files) {
+      // Templates from the include callback are named by the relative path as well
+      const std::string file = config.include_resolver->resolve(path, original_name);
+      found_file = !file.empty();
+      template_name = found_file ? file : storage_name(path / original_name);
+      if (template_storage.contains(template_name)) {
+        return;
+      }
+    } else if (!config.include_callback && !config.batch_include_callback) {
+      return;
+    }
+
+    include_requests.push_back({path, original_name, template_name, found_file});
+  }
+
+  /// Calls the function for all indices on up to the given number of threads, or one per core for 0, and rethrows the
+  /// first error
+  template <class F> static void for_each_concurrently(size_t size, size_t thread_count, const F& function) {
+#if !defined(INJA_NOEXCEPTION)
+    std::vector<std::exception_ptr> errors(size);
+#endif
+    std::atomic<size_t> next {0};
+    const auto work = [&]() {
+      for (size_t i = next++; i < size; i = next++) {
+#if !defined(INJA_NOEXCEPTION)
+        try {
+          function(i);
+        } catch (...) {
+          errors[i] = std::current_exception();
+        }
+#else
+        function(i);
+#endif
+      }
+    };
+
+    if (thread_count == 0) {
+      thread_count = std::max(std::thread::hardware_concurrency(), 1u);
+    }
+    std::vector<std::thread> threads;
+    for (size_t t = 1; t < std::min(thread_count, size); ++t) {
+      threads.emplace_back(work);
+    }
+    work();
+    for (auto& thread : threads) {
+      thread.join();
+    }
+
+#if !defined(INJA_NOEXCEPTION)
+    for (const auto& error : errors) {
+      if (error) {
+        std::rethrow_exception(error);
+      }
+    }
+#endif
+  }
+
+  /// Loads the templates of one level of the include graph, where files are read and parsed concurrently if configured
+  std::vector<LoadedInclude> load_level(const std::vector<IncludeRequest>& requests) const {
+    std::vector<LoadedInclude> result(requests.size());
+    for_each_concurrently(requests.size(), config.include_parse_threads, [&](size_t i) {
+      const auto& request = requests[i];
+      std::ifstream file;
+      if (request.found_file) {
+        file.open(request.name);
+      }
+      if (!file.is_open() || file.fail()) {
+        result[i].from_callback = true;
+        return;
+      }
+
+      result[i].tmpl = Template(std::string(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>()));
+      auto parser = Parser(config, lexer.get_config(), template_storage, function_storage);
+      parser.template_name = request.name;
+      parser.parse_into(result[i].tmpl, std::filesystem::path(request.name).parent_path());
+      parser.finish(result[i].tmpl);
+      result[i].include_requests = std::move(parser.include_requests);
+    });
+
+    std::vector<size_t> missing;
+    for (size_t i = 0; i < requests.size(); ++i) {
+      if (result[i].from_callback) {
+        missing.emplace_back(i);
+      }
+    }
+    if (missing.empty()) {
+      return result;
+    }
+
+    if (config.batch_include_callback) {
+      std::vector<std::pair<std::filesystem::path, std::string>> batch;
+      for (const auto i : missing) {
+        batch.emplace_back(requests[i].path, requests[i].original_name);
+      }
+      auto templates = config.batch_include_callback(batch);
+      if (templates.size() != missing.size()) {
+        INJA_THROW(FileError("include callback returned " + std::to_string(templates.size()) + " templates for " + std::to_string(missing.size()) +
+                             " includes"));
+      }
+      for (size_t j = 0; j < missing.size(); ++j) {
+        result[missing[j]].tmpl = std::move(templates[j]);
+      }
+    } else if (config.include_callback) {
+      for (const auto i : missing) {
+        result[i].tmpl = config.include_callback(requests[i].path, requests[i].original_name);
+      }
+    } else {
+      INJA_THROW(FileError("failed accessing file at '" + requests[missing.front()].name + "'"));
+    }
+    return result;
+  }
+
+  /// Loads all missing templates included by the parsed template level by level, so that the latency grows with the
+  /// depth of the include graph. They are registered at the end, so that other threads never see a partial template.
+  void load_includes() {
+    std::set<std::string> queued {storage_name(template_name)};
+    std::vector<IncludeRequest> level;
+    const auto enqueue = [&](std::vector<IncludeRequest>& requests) {
+      for (auto& request : requests) {
+        if (queued.insert(request.name).second) {
+          level.emplace_back(std::move(request));
+        }
+      }
+      requests.clear();
+    };
+    enqueue(include_requests);
+
+    std::vector<std::pair<std::string, Template>> loaded;
+    while (!level.empty()) {
+      const auto requests = std::move(level);
+      level.clear();
+
+      auto results = load_level(requests);
+      for (size_t i = 0; i < requests.size(); ++i) {
+        enqueue(results[i].include_requests);
+        loaded.emplace_back(requests[i].name, std::move(results[i].tmpl));
+      }
+    }
+
+    // The deepest includes first
+    for (auto it = loaded.rbegin(); it != loaded.rend(); ++it) {
+      template_storage.emplace(it->first, std::move(it->second));
+    }
+  }
+
+  /// Pre-compiles a string literal argument such as in exists("user.name") into a path
+  void add_literal_path(Template& tmpl, FunctionNode& func) const {
+    const auto literal = dynamic_cast<const LiteralNode*>(func.arguments[0]);
+    if (literal && literal->value.is_string()) {
+      func.literal_path = tmpl.arena->make<DataNode>(literal->value.get_ref<const json::string_t&>(), literal->pos);
+    }
+  }
+
+  std::string parse_filename() const {
+    if (tok.kind != Token::Kind::String) {
+      throw_parser_error("expected string, got '" + tok.describe() + "'");
+    }
+
+    if (tok.text.length() < 2) {
+      throw_parser_error("expected filename, got '" + static_cast<std::string>(tok.text) + "'");
+    }
+
+    // Remove first and last character ""
+    return std::string {tok.text.substr(1, tok.text.length() - 2)};
+  }
+
+  bool parse_expression(Template& tmpl, Token::Kind closing) {
+    current_expression_list->root = parse_expression(tmpl);
+    return tok.kind == closing;
+  }
+
+  ExpressionNode* parse_expression(Template& tmpl) {
+    size_t current_bracket_level {0};
+    size_t current_brace_level {0};
+    Arguments arguments;
+    OperatorStack operator_stack;
+
+    while (tok.kind != Token::Kind::Eof) {
+      // Literals
+      switch (tok.kind) {
+      case Token::Kind::String: {
+        if (current_brace_level == 0 && current_bracket_level == 0) {
+          literal_start = tok.text;
+          add_literal(tmpl, arguments);
+        }
+      } break;
+      case Token::Kind::Number: {
+        if (current_brace_level == 0 && current_bracket_level == 0) {
+          literal_start = tok.text;
+          add_literal(tmpl, arguments);
+        }
+      } break;
+      case Token::Kind::LeftBracket: {
+        if (current_brace_level == 0 && current_bracket_level == 0) {
+          literal_start = tok.text;
+        }
+        current_bracket_level += 1;
+      } break;
+      case Token::Kind::LeftBrace: {
+        if (current_brace_level == 0 && current_bracket_level == 0) {
+          literal_start = tok.text;
+        }
+        current_brace_level += 1;
+      } break;
+      case Token::Kind::RightBracket: {
+        if (current_bracket_level == 0) {
+          throw_parser_error("unexpected ']'");
+        }
+
+        current_bracket_level -= 1;
+        if (current_brace_level == 0 && current_bracket_level == 0) {
+          add_literal(tmpl, arguments);
+        }
+      } break;
+      case Token::Kind::RightBrace: {
+        if (current_brace_level == 0) {
+          throw_parser_error("unexpected '}'");
+        }
+
+        current_brace_level -= 1;
+        if (current_brace_level == 0 && current_bracket_level == 0) {
+          add_literal(tmpl, arguments);
+        }
+      } break;
+      case Token::Kind::Id: {
+        get_peek_token();
+
+        // Data Literal
+        if (tok.text == static_cast<decltype(tok.text)>("true") || tok.text == static_cast<decltype(tok.text)>("false") ||
+            tok.text == static_cast<decltype(tok.text)>("null")) {
+          if (current_brace_level == 0 && current_bracket_level == 0) {
+            literal_start = tok.text;
+            add_literal(tmpl, arguments);
+          }
+
+          // Operator
+        } else if (tok.text == "and" || tok.text == "or" || tok.text == "in" || tok.text == "not") {
+          goto parse_operator;
+
+          // Functions
+        } else if (peek_tok.kind == Token::Kind::LeftParen) {
+          auto func = tmpl.arena->make<FunctionNode>(tok.text, tok.text.data() - tmpl.content.c_str());
+          get_next_token();
+          do {
+            get_next_token();
+            auto expr = parse_expression(tmpl);
+            if (!expr) {
+              break;
+            }
+            func->number_args += 1;
+            func->arguments.emplace_back(expr);
+          } while (tok.kind == Token::Kind::Comma);
+          if (tok.kind != Token::Kind::RightParen) {
+            throw_parser_error("expected right parenthesis, got '" + tok.describe() + "'");
+          }
+
+          auto function_data = function_storage.find_function(func->name, func->number_args);
+          if (function_data.operation == FunctionStorage::Operation::None) {
+            throw_parser_error("unknown function " + func->name);
+          }
+          func->operation = function_data.operation;
+          if (function_data.operation == FunctionStorage::Operation::Callback) {
+            func->callback = function_data.callback;
+          } else if (function_data.operation == FunctionStorage::Operation::Exists) {
+            add_literal_path(tmpl, *func);
+          }
+          arguments.emplace_back(func);
+
+          // Variables
+        } else {
+          auto data_node = tmpl.arena->make<DataNode>(static_cast<std::string>(tok.text), tok.text.data() - tmpl.content.c_str());
+          resolve_scope(*data_node);
+          arguments.emplace_back(data_node);
+        }
+
+        // Operators
+      } break;
+      case Token::Kind::Equal:
+      case Token::Kind::NotEqual:
+      case Token::Kind::GreaterThan:
+      case Token::Kind::GreaterEqual:
+      case Token::Kind::LessThan:
+      case Token::Kind::LessEqual:
+      case Token::Kind::Plus:
+      case Token::Kind::Minus:
+      case Token::Kind::Times:
+      case Token::Kind::Slash:
+      case Token::Kind::Power:
+      case Token::Kind::Percent:
+      case Token::Kind::Dot: {
+
+      parse_operator:
+        FunctionStorage::Operation operation;
+        switch (tok.kind) {
+        case Token::Kind::Id: {
+          if (tok.text == "and") {
+            operation = FunctionStorage::Operation::And;
+          } else if (tok.text == "or") {
+            operation = FunctionStorage::Operation::Or;
+          } else if (tok.text == "in") {
+            operation = FunctionStorage::Operation::In;
+          } else if (tok.text == "not") {
+            operation = FunctionStorage::Operation::Not;
+          } else {
+            throw_parser_error("unknown operator in parser.");
+          }
+        } break;
+        case Token::Kind::Equal: {
+          operation = FunctionStorage::Operation::Equal;
+        } break;
+        case Token::Kind::NotEqual: {
+          operation = FunctionStorage::Operation::NotEqual;
+        } break;
+        case Token::Kind::GreaterThan: {
+          operation = FunctionStorage::Operation::Greater;
+        } break;
+        case Token::Kind::GreaterEqual: {
+          operation = FunctionStorage::Operation::GreaterEqual;
+        } break;
+        case Token::Kind::LessThan: {
+          operation = FunctionStorage::Operation::Less;
+        } break;
+        case Token::Kind::LessEqual: {
+          operation = FunctionStorage::Operation::LessEqual;
+        } break;
+        case Token::Kind::Plus: {
+          operation = FunctionStorage::Operation::Add;
+        } break;
+        case Token::Kind::Minus: {
+          operation = FunctionStorage::Operation::Subtract;
+        } break;
+        case Token::Kind::Times: {
+          operation = FunctionStorage::Operation::Multiplication;
+        } break;
+        case Token::Kind::Slash: {
+          operation = FunctionStorage::Operation::Division;
+        } break;
+        case Token::Kind::Power: {
+          operation = FunctionStorage::Operation::Power;
+        } break;
+        case Token::Kind::Percent: {
+          operation = FunctionStorage::Operation::Modulo;
+        } break;
+        case Token::Kind::Dot: {
+          operation = FunctionStorage::Operation::AtId;
+        } break;
+        default: {
+          throw_parser_error("unknown operator in parser.");
+        }
+        }
+        auto function_node = tmpl.arena->make<FunctionNode>(operation, tok.text.data() - tmpl.content.c_str());
+
+        while (!operator_stack.empty() &&
+               ((operator_stack.top()->precedence > function_node->precedence) ||
+                (operator_stack.top()->precedence == function_node->precedence && function_node->associativity == FunctionNode::Associativity::Left))) {
+          add_operator(arguments, operator_stack);
+        }
+
+        operator_stack.emplace(function_node);
+      } break;
+      case Token::Kind::Comma: {
+        if (current_brace_level == 0 && current_bracket_level == 0) {
+          goto break_loop;
+        }
+      } break;
+      case Token::Kind::Colon: {
+        if (current_brace_level == 0 && current_bracket_level == 0) {
+          throw_parser_error("unexpected ':'");
+        }
+      } break;
+      case Token::Kind::LeftParen: {
+        get_next_token();
+        auto expr = parse_expression(tmpl);
+        if (tok.kind != Token::Kind::RightParen) {
+            throw_parser_error("expected right parenthesis, got '" + tok.describe() + "'");
+        }
+        if (!expr) {
+          throw_parser_error("empty expression in parentheses");
+        }
+        arguments.emplace_back(expr);
+      } break;
+
+      // parse function call pipe syntax
+      case Token::Kind::Pipe: {
+        // get function name
+        get_next_token();
+        if (tok.kind != Token::Kind::Id) {
+          throw_parser_error("expected function name, got '" + tok.describe() + "'");
+        }
+        auto func = tmpl.arena->make<FunctionNode>(tok.text, tok.text.data() - tmpl.content.c_str());
+        // add first parameter as last value from arguments
+        func->number_args += 1;
+        func->arguments.emplace_back(arguments.back());
+        arguments.pop_back();
+        get_peek_token();
+        if (peek_tok.kind == Token::Kind::LeftParen) {
+          get_next_token();
+          // parse additional parameters
+          do {
+            get_next_token();
+            auto expr = parse_expression(tmpl);
+            if (!expr) {
+              break;
+            }
+            func->number_args += 1;
+            func->arguments.emplace_back(expr);
+          } while (tok.kind == Token::Kind::Comma);
+          if (tok.kind != Token::Kind::RightParen) {
+            throw_parser_error("expected right parenthesis, got '" + tok.describe() + "'");
+          }
+        }
+        // search store for defined function with such name and number of args
+        auto function_data = function_storage.find_function(func->name, func->number_args);
+        if (function_data.operation == FunctionStorage::Operation::None) {
+          throw_parser_error("unknown function " + func->name);
+        }
+        func->operation = function_data.operation;
+        if (function_data.operation == FunctionStorage::Operation::Callback) {
+          func->callback = function_data.callback;
+        }
+        arguments.emplace_back(func);
+      } break;
+      default:
+        goto break_loop;
+      }
+
+      get_next_token();
+    }
+
+  break_loop:
+    while (!operator_stack.empty()) {
+      add_operator(arguments, operator_stack);
+    }
+
+    ExpressionNode* expr {nullptr};
+    if (arguments.size() == 1) {
+      expr = arguments[0];
+      arguments = {};
+    } else if (arguments.size() > 1) {
+      throw_parser_error("malformed expression");
+    }
+    return expr;
+  }
+
+  bool parse_statement(Template& tmpl, Token::Kind closing, const std::filesystem::path& path) {
+    if (tok.kind != Token::Kind::Id) {
+      return false;
+    }
+
+    if (tok.text == static_cast<decltype(tok.text)>("if")) {
+      get_next_token();
+
+      auto if_statement_node = tmpl.arena->make<IfStatementNode>(current_block, tok.text.data() - tmpl.content.c_str());
+      current_block->nodes.emplace_back(if_statement_node);
+      if_statement_stack.emplace(if_statement_node);
+      current_block = &if_statement_node->true_statement;
+      current_expression_list = &if_statement_node->condition;
+
+      if (!parse_expression(tmpl, closing)) {
+        return false;
+      }
+    } else if (tok.text == static_cast<decltype(tok.text)>("else")) {
+      if (if_statement_stack.empty()) {
+        throw_parser_error("else without matching if");
+      }
+      auto& if_statement_data = if_statement_stack.top();
+      get_next_token();
+
+      if_statement_data->has_false_statement = true;
+      current_block = &if_statement_data->false_statement;
+
+      // Chained else if
+      if (tok.kind == Token::Kind::Id && tok.text == static_cast<decltype(tok.text)>("if")) {
+        get_next_token();
+
+        auto if_statement_node = tmpl.arena->make<IfStatementNode>(true, current_block, tok.text.data() - tmpl.content.c_str());
+        current_block->nodes.emplace_back(if_statement_node);
+        if_statement_stack.emplace(if_statement_node);
+        current_block = &if_statement_node->true_statement;
+        current_expression_list = &if_statement_node->condition;
+
+        if (!parse_expression(tmpl, closing)) {
+          return false;
+        }
+      }
+    } else if (tok.text == static_cast<decltype(tok.text)>("endif")) {
+      if (if_statement_stack.empty()) {
+        throw_parser_error("endif without matching if");
+      }
+
+      // Nested if statements
+      while (if_statement_stack.top()->is_nested) {
+        if_statement_stack.pop();
+      }
+
+      auto& if_statement_data = if_statement_stack.top();
+      get_next_token();
+
+      current_block = if_statement_data->parent;
+      if_statement_stack.pop();
+    } else if (tok.text == static_cast<decltype(tok.text)>("block")) {
+      get_next_token();
+
+      if (tok.kind != Token::Kind::Id) {
+        throw_parser_error("expected block name, got '" + tok.describe() + "'");
+      }
+
+      const std::string block_name = static_cast<std::string>(tok.text);
+
+      auto block_statement_node = tmpl.arena->make<BlockStatementNode>(current_block, block_name, tok.text.data() - tmpl.content.c_str());
+      current_block->nodes.emplace_back(block_statement_node);
+      block_statement_stack.emplace(block_statement_node);
+      loop_binding_boundaries.emplace(loop_binding_stack.size());
+      current_block = &block_statement_node->block;
+      if (!tmpl.add_block(block_statement_node)) {
+        throw_parser_error("block with the name '" + block_name + "' does already exist");
+      }
+
+      get_next_token();
+    } else if (tok.text == static_cast<decltype(tok.text)>("endblock")) {
+      if (block_statement_stack.empty()) {
+        throw_parser_error("endblock without matching block");
+      }
+
+      auto& block_statement_data = block_statement_stack.top();
+      get_next_token();
+
+      current_block = block_statement_data->parent;
+      block_statement_stack.pop();
+      loop_binding_boundaries.pop();
+    } else if (tok.text == static_cast<decltype(tok.text)>("for")) {
+      get_next_token();
+
+      // options: for a in arr; for a, b in obj
+      if (tok.kind != Token::Kind::Id) {
+        throw_parser_error("expected id, got '" + tok.describe() + "'");
+      }
+
+      Token value_token = tok;
+      get_next_token();
+
+      // Object type
+      ForStatementNode* for_statement_node;
+      if (tok.kind == Token::Kind::Comma) {
+        get_next_token();
+        if (tok.kind != Token::Kind::Id) {
+          throw_parser_error("expected id, got '" + tok.describe() + "'");
+        }
+
+        const Token key_token = value_token;
+        value_token = tok;
+        get_next_token();
+
+        for_statement_node = tmpl.arena->make<ForObjectStatementNode>(static_cast<std::string>(key_token.text), static_cast<std::string>(value_token.text),
+                                                                      current_block, tok.text.data() - tmpl.content.c_str());
+
+        // Array type
+      } else {
+        for_statement_node =
+            tmpl.arena->make<ForArrayStatementNode>(static_cast<std::string>(value_token.text), current_block, tok.text.data() - tmpl.content.c_str());
+      }
+
+      current_block->nodes.emplace_back(for_statement_node);
+      for_statement_stack.emplace(for_statement_node);
+      current_block = &for_statement_node->body;
+      current_expression_list = &for_statement_node->condition;
+
+      if (tok.kind != Token::Kind::Id || tok.text != static_cast<decltype(tok.text)>("in")) {
+        throw_parser_error("expected 'in', got '" + tok.describe() + "'");
+      }
+      get_next_token();
+
+      if (!parse_expression(tmpl, closing)) {
+        return false;
+      }
+
+      // The loop variables are bound only within the body, not in the condition
+      loop_binding_stack.emplace_back(for_statement_node);
+    } else if (tok.text == static_cast<decltype(tok.text)>("endfor")) {
+      if (for_statement_stack.empty()) {
+        throw_parser_error("endfor without matching for");
+      }
+
+      auto& for_statement_data = for_statement_stack.top();
+      get_next_token();
+
+      current_block = for_statement_data->parent;
+      for_statement_stack.pop();
+      loop_binding_stack.pop_back();
+    } else if (tok.text == static_cast<decltype(tok.text)>("include")) {
+      get_next_token();
+
+      std::string template_name = parse_filename();
+      add_to_template_storage(path, template_name);
+      tmpl.dependencies.emplace_back(template_name);
+
+      auto node = tmpl.arena->make<IncludeStatementNode>(template_name, tok.text.data() - tmpl.content.c_str());
+      node->link_index = tmpl.dependencies.size() - 1;
+      current_block->nodes.emplace_back(node);
+
+      get_next_token();
+    } else if (tok.text == static_cast<decltype(tok.text)>("extends")) {
+      get_next_token();
+
+      std::string template_name = parse_filename();
+      add_to_template_storage(path, template_name);
+      tmpl.dependencies.emplace_back(template_name);
+
+      auto node = tmpl.arena->make<ExtendsStatementNode>(template_name, tok.text.data() - tmpl.content.c_str());
+      node->link_index = tmpl.dependencies.size() - 1;
+      current_block->nodes.emplace_back(node);
+
+      get_next_token();
+    } else if (tok.text == static_cast<decltype(tok.text)>("set")) {
+      get_next_token();
+
+      if (tok.kind != Token::Kind::Id) {
+        throw_parser_error("expected variable name, got '" + tok.describe() + "'");
+      }
+
+      const std::string key = static_cast<std::string>(tok.text);
+      get_next_token();
+
+      auto set_statement_node = tmpl.arena->make<SetStatementNode>(key, tok.text.data() - tmpl.content.c_str());
+      current_block->nodes.emplace_back(set_statement_node);
+      current_expression_list = &set_statement_node->expression;
+
+      if (tok.text != static_cast<decltype(tok.text)>("=")) {
+        throw_parser_error("expected '=', got '" + tok.describe() + "'");
+      }
+      get_next_token();
+
+      if (!parse_expression(tmpl, closing)) {
+        return false;
+      }
+    } else {
+      return false;
+    }
+    return true;
+  }
+
+  void parse_into(Template& tmpl, const std::filesystem::path& path) {
+    lexer.start(tmpl.content);
+    current_block = &tmpl.root;
+
+    for (;;) {
+      get_next_token();
+      switch (tok.kind) {
+      case Token::Kind::Eof: {
+        if (!if_statement_stack.empty()) {
+          throw_parser_error("unmatched if");
+        }
+        if (!for_statement_stack.empty()) {
+          throw_parser_error("unmatched for");
+        }
+      }
+        current_block = nullptr;
+        return;
+      case Token::Kind::Text: {
+        current_block->nodes.emplace_back(tmpl.arena->make<TextNode>(tok.text.data() - tmpl.content.c_str(), tok.text.size()));
+      } break;
+      case Token::Kind::StatementOpen: {
+        get_next_token();
+        if (!parse_statement(tmpl, Token::Kind::StatementClose, path)) {
+          throw_parser_error("expected statement, got '" + tok.describe() + "'");
+        }
+        if (tok.kind != Token::Kind::StatementClose) {
+          throw_parser_error("expected statement close, got '" + tok.describe() + "'");
+        }
+      } break;
+      case Token::Kind::LineStatementOpen: {
+        get_next_token();
+        if (!parse_statement(tmpl, Token::Kind::LineStatementClose, path)) {
+          throw_parser_error("expected statement, got '" + tok.describe() + "'");
+        }
+        if (tok.kind != Token::Kind::LineStatementClose && tok.kind != Token::Kind::Eof) {
+          throw_parser_error("expected line statement close, got '" + tok.describe() + "'");
+        }
+      } break;
+      case Token::Kind::ExpressionOpen: {
+        get_next_token();
+
+        auto expression_list_node = tmpl.arena->make<ExpressionListNode>(tok.text.data() - tmpl.content.c_str());
+        current_block->nodes.emplace_back(expression_list_node);
+        current_expression_list = expression_list_node;
+
+        if (!parse_expression(tmpl, Token::Kind::ExpressionClose)) {
+          throw_parser_error("expected expression close, got '" + tok.describe() + "'");
+        }
+      } break;
+      case Token::Kind::CommentOpen: {
+        get_next_token();
+        if (tok.kind != Token::Kind::CommentClose) {
+          throw_parser_error("expected comment close, got '" + tok.describe() + "'");
+        }
+      } break;
+      default: {
+        throw_parser_error("unexpected token '" + tok.describe() + "'");
+      } break;
+      }
+    }
+  }
+
+  /// Runs the optional passes after parsing
+  void finish(Template& tmpl) const {
+    Optimizer(config, template_storage, function_storage).optimize(tmpl);
+    tmpl.analyze();
+    if (config.compile_bytecode) {
+      tmpl.compile();
+    }
+  }
+
+public:
+  explicit Parser(const ParserConfig& parser_config, const LexerConfig& lexer_config, TemplateStorage& template_storage,
+                  const FunctionStorage& function_storage)
+      : config(parser_config), lexer(lexer_config), template_storage(template_storage), function_storage(function_storage) {}
+
+  Template parse(std::string_view input, const std::filesystem::path& path) {
+    auto result = Template(std::string(input));
+    parse_into(result, path);
+    finish(result);
+    load_includes();
+    return result;
+  }
+
+  void parse_into_template(Template& tmpl, const std::filesystem::path& filename) {
+    auto sub_parser = Parser(config, lexer.get_config(), template_storage, function_storage);
+    sub_parser.template_name = filename.string();
+    sub_parser.parse_into(tmpl, filename.parent_path());
+    finish(tmpl);
+    sub_parser.load_includes();
+  }
+
+  /// Returns the name under which the template of a file is registered in the storage
+  static std::string storage_name(const std::filesystem::path& filename) {
+    return IncludeResolver::storage_name(filename);
+  }
+
+  static std::string load_file(const std::filesystem::path& filename) {
+    std::ifstream file;
+    file.open(filename);
+    if (file.fail()) {
+      INJA_THROW(FileError("failed accessing file at '" + filename.string() + "'"));
+    }
+    std::string text((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    return text;
+  }
+};
+
+} // namespace inja
+
+#endif // INCLUDE_INJA_PARSER_HPP_
+
+// #include "renderer.hpp"
+
+// #include "serialization.hpp"
+#ifndef INCLUDE_INJA_SERIALIZATION_HPP_
+#define INCLUDE_INJA_SERIALIZATION_HPP_
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define INJA_HAS_MMAP
+#endif
+
+// #include "config.hpp"
+
+// #include "exceptions.hpp"
+
+// #include "function_storage.hpp"
+
+// #include "json.hpp"
+
+// #include "node.hpp"
+
+// #include "template.hpp"
+
+// #include "throw.hpp"
+
+
+namespace inja {
+
+/*!
+ * \brief Layout of a precompiled bundle of templates.
+ *
+ * A bundle starts with a header of the magic bytes, the format and inja versions, and the lexer configuration. It is
+ * followed by the templates, each with its name, content, dependencies, a msgpack pool of its literals, the msgpack of
+ * its static data if it is specialized or null, and its AST in pre-order. All integers are stored in the byte order of
+ * the writing machine, which is detected by the version. Nodes are nested at most max_nesting levels deep.
+ */
+struct TemplateBundle {
+  static constexpr char magic[4] {'I', 'N', 'J', 'B'};
+  static constexpr std::uint32_t format_version {3};
+  static constexpr size_t max_nesting {1000};
+
+  enum class Tag : std::uint8_t {
+    Text,
+    Literal,
+    Data,
+    Function,
+    ExpressionList,
+    ForArray,
+    ForObject,
+    If,
+    Include,
+    Extends,
+    Block,
+    Set,
+  };
+
+  static std::vector<const std::string*> lexer_settings(const LexerConfig& config) {
+    return {&config.statement_open,   &config.statement_open_no_lstrip,     &config.statement_open_force_lstrip,  &config.statement_close,
+            &config.statement_close_force_rstrip, &config.line_statement,  &config.expression_open,  &config.expression_open_force_lstrip,
+            &config.expression_close, &config.expression_close_force_rstrip, &config.comment_open,     &config.comment_open_force_lstrip,
+            &config.comment_close,    &config.comment_close_force_rstrip};
+  }
+};
+
+/*!
+ * \brief Read-only view of a file, which is memory-mapped where the platform supports it.
+ */
+class MappedFile {
+#if defined(INJA_HAS_MMAP)
+  void* address {nullptr};
+  size_t length {0};
+#else
+  std::string buffer;
+#endif
+
+public:
+  explicit MappedFile(const std::filesystem::path& path) {
+#if defined(INJA_HAS_MMAP)
+    const int descriptor = ::open(path.c_str(), O_RDONLY);
+    if (descriptor < 0) {
+      INJA_THROW(FileError("failed accessing file at '" + path.string() + "'"));
+    }
+
+    struct stat status;
+    if (::fstat(descriptor, &status) == 0 && status.st_size > 0) {
+      length = static_cast<size_t>(status.st_size);
+      address = ::mmap(nullptr, length, PROT_READ, MAP_PRIVATE, descriptor, 0);
+    }
+    ::close(descriptor);
+
+    if (address == MAP_FAILED) {
+      address = nullptr;
+      INJA_THROW(FileError("failed mapping file at '" + path.string() + "'"));
+    }
+#else
+    std::ifstream file(path, std::ios::binary);
+    if (file.fail()) {
+      INJA_THROW(FileError("failed accessing file at '" + path.string() + "'"));
+    }
+    buffer.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+#endif
+  }
+
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+
+  ~MappedFile() {
+#if defined(INJA_HAS_MMAP)
+    if (address != nullptr) {
+      ::munmap(address, length);
+    }
+#endif
+  }
+
+  std::string_view data() const {
+#if defined(INJA_HAS_MMAP)
+    return address ? std::string_view(static_cast<const char*>(address), length) : std::string_view();
+#else
+    return buffer;
+#endif
+  }
+};
+
+/*!
+ * \brief Class for writing templates into a precompiled bundle.
+ */
+class BundleWriter : public NodeVisitor {
+  using Tag = TemplateBundle::Tag;
+
+  const LexerConfig& lexer_config;
+
+  std::string nodes;
+  json literals;
+
+  template <class T> static void write_value(std::string& out, T value) {
+    char bytes[sizeof(T)];
+    std::memcpy(bytes, &value, sizeof(T));
+    out.append(bytes, sizeof(T));
+  }
+
+  static void write_size(std::string& out, size_t value) {
+    write_value(out, static_cast<std::uint64_t>(value));
+  }
+
+  static void write_string(std::string& out, std::string_view value) {
+    write_value(out, static_cast<std::uint32_t>(value.size()));
+    out.append(value.data(), value.size());
+  }
+
+  void write_node(Tag tag, const AstNode& node) {
+    write_value(nodes, tag);
+    write_size(nodes, node.pos);
+  }
+
+  void write_expression_list(const ExpressionListNode& node) {
+    write_size(nodes, node.pos);
+    write_value(nodes, static_cast<std::uint8_t>(node.root != nullptr));
+    if (node.root) {
+      node.root->accept(*this);
+    }
+  }
+
+  void visit(const BlockNode& node) override {
+    write_value(nodes, static_cast<std::uint32_t>(node.nodes.size()));
+    for (const auto n : node.nodes) {
+      n->accept(*this);
+    }
+  }
+
+  void visit(const TextNode& node) override {
+    write_node(Tag::Text, node);
+    write_size(nodes, node.length);
+  }
+
+  void visit(const ExpressionNode&) override {}
+
+  void visit(const LiteralNode& node) override {
+    write_node(Tag::Literal, node);
+    write_value(nodes, static_cast<std::uint32_t>(literals.size()));
+    literals.push_back(node.value);
+  }
+
+  void visit(const DataNode& node) override {
+    write_node(Tag::Data, node);
+    write_string(nodes, node.name);
+    write_value(nodes, static_cast<std::uint8_t>(node.scope));
+    write_value(nodes, static_cast<std::uint8_t>(node.is_loop_metadata));
+    write_size(nodes, node.loop_depth);
+  }
+
+  void visit(const FunctionNode& node) override {
+    write_node(Tag::Function, node);
+    write_value(nodes, static_cast<std::uint32_t>(node.operation));
+    write_string(nodes, node.name);
+    write_value(nodes, static_cast<std::int32_t>(node.number_args));
+    write_value(nodes, static_cast<std::uint8_t>(node.literal_path != nullptr));
+    write_value(nodes, static_cast<std::uint32_t>(node.arguments.size()));
+    for (const auto argument : node.arguments) {
+      argument->accept(*this);
+    }
+  }
+
+  void visit(const ExpressionListNode& node) override {
+    write_value(nodes, Tag::ExpressionList);
+    write_expression_list(node);
+  }
+
+  void visit(const StatementNode&) override {}
+  void visit(const ForStatementNode&) override {}
+
+  void visit(const ForArrayStatementNode& node) override {
+    write_node(Tag::ForArray, node);
+    write_string(nodes, node.value);
+    write_expression_list(node.condition);
+    node.body.accept(*this);
+  }
+
+  void visit(const ForObjectStatementNode& node) override {
+    write_node(Tag::ForObject, node);
+    write_string(nodes, node.key);
+    write_string(nodes, node.value);
+    write_expression_list(node.condition);
+    node.body.accept(*this);
+  }
+
+  void visit(const IfStatementNode& node) override {
+    write_node(Tag::If, node);
+    write_value(nodes, static_cast<std::uint8_t>(node.is_nested));
+    write_value(nodes, static_cast<std::uint8_t>(node.has_false_statement));
+    write_expression_list(node.condition);
+    node.true_statement.accept(*this);
+    node.false_statement.accept(*this);
+  }
+
+  void visit(const IncludeStatementNode& node) override {
+    write_node(Tag::Include, node);
+    write_string(nodes, node.file);
+    write_size(nodes, node.link_index);
+  }
+
+  void visit(const ExtendsStatementNode& node) override {
+    write_node(Tag::Extends, node);
+    write_string(nodes, node.file);
+    write_size(nodes, node.link_index);
+  }
+
+  void visit(const BlockStatementNode& node) override {
+    write_node(Tag::Block, node);
+    write_string(nodes, node.name);
+    node.block.accept(*this);
+  }
+
+  void visit(const SetStatementNode& node) override {
+    write_node(Tag::Set, node);
+    write_string(nodes, node.key);
+    write_expression_list(node.expression);
+  }
+
+  void write_template(std::string& out, const std::string& name, const Template& tmpl) {
+    nodes.clear();
+    literals = json::array();
+    tmpl.root.accept(*this);
+
+    std::vector<std::uint8_t> literal_pool;
+    json::to_msgpack(literals, literal_pool);
+    std::vector<std::uint8_t> static_data;
+    json::to_msgpack(tmpl.static_data ? *tmpl.static_data : json(), static_data);
+
+    write_string(out, name);
+    write_string(out, tmpl.content);
+    write_value(out, static_cast<std::uint32_t>(tmpl.dependencies.size()));
+    for (const auto& dependency : tmpl.dependencies) {
+      write_string(out, dependency);
+    }
+    write_string(out, std::string_view(reinterpret_cast<const char*>(literal_pool.data()), literal_pool.size()));
+    write_string(out, std::string_view(reinterpret_cast<const char*>(static_data.data()), static_data.size()));
+    out += nodes;
+  }
+
+public:
+  explicit BundleWriter(const LexerConfig& lexer_config): lexer_config(lexer_config) {}
+
+  /// Writes the named templates into a bundle
+  void write(std::ostream& os, const std::vector<std::pair<std::string, std::shared_ptr<const Template>>>& templates) {
+    std::string out;
+    out.append(TemplateBundle::magic, sizeof(TemplateBundle::magic));
+    write_value(out, TemplateBundle::format_version);
+    write_value(out, static_cast<std::uint32_t>(INJA_VERSION_MAJOR));
+    write_value(out, static_cast<std::uint32_t>(INJA_VERSION_MINOR));
+    write_value(out, static_cast<std::uint32_t>(INJA_VERSION_PATCH));
+    for (const auto setting : TemplateBundle::lexer_settings(lexer_config)) {
+      write_string(out, *setting);
+    }
+    write_value(out, static_cast<std::uint8_t>(lexer_config.trim_blocks));
+    write_value(out, static_cast<std::uint8_t>(lexer_config.lstrip_blocks));
+
+    write_value(out, static_cast<std::uint32_t>(templates.size()));
+    for (const auto& [name, tmpl] : templates) {
+      write_template(out, name, *tmpl);
+    }
+    os.write(out.data(), static_cast<std::streamsize>(out.size()));
+  }
+};
+
+/*!
+ * \brief Class for loading the templates of a precompiled bundle without lexing and parsing them again.
+ */
+class BundleReader {
+  using Op = FunctionStorage::Operation;
+  using Tag = TemplateBundle::Tag;
+
+  const LexerConfig& lexer_config;
+  const ParserConfig& parser_config;
+  const FunctionStorage& function_storage;
+
+  std::string_view data;
+  size_t offset {0};
+
+  Template* tmpl {nullptr};
+  json literals;
+  std::vector<const ForStatementNode*> loop_stack;
+  std::vector<size_t> loop_boundaries;
+  size_t nesting {0};
+
+  /// Counts the nesting of the node that is read, so that a corrupt bundle can not overflow the stack
+  struct NestingGuard {
+    size_t& nesting;
+
+    explicit NestingGuard(size_t& nesting): nesting(nesting) {
+      if (nesting >= TemplateBundle::max_nesting) {
+        throw_invalid("nodes nested too deeply");
+      }
+      nesting += 1;
+    }
+
+    ~NestingGuard() {
+      nesting -= 1;
+    }
+  };
+
+  [[noreturn]] static void throw_invalid(const std::string& message) {
+    INJA_THROW(FileError("invalid template bundle: " + message));
+  }
+
+  template <class T> T read() {
+    if (data.size() - offset < sizeof(T)) {
+      throw_invalid("unexpected end of file");
+    }
+    T result;
+    std::memcpy(&result, data.data() + offset, sizeof(T));
+    offset += sizeof(T);
+    return result;
+  }
+
+  size_t read_size() {
+    return static_cast<size_t>(read<std::uint64_t>());
+  }
+
+  std::string_view read_string() {
+    const size_t length = read<std::uint32_t>();
+    if (data.size() - offset < length) {
+      throw_invalid("unexpected end of file");
+    }
+    const auto result = data.substr(offset, length);
+    offset += length;
+    return result;
+  }
+
+  void read_header() {
+    const auto magic = data.substr(0, sizeof(TemplateBundle::magic));
+    if (magic != std::string_view(TemplateBundle::magic, sizeof(TemplateBundle::magic))) {
+      throw_invalid("not a template bundle");
+    }
+    offset = magic.size();
+
+    if (read<std::uint32_t>() != TemplateBundle::format_version) {
+      throw_invalid("unsupported format version or byte order");
+    }
+
+    const auto major = read<std::uint32_t>();
+    const auto minor = read<std::uint32_t>();
+    const auto patch = read<std::uint32_t>();
+    if (major != INJA_VERSION_MAJOR || minor != INJA_VERSION_MINOR || patch != INJA_VERSION_PATCH) {
+      throw_invalid("written by inja " + std::to_string(major) + "." + std::to_string(minor) + "." + std::to_string(patch));
+    }
+
+    bool same_lexer_config = true;
+    for (const auto setting : TemplateBundle::lexer_settings(lexer_config)) {
+      same_lexer_config &= (read_string() == *setting);
+    }
+    same_lexer_config &= (read<std::uint8_t>() == lexer_config.trim_blocks);
+    same_lexer_config &= (read<std::uint8_t>() == lexer_config.lstrip_blocks);
+    if (!same_lexer_config) {
+      throw_invalid("written with a different lexer configuration");
+    }
+  }
+
+  void read_block(BlockNode& block) {
+    const size_t size = read<std::uint32_t>();
+    block.nodes.reserve(size);
+    for (size_t i = 0; i < size; ++i) {
+      block.nodes.emplace_back(read_node(block));
+    }
+  }
+
+  void read_expression_list(ExpressionListNode& node) {
+    node.pos = read_size();
+    if (read<std::uint8_t>()) {
+      node.root = read_expression(read<Tag>());
+    }
+  }
+
+  /// Binds a loop variable like the parser, as the loops are read in the same nesting
+  void bind_loop_variable(DataNode& node) {
+    const size_t boundary = loop_boundaries.empty() ? 0 : loop_boundaries.back();
+    if (node.loop_depth >= loop_stack.size() - boundary) {
+      throw_invalid("loop variable '" + node.name + "' outside of its loop");
+    }
+    node.loop_variable = loop_stack[loop_stack.size() - 1 - node.loop_depth]->find_variable(node.head);
+    if (!node.loop_variable) {
+      throw_invalid("loop variable '" + node.name + "' outside of its loop");
+    }
+  }
+
+  ExpressionNode* read_expression(Tag tag) {
+    const NestingGuard guard(nesting);
+    const size_t pos = read_size();
+    switch (tag) {
+    case Tag::Literal: {
+      const size_t index = read<std::uint32_t>();
+      if (index >= literals.size()) {
+        throw_invalid("literal out of range");
+      }
+      return tmpl->arena->make<LiteralNode>(literals[index], pos);
+    }
+    case Tag::Data: {
+      auto node = tmpl->arena->make<DataNode>(read_string(), pos);
+      const auto scope = read<std::uint8_t>();
+      if (scope > static_cast<std::uint8_t>(DataNode::Scope::Loop)) {
+        throw_invalid("unknown scope of variable '" + node->name + "'");
+      }
+      node->scope = static_cast<DataNode::Scope>(scope);
+      node->is_loop_metadata = read<std::uint8_t>();
+      node->loop_depth = read_size();
+      if (node->scope == DataNode::Scope::Loop) {
+        bind_loop_variable(*node);
+      }
+      return node;
+    }
+    case Tag::Function: {
+      const auto operation_index = read<std::uint32_t>();
+      if (operation_index > static_cast<std::uint32_t>(Op::None)) {
+        throw_invalid("unknown operation");
+      }
+      const auto operation = static_cast<Op>(operation_index);
+      auto node = tmpl->arena->make<FunctionNode>(read_string(), pos);
+      node->operation = operation;
+      node->number_args = read<std::int32_t>();
+      const bool has_literal_path = read<std::uint8_t>();
+      const size_t size = read<std::uint32_t>();
+      const bool is_binary = (operation == Op::And || operation == Op::Or || operation == Op::Default || operation == Op::AtId);
+      if (is_binary && size != 2) {
+        throw_invalid("wrong number of arguments"); // Which are accessed without checking when rendering
+      }
+      node->arguments.reserve(size);
+      for (size_t i = 0; i < size; ++i) {
+        node->arguments.emplace_back(read_expression(read<Tag>()));
+      }
+
+      if (operation == Op::Callback) {
+        const auto function_data = function_storage.find_function(node->name, node->number_args);
+        if (function_data.operation != Op::Callback) {
+          throw_invalid("unknown function " + node->name);
+        }
+        node->callback = function_data.callback;
+      }
+
+      if (has_literal_path) {
+        const auto literal = node->arguments.empty() ? nullptr : dynamic_cast<const LiteralNode*>(node->arguments[0]);
+        if (!literal || !literal->value.is_string()) {
+          throw_invalid("path without string literal");
+        }
+        node->literal_path = tmpl->arena->make<DataNode>(literal->value.get_ref<const json::string_t&>(), literal->pos);
+      }
+      return node;
+    }
+    default:
+      throw_invalid("expected expression");
+    }
+  }
+
+  AstNode* read_node(BlockNode& parent) {
+    const NestingGuard guard(nesting);
+    const auto tag = read<Tag>();
+    switch (tag) {
+    case Tag::Text: {
+      const size_t pos = read_size();
+      const size_t length = read_size();
+      if (pos > tmpl->content.size() || length > tmpl->content.size() - pos) {
+        throw_invalid("text out of range");
+      }
+      return tmpl->arena->make<TextNode>(pos, length);
+    }
+    case Tag::Literal:
+    case Tag::Data:
+    case Tag::Function: {
+      return read_expression(tag);
+    }
+    case Tag::ExpressionList: {
+      auto node = tmpl->arena->make<ExpressionListNode>();
+      read_expression_list(*node);
+      return node;
+    }
+    case Tag::ForArray:
+    case Tag::ForObject: {
+      const size_t pos = read_size();
+      ForStatementNode* node {nullptr};
+      if (tag == Tag::ForArray) {
+        node = tmpl->arena->make<ForArrayStatementNode>(std::string(read_string()), &parent, pos);
       } else {
-        make_result(val->size());
+        const auto key = std::string(read_string());
+        node = tmpl->arena->make<ForObjectStatementNode>(key, std::string(read_string()), &parent, pos);
+      }
+      read_expression_list(node->condition);
+      loop_stack.emplace_back(node);
+      read_block(node->body);
+      loop_stack.pop_back();
+      return node;
+    }
+    case Tag::If: {
+      const size_t pos = read_size();
+      const bool is_nested = read<std::uint8_t>();
+      auto node = tmpl->arena->make<IfStatementNode>(is_nested, &parent, pos);
+      node->has_false_statement = read<std::uint8_t>();
+      read_expression_list(node->condition);
+      read_block(node->true_statement);
+      read_block(node->false_statement);
+      return node;
+    }
+    case Tag::Include: {
+      const size_t pos = read_size();
+      auto node = tmpl->arena->make<IncludeStatementNode>(std::string(read_string()), pos);
+      node->link_index = read_size();
+      return node;
+    }
+    case Tag::Extends: {
+      const size_t pos = read_size();
+      auto node = tmpl->arena->make<ExtendsStatementNode>(std::string(read_string()), pos);
+      node->link_index = read_size();
+      return node;
+    }
+    case Tag::Block: {
+      const size_t pos = read_size();
+      auto node = tmpl->arena->make<BlockStatementNode>(&parent, std::string(read_string()), pos);
+      loop_boundaries.emplace_back(loop_stack.size());
+      read_block(node->block);
+      loop_boundaries.pop_back();
+      tmpl->add_block(node);
+      return node;
+    }
+    case Tag::Set: {
+      const size_t pos = read_size();
+      auto node = tmpl->arena->make<SetStatementNode>(std::string(read_string()), pos);
+      read_expression_list(node->expression);
+      return node;
+    }
+    default:
+      throw_invalid("unknown node");
+    }
+  }
+
+  Template read_template() {
+    Template result;
+    result.content = read_string();
+    const size_t dependencies = read<std::uint32_t>();
+    for (size_t i = 0; i < dependencies; ++i) {
+      result.dependencies.emplace_back(read_string());
+    }
+
+    const auto literal_pool = read_string();
+    literals = json::from_msgpack(literal_pool.begin(), literal_pool.end());
+    const auto static_data = read_string();
+    auto static_json = json::from_msgpack(static_data.begin(), static_data.end());
+    if (!static_json.is_null()) {
+      result.static_data = std::make_shared<const json>(std::move(static_json));
+    }
+
+    tmpl = &result;
+    read_block(result.root);
+    tmpl = nullptr;
+
+    result.analyze();
+    if (parser_config.compile_bytecode) {
+      result.compile();
+    }
+    return result;
+  }
+
+public:
+  explicit BundleReader(const LexerConfig& lexer_config, const ParserConfig& parser_config, const FunctionStorage& function_storage)
+      : lexer_config(lexer_config), parser_config(parser_config), function_storage(function_storage) {}
+
+  /// Returns the named templates of the bundle, or throws if it was written by another version or lexer configuration
+  std::vector<std::pair<std::string, Template>> read(std::string_view bundle) {
+    data = bundle;
+    read_header();
+
+    std::vector<std::pair<std::string, Template>> result;
+    const size_t size = read<std::uint32_t>();
+    result.reserve(size);
+    for (size_t i = 0; i < size; ++i) {
+      auto name = std::string(read_string());
+      result.emplace_back(std::move(name), read_template());
+    }
+    if (offset != data.size()) {
+      throw_invalid("trailing data");
+    }
+    return result;
+  }
+};
+
+} // namespace inja
+
+#endif // INCLUDE_INJA_SERIALIZATION_HPP_
+
+// #include "specializer.hpp"
+#ifndef INCLUDE_INJA_SPECIALIZER_HPP_
+#define INCLUDE_INJA_SPECIALIZER_HPP_
+
+#include <algorithm>
+#include <set>
+#include <sstream>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// #include "config.hpp"
+
+// #include "function_storage.hpp"
+
+// #include "node.hpp"
+
+// #include "optimizer.hpp"
+
+// #include "renderer.hpp"
+
+// #include "template.hpp"
+
+
+namespace inja {
+
+/*!
+ * \brief A visitor that collects the properties of a subtree that matter for specialization.
+ */
+class SpecializationAnalysis : public NodeVisitor {
+  size_t loop_level {0};
+
+  void visit(const BlockNode& node) override {
+    for (const auto& n : node.nodes) {
+      n->accept(*this);
+    }
+  }
+
+  void visit(const TextNode&) override {}
+  void visit(const ExpressionNode&) override {}
+  void visit(const LiteralNode&) override {}
+
+  void visit(const DataNode& node) override {
+    if (node.is_loop_metadata) {
+      has_loop_metadata = true;
+      has_nested_loop_metadata |= (loop_level > 0);
+    }
+  }
+
+  void visit(const FunctionNode& node) override {
+    for (const auto& n : node.arguments) {
+      n->accept(*this);
+    }
+  }
+
+  void visit(const ExpressionListNode& node) override {
+    if (node.root) {
+      node.root->accept(*this);
+    }
+  }
+
+  void visit(const StatementNode&) override {}
+  void visit(const ForStatementNode&) override {}
+
+  void visit(const ForArrayStatementNode& node) override {
+    node.condition.accept(*this);
+    loop_level += 1;
+    node.body.accept(*this);
+    loop_level -= 1;
+  }
+
+  void visit(const ForObjectStatementNode& node) override {
+    node.condition.accept(*this);
+    loop_level += 1;
+    node.body.accept(*this);
+    loop_level -= 1;
+  }
+
+  void visit(const IfStatementNode& node) override {
+    node.condition.accept(*this);
+    node.true_statement.accept(*this);
+    node.false_statement.accept(*this);
+  }
+
+  void visit(const IncludeStatementNode&) override {
+    has_scoped_statements = true;
+  }
+
+  void visit(const ExtendsStatementNode&) override {
+    has_scoped_statements = true;
+  }
+
+  void visit(const BlockStatementNode& node) override {
+    has_scoped_statements = true;
+    node.block.accept(*this);
+  }
+
+  void visit(const SetStatementNode& node) override {
+    has_scoped_statements = true;
+    assigned_names.emplace(node.head);
+    node.expression.accept(*this);
+  }
+
+public:
+  bool has_scoped_statements {false};    // Statements that depend on the loop frames at render time
+  bool has_loop_metadata {false};        // References to the loop object
+  bool has_nested_loop_metadata {false}; // References to the loop object within a nested loop
+  std::set<std::string> assigned_names;  // Names of all set statements
+};
+
+/*!
+ * \brief Class for partially evaluating a Template against static data.
+ *
+ * The template is rendered as if the data was updated by the static data, so that each top-level key of the static data
+ * shadows the same key of the data. The template is copied node by node, and each variable found in the static data is
+ * replaced by its value. Loops over static values are unrolled, if their body does not depend on the loop frames at
+ * render time. Afterwards, the optimizer folds the resulting constant expressions and if statements, and constant
+ * expressions are pre-rendered as text. If the template includes or extends others, it keeps the static data for them.
+ */
+class Specializer : public NodeVisitor {
+  using Op = FunctionStorage::Operation;
+
+  struct LoopContext {
+    const ForStatementNode* loop; // Loop of the original template
+    ForStatementNode* copy;       // Loop of the specialized template, or nullptr if it is unrolled
+    const std::string* key_name;
+    const std::string* value_name;
+    json key;
+    const json* value;
+    json metadata;
+  };
+
+  const RenderConfig& render_config;
+  const TemplateStorage& template_storage;
+  const FunctionStorage& function_storage;
+  ParserConfig optimizer_config;
+  Optimizer optimizer;
+
+  const json* static_data {nullptr};
+  std::set<std::string> assigned_names;
+  bool has_dynamic_exists {false}; // Whether an exists() call is left for rendering
+  bool has_static_misses {false};  // Whether a name of a key of the static data is left for rendering, where it is missing
+  std::vector<LoopContext> loops;
+
+  Template* result {nullptr};
+  BlockNode* current_block {nullptr};
+  ExpressionNode* current_expression {nullptr};
+
+  ExpressionNode* copy_expression(const ExpressionNode& node) {
+    node.accept(*this);
+    return current_expression;
+  }
+
+  void copy_expression_list(const ExpressionListNode& from, ExpressionListNode& to) {
+    to.root = from.root ? copy_expression(*from.root) : nullptr;
+  }
+
+  void copy_block(const BlockNode& from, BlockNode& to) {
+    const auto old_block = current_block;
+    current_block = &to;
+    from.accept(*this);
+    current_block = old_block;
+  }
+
+  DataNode* copy_data(const DataNode& node) {
+    const auto copy = result->arena->make<DataNode>(node.name, node.pos);
+    copy->is_loop_metadata = node.is_loop_metadata;
+    return copy;
+  }
+
+  void substitute(const DataNode& node, const json& variable) {
+    if (const auto value = node.find_in(variable, 1)) {
+      current_expression = result->arena->make<LiteralNode>(*value, node.pos);
+    } else {
+      current_expression = copy_data(node); // Throws as before when rendering
+    }
+  }
+
+  bool is_unrollable(const ForStatementNode& node) const {
+    auto analysis = SpecializationAnalysis();
+    node.body.accept(analysis);
+    if (analysis.has_scoped_statements || analysis.has_nested_loop_metadata) {
+      return false;
+    }
+
+    // The parent of the loop object must be unrolled as well
+    const bool inside_kept_loop = std::any_of(loops.begin(), loops.end(), [](const LoopContext& loop) { return loop.copy != nullptr; });
+    return !(analysis.has_loop_metadata && inside_kept_loop);
+  }
+
+  void unroll(const ForStatementNode& node, const json& values, const std::string* key_name, const std::string* value_name) {
+    size_t index = 0;
+    for (auto it = values.begin(); it != values.end(); ++it, ++index) {
+      LoopContext context {&node, nullptr, key_name, value_name, json(), &it.value(), json()};
+      if (key_name) {
+        context.key = it.key();
       }
-    } break;
-    case Op::Lower: {
-      auto result = get_arguments<1>(node)[0]->get<json::string_t>();
-      std::transform(result.begin(), result.end(), result.begin(), [](char c) { return static_cast<char>(::tolower(c)); });
-      make_result(std::move(result));
-    } break;
-    case Op::Max: {
-      const auto args = get_arguments<1>(node);
-      const auto result = std::max_element(args[0]->begin(), args[0]->end());
-      data_eval_stack.push(&(*result));
-    } break;
-    case Op::Min: {
-      const auto args = get_arguments<1>(node);
-      const auto result = std::min_element(args[0]->begin(), args[0]->end());
-      data_eval_stack.push(&(*result));
-    } break;
-    case Op::Odd: {
-      make_result(get_arguments<1>(node)[0]->get<const json::number_integer_t>() % 2 != 0);
-    } break;
-    case Op::Range: {
-      std::vector<int> result(get_arguments<1>(node)[0]->get<const json::number_integer_t>());
-      std::iota(result.begin(), result.end(), 0);
-      make_result(std::move(result));
-    } break;
-    case Op::Replace: {
-      const auto args = get_arguments<3>(node);
-      auto result = args[0]->get<std::string>();
-      replace_substring(result, args[1]->get<std::string>(), args[2]->get<std::string>());
-      make_result(std::move(result));
-    } break;
-    case Op::Round: {
-      const auto args = get_arguments<2>(node);
-      const auto precision = args[1]->get<const json::number_integer_t>();
-      const double result = std::round(args[0]->get<const json::number_float_t>() * std::pow(10.0, precision)) / std::pow(10.0, precision);
-      if (precision == 0) {
-        make_result(static_cast<int>(result));
-      } else {
-        make_result(result);
+      context.metadata["index"] = index;
+      context.metadata["index1"] = index + 1;
+      context.metadata["is_first"] = (index == 0);
+      context.metadata["is_last"] = (index == values.size() - 1);
+      if (!loops.empty() && !loops.back().copy) {
+        context.metadata["parent"] = loops.back().metadata;
       }
-    } break;
-    case Op::Sort: {
-      auto result_ptr = std::make_shared<json>(get_arguments<1>(node)[0]->get<std::vector<json>>());
-      std::sort(result_ptr->begin(), result_ptr->end());
-      data_tmp_stack.push_back(result_ptr);
-      data_eval_stack.push(result_ptr.get());
-    } break;
-    case Op::Upper: {
-      auto result = get_arguments<1>(node)[0]->get<json::string_t>();
-      std::transform(result.begin(), result.end(), result.begin(), [](char c) { return static_cast<char>(::toupper(c)); });
-      make_result(std::move(result));
-    } break;
-    case Op::IsBoolean: {
-      make_result(get_arguments<1>(node)[0]->is_boolean());
-    } break;
-    case Op::IsNumber: {
-      make_result(get_arguments<1>(node)[0]->is_number());
-    } break;
-    case Op::IsInteger: {
-      make_result(get_arguments<1>(node)[0]->is_number_integer());
-    } break;
-    case Op::IsFloat: {
-      make_result(get_arguments<1>(node)[0]->is_number_float());
-    } break;
-    case Op::IsObject: {
-      make_result(get_arguments<1>(node)[0]->is_object());
-    } break;
-    case Op::IsArray: {
-      make_result(get_arguments<1>(node)[0]->is_array());
-    } break;
-    case Op::IsString: {
-      make_result(get_arguments<1>(node)[0]->is_string());
-    } break;
-    case Op::Callback: {
-      auto args = get_argument_vector(node);
-      make_result(node.callback(args));
-    } break;
-    case Op::Super: {
-      const auto args = get_argument_vector(node);
-      const size_t old_level = current_level;
-      const size_t level_diff = (args.size() == 1) ? args[0]->get<int>() : 1;
-      const size_t level = current_level + level_diff;
 
-      if (block_statement_stack.empty()) {
-        throw_renderer_error("super() call is not within a block", node);
+      loops.emplace_back(std::move(context));
+      node.body.accept(*this);
+      loops.pop_back();
+    }
+  }
+
+  template <class T> void copy_loop(const T& node, const std::string* key_name, const std::string* value_name) {
+    constexpr bool is_object = std::is_same_v<T, ForObjectStatementNode>;
+
+    ExpressionListNode condition;
+    copy_expression_list(node.condition, condition);
+    optimizer.fold(*result, condition);
+
+    const auto values = dynamic_cast<const LiteralNode*>(condition.root);
+    if (values && (is_object ? values->value.is_object() : values->value.is_array()) && is_unrollable(node)) {
+      unroll(node, values->value, key_name, value_name);
+      return;
+    }
+
+    T* copy;
+    if constexpr (is_object) {
+      copy = result->arena->make<T>(node.key, node.value, current_block, node.pos);
+    } else {
+      copy = result->arena->make<T>(node.value, current_block, node.pos);
+    }
+    copy->condition.root = condition.root;
+    current_block->nodes.emplace_back(copy);
+
+    loops.push_back({&node, copy, key_name, value_name, json(), nullptr, json()});
+    copy_block(node.body, copy->body);
+    loops.pop_back();
+  }
+
+  void visit(const BlockNode& node) override {
+    for (const auto& n : node.nodes) {
+      n->accept(*this);
+    }
+  }
+
+  void visit(const TextNode& node) override {
+    current_block->nodes.emplace_back(result->arena->make<TextNode>(node.pos, node.length));
+  }
+
+  void visit(const ExpressionNode&) override {}
+
+  void visit(const LiteralNode& node) override {
+    current_expression = result->arena->make<LiteralNode>(node.value, node.pos);
+  }
+
+  void visit(const DataNode& node) override {
+    // Variables of an enclosing loop, also unbound names that are matched by a loop at render time
+    size_t depth = 0;
+    for (auto loop = loops.rbegin(); loop != loops.rend(); ++loop) {
+      const bool is_bound = (node.scope == DataNode::Scope::Loop) ? (node.loop_variable == loop->value_name || node.loop_variable == loop->key_name)
+                                                                  : (node.head == *loop->value_name || (loop->key_name && node.head == *loop->key_name));
+      if (is_bound) {
+        const bool is_value = (node.head == *loop->value_name);
+        if (!loop->copy) {
+          substitute(node, is_value ? *loop->value : loop->key);
+        } else {
+          const auto copy = copy_data(node);
+          if (node.scope == DataNode::Scope::Loop) {
+            copy->scope = DataNode::Scope::Loop;
+            copy->loop_variable = is_value ? loop->copy->find_variable(node.head) : loop->copy->find_variable(*loop->key_name);
+            copy->loop_depth = depth;
+          }
+          current_expression = copy;
+        }
+        return;
+      }
+      if (loop->copy) {
+        depth += 1;
       }
+    }
 
-      if (level < 1 || level > template_stack.size() - 1) {
-        throw_renderer_error("level of super() call does not match parent templates (between 1 and " + std::to_string(template_stack.size() - 1) + ")", node);
+    if (node.is_loop_metadata && !loops.empty()) {
+      if (!loops.back().copy) {
+        substitute(node, loops.back().metadata);
+      } else {
+        current_expression = copy_data(node);
       }
+      return;
+    }
 
-      const auto current_block_statement = block_statement_stack.back();
-      const Template* new_template = template_stack.at(level);
-      const Template* old_template = current_template;
-      const auto block_it = new_template->block_storage.find(current_block_statement->name);
-      if (block_it != new_template->block_storage.end()) {
-        current_template = new_template;
-        current_level = level;
-        block_it->second->block.accept(*this);
-        current_level = old_level;
-        current_template = old_template;
+    const bool is_static = (assigned_names.count(node.head) == 0) && is_static_key(node.head);
+    const auto value = is_static ? node.find_in(*static_data) : nullptr;
+    if (value) {
+      current_expression = result->arena->make<LiteralNode>(*value, node.pos);
+    } else {
+      current_expression = copy_data(node);
+      has_static_misses |= is_static;
+    }
+  }
+
+  void visit(const FunctionNode& node) override {
+    const auto copy = result->arena->make<FunctionNode>(node.operation, node.pos);
+    copy->precedence = node.precedence;
+    copy->associativity = node.associativity;
+    copy->name = node.name;
+    copy->number_args = node.number_args;
+    copy->callback = node.callback;
+    if (node.literal_path) {
+      copy->literal_path = copy_data(*node.literal_path);
+    }
+    for (const auto& argument : node.arguments) {
+      copy->arguments.emplace_back(copy_expression(*argument));
+    }
+    current_expression = copy;
+
+    // Names of keys of the static data exist only if they are found in it, while the others are still looked up in the
+    // data when rendering
+    if (node.operation == Op::Exists) {
+      bool exists = false;
+      if (fold_exists(*copy, exists)) {
+        current_expression = result->arena->make<LiteralNode>(json(exists), node.pos);
       } else {
-        throw_renderer_error("could not find block with name '" + current_block_statement->name + "'", node);
+        has_dynamic_exists |= !copy->literal_path;
       }
-      make_result(nullptr);
-    } break;
-    case Op::Join: {
-      const auto args = get_arguments<2>(node);
-      const auto separator = args[1]->get<json::string_t>();
-      std::ostringstream os;
-      std::string sep;
-      for (const auto& value : *args[0]) {
-        os << sep;
-        if (value.is_string()) {
-          os << value.get<std::string>(); // otherwise the value is surrounded with ""
-        } else {
-          os << value.dump();
+    }
+  }
+
+  /// Returns whether the static data has the top-level key, which then shadows the data as if it was updated by it
+  bool is_static_key(const std::string& head) const {
+    return static_data->is_object() && static_data->contains(head);
+  }
+
+  /// Evaluates exists() if its name is known and starts with a key of the static data
+  bool fold_exists(FunctionNode& node, bool& exists) {
+    if (node.literal_path) {
+      if (!is_static_key(node.literal_path->head)) {
+        return false;
+      }
+      exists = (node.literal_path->find_in(*static_data) != nullptr);
+      return true;
+    }
+    if (node.arguments.size() != 1) {
+      return false;
+    }
+
+    ExpressionListNode argument;
+    argument.root = node.arguments[0];
+    optimizer.fold(*result, argument);
+    node.arguments[0] = argument.root;
+
+    const auto name = dynamic_cast<const LiteralNode*>(argument.root);
+    if (!name || !name->value.is_string()) {
+      return false;
+    }
+    const auto& name_string = name->value.get_ref<const json::string_t&>();
+    if (!is_static_key(std::string(string_view::split(name_string, '.').first))) {
+      return false;
+    }
+    exists = static_data->contains(json::json_pointer(DataNode::convert_dot_to_ptr(name_string)));
+    return true;
+  }
+
+  void visit(const ExpressionListNode& node) override {
+    const auto copy = result->arena->make<ExpressionListNode>(node.pos);
+    copy_expression_list(node, *copy);
+    current_block->nodes.emplace_back(copy);
+  }
+
+  void visit(const StatementNode&) override {}
+  void visit(const ForStatementNode&) override {}
+
+  void visit(const ForArrayStatementNode& node) override {
+    copy_loop(node, nullptr, &node.value);
+  }
+
+  void visit(const ForObjectStatementNode& node) override {
+    copy_loop(node, &node.key, &node.value);
+  }
+
+  void visit(const IfStatementNode& node) override {
+    const auto copy = result->arena->make<IfStatementNode>(node.is_nested, current_block, node.pos);
+    copy->has_false_statement = node.has_false_statement;
+    copy_expression_list(node.condition, copy->condition);
+    current_block->nodes.emplace_back(copy);
+    copy_block(node.true_statement, copy->true_statement);
+    copy_block(node.false_statement, copy->false_statement);
+  }
+
+  void visit(const IncludeStatementNode& node) override {
+    const auto copy = result->arena->make<IncludeStatementNode>(node.file, node.pos);
+    copy->link_index = node.link_index;
+    current_block->nodes.emplace_back(copy);
+  }
+
+  void visit(const ExtendsStatementNode& node) override {
+    const auto copy = result->arena->make<ExtendsStatementNode>(node.file, node.pos);
+    copy->link_index = node.link_index;
+    current_block->nodes.emplace_back(copy);
+  }
+
+  void visit(const BlockStatementNode& node) override {
+    const auto copy = result->arena->make<BlockStatementNode>(current_block, node.name, node.pos);
+    current_block->nodes.emplace_back(copy);
+    result->add_block(copy);
+    copy_block(node.block, copy->block);
+  }
+
+  void visit(const SetStatementNode& node) override {
+    const auto copy = result->arena->make<SetStatementNode>(node.key, node.pos);
+    copy_expression_list(node.expression, copy->expression);
+    current_block->nodes.emplace_back(copy);
+  }
+
+  /// Replaces the printing of constant values by text
+  void prerender(BlockNode& block) {
+    for (auto& node : block.nodes) {
+      if (const auto expression = dynamic_cast<ExpressionListNode*>(node)) {
+        if (const auto literal = dynamic_cast<const LiteralNode*>(expression->root)) {
+          std::ostringstream os;
+          Renderer(render_config, template_storage, function_storage).print_to(os, literal->value);
+
+          const size_t pos = result->content.size();
+          result->content += os.str();
+          node = result->arena->make<TextNode>(pos, result->content.size() - pos);
         }
-        sep = separator;
+
+      } else if (const auto if_statement = dynamic_cast<IfStatementNode*>(node)) {
+        prerender(if_statement->true_statement);
+        prerender(if_statement->false_statement);
+      } else if (const auto for_statement = dynamic_cast<ForStatementNode*>(node)) {
+        prerender(for_statement->body);
+      } else if (const auto block_statement = dynamic_cast<BlockStatementNode*>(node)) {
+        prerender(block_statement->block);
       }
-      make_result(os.str());
-    } break;
-    case Op::None:
-      break;
     }
   }
 
-  void visit(const ExpressionListNode& node) override {
-    print_data(eval_expression_list(node));
-  }
+public:
+  explicit Specializer(const ParserConfig& config, const RenderConfig& render_config, const TemplateStorage& template_storage,
+                       const FunctionStorage& function_storage)
+      : render_config(render_config), template_storage(template_storage), function_storage(function_storage), optimizer_config(config),
+        optimizer(optimizer_config, template_storage, function_storage) {
+    optimizer_config.optimization_level = 2;
+  }
+
+  /// Returns a copy of the template in which everything that only depends on the static data is evaluated
+  Template specialize(const Template& tmpl, const json& data) {
+    Template specialized(tmpl.content);
+    specialized.dependencies = tmpl.dependencies;
+    result = &specialized;
+    static_data = &data;
+    has_dynamic_exists = false;
+    has_static_misses = false;
+
+    auto analysis = SpecializationAnalysis();
+    tmpl.root.accept(analysis);
+    assigned_names = std::move(analysis.assigned_names);
+
+    copy_block(tmpl.root, specialized.root);
+    optimizer.optimize(specialized);
+    prerender(specialized.root);
+    optimizer.optimize(specialized);
+
+    // Included and extended templates read the static data when rendering, as well as names before they are assigned and
+    // names that are missing from it
+    const bool is_read_later = !specialized.dependencies.empty() || has_dynamic_exists || has_static_misses ||
+                               std::any_of(assigned_names.begin(), assigned_names.end(), [&](const std::string& name) { return data.is_object() && data.contains(name); });
+    if (is_read_later) {
+      specialized.static_data = std::make_shared<const json>(data);
+    }
+
+    result = nullptr;
+    static_data = nullptr;
+    specialized.analyze();
+    if (optimizer_config.compile_bytecode) {
+      specialized.compile();
+    }
+    return specialized;
+  }
+};
+
+} // namespace inja
+
+#endif // INCLUDE_INJA_SPECIALIZER_HPP_
+
+// #include "template.hpp"
+
+// #include "template_cache.hpp"
+#ifndef INCLUDE_INJA_TEMPLATE_CACHE_HPP_
+#define INCLUDE_INJA_TEMPLATE_CACHE_HPP_
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <functional>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// #include "config.hpp"
+
+// #include "function_storage.hpp"
+
+// #include "include_resolver.hpp"
+
+// #include "template.hpp"
+
+
+namespace inja {
+
+/*!
+ * \brief Bounded least-recently-used cache of templates parsed from strings, safe for concurrent use.
+ */
+class TemplateCache {
+public:
+  struct Statistics {
+    size_t hits {0};
+    size_t misses {0};
+    size_t size {0};
+    size_t capacity {0};
+  };
+
+  /// Returns a hash of all options that change the result of parsing the same input. The include callbacks can not be
+  /// hashed, so that the cache is cleared when they are set
+  static size_t hash_config(const LexerConfig& lexer_config, const ParserConfig& parser_config, const FunctionStorage& function_storage,
+                            const std::filesystem::path& input_path) {
+    size_t result {0};
+    const auto combine = [&result](size_t value) { result ^= value + 0x9e3779b97f4a7c15 + (result << 6) + (result >> 2); };
+    for (const auto& delimiter :
+         {lexer_config.statement_open, lexer_config.statement_open_no_lstrip, lexer_config.statement_open_force_lstrip, lexer_config.statement_close,
+          lexer_config.statement_close_force_rstrip, lexer_config.line_statement, lexer_config.expression_open, lexer_config.expression_open_force_lstrip,
+          lexer_config.expression_close, lexer_config.expression_close_force_rstrip, lexer_config.comment_open, lexer_config.comment_open_force_lstrip,
+          lexer_config.comment_close, lexer_config.comment_close_force_rstrip}) {
+      combine(std::hash<std::string>()(delimiter));
+    }
+    combine(lexer_config.trim_blocks);
+    combine(lexer_config.lstrip_blocks);
+    combine(parser_config.search_included_templates_in_files);
+    combine(parser_config.compile_bytecode);
+    combine(parser_config.optimization_level);
+    for (const auto& search_path : parser_config.include_resolver->get_search_paths()) {
+      combine(std::hash<std::string>()(search_path.string()));
+    }
+    combine(static_cast<size_t>(parser_config.include_resolver->get_negative_ttl().count()));
+    combine(static_cast<size_t>(parser_config.include_resolver->get_positive_ttl().count()));
+    combine(function_storage.get_version());
+    combine(std::hash<std::string>()(input_path.string()));
+    return result;
+  }
+
+private:
+  struct Entry {
+    size_t key;
+    size_t config_hash;
+    std::string input;
+    std::shared_ptr<const Template> tmpl;
+  };
 
-  void visit(const StatementNode&) override {}
+  mutable std::mutex mutex;
+  std::list<Entry> entries; // Most recently used first
+  std::unordered_map<size_t, std::list<Entry>::iterator> index;
+  size_t capacity {0};
+  size_t hits {0};
+  size_t misses {0};
 
-  void visit(const ForStatementNode&) override {}
+  static size_t make_key(std::string_view input, size_t config_hash) {
+    return std::hash<std::string_view>()(input) ^ (config_hash * 0x9e3779b97f4a7c15);
+  }
 
-  void visit(const ForArrayStatementNode& node) override {
-    const auto result = eval_expression_list(node.condition);
-    if (!result->is_array()) {
-      throw_renderer_error("object must be an array", node);
+  void evict() {
+    while (entries.size() > capacity) {
+      index.erase(entries.back().key);
+      entries.pop_back();
     }
+  }
+
+public:
+  explicit TemplateCache(size_t capacity = 0): capacity(capacity) {}
+
+  TemplateCache(const TemplateCache& other) {
+    std::scoped_lock lock(other.mutex);
+    capacity = other.capacity;
+  }
 
-    if (!current_loop_data->empty()) {
-      auto tmp = *current_loop_data; // Because of clang-3
-      (*current_loop_data)["parent"] = std::move(tmp);
+  TemplateCache& operator=(const TemplateCache& other) {
+    if (this != &other) {
+      std::scoped_lock lock(mutex, other.mutex);
+      capacity = other.capacity;
+      evict();
     }
+    return *this;
+  }
 
-    size_t index = 0;
-    (*current_loop_data)["is_first"] = true;
-    (*current_loop_data)["is_last"] = (result->size() <= 1);
-    for (auto it = result->begin(); it != result->end(); ++it) {
-      additional_data[static_cast<std::string>(node.value)] = *it;
+  /// Sets the maximal number of templates, where 0 disables the cache
+  void set_capacity(size_t new_capacity) {
+    std::scoped_lock lock(mutex);
+    capacity = new_capacity;
+    evict();
+  }
 
-      (*current_loop_data)["index"] = index;
-      (*current_loop_data)["index1"] = index + 1;
-      if (index == 1) {
-        (*current_loop_data)["is_first"] = false;
-      }
-      if (index == result->size() - 1) {
-        (*current_loop_data)["is_last"] = true;
-      }
+  bool is_enabled() const {
+    std::scoped_lock lock(mutex);
+    return capacity > 0;
+  }
 
-      node.body.accept(*this);
-      ++index;
+  /// Returns the cached template for the input, or nullptr on a miss
+  std::shared_ptr<const Template> find(std::string_view input, size_t config_hash) {
+    const size_t key = make_key(input, config_hash);
+    std::scoped_lock lock(mutex);
+    const auto it = index.find(key);
+    if (it == index.end() || it->second->config_hash != config_hash || it->second->input != input) {
+      misses += 1;
+      return nullptr;
     }
 
-    additional_data[static_cast<std::string>(node.value)].clear();
-    if (!(*current_loop_data)["parent"].empty()) {
-      const auto tmp = (*current_loop_data)["parent"];
-      *current_loop_data = tmp;
-    } else {
-      current_loop_data = &additional_data["loop"];
-    }
+    hits += 1;
+    entries.splice(entries.begin(), entries, it->second);
+    return it->second->tmpl;
   }
 
-  void visit(const ForObjectStatementNode& node) override {
-    const auto result = eval_expression_list(node.condition);
-    if (!result->is_object()) {
-      throw_renderer_error("object must be an object", node);
+  void insert(std::string_view input, size_t config_hash, std::shared_ptr<const Template> tmpl) {
+    const size_t key = make_key(input, config_hash);
+    std::scoped_lock lock(mutex);
+    if (capacity == 0) {
+      return;
     }
 
-    if (!current_loop_data->empty()) {
-      (*current_loop_data)["parent"] = std::move(*current_loop_data);
+    // A colliding entry is replaced
+    const auto it = index.find(key);
+    if (it != index.end()) {
+      entries.erase(it->second);
+      index.erase(it);
     }
 
-    size_t index = 0;
-    (*current_loop_data)["is_first"] = true;
-    (*current_loop_data)["is_last"] = (result->size() <= 1);
-    for (auto it = result->begin(); it != result->end(); ++it) {
-      additional_data[static_cast<std::string>(node.key)] = it.key();
-      additional_data[static_cast<std::string>(node.value)] = it.value();
+    entries.push_front({key, config_hash, std::string(input), std::move(tmpl)});
+    index.emplace(key, entries.begin());
+    evict();
+  }
 
-      (*current_loop_data)["index"] = index;
-      (*current_loop_data)["index1"] = index + 1;
-      if (index == 1) {
-        (*current_loop_data)["is_first"] = false;
-      }
-      if (index == result->size() - 1) {
-        (*current_loop_data)["is_last"] = true;
-      }
+  void clear() {
+    std::scoped_lock lock(mutex);
+    entries.clear();
+    index.clear();
+  }
 
-      node.body.accept(*this);
-      ++index;
+  Statistics statistics() const {
+    std::scoped_lock lock(mutex);
+    return Statistics {hits, misses, entries.size(), capacity};
+  }
+};
+
+/*!
+ * \brief Cache of templates parsed from files, which are revalidated by their modification time and size.
+ *
+ * Each entry remembers the files of all templates it includes or extends, directly or indirectly. If one of them
+ * changed, it is removed from the template storage so that it is loaded again, and all entries depending on it are
+ * invalidated.
+ */
+class FileTemplateCache {
+  struct FileStamp {
+    bool exists {false};
+    std::filesystem::file_time_type time;
+    std::uintmax_t size {0};
+
+    static FileStamp of(const std::filesystem::path& path) {
+      FileStamp result;
+      std::error_code error;
+      result.time = std::filesystem::last_write_time(path, error);
+      if (!error) {
+        result.size = std::filesystem::file_size(path, error);
+        result.exists = !error;
+      }
+      return result;
     }
 
-    additional_data[static_cast<std::string>(node.key)].clear();
-    additional_data[static_cast<std::string>(node.value)].clear();
-    if (!(*current_loop_data)["parent"].empty()) {
-      *current_loop_data = std::move((*current_loop_data)["parent"]);
-    } else {
-      current_loop_data = &additional_data["loop"];
+    bool operator==(const FileStamp& other) const {
+      return exists == other.exists && (!exists || (time == other.time && size == other.size));
     }
+  };
+
+  struct Entry {
+    std::shared_ptr<const Template> tmpl;
+    std::string path;
+    FileStamp stamp;
+    std::map<std::string, FileStamp> dependencies; // By name in the template storage
+    std::chrono::steady_clock::time_point checked;
+  };
+
+  mutable std::mutex mutex;
+  std::map<std::string, Entry> entries; // By canonical path
+  std::chrono::steady_clock::duration revalidation_interval {std::chrono::seconds(1)};
+  bool enabled {false};
+
+  static std::string canonical_name(const std::filesystem::path& path) {
+    std::error_code error;
+    const auto result = std::filesystem::weakly_canonical(path, error);
+    return error ? path.string() : result.string();
   }
 
-  void visit(const IfStatementNode& node) override {
-    const auto result = eval_expression_list(node.condition);
-    if (truthy(result.get())) {
-      node.true_statement.accept(*this);
-    } else if (node.has_false_statement) {
-      node.false_statement.accept(*this);
+  static void collect_dependencies(const Template& tmpl, const TemplateStorage& storage, std::map<std::string, FileStamp>& result) {
+    for (const auto& name : tmpl.dependencies) {
+      if (result.count(name) == 0) {
+        result.emplace(name, FileStamp::of(name));
+        if (const auto dependency = storage.find(name)) {
+          collect_dependencies(*dependency, storage, result);
+        }
+      }
     }
   }
 
-  void visit(const IncludeStatementNode& node) override {
-    auto sub_renderer = Renderer(config, template_storage, function_storage);
-    const auto included_template_it = template_storage.find(node.file);
-    if (included_template_it != template_storage.end()) {
-      sub_renderer.render_to(*output_stream, included_template_it->second, *data_input, &additional_data);
-    } else if (config.throw_at_missing_includes) {
-      throw_renderer_error("include '" + node.file + "' not found", node);
+  void invalidate_dependents(const std::string& name) {
+    for (auto it = entries.begin(); it != entries.end();) {
+      if (it->second.dependencies.count(name) > 0) {
+        it = entries.erase(it);
+      } else {
+        ++it;
+      }
     }
   }
 
-  void visit(const ExtendsStatementNode& node) override {
-    const auto included_template_it = template_storage.find(node.file);
-    if (included_template_it != template_storage.end()) {
-      const Template* parent_template = &included_template_it->second;
-      render_to(*output_stream, *parent_template, *data_input, &additional_data);
-      break_rendering = true;
-    } else if (config.throw_at_missing_includes) {
-      throw_renderer_error("extends '" + node.file + "' not found", node);
+public:
+  explicit FileTemplateCache() {}
+
+  FileTemplateCache(const FileTemplateCache& other) {
+    std::scoped_lock lock(other.mutex);
+    revalidation_interval = other.revalidation_interval;
+    enabled = other.enabled;
+  }
+
+  FileTemplateCache& operator=(const FileTemplateCache& other) {
+    if (this != &other) {
+      std::scoped_lock lock(mutex, other.mutex);
+      revalidation_interval = other.revalidation_interval;
+      enabled = other.enabled;
+      entries.clear();
     }
+    return *this;
   }
 
-  void visit(const BlockStatementNode& node) override {
-    const size_t old_level = current_level;
-    current_level = 0;
-    current_template = template_stack.front();
-    const auto block_it = current_template->block_storage.find(node.name);
-    if (block_it != current_template->block_storage.end()) {
-      block_statement_stack.emplace_back(&node);
-      block_it->second->block.accept(*this);
-      block_statement_stack.pop_back();
+  /// Enables or disables the cache, and sets the minimal time between two checks of the files of a template
+  void configure(bool enable, std::chrono::steady_clock::duration interval) {
+    std::scoped_lock lock(mutex);
+    enabled = enable;
+    revalidation_interval = interval;
+    if (!enabled) {
+      entries.clear();
     }
-    current_level = old_level;
-    current_template = template_stack.back();
   }
 
-  void visit(const SetStatementNode& node) override {
-    std::string ptr = node.key;
-    replace_substring(ptr, ".", "/");
-    ptr = "/" + ptr;
-    additional_data[json::json_pointer(ptr)] = *eval_expression_list(node.expression);
+  bool is_enabled() const {
+    std::scoped_lock lock(mutex);
+    return enabled;
   }
 
-public:
-  explicit Renderer(const RenderConfig& config, const TemplateStorage& template_storage, const FunctionStorage& function_storage)
-      : config(config), template_storage(template_storage), function_storage(function_storage) {}
+  /// Returns the cached template of the file if it is still valid, or nullptr
+  std::shared_ptr<const Template> find(const std::filesystem::path& path, TemplateStorage& storage) {
+    const auto key = canonical_name(path);
+    const auto now = std::chrono::steady_clock::now();
 
-  void render_to(std::ostream& os, const Template& tmpl, const json& data, json* loop_data = nullptr) {
-    output_stream = &os;
-    current_template = &tmpl;
-    data_input = &data;
-    if (loop_data != nullptr) {
-      additional_data = *loop_data;
-      current_loop_data = &additional_data["loop"];
+    std::scoped_lock lock(mutex);
+    auto it = entries.find(key);
+    if (it == entries.end()) {
+      return nullptr;
     }
 
-    template_stack.emplace_back(current_template);
-    current_template->root.accept(*this);
+    auto& entry = it->second;
+    if (now - entry.checked < revalidation_interval) {
+      return entry.tmpl;
+    }
 
-    data_tmp_stack.clear();
+    std::vector<std::string> changed;
+    for (const auto& [name, stamp] : entry.dependencies) {
+      if (!(FileStamp::of(name) == stamp)) {
+        changed.emplace_back(name);
+      }
+    }
+
+    if (changed.empty() && FileStamp::of(entry.path) == entry.stamp) {
+      entry.checked = now;
+      return entry.tmpl;
+    }
+
+    storage.erase(entry.path);
+    entries.erase(it);
+    for (const auto& name : changed) {
+      storage.erase(name);
+      invalidate_dependents(name);
+    }
+    return nullptr;
+  }
+
+  /// Adds the template parsed from the file, with the current state of its file and all its dependencies
+  void insert(const std::filesystem::path& path, std::shared_ptr<const Template> tmpl, const TemplateStorage& storage) {
+    Entry entry;
+    entry.path = IncludeResolver::storage_name(path); // So that a changed file is also removed from the storage
+    entry.stamp = FileStamp::of(path);
+    collect_dependencies(*tmpl, storage, entry.dependencies);
+    entry.tmpl = std::move(tmpl);
+    entry.checked = std::chrono::steady_clock::now();
+
+    std::scoped_lock lock(mutex);
+    if (enabled) {
+      entries.insert_or_assign(canonical_name(path), std::move(entry));
+    }
+  }
+
+  void clear() {
+    std::scoped_lock lock(mutex);
+    entries.clear();
+  }
+
+  size_t size() const {
+    std::scoped_lock lock(mutex);
+    return entries.size();
   }
 };
 
 } // namespace inja
 
-#endif // INCLUDE_INJA_RENDERER_HPP_
-
-// #include "template.hpp"
+#endif // INCLUDE_INJA_TEMPLATE_CACHE_HPP_
 
 // #include "throw.hpp"
 
 
 namespace inja {
 
+/*!
+ * \brief Result of preloading a template directory, with the parse time or error of each file.
+ */
+struct PreloadReport {
+  struct File {
+    std::string name;
+    std::chrono::steady_clock::duration parse_time {0};
+    std::string error; // Empty if the file was parsed successfully
+  };
+
+  std::vector<File> files;
+
+  size_t count_errors() const {
+    return std::count_if(files.begin(), files.end(), [](const File& file) { return !file.error.empty(); });
+  }
+};
+
 /*!
  * \brief Class for changing the configuration.
+ *
+ * After its configuration and callbacks are set, an environment can be shared between threads: parsing and rendering
+ * may run concurrently, and templates are registered in a storage that is safe for concurrent lookups and insertions.
  */
 class Environment {
   FunctionStorage function_storage;
   TemplateStorage template_storage;
+  TemplateCache template_cache;
+  size_t template_cache_config {0}; // Hash of the configuration that parsing depends on, updated by every setter of it
+  FileTemplateCache file_template_cache;
+
+  /// Returns the parsed template from the cache of string templates, or parses and caches it
+  std::shared_ptr<const Template> parse_cached(std::string_view input) {
+    auto result = template_cache.find(input, template_cache_config);
+    if (!result) {
+      result = std::make_shared<const Template>(parse(input));
+      template_cache.insert(input, template_cache_config, result);
+    }
+    return result;
+  }
+
+  /// Hashes the configuration again after it changed, so that templates parsed before are not found in the cache
+  void update_template_cache_config() {
+    template_cache_config = TemplateCache::hash_config(lexer_config, parser_config, function_storage, input_path);
+  }
+
+  std::shared_ptr<const Template> load_template(const std::filesystem::path& filename) {
+    // Files that are already registered, e.g. by preloading, are not parsed again
+    if (auto registered = template_storage.find(Parser::storage_name(input_path / filename))) {
+      return registered;
+    }
+
+    Parser parser(parser_config, lexer_config, template_storage, function_storage);
+    auto result = Template(Parser::load_file(input_path / filename));
+    parser.parse_into_template(result, (input_path / filename).string());
+    return std::make_shared<const Template>(std::move(result));
+  }
+
+  /// Returns the parsed template of the file from the cache, or parses and caches it
+  std::shared_ptr<const Template> parse_template_cached(const std::filesystem::path& filename) {
+    const auto path = input_path / filename;
+    auto result = file_template_cache.find(path, template_storage);
+    if (!result) {
+      result = load_template(filename);
+      file_template_cache.insert(path, result, template_storage);
+    }
+    return result;
+  }
 
 protected:
   LexerConfig lexer_config;
@@ -2853,8 +6484,13 @@ protected:
 
 public:
   Environment(): Environment("") {}
-  explicit Environment(const std::filesystem::path& global_path): input_path(global_path), output_path(global_path) {}
-  Environment(const std::filesystem::path& input_path, const std::filesystem::path& output_path): input_path(input_path), output_path(output_path) {}
+  explicit Environment(const std::filesystem::path& global_path): input_path(global_path), output_path(global_path) {
+    update_template_cache_config();
+  }
+
+  Environment(const std::filesystem::path& input_path, const std::filesystem::path& output_path): input_path(input_path), output_path(output_path) {
+    update_template_cache_config();
+  }
 
   /// Sets the opener and closer for template statements
   void set_statement(const std::string& open, const std::string& close) {
@@ -2864,12 +6500,14 @@ public:
     lexer_config.statement_close = close;
     lexer_config.statement_close_force_rstrip = "-" + close;
     lexer_config.update_open_chars();
+    update_template_cache_config();
   }
 
   /// Sets the opener for template line statements
   void set_line_statement(const std::string& open) {
     lexer_config.line_statement = open;
     lexer_config.update_open_chars();
+    update_template_cache_config();
   }
 
   /// Sets the opener and closer for template expressions
@@ -2879,6 +6517,7 @@ public:
     lexer_config.expression_close = close;
     lexer_config.expression_close_force_rstrip = "-" + close;
     lexer_config.update_open_chars();
+    update_template_cache_config();
   }
 
   /// Sets the opener and closer for template comments
@@ -2888,21 +6527,66 @@ public:
     lexer_config.comment_close = close;
     lexer_config.comment_close_force_rstrip = "-" + close;
     lexer_config.update_open_chars();
+    update_template_cache_config();
   }
 
   /// Sets whether to remove the first newline after a block
   void set_trim_blocks(bool trim_blocks) {
     lexer_config.trim_blocks = trim_blocks;
+    update_template_cache_config();
   }
 
   /// Sets whether to strip the spaces and tabs from the start of a line to a block
   void set_lstrip_blocks(bool lstrip_blocks) {
     lexer_config.lstrip_blocks = lstrip_blocks;
+    update_template_cache_config();
   }
 
   /// Sets the element notation syntax
   void set_search_included_templates_in_files(bool search_in_files) {
     parser_config.search_included_templates_in_files = search_in_files;
+    update_template_cache_config();
+  }
+
+  /// Sets the directories in which included templates are searched after the directory of the including template
+  void set_include_search_paths(const std::vector<std::filesystem::path>& search_paths) {
+    const auto& resolver = *parser_config.include_resolver;
+    parser_config.include_resolver = std::make_shared<IncludeResolver>(search_paths, resolver.get_negative_ttl(), resolver.get_positive_ttl());
+    update_template_cache_config();
+  }
+
+  /// Sets for how long an included template that is not found in the file system is not searched again, one second by
+  /// default and 0 disables it
+  void set_include_negative_cache_ttl(std::chrono::steady_clock::duration ttl) {
+    const auto& resolver = *parser_config.include_resolver;
+    parser_config.include_resolver = std::make_shared<IncludeResolver>(resolver.get_search_paths(), ttl, resolver.get_positive_ttl());
+    update_template_cache_config();
+  }
+
+  /// Sets for how long the file found for an included template is used without searching it again, one second by default
+  /// and 0 disables it
+  void set_include_positive_cache_ttl(std::chrono::steady_clock::duration ttl) {
+    const auto& resolver = *parser_config.include_resolver;
+    parser_config.include_resolver = std::make_shared<IncludeResolver>(resolver.get_search_paths(), resolver.get_negative_ttl(), ttl);
+    update_template_cache_config();
+  }
+
+  /// Sets the number of threads on which the included files of one level are parsed, where 0 uses one per core and 1
+  /// (the default) parses them on the calling thread
+  void set_include_parse_threads(size_t thread_count) {
+    parser_config.include_parse_threads = thread_count;
+  }
+
+  /// Sets whether parsed templates are compiled to bytecode for rendering
+  void set_compile_bytecode(bool compile) {
+    parser_config.compile_bytecode = compile;
+    update_template_cache_config();
+  }
+
+  /// Sets how far parsed templates are optimized, from 0 (none) to 2
+  void set_optimization_level(unsigned int level) {
+    parser_config.optimization_level = level;
+    update_template_cache_config();
   }
 
   /// Sets whether a missing include will throw an error
@@ -2910,21 +6594,65 @@ public:
     render_config.throw_at_missing_includes = will_throw;
   }
 
+  /// Sets the maximal number of nodes of included templates that are rendered inline, 0 disables inlining
+  void set_include_inline_threshold(size_t threshold) {
+    render_config.include_inline_threshold = threshold;
+  }
+
   /// Sets whether we'll automatically perform HTML escape
   void set_html_autoescape(bool will_escape) {
     render_config.html_autoescape = will_escape;
   }
 
+  /// Sets the number of templates that are kept when rendering strings, where 0 (the default) disables the cache
+  void set_template_cache_size(size_t capacity) {
+    template_cache.set_capacity(capacity);
+  }
+
+  /// Sets whether templates parsed from files are cached, and how often their files are checked for changes
+  void set_file_template_cache(bool enable, std::chrono::steady_clock::duration revalidation_interval = std::chrono::seconds(1)) {
+    file_template_cache.configure(enable, revalidation_interval);
+  }
+
+  /// Returns the hit and miss counters of the cache for rendering strings
+  TemplateCache::Statistics get_template_cache_statistics() const {
+    return template_cache.statistics();
+  }
+
+  /// Returns the hit, miss and file lookup counters of the resolution of included files
+  IncludeResolver::Statistics get_include_resolver_statistics() const {
+    return parser_config.include_resolver->statistics();
+  }
+
   Template parse(std::string_view input) {
     Parser parser(parser_config, lexer_config, template_storage, function_storage);
     return parser.parse(input, input_path);
   }
 
+  /// Returns a smaller template in which everything that only depends on the static data is pre-rendered
+  Template specialize(const Template& tmpl, const json& static_data) {
+    Specializer specializer(parser_config, render_config, template_storage, function_storage);
+    return specializer.specialize(tmpl, static_data);
+  }
+
+  /// Returns the parsed template as an immutable handle, which can be rendered and included without copying it
+  std::shared_ptr<const Template> parse_shared(std::string_view input) {
+    if (template_cache.is_enabled()) {
+      return parse_cached(input);
+    }
+    return std::make_shared<const Template>(parse(input));
+  }
+
+  /// Returns the parsed template of the file as an immutable handle, which can be rendered and included without copying it
+  std::shared_ptr<const Template> parse_template_shared(const std::filesystem::path& filename) {
+    if (file_template_cache.is_enabled()) {
+      return parse_template_cached(filename);
+    }
+    return load_template(filename);
+  }
+
   Template parse_template(const std::filesystem::path& filename) {
-    Parser parser(parser_config, lexer_config, template_storage, function_storage);
-    auto result = Template(Parser::load_file(input_path / filename));
-    parser.parse_into_template(result, (input_path / filename).string());
-    return result;
+    return *parse_template_shared(filename);
   }
 
   Template parse_file(const std::filesystem::path& filename) {
@@ -2932,6 +6660,9 @@ public:
   }
 
   std::string render(std::string_view input, const json& data) {
+    if (template_cache.is_enabled()) {
+      return render(*parse_cached(input), data);
+    }
     return render(parse(input), data);
   }
 
@@ -2941,8 +6672,15 @@ public:
     return os.str();
   }
 
+  /// Renders with the bookkeeping kept in the context, which is reused by the next render with it
+  std::string render(const Template& tmpl, const json& data, RenderContext& context) {
+    std::stringstream os;
+    render_to(os, tmpl, data, context);
+    return os.str();
+  }
+
   std::string render_file(const std::filesystem::path& filename, const json& data) {
-    return render(parse_template(filename), data);
+    return render(*parse_template_shared(filename), data);
   }
 
   std::string render_file_with_json_file(const std::filesystem::path& filename, const std::string& filename_data) {
@@ -2977,10 +6715,118 @@ public:
     return os;
   }
 
+  std::ostream& render_to(std::ostream& os, const Template& tmpl, const json& data, RenderContext& context) {
+    Renderer(render_config, template_storage, function_storage, context).render_to(os, tmpl, data);
+    return os;
+  }
+
   std::ostream& render_to(std::ostream& os, const std::string_view input, const json& data) {
+    if (template_cache.is_enabled()) {
+      return render_to(os, *parse_cached(input), data);
+    }
     return render_to(os, parse(input), data);
   }
 
+  /*!
+  @brief Parses all files below the directory whose file name matches the pattern on a pool of threads
+
+  The templates and everything they include are registered in a single step after all files are parsed, under the
+  same names that includes of these files resolve to. Files that fail to parse are reported and not registered. A
+  thread count of 0 uses one thread per core.
+  */
+  PreloadReport preload_directory(const std::filesystem::path& directory, std::string_view pattern = "*", size_t thread_count = 0) {
+    PreloadReport report;
+    for (const auto& entry : std::filesystem::recursive_directory_iterator(input_path / directory)) {
+      if (entry.is_regular_file() && string_view::matches_wildcard(entry.path().filename().string(), pattern)) {
+        report.files.push_back({Parser::storage_name(entry.path()), {}, {}});
+      }
+    }
+    std::sort(report.files.begin(), report.files.end(), [](const auto& a, const auto& b) { return a.name < b.name; });
+
+    // Parsed into a staging copy of the storage, so that includes between the files are shared by the workers
+    const TemplateStorage original_storage = template_storage;
+    TemplateStorage staging_storage = original_storage;
+
+    // The workers already run in parallel, so that their parsers do not start threads of their own
+    ParserConfig worker_config = parser_config;
+    worker_config.include_parse_threads = 1;
+
+    std::atomic<size_t> next {0};
+    const auto work = [&]() {
+      for (size_t i = next++; i < report.files.size(); i = next++) {
+        auto& file = report.files[i];
+        const auto start = std::chrono::steady_clock::now();
+#if !defined(INJA_NOEXCEPTION)
+        try {
+#endif
+          if (!staging_storage.find(file.name)) {
+            Parser parser(worker_config, lexer_config, staging_storage, function_storage);
+            auto tmpl = Template(Parser::load_file(file.name));
+            parser.parse_into_template(tmpl, file.name);
+            staging_storage.emplace(file.name, std::move(tmpl));
+          }
+#if !defined(INJA_NOEXCEPTION)
+        } catch (const std::exception& e) {
+          file.error = e.what();
+        }
+#endif
+        file.parse_time = std::chrono::steady_clock::now() - start;
+      }
+    };
+
+    if (thread_count == 0) {
+      thread_count = std::max(std::thread::hardware_concurrency(), 1u);
+    }
+    std::vector<std::thread> threads;
+    for (size_t t = 1; t < std::min(thread_count, report.files.size()); ++t) {
+      threads.emplace_back(work);
+    }
+    work();
+    for (auto& thread : threads) {
+      thread.join();
+    }
+
+    const auto original_templates = original_storage.snapshot();
+    const std::map<std::string, std::shared_ptr<const Template>> original_map(original_templates.begin(), original_templates.end());
+
+    std::vector<std::pair<std::string, std::shared_ptr<const Template>>> new_templates;
+    for (auto& [name, tmpl] : staging_storage.snapshot()) {
+      const auto original = original_map.find(name);
+      if (original == original_map.end() || original->second != tmpl) {
+        new_templates.emplace_back(name, std::move(tmpl));
+      }
+    }
+    template_storage.insert_or_assign_all(new_templates);
+    return report;
+  }
+
+  /*!
+  @brief Registers the files below the directory whose file name matches the pattern, without reading them
+
+  Each file is read and parsed when it is rendered or included for the first time, exactly once even if several threads
+  need it at the same time. It uses the configuration and callbacks of the environment at the time of registration.
+  */
+  void add_template_root(const std::filesystem::path& directory, std::string_view pattern = "*") {
+    struct LoaderContext {
+      LexerConfig lexer_config;
+      ParserConfig parser_config;
+      FunctionStorage function_storage;
+    };
+    const auto context = std::make_shared<const LoaderContext>(LoaderContext {lexer_config, parser_config, function_storage});
+
+    for (const auto& entry : std::filesystem::recursive_directory_iterator(input_path / directory)) {
+      if (entry.is_regular_file() && string_view::matches_wildcard(entry.path().filename().string(), pattern)) {
+        const std::string name = Parser::storage_name(entry.path());
+        template_storage.emplace_lazy(name, [context, name](TemplateStorage& storage) {
+          Parser parser(context->parser_config, context->lexer_config, storage, context->function_storage);
+          auto result = Template(Parser::load_file(name));
+          parser.parse_into_template(result, name);
+          return result;
+        });
+      }
+    }
+  }
+
   std::string load_file(const std::string& filename) {
     const Parser parser(parser_config, lexer_config, template_storage, function_storage);
     return Parser::load_file(input_path / filename);
@@ -3015,6 +6861,7 @@ public:
   */
   void add_callback(const std::string& name, int num_args, const CallbackFunction& callback) {
     function_storage.add_callback(name, num_args, callback);
+    update_template_cache_config();
   }
 
   /*!
@@ -3025,6 +6872,7 @@ public:
       callback(args);
       return json();
     });
+    update_template_cache_config();
   }
 
   /** Includes a template with a given name into the environment.
@@ -3032,7 +6880,94 @@ public:
    * include "<name>" syntax.
    */
   void include_template(const std::string& name, const Template& tmpl) {
-    template_storage[name] = tmpl;
+    template_storage.insert_or_assign(name, tmpl);
+  }
+
+  /// Includes a template without copying it
+  void include_template(const std::string& name, Template&& tmpl) {
+    template_storage.insert_or_assign(name, std::move(tmpl));
+  }
+
+  /// Includes a shared template without copying it, e.g. one that is also included by other environments
+  void include_template(const std::string& name, std::shared_ptr<const Template> tmpl) {
+    template_storage.insert_or_assign(name, std::move(tmpl));
+  }
+
+  /*!
+  @brief Links the template and everything it includes or extends, directly or indirectly, to their targets up front
+
+  Throws if a target is missing (unless missing includes are allowed), or if templates extend each other in a cycle.
+  Renders then find the targets without looking up their names, until a template of the environment is replaced.
+  */
+  void link(const Template& tmpl) {
+    std::vector<std::shared_ptr<const Template>> linked;
+    std::set<const Template*> visited {&tmpl};
+    std::vector<const Template*> queue {&tmpl};
+    for (size_t i = 0; i < queue.size(); ++i) {
+      for (const auto& name : queue[i]->dependencies) {
+        auto target = template_storage.find(name);
+        if (!target) {
+          if (render_config.throw_at_missing_includes) {
+            INJA_THROW(LinkError("template '" + name + "' not found"));
+          }
+          continue;
+        }
+        if (visited.insert(target.get()).second) {
+          queue.emplace_back(target.get());
+          linked.emplace_back(std::move(target));
+        }
+      }
+    }
+
+    for (const auto current : queue) {
+      std::vector<std::string> chain;
+      for (auto parent = current; parent != nullptr;) {
+        auto statistic_visitor = StatisticsVisitor();
+        parent->root.accept(statistic_visitor);
+        if (statistic_visitor.extended_templates.empty()) {
+          break;
+        }
+
+        const auto& name = statistic_visitor.extended_templates.front();
+        if (std::find(chain.begin(), chain.end(), name) != chain.end()) {
+          std::string cycle;
+          for (const auto& link : chain) {
+            cycle += link + " -> ";
+          }
+          INJA_THROW(LinkError("templates extend each other in a cycle: " + cycle + name));
+        }
+        chain.emplace_back(name);
+        const auto target = template_storage.find_loaded(name);
+        parent = target.get();
+      }
+    }
+
+    // Loading the targets changed the storage, so all links are built afterwards
+    for (const auto current : queue) {
+      current->link(template_storage);
+    }
+  }
+
+  /// Returns the included template of the given name, or nullptr if there is none
+  std::shared_ptr<const Template> find_template(std::string_view name) const {
+    return template_storage.find(name);
+  }
+
+  /// Writes all included templates into a precompiled bundle
+  void save_bundle(const std::filesystem::path& filename) const {
+    std::ofstream file(output_path / filename, std::ios::binary);
+    if (file.fail()) {
+      INJA_THROW(FileError("failed accessing file at '" + (output_path / filename).string() + "'"));
+    }
+    BundleWriter(lexer_config).write(file, template_storage.snapshot());
+  }
+
+  /// Includes all templates of a precompiled bundle, which must have been written by the same inja version and lexer configuration
+  void load_bundle(const std::filesystem::path& filename) {
+    const MappedFile file(input_path / filename);
+    for (auto& [name, tmpl] : BundleReader(lexer_config, parser_config, function_storage).read(file.data())) {
+      template_storage.insert_or_assign(name, std::move(tmpl));
+    }
   }
 
   /*!
@@ -3040,14 +6975,25 @@ public:
   */
   void set_include_callback(const std::function<Template(const std::filesystem::path&, const std::string&)>& callback) {
     parser_config.include_callback = callback;
+    template_cache.clear();
+  }
+
+  /*!
+  @brief Sets a function that is called once with all included files of a level that are not found, and returns their templates in the same order
+  */
+  void set_batch_include_callback(
+      const std::function<std::vector<Template>(const std::vector<std::pair<std::filesystem::path, std::string>>&)>& callback) {
+    parser_config.batch_include_callback = callback;
+    template_cache.clear();
   }
 };
 
 /*!
-@brief render with default settings to a string
+@brief Returns the cache of the free render functions, which is disabled by default
 */
-inline std::string render(std::string_view input, const json& data) {
-  return Environment().render(input, data);
+inline TemplateCache& default_template_cache() {
+  static TemplateCache cache;
+  return cache;
 }
 
 /*!
@@ -3055,7 +7001,32 @@ inline std::string render(std::string_view input, const json& data) {
 */
 inline void render_to(std::ostream& os, std::string_view input, const json& data) {
   Environment env;
-  env.render_to(os, env.parse(input), data);
+  auto& cache = default_template_cache();
+  if (!cache.is_enabled()) {
+    env.render_to(os, env.parse(input), data);
+    return;
+  }
+
+  static const size_t config_hash = TemplateCache::hash_config(LexerConfig(), ParserConfig(), FunctionStorage(), std::filesystem::path());
+  auto tmpl = cache.find(input, config_hash);
+  if (!tmpl) {
+    tmpl = std::make_shared<const Template>(env.parse(input));
+
+    // Included templates are only stored in the temporary environment
+    if (tmpl->count_includes() == 0) {
+      cache.insert(input, config_hash, tmpl);
+    }
+  }
+  env.render_to(os, *tmpl, data);
+}
+
+/*!
+@brief render with default settings to a string
+*/
+inline std::string render(std::string_view input, const json& data) {
+  std::stringstream os;
+  render_to(os, input, data);
+  return os.str();
 }
 
 } // namespace inja
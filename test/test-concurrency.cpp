@@ -0,0 +1,75 @@
+// Copyright (c) 2020 Pantor. All rights reserved.
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include "inja/environment.hpp"
+
+#include "test-common.hpp"
+
+TEST_CASE("concurrent rendering") {
+  inja::Environment env {test_file_directory};
+  env.include_template("greeting", env.parse("Hello {{ name }}"));
+
+  inja::json data;
+  data["name"] = "Jeff";
+  data["names"] = {"Jeff", "Seb"};
+
+  const auto tmpl = env.parse("{% for n in names %}{% include \"greeting\" %}, {% endfor %}{{ upper(name) }}");
+
+  constexpr size_t thread_count {8};
+  constexpr size_t iterations {200};
+  std::atomic<size_t> failures {0};
+
+  std::vector<std::thread> threads;
+  for (size_t t = 0; t < thread_count; ++t) {
+    threads.emplace_back([&, t]() {
+      for (size_t i = 0; i < iterations; ++i) {
+        // Shared parsed template, and templates from files that are parsed and registered concurrently
+        failures += (env.render(tmpl, data) != "Hello Jeff, Hello Jeff, JEFF");
+        failures += (env.render_file("include.txt", data) != "Answer: Hello Jeff.");
+        failures += (env.render_file_with_json_file("html-extend/template.txt", "html-extend/data.json") != env.load_file("html-extend/result.txt"));
+        failures += (env.render("{% include \"simple.txt\" %} {{ length(names) }}", data) != "Hello Jeff. 2");
+
+        // Replacing a template while other threads render it
+        if (t == 0) {
+          env.include_template("greeting", env.parse("Hello {{ name }}"));
+        }
+      }
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+
+  CHECK(failures == 0);
+}
+
+TEST_CASE("concurrent lazy loading") {
+  inja::TemplateStorage storage;
+  std::atomic<size_t> loads {0};
+  storage.emplace_lazy("lazy", [&loads](inja::TemplateStorage&) {
+    loads += 1;
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    return inja::Template("Lazy");
+  });
+  CHECK(storage.contains("lazy"));
+
+  constexpr size_t thread_count {8};
+  std::vector<std::shared_ptr<const inja::Template>> results(thread_count);
+  std::vector<std::thread> threads;
+  for (size_t t = 0; t < thread_count; ++t) {
+    threads.emplace_back([&, t]() { results[t] = storage.find("lazy"); });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+
+  CHECK(loads == 1);
+  for (const auto& result : results) {
+    REQUIRE(result != nullptr);
+    CHECK(result == results[0]);
+    CHECK(result->content == "Lazy");
+  }
+}
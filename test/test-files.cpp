@@ -1,5 +1,8 @@
 // Copyright (c) 2020 Pantor. All rights reserved.
 
+#include <chrono>
+#include <thread>
+
 #include "inja/environment.hpp"
 
 #include "test-common.hpp"
@@ -106,3 +109,260 @@ TEST_CASE("include-in-memory-and-file-template") {
 
   CHECK(env.render_file("include-both.txt", data) == "Hello Jeff. - Bye Jeff.");
 }
+
+TEST_CASE("complete-files-bytecode") {
+  inja::Environment env {test_file_directory};
+  env.set_compile_bytecode(true);
+
+  for (std::string test_name : {"simple-file", "nested", "nested-line", "html", "html-extend"}) {
+    SUBCASE(test_name.c_str()) {
+      CHECK(env.render_file_with_json_file(test_name + "/template.txt", test_name + "/data.json") == env.load_file(test_name + "/result.txt"));
+    }
+  }
+}
+
+TEST_CASE("complete-files-concurrent-includes") {
+  inja::Environment env {test_file_directory};
+  env.set_include_parse_threads(0);
+
+  for (std::string test_name : {"simple-file", "nested", "nested-line", "html", "html-extend"}) {
+    SUBCASE(test_name.c_str()) {
+      CHECK(env.render_file_with_json_file(test_name + "/template.txt", test_name + "/data.json") == env.load_file(test_name + "/result.txt"));
+    }
+  }
+}
+
+TEST_CASE("preload-directory") {
+  inja::Environment env {test_file_directory};
+
+  SUBCASE("templates are registered") {
+    const auto report = env.preload_directory("html", "*.txt", 4);
+    CHECK(report.files.size() == 4);
+    CHECK(report.count_errors() == 0);
+    CHECK(env.find_template((test_file_directory / "html/header.txt").string()) != nullptr);
+    CHECK(env.render_file_with_json_file("html/template.txt", "html/data.json") == env.load_file("html/result.txt"));
+  }
+
+  SUBCASE("errors are reported per file") {
+    const auto directory = std::filesystem::temp_directory_path() / "inja-preload-directory";
+    std::filesystem::create_directories(directory);
+    std::ofstream(directory / "valid.html") << "Valid {% include \"broken.txt\" %}";
+    std::ofstream(directory / "broken.txt") << "{% if %}";
+    std::ofstream(directory / "other.html") << "Other {{ name }}";
+
+    inja::Environment temp_env;
+    const auto report = temp_env.preload_directory(directory, "*.html");
+    REQUIRE(report.files.size() == 2);
+    CHECK(report.count_errors() == 1);
+    CHECK(report.files[0].error.empty());
+    CHECK(report.files[1].error == "[inja.exception.parser_error] (at 1:9) unmatched if");
+    CHECK(temp_env.find_template((directory / "other.html").string()) != nullptr);
+    CHECK(temp_env.find_template((directory / "valid.html").string()) == nullptr);
+
+    std::filesystem::remove_all(directory);
+  }
+}
+
+TEST_CASE("template-root") {
+  const auto directory = std::filesystem::temp_directory_path() / "inja-template-root";
+  std::filesystem::create_directories(directory);
+  std::ofstream(directory / "page.html") << "Page {% include \"part.html\" %}";
+  std::ofstream(directory / "part.html") << "Part {{ name }}";
+  std::ofstream(directory / "broken.html") << "{% if %}";
+
+  inja::Environment env;
+  env.add_template_root(directory, "*.html");
+
+  inja::json data;
+  data["name"] = "Jeff";
+
+  // Broken files are only reported when they are needed
+  CHECK(env.render_file(directory / "page.html", data) == "Page Part Jeff");
+  CHECK(env.render("{% include \"" + (directory / "part.html").string() + "\" %}!", data) == "Part Jeff!");
+  CHECK_THROWS_WITH(env.find_template((directory / "broken.html").string()), "[inja.exception.parser_error] (at 1:9) unmatched if");
+
+  std::filesystem::remove_all(directory);
+}
+
+TEST_CASE("include-resolver") {
+  const auto directory = std::filesystem::temp_directory_path() / "inja-include-resolver";
+  std::filesystem::create_directories(directory / "page");
+  std::filesystem::create_directories(directory / "shared");
+  std::ofstream(directory / "page" / "main.txt") << "Main {% include \"footer.txt\" %} {% include \"virtual\" %}";
+  std::ofstream(directory / "shared" / "footer.txt") << "Footer";
+
+  inja::Environment env {directory.string() + "/"};
+  env.set_include_callback([&env](const std::filesystem::path&, const std::string& name) { return env.parse("<" + name + ">"); });
+  env.set_include_search_paths({directory / "shared"});
+
+  SUBCASE("search paths") {
+    CHECK(env.render_file("page/main.txt", {}) == "Main Footer <virtual>");
+    CHECK(env.find_template((directory / "shared" / "footer.txt").string()) != nullptr);
+  }
+
+  SUBCASE("missing files are cached") {
+    env.set_include_positive_cache_ttl(std::chrono::hours(1));
+    env.set_include_negative_cache_ttl(std::chrono::hours(1));
+    CHECK(env.render_file("page/main.txt", {}) == "Main Footer <virtual>");
+    CHECK(env.render_file("page/main.txt", {}) == "Main Footer <virtual>");
+
+    // The second parse finds both includes in the cache
+    const auto statistics = env.get_include_resolver_statistics();
+    CHECK(statistics.misses == 2);
+    CHECK(statistics.hits == 2);
+    CHECK(statistics.syscalls == 4);
+  }
+
+  SUBCASE("missing files are cached by default") {
+    CHECK(env.render_file("page/main.txt", {}) == "Main Footer <virtual>");
+    CHECK(env.get_include_resolver_statistics().syscalls == 4);
+
+    // Within the TTL, the include served by the callback is not looked up in the file system again
+    CHECK(env.render("{% include \"virtual\" %}", {}) == "<virtual>");
+    CHECK(env.render("{% include \"virtual\" %}", {}) == "<virtual>");
+    const auto statistics = env.get_include_resolver_statistics();
+    CHECK(statistics.hits == 1);
+    CHECK(statistics.syscalls == 6);
+  }
+
+  SUBCASE("found files expire") {
+    env.set_include_positive_cache_ttl(std::chrono::milliseconds(1));
+    CHECK(env.render_file("page/main.txt", {}) == "Main Footer <virtual>");
+
+    std::filesystem::remove(directory / "shared" / "footer.txt");
+    std::ofstream(directory / "page" / "footer.txt") << "Moved footer";
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    CHECK(env.render_file("page/main.txt", {}) == "Main Moved footer <virtual>");
+  }
+
+  std::filesystem::remove_all(directory);
+}
+
+TEST_CASE("file-template-cache") {
+  const auto directory = std::filesystem::temp_directory_path() / "inja-file-template-cache";
+  std::filesystem::create_directories(directory);
+  const auto write_file = [&directory](const std::string& name, const std::string& content) {
+    std::ofstream file(directory / name);
+    file << content;
+  };
+
+  write_file("main.txt", "Main {% include \"part.txt\" %}");
+  write_file("part.txt", "Part {{ name }}");
+
+  inja::Environment env {directory.string() + "/"};
+  inja::json data;
+  data["name"] = "Jeff";
+
+  SUBCASE("changes are picked up") {
+    env.set_file_template_cache(true, std::chrono::seconds(0));
+    CHECK(env.render_file("main.txt", data) == "Main Part Jeff");
+    CHECK(env.render_file("main.txt", data) == "Main Part Jeff");
+
+    write_file("part.txt", "Changed part {{ name }}");
+    CHECK(env.render_file("main.txt", data) == "Main Changed part Jeff");
+
+    write_file("main.txt", "Changed main {% include \"part.txt\" %}");
+    CHECK(env.render_file("main.txt", data) == "Changed main Changed part Jeff");
+  }
+
+  SUBCASE("changes of a file that is also included are picked up") {
+    std::filesystem::create_directories(directory / "dir");
+    write_file("dir/part.txt", "Part {{ name }}");
+    write_file("with-part.txt", "{% include \"dir/part.txt\" %}");
+
+    env.set_file_template_cache(true, std::chrono::seconds(0));
+    CHECK(env.render_file("with-part.txt", data) == "Part Jeff");
+    CHECK(env.render_file("./dir/part.txt", data) == "Part Jeff");
+
+    write_file("dir/part.txt", "Changed part {{ name }}");
+    CHECK(env.render_file("./dir/part.txt", data) == "Changed part Jeff");
+  }
+
+  SUBCASE("files are checked once per interval") {
+    env.set_file_template_cache(true, std::chrono::hours(1));
+    CHECK(env.render_file("main.txt", data) == "Main Part Jeff");
+
+    write_file("main.txt", "Changed main");
+    CHECK(env.render_file("main.txt", data) == "Main Part Jeff");
+  }
+
+  std::filesystem::remove_all(directory);
+}
+
+TEST_CASE("precompiled-bundle") {
+  const auto bundle = std::filesystem::temp_directory_path() / "inja-precompiled-bundle.bin";
+
+  inja::Environment env {test_file_directory};
+  env.add_callback("double", 1, [](inja::Arguments& args) { return 2 * args.at(0)->get<int>(); });
+  for (std::string test_name : {"simple-file", "nested", "nested-line", "html", "html-extend"}) {
+    env.include_template(test_name, env.parse_template(test_name + "/template.txt"));
+  }
+  env.include_template("inline", env.parse("{% for x in xs %}{% for y in x %}{{ loop.parent.index }}{{ double(y) }}{% endfor %}{% endfor %} "
+                                           "{% block b %}{% if exists(\"a.b\") %}{{ a.b }}{% else %}-{% endif %}{% endblock %}"));
+  env.include_template("specialized", env.specialize(env.parse("{{ site }}:{% include \"inline\" %}"), {{"site", "Inja"}, {"a", {{"b", "static"}}}}));
+  env.save_bundle(bundle);
+
+  SUBCASE("templates are rendered without parsing") {
+    for (const bool compile_bytecode : {false, true}) {
+      inja::Environment loaded {test_file_directory};
+      loaded.set_compile_bytecode(compile_bytecode);
+      loaded.add_callback("double", 1, [](inja::Arguments& args) { return 2 * args.at(0)->get<int>(); });
+      loaded.load_bundle(bundle);
+
+      for (std::string test_name : {"simple-file", "nested", "nested-line", "html", "html-extend"}) {
+        const auto data = loaded.load_json(test_name + "/data.json");
+        CHECK(loaded.render(*loaded.find_template(test_name), data) == loaded.load_file(test_name + "/result.txt"));
+      }
+
+      const inja::json data = {{"xs", {{1, 2}, {3}}}, {"a", {{"b", "ab"}}}};
+      CHECK(loaded.render(*loaded.find_template("inline"), data) == "020416 ab");
+      CHECK(loaded.render(*loaded.find_template("specialized"), {{"xs", {{1, 2}, {3}}}}) == "Inja:020416 static");
+    }
+  }
+
+  SUBCASE("incompatible bundles are rejected") {
+    inja::Environment loaded;
+    loaded.set_expression("<%", "%>");
+    CHECK_THROWS_WITH(loaded.load_bundle(bundle), "[inja.exception.file_error] invalid template bundle: written with a different lexer configuration");
+
+    inja::Environment without_callback;
+    CHECK_THROWS_WITH(without_callback.load_bundle(bundle), "[inja.exception.file_error] invalid template bundle: unknown function double");
+  }
+
+  SUBCASE("corrupt bundles are rejected") {
+    const auto corrupt = std::filesystem::temp_directory_path() / "inja-corrupt-bundle.bin";
+    const auto save_corrupt = [&](const inja::Template& tmpl, const std::string& after, int offset, char value) {
+      inja::Environment writer;
+      writer.include_template("tmpl", tmpl);
+      writer.save_bundle(corrupt);
+
+      std::ifstream file(corrupt, std::ios::binary);
+      std::string content((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+      file.close();
+      if (!after.empty()) {
+        const size_t position = content.rfind(after);
+        REQUIRE(position != std::string::npos);
+        content[position + after.size() + offset] = value;
+      }
+      std::ofstream(corrupt, std::ios::binary) << content;
+    };
+
+    inja::Environment loaded;
+    save_corrupt(loaded.parse("{{ name }}"), std::string("\x04\0\0\0name", 8), 0, 7);
+    CHECK_THROWS_WITH(loaded.load_bundle(corrupt), "[inja.exception.file_error] invalid template bundle: unknown scope of variable 'name'");
+
+    save_corrupt(loaded.parse("{{ upper(name) }}"), std::string("\x05\0\0\0upper", 9), -10, 127);
+    CHECK_THROWS_WITH(loaded.load_bundle(corrupt), "[inja.exception.file_error] invalid template bundle: unknown operation");
+
+    std::string nested;
+    for (size_t i = 0; i < inja::TemplateBundle::max_nesting; ++i) {
+      nested = "{% if true %}" + nested + "{% endif %}";
+    }
+    save_corrupt(loaded.parse(nested), "", 0, 0);
+    CHECK_THROWS_WITH(loaded.load_bundle(corrupt), "[inja.exception.file_error] invalid template bundle: nodes nested too deeply");
+
+    std::filesystem::remove_all(corrupt);
+  }
+
+  std::filesystem::remove_all(bundle);
+}
@@ -182,6 +182,7 @@ TEST_CASE("functions") {
   SUBCASE("exists") {
     CHECK(env.render("{{ exists(\"name\") }}", data) == "true");
     CHECK(env.render("{{ exists(\"zipcode\") }}", data) == "false");
+    CHECK(env.render("{{ exists(\"brother.name\") }} {{ exists(\"names.1\") }} {{ exists(\"names.4\") }}", data) == "true true false");
     CHECK(env.render("{{ exists(name) }}", data) == "false");
     CHECK(env.render("{{ exists(property) }}", data) == "true");
 
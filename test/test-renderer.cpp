@@ -67,6 +67,15 @@ TEST_CASE("types") {
                      data) == "0: Jeff, 1: Seb!");
 
     CHECK(env.render("{% for name in [] %}a{% endfor %}", data) == "");
+    CHECK(env.render("{% for name in names %}{% endfor %}{{ name }}", data) == "Peter");
+    CHECK(env.render("{% for name in names %}{% set name=\"x\" %}{{ name }}{% endfor %}", data) == "xx");
+    CHECK(env.render("{% for x in [[1, 2], [3]] %}{% for x in x %}{{ x }}{% endfor %}{% endfor %}", data) == "123");
+    CHECK(env.render("{% for type, name in relatives %}{{ type }}{% endfor %}{{ existsIn(relatives, \"mother\") }}", data) == "brothermothersistertrue");
+    CHECK(env.render("{% for x in [[1, 2], [3, 4]] %}{% for y in x %}{{ x.1 }}{{ y }}{% endfor %}{% endfor %}", data) == "21224344");
+
+    env.include_template("loop-row", env.parse("{% for name in names %}{% block row %}{{ name }}{% endblock %}{% endfor %}"));
+    CHECK(env.render("{% extends \"loop-row\" %}{% block row %}{{ loop.index }}{{ name }}{% endblock %}", data) == "0Jeff1Seb");
+    CHECK(env.render("{% for name in [\"x\"] %}{% include \"loop-row\" %}{{ name }}{% endfor %}", data) == "JeffSebx");
 
     CHECK_THROWS_WITH(env.render("{% for name ins names %}a{% endfor %}", data), "[inja.exception.parser_error] (at 1:13) expected 'in', got 'ins'");
     CHECK_THROWS_WITH(env.render("{% for name in empty_loop %}a{% endfor %}", data), "[inja.exception.render_error] (at 1:16) variable 'empty_loop' not found");
@@ -99,6 +108,10 @@ TEST_CASE("types") {
 {%endfor%}{%endfor%}
 )"""",
                      ldata) == "\n0:0::false\n1,2,\n0:1::false\n\n0:2::false\n\n2:0::true\n3,4,\n2:1::true\n5,6,\n\n");
+
+    CHECK(env.render("{% for o in outer %}{% for i in o.inner %}{% for ii in i.in2 %}{{ loop.parent.parent.index1 }}{% endfor %}{% endfor %}{% endfor %}", ldata) == "113333");
+    CHECK(env.render("{% for a in [1] %}{% endfor %}{% for b in [1] %}{{ existsIn(loop, \"parent\") }}{% endfor %}", ldata) == "false");
+    CHECK(env.render("{% for a in [1] %}{{ loop }}{% endfor %}", ldata) == "{\"index\":0,\"index1\":1,\"is_first\":true,\"is_last\":true}");
   }
 
   SUBCASE("conditionals") {
@@ -128,6 +141,12 @@ TEST_CASE("types") {
     CHECK(env.render("{% set age=2+3 %}{{age}}", data) == "5");
     CHECK(env.render("{% set predefined.value=1 %}{% if existsIn(predefined, \"value\") %}{{predefined.value}}{% endif %}", data) == "1");
     CHECK(env.render("{% set brother.name=\"Bob\" %}{{brother.name}}", data) == "Bob");
+    CHECK(env.render("{% set items=[1, 2] %}{% for x in items %}{% set items=[] %}{{ x }}{% endfor %}{{ length(items) }}", data) == "120");
+    CHECK(env.render("{% for x in [1, 2, 3] %}{{ age }}{% set age=x %}{% endfor %}", data) == "2912");
+    CHECK(env.render("{% for x in [1, 2] %}{{ brother.name }}{% set brother.name=\"Bob\" %}{% endfor %}", data) == "ChrisBob");
+    CHECK(env.render("{% for a in [[1,2]] %}{% set a = [3,4] %}{% for b in a %}{% set a = [] %}{{ b }}{% endfor %}{% endfor %}", data) == "34");
+    CHECK(env.render("{% for type, name in relatives %}{% set type=\"z\" %}{% set name=type + \"y\" %}{{ type }}{{ name }}{% endfor %}", data) == "zzyzzyzzy");
+    CHECK(env.render("{% for x in [1, 2] %}{% set loop.index=5 %}{{ loop.index }}{{ loop.index1 }}{% set loop.is_last=x %}{{ loop.is_last }};{% endfor %}", data) == "511;522;");
     CHECK_THROWS_WITH(env.render("{% if predefined %}{% endif %}", data), "[inja.exception.render_error] (at 1:7) variable 'predefined' not found");
     CHECK(env.render("{{age}}", data) == "29");
     CHECK(env.render("{{brother.name}}", data) == "Chris");
@@ -179,6 +198,43 @@ TEST_CASE("templates") {
     CHECK(env.render(temp, data) == "Brunswick");
   }
 
+  SUBCASE("render-context") {
+    inja::Environment env;
+    inja::RenderContext context;
+    env.include_template("row", env.parse("{% set x = name %}{{ x }}"));
+    const inja::Template temp = env.parse("{% for name in [\"a\", \"b\"] %}{% include \"row\" %}{{ loop.index }}{{ city }}{% endfor %}");
+
+    CHECK(env.render(temp, data, context) == "a0Brunswickb1Brunswick");
+    CHECK_THROWS_WITH(env.render(temp, inja::json::object(), context), "[inja.exception.render_error] (at 1:67) variable 'city' not found");
+    CHECK(env.render(temp, data, context) == "a0Brunswickb1Brunswick");
+  }
+
+  SUBCASE("render-context-arena") {
+    inja::Environment env;
+    inja::RenderContext context;
+    context.set_arena_capacity(64);
+    const inja::Template temp = env.parse("{% for x in range(100) %}{{ upper(name) }}{{ x * 2 }}{% endfor %}");
+    const std::string result = env.render(temp, data);
+
+    CHECK(env.render(temp, data, context) == result);
+    CHECK(env.render(temp, data, context) == result);
+#ifdef INJA_HAS_MEMORY_RESOURCE
+    CHECK(context.get_arena_capacity() > 64);
+#endif
+
+    context.set_arena_capacity(0);
+    CHECK(env.render(temp, data, context) == result);
+    CHECK(context.get_arena_capacity() == 0);
+
+    // Temporaries of a render that failed are released before the arena is replaced
+    const inja::Template failing = env.parse("{% for x in range(3) %}{{ upper(name) }}{{ unknown }}{% endfor %}");
+    context.set_arena_capacity(256);
+    CHECK_THROWS_WITH(env.render(failing, data, context), "[inja.exception.render_error] (at 1:44) variable 'unknown' not found");
+    context.set_arena_capacity(512);
+    CHECK_THROWS_WITH(env.render(failing, data, context), "[inja.exception.render_error] (at 1:44) variable 'unknown' not found");
+    CHECK(env.render(temp, data, context) == result);
+  }
+
   SUBCASE("include") {
     inja::Environment env;
     const inja::Template t1 = env.parse("Hello {{ name }}");
@@ -191,6 +247,19 @@ TEST_CASE("templates") {
     CHECK_THROWS_WITH(env.parse("{% include does-not-exist %}!"), "[inja.exception.parser_error] (at 1:12) expected string, got 'does-not-exist'");
   }
 
+  SUBCASE("include-shared") {
+    inja::Environment env;
+    inja::Environment other_env;
+    const auto greeting = env.parse_shared("Hello {{ name }}");
+    env.include_template("greeting", greeting);
+    other_env.include_template("greeting", greeting);
+
+    CHECK(env.find_template("greeting") == greeting);
+    CHECK(other_env.find_template("greeting") == greeting);
+    CHECK(other_env.render("{% include \"greeting\" %}!", data) == "Hello Peter!");
+    CHECK(env.render(*env.parse_shared("{% include \"greeting\" %}?"), data) == "Hello Peter?");
+  }
+
   SUBCASE("include-callback") {
     inja::Environment env;
 
@@ -209,6 +278,95 @@ TEST_CASE("templates") {
     CHECK(env.render(t2, data) == "Bye Jeff!");
   }
 
+  SUBCASE("include-link") {
+    inja::Environment env;
+    env.set_search_included_templates_in_files(false);
+    env.include_template("greeting", env.parse("Hello {{ name }}"));
+
+    const inja::Template t1 = env.parse("{% include \"greeting\" %}!");
+    env.link(t1);
+    CHECK(env.render(t1, data) == "Hello Peter!");
+
+    env.include_template("greeting", env.parse("Bye {{ name }}"));
+    CHECK(env.render(t1, data) == "Bye Peter!");
+
+    CHECK_THROWS_WITH(env.link(env.parse("{% include \"missing\" %}")), "[inja.exception.link_error] template 'missing' not found");
+
+    env.include_template("a", env.parse("{% extends \"b\" %}"));
+    env.include_template("b", env.parse("{% extends \"a\" %}"));
+    CHECK_THROWS_WITH(env.link(env.parse("{% extends \"a\" %}")), "[inja.exception.link_error] templates extend each other in a cycle: a -> b -> a");
+
+    // Includes after an extends statement in a loop are linked by the extending template
+    env.include_template("scoped", env.parse("{% set x=1 %}<{{ name }}>"));
+    env.include_template("parent", env.parse("{% include \"greeting\" %}|"));
+    CHECK(env.render("{% for n in [1, 2] %}{% include \"scoped\" %}{% extends \"parent\" %}{% endfor %}", data) == "<Peter>Bye Peter|<Peter>");
+  }
+
+  SUBCASE("extends-blocks") {
+    for (const bool compile_bytecode : {false, true}) {
+      inja::Environment env;
+      env.set_search_included_templates_in_files(false);
+      env.set_compile_bytecode(compile_bytecode);
+      env.include_template("base", env.parse("<{% block a %}base-a{% endblock %}|{% block b %}base-b{% endblock %}>"));
+      env.include_template("inter", env.parse("{% extends \"base\" %}{% block b %}inter-b{% endblock %}"));
+
+      CHECK(env.render("{% extends \"inter\" %}{% block a %}{{ super(2) }}+{{ name }}{% endblock %}", data) == "<base-a+Peter|>");
+      CHECK(env.render("{% extends \"inter\" %}{% block b %}{{ super() }}/{{ super(2) }}{% endblock %}", data) == "<|inter-b/base-b>");
+      CHECK(env.render("{% extends \"inter\" %}", data) == "<|>");
+      CHECK_THROWS_WITH(env.render("{% extends \"inter\" %}{% block a %}{{ super() }}{% endblock %}", data),
+                        "[inja.exception.render_error] (at 1:38) could not find block with name 'a'");
+    }
+  }
+
+  SUBCASE("include-inline") {
+    for (const size_t threshold : {0, 64}) {
+      inja::Environment env;
+      env.set_include_inline_threshold(threshold);
+      env.include_template("row", env.parse("{{ loop.index }}:{{ name }}{% for x in [1, 2] %}{{ x }}{% endfor %};"));
+      env.include_template("scoped", env.parse("{% set name=\"x\" %}{{ name }}"));
+      env.include_template("error", env.parse("\n{{ unknown }}"));
+
+      CHECK(env.render("{% for name in [\"Jeff\", \"Seb\"] %}{% include \"row\" %}{% endfor %}", data) == "0:Jeff12;1:Seb12;");
+      CHECK(env.render("{% include \"scoped\" %}{{ name }}", data) == "xPeter");
+      CHECK_THROWS_WITH(env.render("{% include \"error\" %}", data), "[inja.exception.render_error] (at 2:4) variable 'unknown' not found");
+
+      // An extends statement in a loop does not stop the rendering of included templates
+      env.include_template("plain", env.parse("<{{ name }}>"));
+      env.include_template("parent", env.parse("P"));
+      CHECK(env.render("{% for n in [1, 2] %}{% include \"plain\" %}{% extends \"parent\" %}{% endfor %}", data) == "<Peter>P<Peter>");
+    }
+  }
+
+  SUBCASE("include-scope") {
+    inja::Environment env;
+    env.set_include_inline_threshold(0);
+    env.include_template("read", env.parse("{{ name }}{{ city }}{% for x in [1] %}{{ loop.parent.index }}{% endfor %};"));
+    env.include_template("write", env.parse("{% set city=\"x\" %}{% include \"read\" %}"));
+
+    CHECK(env.render("{% set city=\"Berlin\" %}{% for name in [\"a\", \"b\"] %}{% include \"read\" %}{% endfor %}", data) == "aBerlin0;bBerlin1;");
+    CHECK(env.render("{% for name in [\"a\"] %}{% set name=\"b\" %}{% include \"write\" %}{% include \"read\" %}{% endfor %}", data) == "bx0;bBrunswick0;");
+  }
+
+  SUBCASE("batch-include-callback") {
+    inja::Environment env;
+    env.set_search_included_templates_in_files(false);
+
+    std::vector<std::vector<std::string>> batches;
+    env.set_batch_include_callback([&env, &batches](const std::vector<std::pair<std::filesystem::path, std::string>>& includes) {
+      std::vector<inja::Template> result;
+      batches.emplace_back();
+      for (const auto& include : includes) {
+        batches.back().emplace_back(include.second);
+        result.emplace_back(env.parse("<" + include.second + ">"));
+      }
+      return result;
+    });
+
+    const inja::Template t1 = env.parse("{% include \"a\" %}{% include \"b\" %}{% include \"a\" %}!");
+    CHECK(env.render(t1, data) == "<a><b><a>!");
+    CHECK(batches == std::vector<std::vector<std::string>> {{"a", "b"}});
+  }
+
   SUBCASE("include-in-loop") {
     inja::json loop_data;
     loop_data["cities"] = inja::json::array({{{"name", "Munich"}}, {{"name", "New York"}}});
@@ -312,3 +470,163 @@ $$ endif
     CHECK(env.render(string_template, data) == "Hello Peter\n    You really are Peter\n");
   }
 }
+
+TEST_CASE("bytecode") {
+  inja::json data;
+  data["name"] = "Peter";
+  data["age"] = 29;
+  data["names"] = {"Jeff", "Seb"};
+  data["brother"]["name"] = "Chris";
+  data["relatives"]["mother"] = "Maria";
+  data["relatives"]["brother"] = "Chris";
+  data["is_happy"] = true;
+  data["vars"] = {2, 3, 4, 0, -1, -2, -3};
+
+  inja::Environment env;
+  inja::Environment env_bytecode;
+  env_bytecode.set_compile_bytecode(true);
+
+  env.include_template("greeting", env.parse("Hello {{ name }}"));
+  env_bytecode.include_template("greeting", env_bytecode.parse("Hello {{ name }}"));
+  env.include_template("base", env.parse("B{% block b %}{{ name }}{% endblock %}!"));
+  env_bytecode.include_template("base", env_bytecode.parse("B{% block b %}{{ name }}{% endblock %}!"));
+  env.include_template("plain", env.parse("P{{ name }}!"));
+  env_bytecode.include_template("plain", env_bytecode.parse("P{{ name }}!"));
+
+  for (const std::string input : {
+           "Hello {{ name }}!",
+           "{{ age + 2 * 3 }} {{ 2 ^ 3 }} {{ 7 % 3 }} {{ 10 / 4 }}",
+           "{% if is_happy and age > 20 %}yes{% else if age == 29 %}no{% else %}maybe{% endif %}",
+           "{% if not is_happy or age < 20 %}yes{% else %}no{% endif %}",
+           "{% for name in names %}{{ loop.index }}: {{ name }}{% if not loop.is_last %}, {% endif %}{% endfor %}!",
+           "{% for type, name in relatives %}{{ loop.index1 }}: {{ type }}: {{ name }}{% if loop.is_last == false %}, {% endif %}{% endfor %}",
+           "{% for v in vars %}{% for n in names %}{{ loop.parent.index }}{{ n }}{% endfor %}{% endfor %}",
+           "{% for name in [] %}a{% endfor %}{{ default(nothing, \"none\") }} {{ default(name, \"none\") }}",
+           "{% set age=2+3 %}{{ age }} {{ brother.name | upper }} {{ [\"C\", \"A\", \"B\"] | sort | join(\",\") }}",
+           "{{ at(brother, \"name\") }} {{ length(names) }} {{ exists(\"name\") }} {{ existsIn(brother, \"name\") }}",
+           "{% include \"greeting\" %}!",
+           "{% for n in names %}{{ n }}{% extends \"base\" %}{{ loop.index }}{% endfor %}{% block b %}{{ n }}{% endblock %}",
+           "{% for n in names %}{% if true %}{{ n }}{{ n }}{% endif %}{% if loop.is_first %}{% extends \"base\" %}{% endif %}{% endfor %}x",
+           "{% extends \"base\" %}{% block b %}[{% extends \"greeting\" %}]{% endblock %}",
+           "{% for n in names %}{% extends \"plain\" %}{{ n }}{% endfor %}",
+           "{% set items=[1, 2] %}{% for x in items %}{% set items=[] %}{{ x }}{% endfor %}{{ length(items) }}",
+           "{% for a in [[1,2]] %}{% set a = [3,4] %}{% for b in a %}{% set a = [] %}{{ b }}{% endfor %}{% endfor %}",
+           "{% for type, name in relatives %}{% set type=\"z\" %}{{ type }}{{ name }}{% endfor %}",
+           "{% for n in names %}{% set loop.index=n %}{{ loop.index }}{{ loop.index1 }}{% endfor %}",
+           "{% for x in range(3) %}{% for y in sort([3, 1, 2]) %}{% if upper(name) == \"PETER\" %}{{ x * y }}{% endif %}{% endfor %};{% endfor %}",
+       }) {
+    CAPTURE(input);
+    CHECK(env_bytecode.render(input, data) == env.render(input, data));
+  }
+
+  CHECK_THROWS_WITH(env_bytecode.render("{{ }}", data), "[inja.exception.render_error] (at 1:4) empty expression");
+  CHECK_THROWS_WITH(env_bytecode.render("{{unknown}}", data), "[inja.exception.render_error] (at 1:3) variable 'unknown' not found");
+  CHECK_THROWS_WITH(env_bytecode.render("{% if 1 and undefined %}do{% endif %}", data), "[inja.exception.render_error] (at 1:13) variable 'undefined' not found");
+  CHECK(env_bytecode.render("{% if 0 and undefined %}do{% else %}nothing{% endif %}", data) == "nothing");
+
+  // Only templates that might stop rendering by an extends statement check for it
+  const auto count_breaks = [](const inja::Template& tmpl) {
+    size_t count = 0;
+    for (const auto& instruction : tmpl.program->instructions) {
+      count += (instruction.opcode == inja::Instruction::Opcode::Break) ? 1 : 0;
+    }
+    return count;
+  };
+  CHECK(count_breaks(env_bytecode.parse("{% for n in names %}{% if true %}{{ n }}{% endif %}{% include \"greeting\" %}{% endfor %}!")) == 0);
+  CHECK(count_breaks(env_bytecode.parse("A{% block b %}{{ name }}{% endblock %}B")) == 2);
+  CHECK(count_breaks(env_bytecode.parse("A{% if is_happy %}{% extends \"base\" %}{% endif %}B{{ name }}")) == 3);
+}
+
+TEST_CASE("optimization") {
+  inja::json data;
+  data["name"] = "Peter";
+  data["names"] = {"Jeff", "Seb"};
+  data["is_happy"] = true;
+
+  inja::Environment env;
+  inja::Environment env_optimized;
+  env_optimized.set_optimization_level(2);
+  env_optimized.set_trim_blocks(true);
+  env.set_trim_blocks(true);
+
+  for (const std::string input : {
+           "{{ 60 * 60 * 24 }} {{ \"a\" + \"b\" }} {{ upper(\"abc\") }} {{ [3, 1, 2] | sort | join(\",\") }}",
+           "{% if 1 == 1 %}yes{% else %}no{% endif %}{% if 1 > 2 %}yes{% else if 2 > 1 %}maybe{% endif %}",
+           "{% if false %}{{ unknown }}{% endif %}{% if 1 == 1 and is_happy %}happy{% endif %}",
+           "Hello{# comment #} {# comment #}{{ name }}!\n{% if true %}\nline\n{% endif %}\nend",
+           "{% for name in names %}{% if 2 < 3 %}<{{ name }}>{% endif %}{# #}, {% endfor %}",
+           "{% set x = 2 * 3 %}{{ x }} {{ length(\"text\") + 1 }}",
+       }) {
+    CAPTURE(input);
+    CHECK(env_optimized.render(input, data) == env.render(input, data));
+  }
+
+  const auto tmpl = env_optimized.parse("a{# b #}c{% if 1 == 1 %}d{% endif %}e{{ 2 + 3 }}");
+  CHECK(tmpl.root.nodes.size() == 2);
+  CHECK(env_optimized.render(tmpl, data) == "acde5");
+
+  CHECK_THROWS_WITH(env_optimized.render("{{ 1 / 0 }}", data), "[inja.exception.render_error] (at 1:6) division by zero");
+}
+
+TEST_CASE("specialization") {
+  inja::Environment env;
+  env.include_template("greeting", env.parse("Hello {{ user }}"));
+  env.include_template("site", env.parse("{{ site }}{% if exists(\"flags.beta\") %}/{{ user }}{% endif %}"));
+  env.include_template("layout", env.parse("<{% block title %}{{ site }}{% endblock %}>"));
+  env.include_template("blog", env.parse("{{ default(links.blog, \"-\") }} {{ exists(\"links.blog\") }}"));
+
+  inja::json static_data;
+  static_data["site"] = "Inja";
+  static_data["locales"] = {"de", "en"};
+  static_data["flags"]["beta"] = false;
+  static_data["links"]["home"] = "/";
+  static_data["links"]["docs"] = "/docs";
+
+  inja::json data;
+  data["user"] = "Peter";
+  data["items"] = {1, 2};
+  data["links"]["blog"] = "/blog"; // Shadowed by the static links as a whole
+
+  inja::json all_data = data;
+  all_data.update(static_data);
+
+  for (const std::string input : {
+           "{{ site }} {{ upper(site) }} for {{ user }}",
+           "{% if flags.beta %}beta {{ user }}{% else %}stable{% endif %}",
+           "{% for l in locales %}{{ loop.index1 }}:{{ l }}/{{ user }}{% if not loop.is_last %}, {% endif %}{% endfor %}",
+           "{% for name, url in links %}<a href=\"{{ url }}\">{{ name }}</a>{% endfor %}",
+           "{% for i in items %}{% for l in locales %}{{ i }}{{ l }}{% endfor %}{{ loop.index }}{% endfor %}",
+           "{% for l in locales %}{% for i in items %}{{ loop.parent.index }}{{ i }}{{ l }}{% endfor %}{% endfor %}",
+           "{% for l in locales %}{% include \"greeting\" %}{{ l }}{% endfor %}",
+           "{% set site = \"Other\" %}{{ site }} {{ length(locales) }}",
+           "{{ site }}{% set site = \"Other\" %}{{ site }}",
+           "{% include \"site\" %} {% for l in locales %}{% include \"site\" %}{% endfor %}",
+           "{% extends \"layout\" %}{% block title %}{{ super() }}: {{ user }}{% endblock %}",
+           "{{ exists(\"site\") }} {{ exists(\"links.home\") }} {{ exists(\"links.other\") }} {{ exists(\"user\") }}",
+           "{% set path = \"flags.beta\" %}{{ exists(path) }} {{ exists(\"flags\" + \".beta\") }} {{ existsIn(links, \"docs\") }}",
+           "{{ links.home }} {{ default(links.blog, \"-\") }} {{ exists(\"links.blog\") }} {% include \"blog\" %}",
+           "{% set path = \"links.blog\" %}{{ exists(path) }} {{ existsIn(links, \"blog\") }} {{ length(links) }}",
+       }) {
+    CAPTURE(input);
+    const auto tmpl = env.parse(input);
+    CHECK(env.render(env.specialize(tmpl, static_data), data) == env.render(tmpl, all_data));
+  }
+
+  // Included templates that are rendered on their own read the static data as well
+  env.set_include_inline_threshold(0);
+  const auto included = env.parse("{% include \"site\" %}|{% include \"greeting\" %}");
+  CHECK(env.render(env.specialize(included, static_data), data) == "Inja/Peter|Hello Peter");
+
+  const auto specialized = env.specialize(env.parse("{{ site }}{% for l in locales %}-{{ l }}{% endfor %}{% if flags.beta %}{{ user }}{% endif %}"), static_data);
+  CHECK(specialized.root.nodes.size() == 1);
+  CHECK(env.render(specialized, data) == "Inja-de-en");
+  CHECK(env.specialize(env.parse("{% if exists(\"links.docs\") %}docs{% endif %}"), static_data).root.nodes.size() == 1);
+
+  CHECK_THROWS_WITH(env.render(env.specialize(env.parse("{{ site }} {{ unknown }}"), static_data), data),
+                    "[inja.exception.render_error] (at 1:15) variable 'unknown' not found");
+
+  // Keys that the static data only partly overlaps are not merged with the data
+  const auto overlapping = env.parse("{{ links.home }} {{ links.blog }}");
+  CHECK_THROWS_WITH(env.render(overlapping, all_data), "[inja.exception.render_error] (at 1:21) variable 'links.blog' not found");
+  CHECK_THROWS_WITH(env.render(env.specialize(overlapping, static_data), data), "[inja.exception.render_error] (at 1:21) variable 'links.blog' not found");
+}
@@ -53,3 +53,119 @@ TEST_CASE("copy environment") {
   // template is unchanged in copy
   CHECK(copy.render(test_tpl, inja::json()) == "4");
 }
+
+TEST_CASE("node arena") {
+  inja::Environment env;
+  const inja::Template t1 = env.parse("Hello {{ name }}{% if is_happy %}!{% endif %}");
+
+  // Text, expression list, data, if statement, data, text
+  CHECK(t1.arena->size() == 6);
+
+  // Copies share the nodes of the original template
+  const inja::Template t2 = t1;
+  CHECK(t2.arena == t1.arena);
+  CHECK(t2.root.nodes.front() == t1.root.nodes.front());
+  CHECK(env.render(t2, inja::json {{"name", "Jeff"}, {"is_happy", true}}) == "Hello Jeff!");
+
+  // Data nodes refer to their own path, and are neither copied nor moved
+  CHECK_FALSE(std::is_copy_constructible<inja::DataNode>::value);
+  CHECK_FALSE(std::is_move_constructible<inja::DataNode>::value);
+
+  // A node whose constructor throws is not registered for destruction
+  inja::NodeArena arena;
+  CHECK_THROWS(arena.make<inja::LiteralNode>(std::string_view("[1,"), 0));
+  CHECK(arena.size() == 0);
+  CHECK(arena.make<inja::LiteralNode>(std::string_view("[1]"), 0)->value.size() == 1);
+  CHECK(arena.size() == 1);
+}
+
+TEST_CASE("template links") {
+  inja::Environment env;
+  env.include_template("a", env.parse("A{{ name }}"));
+  env.include_template("b", env.parse("B{% set name = 1 %}"));
+  const inja::Template tmpl = env.parse("{% include \"a\" %}{% include \"b\" %}");
+
+  inja::TemplateStorage storage;
+  storage.insert_or_assign("a", env.parse("A{{ name }}"));
+  storage.insert_or_assign("b", env.parse("B{% set name = 1 %}"));
+
+  // The properties of the targets are computed when they are parsed
+  const auto links = tmpl.link(storage);
+  CHECK(links->targets[0].inline_size == 3);
+  CHECK(links->targets[0].is_read_only);
+  CHECK(links->targets[1].inline_size == std::string::npos);
+  CHECK_FALSE(links->targets[1].is_read_only);
+  CHECK(tmpl.link(storage) == links);
+
+  // Replacing one target only links that one again
+  storage.insert_or_assign("b", env.parse("B"));
+  const auto relinked = tmpl.link(storage);
+  CHECK(relinked != links);
+  CHECK(relinked->targets[0].tmpl.lock() == links->targets[0].tmpl.lock());
+  CHECK(relinked->targets[1].tmpl.lock() == storage.find("b"));
+  CHECK(relinked->targets[1].is_read_only);
+}
+
+TEST_CASE("template cache") {
+  inja::Environment env;
+  inja::json data;
+  data["name"] = "Jeff";
+
+  SUBCASE("disabled by default") {
+    CHECK(env.render("Hello {{ name }}", data) == "Hello Jeff");
+    CHECK(env.get_template_cache_statistics().misses == 0);
+  }
+
+  SUBCASE("least recently used templates are evicted") {
+    env.set_template_cache_size(2);
+    CHECK(env.render("a{{ name }}", data) == "aJeff");
+    CHECK(env.render("b{{ name }}", data) == "bJeff");
+    CHECK(env.render("a{{ name }}", data) == "aJeff");
+    CHECK(env.render("c{{ name }}", data) == "cJeff"); // Evicts b
+
+    auto statistics = env.get_template_cache_statistics();
+    CHECK(statistics.hits == 1);
+    CHECK(statistics.misses == 3);
+    CHECK(statistics.size == 2);
+
+    CHECK(env.render("a{{ name }}", data) == "aJeff");
+    CHECK(env.render("b{{ name }}", data) == "bJeff");
+    statistics = env.get_template_cache_statistics();
+    CHECK(statistics.hits == 2);
+    CHECK(statistics.misses == 4);
+  }
+
+  SUBCASE("configuration is part of the key") {
+    env.set_template_cache_size(8);
+    CHECK(env.render("{{ name }} <% name %>", data) == "Jeff <% name %>");
+    env.set_expression("<%", "%>");
+    CHECK(env.render("{{ name }} <% name %>", data) == "{{ name }} Jeff");
+    CHECK(env.get_template_cache_statistics().hits == 0);
+  }
+
+  SUBCASE("functions and input paths are part of the key") {
+    env.set_template_cache_size(8);
+    env.add_callback("greet", [](inja::Arguments& args) { return "Hi " + args.at(0)->get<std::string>(); });
+    CHECK(env.render("{{ greet(name) }}", data) == "Hi Jeff");
+    CHECK(env.render("{{ greet(name) }}", data) == "Hi Jeff");
+    env.add_callback("greet", 1, [](inja::Arguments& args) { return "Hello " + args.at(0)->get<std::string>(); });
+    CHECK(env.render("{{ greet(name) }}", data) == "Hello Jeff");
+    CHECK(env.get_template_cache_statistics().hits == 1);
+
+    // Include callbacks can not be compared, so that setting one clears the cache
+    env.set_include_callback([](const std::filesystem::path&, const std::string&) { return inja::Template(); });
+    CHECK(env.get_template_cache_statistics().size == 0);
+
+    const inja::ParserConfig parser_config;
+    CHECK(inja::TemplateCache::hash_config(inja::LexerConfig(), parser_config, inja::FunctionStorage(), "a/") !=
+          inja::TemplateCache::hash_config(inja::LexerConfig(), parser_config, inja::FunctionStorage(), "b/"));
+  }
+
+  SUBCASE("free functions") {
+    inja::default_template_cache().set_capacity(4);
+    CHECK(inja::render("Hello {{ name }}", data) == "Hello Jeff");
+    CHECK(inja::render("Hello {{ name }}", data) == "Hello Jeff");
+    CHECK(inja::default_template_cache().statistics().hits == 1);
+    inja::default_template_cache().set_capacity(0);
+  }
+}
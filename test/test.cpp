@@ -6,6 +6,7 @@
 
 #include <filesystem>
 
+#include "test-concurrency.cpp"
 #include "test-files.cpp"
 #include "test-functions.cpp"
 #include "test-renderer.cpp"
@@ -0,0 +1,43 @@
+// Copyright (c) 2025 Pantor. All rights reserved.
+
+#include <filesystem>
+#include <iostream>
+#include <string>
+
+#include <inja/inja.hpp>
+
+// Precompiles the files of a template directory, optionally only those with the given extension, into a bundle that
+// is loaded by inja::Environment::load_bundle. Templates are named by their path, so the tool should run from the
+// directory the application renders from.
+int main(int argc, char* argv[]) {
+  if (argc < 3 || argc > 4) {
+    std::cerr << "usage: " << argv[0] << " <template-directory> <bundle> [extension]" << std::endl;
+    return 1;
+  }
+
+  const std::filesystem::path directory {argv[1]};
+  const std::filesystem::path bundle {argv[2]};
+  const std::string extension {(argc == 4) ? argv[3] : ""};
+
+  inja::Environment env;
+  size_t count {0};
+  try {
+    for (const auto& entry : std::filesystem::recursive_directory_iterator(directory)) {
+      if (!entry.is_regular_file() || (!extension.empty() && entry.path().extension() != extension)) {
+        continue;
+      }
+
+      const auto name = entry.path().string();
+      env.include_template(name, env.parse_template_shared(name));
+      count += 1;
+    }
+
+    env.save_bundle(bundle);
+  } catch (const std::exception& e) {
+    std::cerr << e.what() << std::endl;
+    return 1;
+  }
+
+  std::cout << "precompiled " << count << " templates into " << bundle.string() << std::endl;
+  return 0;
+}